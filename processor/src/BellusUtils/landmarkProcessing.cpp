@@ -14,6 +14,7 @@
 #include "landmarkProcessing.h"
 
 #include "../utils/yaml/Yaml.hpp"
+#include "../utils/logger.h"
 #include "../mathUtils/geometryFunctions.h"
 #include "../mathUtils/C3dVector.h"
 
@@ -69,7 +70,7 @@ namespace
 			}
 			catch (const std::exception& e)
 			{
-				ucout << "Bellus landmark data: float values could not be converted: " << e.what() << std::endl;
+				logWarning() << "Bellus landmark data: float values could not be converted: " << e.what();
 				message_reply(web::http::status_codes::BadRequest, U("Bellus3D landmark yaml data : float values of coordinates could not be converted. "));
 				return false;
 			}
@@ -107,7 +108,7 @@ namespace bellusLandmarksProcessing
 		}
 		catch (const std::exception& e)
 		{
-			ucout << "A standard exception was caught when reading Bellus3D landmark yaml data : " << e.what() << std::endl;
+			logWarning() << "A standard exception was caught when reading Bellus3D landmark yaml data : " << e.what();
 			message_reply(web::http::status_codes::BadRequest, U("Bellus3D landmark yaml data could not be decoded."));
 			return false;
 		}
@@ -118,7 +119,7 @@ namespace bellusLandmarksProcessing
 		}
 		catch (const std::exception& e)
 		{
-			ucout << "3D Landmark data not found when reading Bellus3D yaml data : " << e.what() << std::endl;
+			logWarning() << "3D Landmark data not found when reading Bellus3D yaml data : " << e.what();
 			message_reply(web::http::status_codes::BadRequest, U("Bellus3D landmark yaml data not in expected format: Node Point3f/data is missing."));
 			return false;
 		}
@@ -261,7 +262,7 @@ namespace bellusLandmarksProcessing
 		}
 		catch (const std::exception& e)
 		{
-			ucout << "A standard exception was caught when reading Bellus3D landmark yaml data : " << e.what() << std::endl;
+			logWarning() << "A standard exception was caught when reading Bellus3D landmark yaml data : " << e.what();
 			message_reply(web::http::status_codes::BadRequest, U("Bellus3D landmark yaml data could not be decoded."));
 			return false;
 		}
@@ -272,7 +273,7 @@ namespace bellusLandmarksProcessing
 		}
 		catch (const std::exception& e)
 		{
-			ucout << "3D Landmark data not found when reading Bellus3D yaml data : " << e.what() << std::endl;
+			logWarning() << "3D Landmark data not found when reading Bellus3D yaml data : " << e.what();
 			message_reply(web::http::status_codes::BadRequest, U("Bellus3D landmark yaml data not in expected format: Node Point3f/data is missing."));
 			return false;
 		}
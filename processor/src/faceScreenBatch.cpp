@@ -0,0 +1,496 @@
+// Offline batch processing of a cohort of subjects, e.g., for re-scoring archived scans after models have been retrained.
+//
+// Invocation: faceScreenBatch [manifest.csv] [output.csv] [path to modelDB.json] [number of threads] [heatmap output dir]
+//
+// The manifest is a csv file with header line and columns: id,mesh,landmarks,age,ethnicityCode[,regions]
+//		mesh - obj file, landmarks - json file (format as for REST API endpoint /landmarks). Relative paths are relative to the manifest.
+//		regions - facial regions to classify, separated by ';'. All regions available for the identified model if empty or omitted.
+// Results are appended to output.csv as soon as a subject has been processed, one line per heatmap and per facial region classification.
+// Processed subject ids are recorded in output.csv.checkpoint. Restarting with the same arguments skips these subjects.
+// If a heatmap output dir is given, heatmaps are additionally written there as binary vtp files (<id>.vtp).
+
+#include <cpprest/json.h>
+
+#include <vtkDataArray.h>
+#include <vtkNew.h>
+#include <vtkOBJReader.h>
+#include <vtkPointData.h>
+#include <vtkXMLPolyDataWriter.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "faceScreeningObject.h"
+#include "heatmapProcessing/msNormalisationTools.h"
+#include "heatmapProcessing/vtkSurfacePCA.h"
+#include "subjectClassification/classificationTools.h"
+#include "toolUtilities.h"
+#include "utils/computePool.h"
+
+namespace {
+
+struct manifestRow
+{
+	std::string id;
+	std::filesystem::path meshFile;
+	std::filesystem::path landmarksFile;
+	float age = -1.0F;
+	std::string ethnicityCode;
+	std::vector<std::string> regions;
+};
+
+struct resultRow
+{
+	std::string result; // heatmap or classification
+	std::string region;
+	web::http::status_code statusCode = web::http::status_codes::OK;
+	std::string message;
+	std::vector<double> values; // heatmap: mean, minimum, maximum, meanAbsolute, fractionAbove2; classification: mean, stdError
+};
+
+// Face model and projection file for heatmap computation. msNormalisationTools keeps state per computation, hence each worker thread holds its own instance.
+struct heatmapModel
+{
+	vtkSmartPointer<vtkSurfacePCA> pca;
+	std::unique_ptr<msNormalisationTools> norm;
+};
+
+std::vector<std::string> splitString(const std::string& str, const char delimiter)
+{
+	std::vector<std::string> items;
+	std::stringstream itemStream(str);
+	std::string item;
+	while (std::getline(itemStream, item, delimiter))
+	{
+		item.erase(0, item.find_first_not_of(" \t\r\n"));
+		item.erase(item.find_last_not_of(" \t\r\n") + 1);
+		items.push_back(item);
+	}
+	return items;
+}
+
+std::string csvQuote(const std::string& str)
+{
+	std::string quoted("\"");
+	for (const auto c : str)
+	{
+		quoted += (c == '"') ? std::string("\"\"") : std::string(1, c);
+	}
+	return quoted + "\"";
+}
+
+// Returns empty optional if manifest cannot be read or is malformed.
+std::optional<std::vector<manifestRow>> readManifest(const std::filesystem::path& manifestFile)
+{
+	std::ifstream inFile(manifestFile);
+	std::string line;
+	if (!inFile || !std::getline(inFile, line))
+	{
+		std::cerr << "Manifest " << manifestFile << " cannot be read." << std::endl;
+		return {};
+	}
+
+	const auto header = splitString(line, ',');
+	std::map<std::string, size_t> columns;
+	for (size_t column = 0; column < header.size(); ++column)
+	{
+		columns[header[column]] = column;
+	}
+	for (const auto& requiredColumn : { "id", "mesh", "landmarks", "age", "ethnicityCode" })
+	{
+		if (columns.count(requiredColumn) == 0)
+		{
+			std::cerr << "Manifest " << manifestFile << " has no column " << requiredColumn << "." << std::endl;
+			return {};
+		}
+	}
+
+	const auto manifestDir = manifestFile.parent_path();
+	std::vector<manifestRow> rows;
+	size_t lineNumber = 1;
+	while (std::getline(inFile, line))
+	{
+		++lineNumber;
+		if (line.find_first_not_of(" \t\r\n") == std::string::npos)
+		{
+			continue;
+		}
+		const auto fields = splitString(line, ',');
+		const auto field = [&fields, &columns](const std::string& column) -> std::string
+		{
+			const auto found = columns.find(column);
+			return (found != columns.end() && found->second < fields.size()) ? fields[found->second] : std::string();
+		};
+
+		manifestRow row;
+		row.id = field("id");
+		row.meshFile = manifestDir / field("mesh");
+		row.landmarksFile = manifestDir / field("landmarks");
+		row.ethnicityCode = field("ethnicityCode");
+		try
+		{
+			row.age = std::stof(field("age"));
+		}
+		catch (const std::exception&)
+		{
+			std::cerr << "Manifest line " << lineNumber << ": invalid age '" << field("age") << "'." << std::endl;
+			return {};
+		}
+		for (const auto& region : splitString(field("regions"), ';'))
+		{
+			if (!region.empty())
+			{
+				row.regions.push_back(region);
+			}
+		}
+		if (row.id.empty())
+		{
+			std::cerr << "Manifest line " << lineNumber << ": id missing." << std::endl;
+			return {};
+		}
+		rows.push_back(row);
+	}
+	return rows;
+}
+
+resultRow summariseHeatmap(const processingStatus& status, vtkPolyData* heatmap)
+{
+	resultRow row{ "heatmap", "", status.statusCode, utility::conversions::to_utf8string(status.message), {} };
+	vtkDataArray* stdv = (heatmap != nullptr) ? heatmap->GetPointData()->GetScalars() : nullptr;
+	if (!status.succeeded() || stdv == nullptr || stdv->GetNumberOfTuples() == 0)
+	{
+		return row;
+	}
+
+	double sum(0.0), sumAbs(0.0), minimum(stdv->GetTuple1(0)), maximum(stdv->GetTuple1(0));
+	vtkIdType nAbove2(0);
+	const auto nValues = stdv->GetNumberOfTuples();
+	for (vtkIdType i = 0; i < nValues; ++i)
+	{
+		const double value = stdv->GetTuple1(i);
+		sum += value;
+		sumAbs += std::fabs(value);
+		minimum = std::min(minimum, value);
+		maximum = std::max(maximum, value);
+		nAbove2 += (std::fabs(value) > 2.0) ? 1 : 0;
+	}
+	row.values = { sum / nValues, minimum, maximum, sumAbs / nValues, static_cast<double>(nAbove2) / nValues };
+	return row;
+}
+
+// Results and checkpoint are written under one lock, so that checkpointed subjects always have complete results in the output file.
+class batchOutput
+{
+public:
+	bool open(const std::filesystem::path& outputFile)
+	{
+		checkpointFile = outputFile;
+		checkpointFile += ".checkpoint";
+
+		std::ifstream checkpointIn(checkpointFile);
+		std::string id;
+		while (std::getline(checkpointIn, id))
+		{
+			if (!id.empty())
+			{
+				processedIds.insert(id);
+			}
+		}
+
+		const bool resuming = !processedIds.empty() && std::filesystem::exists(outputFile);
+		out.open(outputFile, resuming ? std::ios::app : std::ios::trunc);
+		checkpointOut.open(checkpointFile, resuming ? std::ios::app : std::ios::trunc);
+		if (!out || !checkpointOut)
+		{
+			std::cerr << "Output file " << outputFile << " or checkpoint file cannot be written." << std::endl;
+			return false;
+		}
+		if (!resuming)
+		{
+			processedIds.clear();
+			out << "id,result,region,status,mean,stdError,minimum,maximum,meanAbsolute,fractionAbove2,message" << std::endl;
+		}
+		return true;
+	}
+
+	bool processed(const std::string& id) const { return processedIds.count(id) > 0; }
+	size_t numberOfProcessed() const { return processedIds.size(); }
+
+	void write(const std::string& id, const std::vector<resultRow>& rows)
+	{
+		std::lock_guard<std::mutex> guard(outputMutex);
+		for (const auto& row : rows)
+		{
+			const auto value = [&row](size_t index) { return index < row.values.size() ? std::to_string(row.values[index]) : std::string(); };
+			out << csvQuote(id) << ',' << row.result << ',' << csvQuote(row.region) << ',' << row.statusCode << ',' << value(0) << ',';
+			if (row.result == "classification")
+			{
+				out << value(1) << ",,,,";
+			}
+			else
+			{
+				out << ',' << value(1) << ',' << value(2) << ',' << value(3) << ',' << value(4);
+			}
+			out << ',' << csvQuote(row.message) << '\n';
+		}
+		out.flush();
+		checkpointOut << id << std::endl;
+	}
+
+private:
+	std::filesystem::path checkpointFile;
+	std::set<std::string> processedIds;
+	std::ofstream out;
+	std::ofstream checkpointOut;
+	std::mutex outputMutex;
+};
+
+class batchProcessor
+{
+public:
+	batchProcessor(const web::json::value& modelDB, const std::filesystem::path& modelsRootDirectory, const std::filesystem::path& heatmapOutputDir)
+		: modelDescriptors(modelDB.at(U("modelDescriptors")))
+		, landmarkSetTypes(modelDB.at(U("landmarkSetTypes")))
+		, modelsRootDirectory(modelsRootDirectory)
+		, heatmapOutputDir(heatmapOutputDir)
+	{}
+
+	// Processes one subject. Loaded models are kept in heatmapModels (per worker thread) and splitModels (shared) for subsequent subjects.
+	std::vector<resultRow> process(const manifestRow& row, std::map<std::filesystem::path, heatmapModel>& heatmapModels)
+	{
+		const auto failure = [](web::http::status_code statusCode, const std::string& message)
+		{
+			return std::vector<resultRow>{ { "subject", "", statusCode, message, {} } };
+		};
+
+		FaceScreeningObject subject;
+
+		const auto landmarksJson = readJsonFile(row.landmarksFile);
+		if (!landmarksJson || !landmarksJson->is_object())
+		{
+			return failure(web::http::status_codes::BadRequest, "Landmark file cannot be read.");
+		}
+		const auto landmarkSetType = subject.parseLandmarks(*landmarksJson, landmarkSetTypes);
+		if (landmarkSetType.empty())
+		{
+			return failure(web::http::status_codes::NotFound, "Provided landmark set could not be decoded to a known landmark set type.");
+		}
+
+		const auto ethnicityCode = utility::conversions::to_string_t(row.ethnicityCode);
+		if (!modelDescriptors.has_object_field(ethnicityCode) || !modelDescriptors.at(ethnicityCode).has_object_field(landmarkSetType))
+		{
+			return failure(web::http::status_codes::NotFound, "No models available for landmark set and ethnicity code.");
+		}
+		const auto modelDataDirs = modelDescriptors.at(ethnicityCode).at(landmarkSetType);
+		subject.ethnicityCode = row.ethnicityCode;
+		subject.landmarkSetType = utility::conversions::to_utf8string(landmarkSetType);
+
+		vtkNew<vtkOBJReader> objReader;
+		objReader->SetFileName(row.meshFile.string().c_str());
+		objReader->Update();
+		subject.surfaceMesh = objReader->GetOutput();
+		if (!(subject.surfaceMesh->GetNumberOfCells() > 0))
+		{
+			return failure(web::http::status_codes::NotFound, "Mesh could not be read.");
+		}
+
+		std::vector<resultRow> results;
+		if (modelDataDirs.has_field(U("unsplitModelsPath")))
+		{
+			const auto modelFilesRootDir = modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("unsplitModelsPath")).as_string());
+			auto& model = heatmapModels[modelFilesRootDir];
+			if (!model.pca)
+			{
+				model.pca = vtkSmartPointer<vtkSurfacePCA>::New();
+				model.norm = std::make_unique<msNormalisationTools>();
+				model.norm->SetPCAModel(model.pca);
+				if (!model.pca->LoadFile((modelFilesRootDir / "model.dat").string()) || !model.norm->LoadProjectionFile((modelFilesRootDir / "projection.csv").string()))
+				{
+					heatmapModels.erase(modelFilesRootDir);
+					return failure(web::http::status_codes::NotFound, "Face model or projection file could not be loaded.");
+				}
+			}
+
+			const auto status = subject.computeHeatmap(model.pca, *model.norm, row.age);
+			results.push_back(summariseHeatmap(status, subject.heatmap));
+			if (status.succeeded() && !heatmapOutputDir.empty())
+			{
+				vtkNew<vtkXMLPolyDataWriter> writer;
+				writer->SetFileName((heatmapOutputDir / (row.id + ".vtp")).string().c_str());
+				writer->SetInputData(subject.heatmap);
+				writer->SetDataModeToBinary();
+				writer->Write();
+			}
+		}
+
+		if (modelDataDirs.has_field(U("splitModelsPath")))
+		{
+			const auto facialModelDataPath = modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("splitModelsPath")).as_string());
+			auto regions = row.regions;
+			if (regions.empty() && std::filesystem::is_directory(facialModelDataPath))
+			{
+				for (const auto& facialRegionModelPath : std::filesystem::directory_iterator(facialModelDataPath))
+				{
+					regions.push_back(std::filesystem::canonical(facialRegionModelPath.path()).filename().string());
+				}
+				std::sort(regions.begin(), regions.end());
+			}
+
+			for (const auto& region : regions)
+			{
+				const auto facialRegionModelDataPath = facialModelDataPath / region;
+				auto classifier = classifierFor(facialRegionModelDataPath);
+				if (!classifier)
+				{
+					results.push_back({ "classification", region, web::http::status_codes::NotFound, "Split models for facial region could not be loaded.", {} });
+					continue;
+				}
+				classificationResult classification;
+				const auto status = subject.computeClassification(*classifier, facialRegionModelDataPath, region, classification);
+				resultRow row{ "classification", region, status.statusCode, utility::conversions::to_utf8string(status.message), {} };
+				if (status.succeeded())
+				{
+					row.message.clear();
+					row.values = { classification.mean, classification.stdDev };
+				}
+				results.push_back(row);
+			}
+		}
+		return results;
+	}
+
+private:
+	// Returns a classifier sharing the split models of a facial region with all other workers. Models are loaded on first use.
+	std::unique_ptr<ClassificationTools> classifierFor(const std::filesystem::path& facialRegionModelDataPath)
+	{
+		std::lock_guard<std::mutex> guard(splitModelsMutex);
+		auto found = splitModels.find(facialRegionModelDataPath);
+		if (found == splitModels.end())
+		{
+			ClassificationTools loader;
+			if (!loader.LoadSplitModels(facialRegionModelDataPath))
+			{
+				return nullptr;
+			}
+			found = splitModels.emplace(facialRegionModelDataPath, loader.splitModels).first;
+		}
+		auto classifier = std::make_unique<ClassificationTools>();
+		classifier->splitModels = found->second;
+		return classifier;
+	}
+
+	const web::json::value modelDescriptors;
+	const web::json::value landmarkSetTypes;
+	const std::filesystem::path modelsRootDirectory;
+	const std::filesystem::path heatmapOutputDir;
+
+	std::map<std::filesystem::path, std::shared_ptr<const ClassificationTools::SplitModels>> splitModels;
+	std::mutex splitModelsMutex;
+};
+
+} // unnamed namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Invocation : " << argv[0] << " [manifest.csv] [output.csv] [path to modelDB.json] [number of threads] [heatmap output dir]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::filesystem::path manifestFile(argv[1]);
+	const std::filesystem::path outputFile(argv[2]);
+	const std::filesystem::path faceModelDBfile((argc >= 4) ? argv[3] : "./modelDB.json");
+
+	unsigned int numberOfThreads = std::max(1U, std::thread::hardware_concurrency());
+	if (argc >= 5)
+	{
+		try
+		{
+			numberOfThreads = static_cast<unsigned int>(std::max(1, std::stoi(argv[4])));
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << "faceScreenBatch Error: Number of threads - argument invalid. " << ex.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::filesystem::path heatmapOutputDir;
+	if (argc >= 6)
+	{
+		heatmapOutputDir = argv[5];
+		std::filesystem::create_directories(heatmapOutputDir);
+	}
+
+	const auto modelDB = readModelDB(faceModelDBfile);
+	if (!modelDB)
+	{
+		return EXIT_FAILURE;
+	}
+
+	const auto manifest = readManifest(manifestFile);
+	if (!manifest)
+	{
+		return EXIT_FAILURE;
+	}
+
+	batchOutput output;
+	if (!output.open(outputFile))
+	{
+		return EXIT_FAILURE;
+	}
+	std::cout << "faceScreenBatch: " << manifest->size() << " subjects in manifest, " << output.numberOfProcessed()
+		<< " already processed. Using " << numberOfThreads << " threads." << std::endl;
+
+	batchProcessor processor(*modelDB, faceModelDBfile.parent_path(), heatmapOutputDir);
+
+	// Subjects are distributed over worker threads. Each worker processes one subject at a time, so parallel loops within a subject are run serially.
+	std::atomic<size_t> nextRow(0);
+	std::atomic<size_t> numberOfFailures(0);
+	std::vector<std::thread> workers;
+	for (unsigned int worker = 0; worker < numberOfThreads; ++worker)
+	{
+		workers.emplace_back([&]()
+		{
+			SequentialParallelLoops sequential;
+			std::map<std::filesystem::path, heatmapModel> heatmapModels;
+			for (auto rowIndex = nextRow++; rowIndex < manifest->size(); rowIndex = nextRow++)
+			{
+				const auto& row = manifest->at(rowIndex);
+				if (output.processed(row.id))
+				{
+					continue;
+				}
+				const auto results = processor.process(row, heatmapModels);
+				if (std::any_of(results.cbegin(), results.cend(), [](const auto& result) { return result.statusCode != web::http::status_codes::OK; }))
+				{
+					++numberOfFailures;
+				}
+				output.write(row.id, results);
+				std::cout << "Processed subject " << row.id << " (" << rowIndex + 1 << "/" << manifest->size() << ")" << std::endl;
+			}
+		});
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	std::cout << "faceScreenBatch finished. Subjects with failures: " << numberOfFailures << std::endl;
+	return (numberOfFailures > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,386 @@
+// Benchmark of the processing stages of heatmap computation and classification, requiring no patient data.
+//
+// Invocation: faceScreenBench [path to modelDB.json] [output.json] [number of subjects] [thread counts] [ethnicityCode] [landmarkSetType] [subdivisions] [noise in mm] [baseline.json]
+//
+// Subjects are synthesised from the face model of ethnicityCode and landmarkSetType (defaults CAUC, Bellus16) by applying random mode vectors
+// (standard normal, fixed seed) to the mean shape. To mimic scanner output, synthesised meshes are optionally densified by linear subdivision
+// (each subdivision quadruples the number of triangles) and displaced by Gaussian noise (standard deviation in mm), landmarks included.
+// Each stage is run for all subjects with each number of worker threads in thread counts (comma separated, e.g., 1,2,4; default 1).
+// Workers process one subject at a time. With more than one worker, parallel loops within a subject are run serially.
+// Stages: model_load, split_model_load, resample, shape_parameters, matched_mean_significance, render, heatmap_end_to_end, classification_end_to_end.
+// Classification is benchmarked for the first facial region (in alphabetical order) of the split models.
+// Timings (median, 90th percentile, minimum, maximum, mean in ms and throughput per second) are written to output.json.
+// If baseline.json (output of an earlier run) is given, the run fails if the median of any stage is more than 25% slower than in the baseline.
+
+#include <cpprest/json.h>
+
+#include <vtkNew.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "faceScreeningObject.h"
+#include "heatmapProcessing/msNormalisationTools.h"
+#include "heatmapProcessing/vtkSurfacePCA.h"
+#include "subjectClassification/classificationTools.h"
+#include "syntheticSubjects.h"
+#include "toolUtilities.h"
+#include "utils/computePool.h"
+
+namespace {
+
+// Relative slowdown of a stage median (compared to baseline) reported as regression.
+constexpr double REGRESSION_TOLERANCE = 0.25;
+
+// State of a worker thread. msNormalisationTools keeps state per computation, hence each worker holds its own models.
+struct workerModels
+{
+	vtkSmartPointer<vtkSurfacePCA> pca;
+	std::unique_ptr<msNormalisationTools> norm;
+	std::unique_ptr<ClassificationTools> classifier;
+};
+
+struct stageResult
+{
+	std::string stage;
+	unsigned int threads = 1;
+	std::vector<double> milliseconds; // one per operation
+	double wallSeconds = 0.0;
+	size_t failures = 0;
+};
+
+double millisecondsSince(const std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Value at quantile q (0..1) of sorted values, nearest rank.
+double quantile(const std::vector<double>& sortedValues, const double q)
+{
+	if (sortedValues.empty())
+	{
+		return 0.0;
+	}
+	const auto rank = static_cast<size_t>(q * static_cast<double>(sortedValues.size() - 1) + 0.5);
+	return sortedValues[std::min(rank, sortedValues.size() - 1)];
+}
+
+// Runs operation for each subject, distributing subjects over numberOfThreads workers. operation returns false on failure.
+stageResult runStage(const std::string& stage, const unsigned int numberOfThreads, const size_t numberOfOperations,
+	const std::function<bool(workerModels&, size_t)>& operation, std::vector<workerModels>& models)
+{
+	stageResult result;
+	result.stage = stage;
+	result.threads = numberOfThreads;
+	result.milliseconds.resize(numberOfOperations);
+
+	std::atomic<size_t> nextOperation(0);
+	std::atomic<size_t> failures(0);
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned int worker = 0; worker < numberOfThreads; ++worker)
+	{
+		workers.emplace_back([&, worker]()
+		{
+			// With several workers, each processes one subject at a time, so parallel loops within a subject are run serially.
+			std::optional<SequentialParallelLoops> sequential;
+			if (numberOfThreads > 1)
+			{
+				sequential.emplace();
+			}
+			for (auto index = nextOperation++; index < numberOfOperations; index = nextOperation++)
+			{
+				const auto operationStart = std::chrono::steady_clock::now();
+				if (!operation(models[worker], index))
+				{
+					++failures;
+				}
+				result.milliseconds[index] = millisecondsSince(operationStart);
+			}
+		});
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	result.wallSeconds = millisecondsSince(start) / 1000.0;
+	result.failures = failures;
+
+	std::sort(result.milliseconds.begin(), result.milliseconds.end());
+	std::cout << stage << " (" << numberOfThreads << " threads): median " << quantile(result.milliseconds, 0.5) << " ms, p90 "
+		<< quantile(result.milliseconds, 0.9) << " ms" << (result.failures > 0 ? ", FAILURES: " + std::to_string(result.failures) : std::string()) << std::endl;
+	return result;
+}
+
+web::json::value toJson(const stageResult& result)
+{
+	const auto& ms = result.milliseconds;
+	double sum = 0.0;
+	for (const auto value : ms)
+	{
+		sum += value;
+	}
+	web::json::value json = web::json::value::object();
+	json[U("stage")] = web::json::value::string(utility::conversions::to_string_t(result.stage));
+	json[U("threads")] = web::json::value::number(result.threads);
+	json[U("operations")] = web::json::value::number(static_cast<uint64_t>(ms.size()));
+	json[U("failures")] = web::json::value::number(static_cast<uint64_t>(result.failures));
+	json[U("medianMs")] = web::json::value::number(quantile(ms, 0.5));
+	json[U("p90Ms")] = web::json::value::number(quantile(ms, 0.9));
+	json[U("minMs")] = web::json::value::number(ms.empty() ? 0.0 : ms.front());
+	json[U("maxMs")] = web::json::value::number(ms.empty() ? 0.0 : ms.back());
+	json[U("meanMs")] = web::json::value::number(ms.empty() ? 0.0 : sum / static_cast<double>(ms.size()));
+	json[U("throughputPerSecond")] = web::json::value::number(result.wallSeconds > 0.0 ? static_cast<double>(ms.size()) / result.wallSeconds : 0.0);
+	return json;
+}
+
+// Returns number of stages whose median regressed beyond REGRESSION_TOLERANCE compared to the same stage and thread count in baseline.
+size_t compareToBaseline(const web::json::array& results, const web::json::value& baseline)
+{
+	if (!baseline.has_array_field(U("results")))
+	{
+		std::cerr << "Baseline has no results." << std::endl;
+		return 1;
+	}
+	size_t regressions = 0;
+	for (const auto& result : results)
+	{
+		for (const auto& baselineResult : baseline.at(U("results")).as_array())
+		{
+			if (baselineResult.at(U("stage")) != result.at(U("stage")) || baselineResult.at(U("threads")) != result.at(U("threads")))
+			{
+				continue;
+			}
+			const auto median = result.at(U("medianMs")).as_double();
+			const auto baselineMedian = baselineResult.at(U("medianMs")).as_double();
+			if (median > baselineMedian * (1.0 + REGRESSION_TOLERANCE))
+			{
+				ucout << U("REGRESSION: ") << result.at(U("stage")).as_string() << U(" (") << result.at(U("threads")).as_integer() << U(" threads): median ")
+					<< median << U(" ms, baseline ") << baselineMedian << U(" ms") << std::endl;
+				++regressions;
+			}
+		}
+	}
+	return regressions;
+}
+
+} // unnamed namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Invocation : " << argv[0] << " [path to modelDB.json] [output.json] [number of subjects] [thread counts] [ethnicityCode] [landmarkSetType] [subdivisions] [noise in mm] [baseline.json]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::filesystem::path faceModelDBfile(argv[1]);
+	const std::filesystem::path outputFile(argv[2]);
+	size_t numberOfSubjects = 8;
+	std::vector<unsigned int> threadCounts;
+	int subdivisions = 0;
+	double noiseMm = 0.0;
+	try
+	{
+		if (argc >= 4)
+		{
+			numberOfSubjects = static_cast<size_t>(std::max(1, std::stoi(argv[3])));
+		}
+		std::stringstream threadCountStream((argc >= 5) ? argv[4] : "1");
+		std::string threadCount;
+		while (std::getline(threadCountStream, threadCount, ','))
+		{
+			threadCounts.push_back(static_cast<unsigned int>(std::max(1, std::stoi(threadCount))));
+		}
+		if (argc >= 8)
+		{
+			subdivisions = std::max(0, std::stoi(argv[7]));
+		}
+		if (argc >= 9)
+		{
+			noiseMm = std::max(0.0, std::stod(argv[8]));
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "faceScreenBench Error: Numeric argument invalid. " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	const auto ethnicityCode = utility::conversions::to_string_t((argc >= 6) ? argv[5] : "CAUC");
+	const auto landmarkSetType = utility::conversions::to_string_t((argc >= 7) ? argv[6] : "Bellus16");
+
+	const auto modelDB = readModelDB(faceModelDBfile);
+	if (!modelDB)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto& landmarkSetTypes = modelDB->at(U("landmarkSetTypes"));
+	const auto foundModelDataDirs = faceModelDataDirs(*modelDB, ethnicityCode, landmarkSetType);
+	if (!foundModelDataDirs)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto& modelDataDirs = *foundModelDataDirs;
+	const auto modelsRootDirectory = faceModelDBfile.parent_path();
+	const auto modelFilesRootDir = modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("unsplitModelsPath")).as_string());
+
+	// Facial region and split models for classification, if available.
+	std::filesystem::path facialRegionModelDataPath;
+	std::string facialRegion;
+	if (modelDataDirs.has_string_field(U("splitModelsPath")))
+	{
+		const auto facialModelDataPath = modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("splitModelsPath")).as_string());
+		std::vector<std::string> regions;
+		if (std::filesystem::is_directory(facialModelDataPath))
+		{
+			for (const auto& facialRegionModelPath : std::filesystem::directory_iterator(facialModelDataPath))
+			{
+				regions.push_back(std::filesystem::canonical(facialRegionModelPath.path()).filename().string());
+			}
+		}
+		if (!regions.empty())
+		{
+			facialRegion = *std::min_element(regions.cbegin(), regions.cend());
+			facialRegionModelDataPath = facialModelDataPath / facialRegion;
+		}
+	}
+
+	vtkNew<vtkSurfacePCA> synthesisModel;
+	if (!synthesisModel->LoadFile((modelFilesRootDir / "model.dat").string()))
+	{
+		std::cerr << "Face model in " << modelFilesRootDir << " could not be loaded." << std::endl;
+		return EXIT_FAILURE;
+	}
+	auto subjects = synthesiseSubjects(synthesisModel, landmarkSetTypes, landmarkSetType, numberOfSubjects, subdivisions, noiseMm);
+	if (subjects.empty())
+	{
+		return EXIT_FAILURE;
+	}
+	std::cout << "faceScreenBench: " << subjects.size() << " synthetic subjects with " << subjects.front()->data.surfaceMesh->GetNumberOfPoints() << " points each." << std::endl;
+
+	web::json::value results = web::json::value::array();
+	const auto addResult = [&results](const stageResult& result) { results[results.size()] = toJson(result); };
+
+	for (const auto numberOfThreads : threadCounts)
+	{
+		std::vector<workerModels> models(numberOfThreads);
+
+		addResult(runStage("model_load", numberOfThreads, numberOfThreads, [&](workerModels&, size_t worker)
+		{
+			auto& model = models[worker];
+			model.pca = vtkSmartPointer<vtkSurfacePCA>::New();
+			model.norm = std::make_unique<msNormalisationTools>();
+			model.norm->SetPCAModel(model.pca);
+			return model.pca->LoadFile((modelFilesRootDir / "model.dat").string()) && model.norm->LoadProjectionFile((modelFilesRootDir / "projection.csv").string());
+		}, models));
+
+		// Split models are shared by all workers, as in batch processing.
+		std::shared_ptr<const ClassificationTools::SplitModels> splitModels;
+		if (!facialRegionModelDataPath.empty())
+		{
+			addResult(runStage("split_model_load", 1, 1, [&](workerModels&, size_t)
+			{
+				ClassificationTools loader;
+				if (!loader.LoadSplitModels(facialRegionModelDataPath))
+				{
+					return false;
+				}
+				splitModels = loader.splitModels;
+				return true;
+			}, models));
+			for (auto& model : models)
+			{
+				model.classifier = std::make_unique<ClassificationTools>();
+				model.classifier->splitModels = splitModels;
+			}
+		}
+
+		std::vector<vtkSmartPointer<vtkPolyData>> resampledSurfaces(subjects.size());
+		addResult(runStage("resample", numberOfThreads, subjects.size(), [&](workerModels& model, size_t s)
+		{
+			resampledSurfaces[s] = vtkSmartPointer<vtkPolyData>::New();
+			model.pca->Resample(subjects[s]->data.surfaceMesh, subjects[s]->landmarks, resampledSurfaces[s]);
+			return resampledSurfaces[s]->GetNumberOfPoints() > 0;
+		}, models));
+
+		std::vector<vtkSmartPointer<vtkDoubleArray>> shapeParameters(subjects.size());
+		addResult(runStage("shape_parameters", numberOfThreads, subjects.size(), [&](workerModels& model, size_t s)
+		{
+			shapeParameters[s] = vtkSmartPointer<vtkDoubleArray>::New();
+			model.pca->GetApproximateShapeParametersFromResampledSurface(resampledSurfaces[s], shapeParameters[s], true);
+			return shapeParameters[s]->GetNumberOfValues() > 0;
+		}, models));
+
+		addResult(runStage("matched_mean_significance", numberOfThreads, subjects.size(), [&](workerModels& model, size_t s)
+		{
+			vtkNew<vtkPolyData> signature;
+			model.pca->ParameteriseShape(shapeParameters[s], signature);
+			return model.norm->CalculateMatchedMeanSignificance(signature, shapeParameters[s], static_cast<int>(subjects[s]->age)) == 0;
+		}, models));
+
+		addResult(runStage("heatmap_end_to_end", numberOfThreads, subjects.size(), [&](workerModels& model, size_t s)
+		{
+			return subjects[s]->data.computeHeatmap(model.pca, *model.norm, subjects[s]->age).succeeded();
+		}, models));
+
+		addResult(runStage("render", numberOfThreads, subjects.size(), [&](workerModels&, size_t s)
+		{
+			std::vector<uint8_t> jpegImage;
+			return subjects[s]->data.renderHeatmapImage(jpegImage).succeeded();
+		}, models));
+
+		if (splitModels)
+		{
+			addResult(runStage("classification_end_to_end", numberOfThreads, subjects.size(), [&](workerModels& model, size_t s)
+			{
+				classificationResult classification;
+				return subjects[s]->data.computeClassification(*model.classifier, facialRegionModelDataPath, facialRegion, classification).succeeded();
+			}, models));
+		}
+	}
+
+	web::json::value output = web::json::value::object();
+	output[U("ethnicityCode")] = web::json::value::string(ethnicityCode);
+	output[U("landmarkSetType")] = web::json::value::string(landmarkSetType);
+	output[U("facialRegion")] = web::json::value::string(utility::conversions::to_string_t(facialRegion));
+	output[U("subjects")] = web::json::value::number(static_cast<uint64_t>(subjects.size()));
+	output[U("pointsPerSubject")] = web::json::value::number(static_cast<int64_t>(subjects.front()->data.surfaceMesh->GetNumberOfPoints()));
+	output[U("subdivisions")] = web::json::value::number(subdivisions);
+	output[U("noiseMm")] = web::json::value::number(noiseMm);
+	output[U("hardwareThreads")] = web::json::value::number(std::thread::hardware_concurrency());
+	output[U("results")] = results;
+
+	std::ofstream out(outputFile);
+	out << utility::conversions::to_utf8string(output.serialize()) << std::endl;
+	if (!out)
+	{
+		std::cerr << "Output file " << outputFile << " cannot be written." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	size_t failures = 0;
+	for (const auto& result : results.as_array())
+	{
+		failures += static_cast<size_t>(result.at(U("failures")).as_number().to_uint64());
+	}
+	size_t regressions = 0;
+	if (argc >= 10)
+	{
+		const auto baseline = readJsonFile(argv[9]);
+		regressions = baseline ? compareToBaseline(results.as_array(), *baseline) : 1;
+	}
+	std::cout << "faceScreenBench finished. Failed operations: " << failures << ", regressions: " << regressions << std::endl;
+	return (failures > 0 || regressions > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
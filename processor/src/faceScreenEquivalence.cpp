@@ -0,0 +1,436 @@
+// Numerical equivalence harness: checks that optimised kernels (see utils/kernelSelection.h) reproduce the clinical outputs of the legacy code.
+//
+// Invocation: faceScreenEquivalence [path to modelDB.json] [report.json] [number of subjects] [tolerances.json] [golden.json] [ethnicityCode] [landmarkSetType]
+//
+// Fixed inputs are subjects synthesised from the face model of ethnicityCode and landmarkSetType (defaults CAUC, Bellus16) with a fixed seed (default 4 subjects).
+// Each subject is processed with all kernels legacy (reference), with each kernel optimised on its own, and with all kernels optimised.
+// Outputs compared against the reference: "Stdv" scalars of the heatmap (per-vertex maximum and mean absolute difference), shape parameters
+// (maximum absolute difference) and, for each facial region of the split models, classification mean and standard error (absolute difference).
+// tolerances.json (optional, "" for defaults) may set stdvMaxAbs, stdvMeanAbs, modesMaxAbs, classificationMeanAbs and classificationStdErrAbs.
+// golden.json (optional): written from the reference outputs if it does not exist. Otherwise, its outputs become the reference, and the legacy
+// outputs of this run are compared against them as well, which catches changes of the legacy path itself (e.g., after updating VTK).
+// All differences are written to report.json. Exits with failure if any difference exceeds its tolerance, e.g., to fail a CI build.
+
+#include <cpprest/json.h>
+
+#include <vtkDataArray.h>
+#include <vtkDoubleArray.h>
+#include <vtkNew.h>
+#include <vtkPointData.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "faceScreeningObject.h"
+#include "heatmapProcessing/msNormalisationTools.h"
+#include "heatmapProcessing/vtkSurfacePCA.h"
+#include "subjectClassification/classificationTools.h"
+#include "syntheticSubjects.h"
+#include "toolUtilities.h"
+#include "utils/kernelSelection.h"
+
+namespace {
+
+struct subjectOutputs
+{
+	bool heatmapComputed = false;
+	std::vector<double> modes;
+	std::vector<double> stdv;
+	std::map<std::string, classificationResult> classifications; // successful classifications by facial region
+};
+
+struct differences
+{
+	bool mismatch = false; // outputs missing in one of both, or of different size
+	double stdvMaxAbs = 0.0;
+	double stdvMeanAbs = 0.0;
+	double modesMaxAbs = 0.0;
+	double classificationMeanAbs = 0.0;
+	double classificationStdErrAbs = 0.0;
+};
+
+struct tolerances
+{
+	double stdvMaxAbs = 1e-3;
+	double stdvMeanAbs = 1e-5;
+	double modesMaxAbs = 1e-5;
+	double classificationMeanAbs = 1e-5;
+	double classificationStdErrAbs = 1e-5;
+
+	bool exceededBy(const differences& d) const
+	{
+		return d.mismatch || d.stdvMaxAbs > stdvMaxAbs || d.stdvMeanAbs > stdvMeanAbs || d.modesMaxAbs > modesMaxAbs
+			|| d.classificationMeanAbs > classificationMeanAbs || d.classificationStdErrAbs > classificationStdErrAbs;
+	}
+};
+
+// Maximum and mean absolute difference of two vectors of equal size.
+std::pair<double, double> absoluteDifference(const std::vector<double>& a, const std::vector<double>& b)
+{
+	double maximum = 0.0, sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		const double difference = std::fabs(a[i] - b[i]);
+		maximum = std::max(maximum, difference);
+		sum += difference;
+	}
+	return { maximum, a.empty() ? 0.0 : sum / static_cast<double>(a.size()) };
+}
+
+differences compare(const subjectOutputs& reference, const subjectOutputs& outputs)
+{
+	differences d;
+	if (reference.heatmapComputed != outputs.heatmapComputed || reference.stdv.size() != outputs.stdv.size() || reference.modes.size() != outputs.modes.size()
+		|| reference.classifications.size() != outputs.classifications.size())
+	{
+		d.mismatch = true;
+		return d;
+	}
+	std::tie(d.stdvMaxAbs, d.stdvMeanAbs) = absoluteDifference(reference.stdv, outputs.stdv);
+	d.modesMaxAbs = absoluteDifference(reference.modes, outputs.modes).first;
+	for (const auto& [region, classification] : reference.classifications)
+	{
+		const auto found = outputs.classifications.find(region);
+		if (found == outputs.classifications.end())
+		{
+			d.mismatch = true;
+			continue;
+		}
+		d.classificationMeanAbs = std::max(d.classificationMeanAbs, static_cast<double>(std::fabs(classification.mean - found->second.mean)));
+		d.classificationStdErrAbs = std::max(d.classificationStdErrAbs, static_cast<double>(std::fabs(classification.stdDev - found->second.stdDev)));
+	}
+	return d;
+}
+
+web::json::value toJson(const std::vector<double>& values)
+{
+	web::json::value json = web::json::value::array(values.size());
+	for (size_t i = 0; i < values.size(); ++i)
+	{
+		json[i] = web::json::value::number(values[i]);
+	}
+	return json;
+}
+
+std::vector<double> vectorFromJson(const web::json::value& json)
+{
+	std::vector<double> values;
+	for (const auto& value : json.as_array())
+	{
+		values.push_back(value.as_double());
+	}
+	return values;
+}
+
+web::json::value toJson(const subjectOutputs& outputs)
+{
+	web::json::value json = web::json::value::object();
+	json[U("heatmapComputed")] = web::json::value::boolean(outputs.heatmapComputed);
+	json[U("modes")] = toJson(outputs.modes);
+	json[U("stdv")] = toJson(outputs.stdv);
+	web::json::value classifications = web::json::value::object();
+	for (const auto& [region, classification] : outputs.classifications)
+	{
+		classifications[utility::conversions::to_string_t(region)] = toJson(std::vector<double>{ classification.mean, classification.stdDev });
+	}
+	json[U("classifications")] = classifications;
+	return json;
+}
+
+subjectOutputs outputsFromJson(const web::json::value& json)
+{
+	subjectOutputs outputs;
+	outputs.heatmapComputed = json.at(U("heatmapComputed")).as_bool();
+	outputs.modes = vectorFromJson(json.at(U("modes")));
+	outputs.stdv = vectorFromJson(json.at(U("stdv")));
+	for (const auto& [region, classification] : json.at(U("classifications")).as_object())
+	{
+		const auto values = vectorFromJson(classification);
+		outputs.classifications[utility::conversions::to_utf8string(region)] = { static_cast<float>(values.at(0)), static_cast<float>(values.at(1)) };
+	}
+	return outputs;
+}
+
+web::json::value toJson(const differences& d)
+{
+	web::json::value json = web::json::value::object();
+	json[U("mismatch")] = web::json::value::boolean(d.mismatch);
+	json[U("stdvMaxAbs")] = web::json::value::number(d.stdvMaxAbs);
+	json[U("stdvMeanAbs")] = web::json::value::number(d.stdvMeanAbs);
+	json[U("modesMaxAbs")] = web::json::value::number(d.modesMaxAbs);
+	json[U("classificationMeanAbs")] = web::json::value::number(d.classificationMeanAbs);
+	json[U("classificationStdErrAbs")] = web::json::value::number(d.classificationStdErrAbs);
+	return json;
+}
+
+class equivalenceRunner
+{
+public:
+	equivalenceRunner(const std::filesystem::path& modelFilesRootDir, const std::filesystem::path& facialModelDataPath)
+		: modelFilesRootDir(modelFilesRootDir)
+		, facialModelDataPath(facialModelDataPath)
+	{}
+
+	bool loadModels()
+	{
+		pca = vtkSmartPointer<vtkSurfacePCA>::New();
+		norm.SetPCAModel(pca);
+		if (!pca->LoadFile((modelFilesRootDir / "model.dat").string()) || !norm.LoadProjectionFile((modelFilesRootDir / "projection.csv").string()))
+		{
+			std::cerr << "Face model or projection file in " << modelFilesRootDir << " could not be loaded." << std::endl;
+			return false;
+		}
+		if (!facialModelDataPath.empty() && std::filesystem::is_directory(facialModelDataPath))
+		{
+			for (const auto& facialRegionModelPath : std::filesystem::directory_iterator(facialModelDataPath))
+			{
+				const auto region = std::filesystem::canonical(facialRegionModelPath.path()).filename().string();
+				ClassificationTools loader;
+				if (!loader.LoadSplitModels(facialModelDataPath / region))
+				{
+					std::cerr << "Split models of facial region " << region << " could not be loaded." << std::endl;
+					return false;
+				}
+				splitModels[region] = loader.splitModels;
+			}
+		}
+		return true;
+	}
+
+	vtkSurfacePCA* model() { return pca; }
+
+	// Computes outputs of subject with the kernel implementations currently selected.
+	subjectOutputs run(syntheticSubject& subject)
+	{
+		subjectOutputs outputs;
+		vtkNew<vtkDoubleArray> projection;
+		outputs.heatmapComputed = subject.data.computeHeatmap(pca, norm, subject.age, nullptr, projection).succeeded();
+		if (outputs.heatmapComputed)
+		{
+			for (vtkIdType mode = 0; mode < projection->GetNumberOfValues(); ++mode)
+			{
+				outputs.modes.push_back(projection->GetValue(mode));
+			}
+			vtkDataArray* stdv = subject.data.heatmap->GetPointData()->GetArray("Stdv");
+			if (stdv == nullptr)
+			{
+				stdv = subject.data.heatmap->GetPointData()->GetScalars();
+			}
+			for (vtkIdType i = 0; stdv != nullptr && i < stdv->GetNumberOfTuples(); ++i)
+			{
+				outputs.stdv.push_back(stdv->GetTuple1(i));
+			}
+		}
+		for (const auto& [region, models] : splitModels)
+		{
+			ClassificationTools classifier;
+			classifier.splitModels = models;
+			classificationResult classification;
+			if (subject.data.computeClassification(classifier, facialModelDataPath / region, region, classification).succeeded())
+			{
+				outputs.classifications[region] = classification;
+			}
+		}
+		return outputs;
+	}
+
+private:
+	const std::filesystem::path modelFilesRootDir;
+	const std::filesystem::path facialModelDataPath;
+	vtkSmartPointer<vtkSurfacePCA> pca;
+	msNormalisationTools norm;
+	std::map<std::string, std::shared_ptr<const ClassificationTools::SplitModels>> splitModels;
+};
+
+} // unnamed namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Invocation : " << argv[0] << " [path to modelDB.json] [report.json] [number of subjects] [tolerances.json] [golden.json] [ethnicityCode] [landmarkSetType]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::filesystem::path faceModelDBfile(argv[1]);
+	const std::filesystem::path reportFile(argv[2]);
+	size_t numberOfSubjects = 4;
+	if (argc >= 4)
+	{
+		try
+		{
+			numberOfSubjects = static_cast<size_t>(std::max(1, std::stoi(argv[3])));
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << "faceScreenEquivalence Error: Number of subjects - argument invalid. " << ex.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	tolerances tolerance;
+	if (argc >= 5 && std::string(argv[4]).size() > 0)
+	{
+		const auto toleranceJson = readJsonFile(argv[4]);
+		if (!toleranceJson || !toleranceJson->is_object())
+		{
+			std::cerr << "Tolerances file " << argv[4] << " cannot be read." << std::endl;
+			return EXIT_FAILURE;
+		}
+		const auto setIfPresent = [&toleranceJson](const utility::string_t& name, double& value)
+		{
+			if (toleranceJson->has_number_field(name))
+			{
+				value = toleranceJson->at(name).as_double();
+			}
+		};
+		setIfPresent(U("stdvMaxAbs"), tolerance.stdvMaxAbs);
+		setIfPresent(U("stdvMeanAbs"), tolerance.stdvMeanAbs);
+		setIfPresent(U("modesMaxAbs"), tolerance.modesMaxAbs);
+		setIfPresent(U("classificationMeanAbs"), tolerance.classificationMeanAbs);
+		setIfPresent(U("classificationStdErrAbs"), tolerance.classificationStdErrAbs);
+	}
+	const std::filesystem::path goldenFile((argc >= 6) ? argv[5] : "");
+	const auto ethnicityCode = utility::conversions::to_string_t((argc >= 7) ? argv[6] : "CAUC");
+	const auto landmarkSetType = utility::conversions::to_string_t((argc >= 8) ? argv[7] : "Bellus16");
+
+	const auto modelDB = readModelDB(faceModelDBfile);
+	if (!modelDB)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto foundModelDataDirs = faceModelDataDirs(*modelDB, ethnicityCode, landmarkSetType);
+	if (!foundModelDataDirs)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto& modelDataDirs = *foundModelDataDirs;
+	const auto modelsRootDirectory = faceModelDBfile.parent_path();
+	std::filesystem::path facialModelDataPath;
+	if (modelDataDirs.has_string_field(U("splitModelsPath")))
+	{
+		facialModelDataPath = modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("splitModelsPath")).as_string());
+	}
+
+	equivalenceRunner runner(modelsRootDirectory / std::filesystem::path(modelDataDirs.at(U("unsplitModelsPath")).as_string()), facialModelDataPath);
+	if (!runner.loadModels())
+	{
+		return EXIT_FAILURE;
+	}
+	auto subjects = synthesiseSubjects(runner.model(), modelDB->at(U("landmarkSetTypes")), landmarkSetType, numberOfSubjects);
+	if (subjects.empty())
+	{
+		return EXIT_FAILURE;
+	}
+
+	// Reference: all kernels legacy.
+	kernelSelection::selectLegacyForAll(true);
+	std::vector<subjectOutputs> reference;
+	for (auto& subject : subjects)
+	{
+		reference.push_back(runner.run(*subject));
+	}
+
+	// Configurations compared against the reference: each kernel optimised on its own, then all kernels optimised.
+	std::vector<std::pair<std::string, std::vector<subjectOutputs>>> configurations;
+	for (size_t k = 0; k <= static_cast<size_t>(Kernel::NumberOfKernels); ++k)
+	{
+		const bool allOptimised = (k == static_cast<size_t>(Kernel::NumberOfKernels));
+		kernelSelection::selectLegacyForAll(!allOptimised);
+		if (!allOptimised)
+		{
+			kernelSelection::selectLegacy(static_cast<Kernel>(k), false);
+		}
+		std::vector<subjectOutputs> outputs;
+		for (auto& subject : subjects)
+		{
+			outputs.push_back(runner.run(*subject));
+		}
+		configurations.emplace_back(allOptimised ? std::string("allOptimised") : std::string(kernelSelection::kernelName(static_cast<Kernel>(k))) + "Optimised", outputs);
+	}
+
+	if (!goldenFile.empty())
+	{
+		if (std::filesystem::exists(goldenFile))
+		{
+			const auto golden = readJsonFile(goldenFile);
+			if (!golden || !golden->has_array_field(U("subjects")) || golden->at(U("subjects")).size() != subjects.size())
+			{
+				std::cerr << "Golden file " << goldenFile << " invalid or recorded for a different number of subjects." << std::endl;
+				return EXIT_FAILURE;
+			}
+			std::vector<subjectOutputs> goldenOutputs;
+			for (const auto& outputs : golden->at(U("subjects")).as_array())
+			{
+				goldenOutputs.push_back(outputsFromJson(outputs));
+			}
+			// The golden outputs become the reference of all configurations. Legacy outputs of this run are compared as further configuration.
+			configurations.emplace_back("legacy", reference);
+			reference.swap(goldenOutputs);
+		}
+		else
+		{
+			web::json::value golden = web::json::value::object();
+			golden[U("subjects")] = web::json::value::array(reference.size());
+			for (size_t s = 0; s < reference.size(); ++s)
+			{
+				golden[U("subjects")][s] = toJson(reference[s]);
+			}
+			std::ofstream out(goldenFile);
+			out << utility::conversions::to_utf8string(golden.serialize()) << std::endl;
+			std::cout << "Golden outputs written to " << goldenFile << std::endl;
+		}
+	}
+
+	bool passed = true;
+	web::json::value report = web::json::value::object();
+	report[U("ethnicityCode")] = web::json::value::string(ethnicityCode);
+	report[U("landmarkSetType")] = web::json::value::string(landmarkSetType);
+	report[U("subjects")] = web::json::value::number(static_cast<uint64_t>(subjects.size()));
+	web::json::value reportConfigurations = web::json::value::array();
+	for (const auto& [name, outputs] : configurations)
+	{
+		web::json::value configuration = web::json::value::object();
+		configuration[U("configuration")] = web::json::value::string(utility::conversions::to_string_t(name));
+		web::json::value subjectDifferences = web::json::value::array(outputs.size());
+		bool configurationPassed = true;
+		for (size_t s = 0; s < outputs.size(); ++s)
+		{
+			const auto d = compare(reference[s], outputs[s]);
+			subjectDifferences[s] = toJson(d);
+			if (tolerance.exceededBy(d))
+			{
+				configurationPassed = false;
+				std::cout << "NOT EQUIVALENT: " << name << ", subject " << s << ": " << utility::conversions::to_utf8string(toJson(d).serialize()) << std::endl;
+			}
+		}
+		configuration[U("passed")] = web::json::value::boolean(configurationPassed);
+		configuration[U("differences")] = subjectDifferences;
+		reportConfigurations[reportConfigurations.size()] = configuration;
+		passed = passed && configurationPassed;
+	}
+	report[U("configurations")] = reportConfigurations;
+	report[U("passed")] = web::json::value::boolean(passed);
+
+	std::ofstream out(reportFile);
+	out << utility::conversions::to_utf8string(report.serialize()) << std::endl;
+	if (!out)
+	{
+		std::cerr << "Report file " << reportFile << " cannot be written." << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "faceScreenEquivalence finished: " << (passed ? "all outputs equivalent." : "OUTPUTS DIFFER.") << std::endl;
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,365 @@
+// Closed-loop load generator for capacity planning of faceScreenServer.
+//
+// Invocation: faceScreenLoadGen [server URL] [path to modelDB.json] [number of virtual users] [duration in seconds] [report.json] [facialRegion] [ethnicityCode] [landmarkSetType]
+//
+// Each virtual user repeatedly runs the call sequence of the backend for one subject, starting the next sequence as soon as the previous one finished:
+//		processingToken -> landmarks -> objFile -> computeHeatmap -> heatmapPolyData -> computeClassification -> delete
+// Subjects are synthesised from the face model of ethnicityCode and landmarkSetType (defaults CAUC, Bellus16), one per virtual user.
+// Classification is requested for facialRegion, or, if omitted, for the first region listed by endpoint /classificationRegions.
+// Server URL, e.g., http://localhost:34568/faceScreen/processor/. Defaults: 4 virtual users, 60 s; no new sequences are started after the duration.
+// Reported per endpoint: requests, throughput, errors (status not 200 or no response), 507 (out of processing tokens) and p50/p95/p99 latency.
+// The report is printed and written as json to report.json (optional).
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <vtkNew.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "heatmapProcessing/vtkSurfacePCA.h"
+#include "syntheticSubjects.h"
+#include "toolUtilities.h"
+
+namespace {
+
+// Endpoints in order of the call sequence.
+enum class endpoint { processingToken, landmarks, objFile, computeHeatmap, heatmapPolyData, computeClassification, deleteToken, numberOfEndpoints };
+
+const char* endpointName(const endpoint e)
+{
+	static const char* names[] = { "processingToken", "landmarks", "objFile", "computeHeatmap", "heatmapPolyData", "computeClassification", "delete" };
+	return names[static_cast<size_t>(e)];
+}
+
+struct endpointStatistics
+{
+	std::vector<double> milliseconds; // all requests, including failed ones
+	size_t errors = 0;
+	size_t insufficientStorage = 0; // 507
+};
+
+// Upload of a synthesised subject, prepared once per virtual user.
+struct subjectUpload
+{
+	std::string landmarksJson;
+	std::string objFile;
+	float age = 0.0F;
+};
+
+class loadStatistics
+{
+public:
+	void record(const endpoint e, const double milliseconds, const web::http::status_code statusCode)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		auto& statistics = endpoints[static_cast<size_t>(e)];
+		statistics.milliseconds.push_back(milliseconds);
+		if (statusCode != web::http::status_codes::OK)
+		{
+			++statistics.errors;
+		}
+		if (statusCode == web::http::status_codes::InsufficientStorage)
+		{
+			++statistics.insufficientStorage;
+		}
+	}
+
+	void sequenceCompleted(const bool successful)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		++sequences;
+		failedSequences += successful ? 0 : 1;
+	}
+
+	// Prints report and returns it as json. Sorts recorded latencies.
+	web::json::value report(const double durationSeconds, const unsigned int numberOfUsers)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		const auto quantile = [](const std::vector<double>& sorted, const double q)
+		{
+			return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size() - 1) + 0.5))];
+		};
+
+		web::json::value json = web::json::value::object();
+		json[U("virtualUsers")] = web::json::value::number(numberOfUsers);
+		json[U("durationSeconds")] = web::json::value::number(durationSeconds);
+		json[U("sequences")] = web::json::value::number(static_cast<uint64_t>(sequences));
+		json[U("failedSequences")] = web::json::value::number(static_cast<uint64_t>(failedSequences));
+		json[U("sequencesPerSecond")] = web::json::value::number(static_cast<double>(sequences) / durationSeconds);
+
+		std::cout << std::fixed << std::setprecision(1)
+			<< "Virtual users: " << numberOfUsers << ", duration: " << durationSeconds << " s, sequences: " << sequences << " (" << failedSequences << " failed), "
+			<< static_cast<double>(sequences) / durationSeconds << " sequences/s" << std::endl
+			<< std::left << std::setw(24) << "endpoint" << std::right << std::setw(10) << "requests" << std::setw(10) << "req/s" << std::setw(10) << "errors"
+			<< std::setw(10) << "507" << std::setw(12) << "p50 ms" << std::setw(12) << "p95 ms" << std::setw(12) << "p99 ms" << std::endl;
+
+		web::json::value endpointsJson = web::json::value::array();
+		for (size_t e = 0; e < endpoints.size(); ++e)
+		{
+			auto& statistics = endpoints[e];
+			std::sort(statistics.milliseconds.begin(), statistics.milliseconds.end());
+			const auto requests = statistics.milliseconds.size();
+			const double p50 = quantile(statistics.milliseconds, 0.50), p95 = quantile(statistics.milliseconds, 0.95), p99 = quantile(statistics.milliseconds, 0.99);
+			const auto name = endpointName(static_cast<endpoint>(e));
+
+			std::cout << std::left << std::setw(24) << name << std::right << std::setw(10) << requests << std::setw(10) << static_cast<double>(requests) / durationSeconds
+				<< std::setw(10) << statistics.errors << std::setw(10) << statistics.insufficientStorage << std::setw(12) << p50 << std::setw(12) << p95 << std::setw(12) << p99 << std::endl;
+
+			web::json::value endpointJson = web::json::value::object();
+			endpointJson[U("endpoint")] = web::json::value::string(utility::conversions::to_string_t(name));
+			endpointJson[U("requests")] = web::json::value::number(static_cast<uint64_t>(requests));
+			endpointJson[U("requestsPerSecond")] = web::json::value::number(static_cast<double>(requests) / durationSeconds);
+			endpointJson[U("errors")] = web::json::value::number(static_cast<uint64_t>(statistics.errors));
+			endpointJson[U("errorRate")] = web::json::value::number(requests > 0 ? static_cast<double>(statistics.errors) / requests : 0.0);
+			endpointJson[U("insufficientStorage")] = web::json::value::number(static_cast<uint64_t>(statistics.insufficientStorage));
+			endpointJson[U("insufficientStorageRate")] = web::json::value::number(requests > 0 ? static_cast<double>(statistics.insufficientStorage) / requests : 0.0);
+			endpointJson[U("p50Ms")] = web::json::value::number(p50);
+			endpointJson[U("p95Ms")] = web::json::value::number(p95);
+			endpointJson[U("p99Ms")] = web::json::value::number(p99);
+			endpointsJson[e] = endpointJson;
+		}
+		json[U("endpoints")] = endpointsJson;
+		return json;
+	}
+
+private:
+	std::mutex mutex;
+	std::array<endpointStatistics, static_cast<size_t>(endpoint::numberOfEndpoints)> endpoints;
+	size_t sequences = 0;
+	size_t failedSequences = 0;
+};
+
+class virtualUser
+{
+public:
+	virtualUser(const utility::string_t& serverUrl, const subjectUpload& subject, const std::string& ethnicityCode, const std::string& facialRegion, loadStatistics& statistics)
+		: client(serverUrl, clientConfig())
+		, subject(subject)
+		, ethnicityCode(utility::conversions::to_string_t(ethnicityCode))
+		, facialRegion(utility::conversions::to_string_t(facialRegion))
+		, statistics(statistics)
+	{}
+
+	// Runs call sequence once. Returns true if all requests succeeded. The processing token is deleted even if a later step failed.
+	bool runSequence()
+	{
+		const auto token = request(endpoint::processingToken, web::http::methods::GET, web::uri_builder(U("processingToken")));
+		if (!token)
+		{
+			return false;
+		}
+
+		bool successful =
+			request(endpoint::landmarks, web::http::methods::POST, web::uri_builder(U("landmarks")).append_query(U("processingToken"), *token).append_query(U("ethnicityCode"), ethnicityCode),
+				subject.landmarksJson, U("application/json")).has_value()
+			&& request(endpoint::objFile, web::http::methods::PUT, web::uri_builder(U("objFile")).append_query(U("processingToken"), *token), subject.objFile).has_value()
+			&& request(endpoint::computeHeatmap, web::http::methods::GET, web::uri_builder(U("computeHeatmap")).append_query(U("processingToken"), *token)
+				.append_query(U("subjectAge"), subject.age)).has_value()
+			&& request(endpoint::heatmapPolyData, web::http::methods::GET, web::uri_builder(U("heatmapPolyData")).append_query(U("processingToken"), *token)).has_value()
+			&& request(endpoint::computeClassification, web::http::methods::GET, web::uri_builder(U("computeClassification")).append_query(U("processingToken"), *token)
+				.append_query(U("facialRegion"), facialRegion)).has_value();
+
+		successful = request(endpoint::deleteToken, web::http::methods::DEL, web::uri_builder(U("delete")).append_query(U("processingToken"), *token)).has_value() && successful;
+		return successful;
+	}
+
+private:
+	static web::http::client::http_client_config clientConfig()
+	{
+		web::http::client::http_client_config config;
+		config.set_timeout(std::chrono::seconds(300)); // heatmaps of large meshes under full load
+		return config;
+	}
+
+	// Sends request and records its latency. Returns response body if status is OK, empty optional otherwise.
+	std::optional<utility::string_t> request(const endpoint e, const web::http::method& method, const web::uri_builder& uri, const std::string& body = std::string(),
+		const utility::string_t& contentType = U("application/octet-stream"))
+	{
+		web::http::http_request message(method);
+		message.set_request_uri(uri.to_string());
+		if (!body.empty())
+		{
+			message.set_body(body, utility::conversions::to_utf8string(contentType));
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		web::http::status_code statusCode = 0; // no response
+		utility::string_t responseBody;
+		try
+		{
+			const auto response = client.request(message).get(); // Blocking is intended: each virtual user is a thread running one sequence at a time.
+			statusCode = response.status_code();
+			responseBody = response.extract_string().get();
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << endpointName(e) << ": " << ex.what() << std::endl;
+		}
+		statistics.record(e, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), statusCode);
+
+		if (statusCode != web::http::status_codes::OK)
+		{
+			return {};
+		}
+		return responseBody;
+	}
+
+	web::http::client::http_client client;
+	const subjectUpload& subject;
+	const utility::string_t ethnicityCode;
+	const utility::string_t facialRegion;
+	loadStatistics& statistics;
+};
+
+// Returns first facial region (alphabetical order) listed by endpoint /classificationRegions for subject, empty string if none.
+std::string firstFacialRegion(const utility::string_t& serverUrl, const subjectUpload& subject, const std::string& ethnicityCode)
+{
+	web::http::client::http_client client(serverUrl);
+	try
+	{
+		const auto token = client.request(web::http::methods::GET, U("processingToken")).get().extract_string().get();
+		client.request(web::http::methods::POST, web::uri_builder(U("landmarks")).append_query(U("processingToken"), token)
+			.append_query(U("ethnicityCode"), utility::conversions::to_string_t(ethnicityCode)).to_string(), subject.landmarksJson, "application/json").get();
+		const auto regions = client.request(web::http::methods::GET, web::uri_builder(U("classificationRegions")).append_query(U("processingToken"), token).to_string())
+			.get().extract_json(true).get();
+		client.request(web::http::methods::DEL, web::uri_builder(U("delete")).append_query(U("processingToken"), token).to_string()).get();
+
+		std::vector<std::string> regionNames;
+		for (const auto& region : regions.as_array())
+		{
+			regionNames.push_back(utility::conversions::to_utf8string(region.as_string()));
+		}
+		return regionNames.empty() ? std::string() : *std::min_element(regionNames.cbegin(), regionNames.cend());
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Facial regions cannot be retrieved from server: " << ex.what() << std::endl;
+		return {};
+	}
+}
+
+} // unnamed namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Invocation : " << argv[0] << " [server URL] [path to modelDB.json] [number of virtual users] [duration in seconds] [report.json] [facialRegion] [ethnicityCode] [landmarkSetType]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const auto serverUrl = utility::conversions::to_string_t(argv[1]);
+	const std::filesystem::path faceModelDBfile(argv[2]);
+	unsigned int numberOfUsers = 4;
+	unsigned int durationSeconds = 60;
+	try
+	{
+		if (argc >= 4)
+		{
+			numberOfUsers = static_cast<unsigned int>(std::max(1, std::stoi(argv[3])));
+		}
+		if (argc >= 5)
+		{
+			durationSeconds = static_cast<unsigned int>(std::max(1, std::stoi(argv[4])));
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "faceScreenLoadGen Error: Number of virtual users or duration - argument invalid. " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	const std::filesystem::path reportFile((argc >= 6) ? argv[5] : "");
+	std::string facialRegion((argc >= 7) ? argv[6] : "");
+	const std::string ethnicityCode((argc >= 8) ? argv[7] : "CAUC");
+	const auto landmarkSetType = utility::conversions::to_string_t((argc >= 9) ? argv[8] : "Bellus16");
+
+	// Subjects are synthesised from the face model the server uses for ethnicityCode and landmarkSetType.
+	const auto modelDB = readModelDB(faceModelDBfile);
+	if (!modelDB)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto modelDataDirs = faceModelDataDirs(*modelDB, utility::conversions::to_string_t(ethnicityCode), landmarkSetType);
+	if (!modelDataDirs)
+	{
+		return EXIT_FAILURE;
+	}
+	const auto modelFilesRootDir = faceModelDBfile.parent_path() / std::filesystem::path(modelDataDirs->at(U("unsplitModelsPath")).as_string());
+	vtkNew<vtkSurfacePCA> pca;
+	if (!pca->LoadFile((modelFilesRootDir / "model.dat").string()))
+	{
+		std::cerr << "Face model in " << modelFilesRootDir << " could not be loaded." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const auto subjects = synthesiseSubjects(pca, modelDB->at(U("landmarkSetTypes")), landmarkSetType, numberOfUsers);
+	if (subjects.empty())
+	{
+		return EXIT_FAILURE;
+	}
+	std::vector<subjectUpload> uploads;
+	for (const auto& subject : subjects)
+	{
+		uploads.push_back({ utility::conversions::to_utf8string(subject->landmarksJson.serialize()), objFileContent(subject->data.surfaceMesh), subject->age });
+	}
+
+	if (facialRegion.empty())
+	{
+		facialRegion = firstFacialRegion(serverUrl, uploads.front(), ethnicityCode);
+		if (facialRegion.empty())
+		{
+			std::cerr << "No facial region for classification available. Exiting ..." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	std::cout << "faceScreenLoadGen: " << numberOfUsers << " virtual users for " << durationSeconds << " s, classifying facial region " << facialRegion << std::endl;
+
+	loadStatistics statistics;
+	const auto start = std::chrono::steady_clock::now();
+	const auto end = start + std::chrono::seconds(durationSeconds);
+	std::vector<std::thread> users;
+	for (unsigned int user = 0; user < numberOfUsers; ++user)
+	{
+		users.emplace_back([&, user]()
+		{
+			virtualUser virtualUser(serverUrl, uploads[user], ethnicityCode, facialRegion, statistics);
+			while (std::chrono::steady_clock::now() < end)
+			{
+				statistics.sequenceCompleted(virtualUser.runSequence());
+			}
+		});
+	}
+	for (auto& user : users)
+	{
+		user.join();
+	}
+	const auto elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const auto report = statistics.report(elapsedSeconds, numberOfUsers);
+	if (!reportFile.empty())
+	{
+		std::ofstream out(reportFile);
+		out << utility::conversions::to_utf8string(report.serialize()) << std::endl;
+		if (!out)
+		{
+			std::cerr << "Report file " << reportFile << " cannot be written." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
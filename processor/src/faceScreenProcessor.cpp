@@ -12,14 +12,28 @@
 #include <vtkTexture.h>
 #include <vtkUnsignedCharArray.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdio> // C-style I/O used for temp files
 #include <filesystem>
 #include <map>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <sstream>
 #include <string>
-
+#include <utility>
+#include <vector>
+
+#include "utils/allocationAccounting.h"
+#include "utils/cancellationToken.h"
+#include "utils/kernelSelection.h"
+#include "utils/logger.h"
+#include "utils/multipartFormData.h"
+#include "utils/serverMetrics.h"
 #include "utils/zstr/zstr.hpp"
 #include "BellusUtils/landmarkProcessing.h"
 
@@ -47,16 +61,35 @@ void FaceScreenProcessor::readFaceScreenServerConfig()
 		}
 		else
 		{
-			std::cerr << 
+			logWarning() << 
 			"File faceScreenServerConfig.json not found. Using default values max_Number_FacescreeningObjects = " <<  max_Number_FacescreeningObjects
-			<< " and min_Lifetime_in_seconds_FacescreeningObjects = " << min_Lifetime_in_seconds_FacescreeningObjects 
-			<< std::endl;
+			<< " and min_Lifetime_in_seconds_FacescreeningObjects = " << min_Lifetime_in_seconds_FacescreeningObjects;
 		}
 	}
 	catch (web::json::json_exception ex) 
 	{
-		std::cout << "ERROR Parsing file faceScreenServerConfig.json. Invalid JSON format: ";
-		std::cout << ex.what() << std::endl;
+		logError() << "ERROR Parsing file faceScreenServerConfig.json. Invalid JSON format: " << ex.what();
+	}
+
+	// Logging is configured first, so that the remaining configuration is logged to the configured destination.
+	if (v.has_field(utility::string_t(U("logLevel"))))
+	{
+		logLevelName = utility::conversions::to_utf8string(v[utility::string_t(U("logLevel"))].as_string());
+	}
+	if (v.has_field(utility::string_t(U("logFile"))))
+	{
+		logFile = filesystem::path(v[utility::string_t(U("logFile"))].as_string());
+	}
+	const auto logLevel = logger::levelFromName(logLevelName);
+	if (!logLevel)
+	{
+		logWarning() << "File faceScreenServerConfig.json: Unknown logLevel " << logLevelName << " (debug, info, warning or error). Using info.";
+		logLevelName = "info";
+	}
+	if (!logger::configure(logLevel.value_or(LogLevel::Info), logFile))
+	{
+		logError() << "Log file " << logFile << " cannot be opened. Logging to stdout.";
+		logFile.clear();
 	}
 
 	if (v.has_field(utility::string_t(U("processingTokenTimeoutInSeconds"))))
@@ -65,8 +98,8 @@ void FaceScreenProcessor::readFaceScreenServerConfig()
 	}
 	else
 	{
-		std::cerr << "File faceScreenServerConfig.json does not contain value for processingTokenTimeoutInSeconds. Using default value: " 
-		<< min_Lifetime_in_seconds_FacescreeningObjects << std::endl;
+		logWarning() << "File faceScreenServerConfig.json does not contain value for processingTokenTimeoutInSeconds. Using default value: " 
+		<< min_Lifetime_in_seconds_FacescreeningObjects;
 	}
 
 	if (v.has_field(utility::string_t(U("maxNumProcessingTokens"))))
@@ -75,11 +108,73 @@ void FaceScreenProcessor::readFaceScreenServerConfig()
 	}
 	else
 	{
-		std::cerr << "File faceScreenServerConfig.json does not contain value for max_Number_FacescreeningObjects. Using default value: " 
-		<< max_Number_FacescreeningObjects << std::endl;
+		logWarning() << "File faceScreenServerConfig.json does not contain value for max_Number_FacescreeningObjects. Using default value: " 
+		<< max_Number_FacescreeningObjects;
+	}
+	if (v.has_field(utility::string_t(U("computeThreads"))))
+	{
+		numberOfComputeThreads = v[utility::string_t(U("computeThreads"))].as_integer();
+	}
+	if (v.has_field(utility::string_t(U("resultCacheMegabytes"))))
+	{
+		resultCacheMegabytes = v[utility::string_t(U("resultCacheMegabytes"))].as_integer();
+	}
+	if (v.has_field(utility::string_t(U("resultCacheDirectory"))))
+	{
+		resultCacheDirectory = filesystem::path(v[utility::string_t(U("resultCacheDirectory"))].as_string());
+	}
+	if (v.has_field(utility::string_t(U("precomputeOnUpload"))))
+	{
+		precomputeOnUpload = v[utility::string_t(U("precomputeOnUpload"))].as_bool();
+	}
+	// Recording of requests for replay (see faceScreenReplay). Bodies contain patient data and are stored only if captureBodies is true.
+	if (v.has_field(utility::string_t(U("captureFile"))))
+	{
+		captureFile = filesystem::path(v[utility::string_t(U("captureFile"))].as_string());
+	}
+	if (v.has_field(utility::string_t(U("captureBodies"))))
+	{
+		captureBodies = v[utility::string_t(U("captureBodies"))].as_bool();
+	}
+	// Per-request traces for finding the critical path of slow requests, written to traceDirectory.
+	if (v.has_field(utility::string_t(U("traceDirectory"))))
+	{
+		traceDirectory = filesystem::path(v[utility::string_t(U("traceDirectory"))].as_string());
+		std::error_code error;
+		filesystem::create_directories(traceDirectory, error);
+		if (error)
+		{
+			logError() << "File faceScreenServerConfig.json: Cannot create traceDirectory " << traceDirectory << ": " << error.message() << ". Tracing disabled.";
+			traceDirectory.clear();
+		}
+	}
+	if (v.has_field(utility::string_t(U("traceSampleRate"))))
+	{
+		traceSampleRate = std::clamp(v[utility::string_t(U("traceSampleRate"))].as_double(), 0.0, 1.0);
+	}
+	// Fallback to legacy implementations of numerical kernels, e.g., should an optimised kernel be suspected of changing results.
+	if (v.has_array_field(utility::string_t(U("legacyKernels"))))
+	{
+		for (const auto& kernel : v[utility::string_t(U("legacyKernels"))].as_array())
+		{
+			if (!kernel.is_string() || !kernelSelection::selectLegacy(utility::conversions::to_utf8string(kernel.as_string())))
+			{
+				logWarning() << "File faceScreenServerConfig.json: Unknown kernel in legacyKernels ignored: " << kernel.serialize();
+				continue;
+			}
+			logInfo() << "Using legacy implementation of kernel " << kernel.as_string();
+		}
 	}
-	std::cout << "FaceScreenServer configuration: maxNumProcessingTokens: " << max_Number_FacescreeningObjects 
-		<< " processingTokenTimeout: " << min_Lifetime_in_seconds_FacescreeningObjects << std::endl;
+
+	logInfo() << "FaceScreenServer configuration: maxNumProcessingTokens: " << max_Number_FacescreeningObjects 
+		<< " processingTokenTimeout: " << min_Lifetime_in_seconds_FacescreeningObjects 
+		<< " computeThreads: " << numberOfComputeThreads 
+		<< " resultCacheMegabytes: " << resultCacheMegabytes 
+		<< " resultCacheDirectory: " << resultCacheDirectory 
+		<< " precomputeOnUpload: " << precomputeOnUpload
+		<< " captureFile: " << captureFile << (captureBodies ? " (with bodies)" : "")
+		<< " logLevel: " << logLevelName << " logFile: " << logFile
+		<< " traceDirectory: " << traceDirectory << " traceSampleRate: " << traceSampleRate;
 }
 
 void FaceScreenProcessor::readFaceScreenServerUsers()
@@ -98,16 +193,14 @@ void FaceScreenProcessor::readFaceScreenServerUsers()
 		}
 		else
 		{
-			std::cerr << 
-			" W A R N I N G:   File faceScreenServerUsers.json not found.  NO ACCESS RETRICTIONS TO ISSUEING PROCESSING TOKENS IN PLACE!" 
-			<< std::endl;
+			logWarning() << 
+			" W A R N I N G:   File faceScreenServerUsers.json not found.  NO ACCESS RETRICTIONS TO ISSUEING PROCESSING TOKENS IN PLACE!";
 			return;
 		}
 	}
 	catch (web::json::json_exception ex) 
 	{
-		std::cout << "ERROR Parsing file faceScreenServerUsers.json. Invalid JSON format: ";
-		std::cout << ex.what() << std::endl;
+		logError() << "ERROR Parsing file faceScreenServerUsers.json. Invalid JSON format: " << ex.what();
 		return;
 	}	
 	try
@@ -122,8 +215,7 @@ void FaceScreenProcessor::readFaceScreenServerUsers()
 	}
 	catch (web::json::json_exception ex) 
 	{
-		std::cout << "ERROR Parsing file faceScreenServerUsers.json. Format not recognized. ";
-		std::cout << ex.what();
+		logError() << "ERROR Parsing file faceScreenServerUsers.json. Format not recognized. " << ex.what();
 		return;
 	}
 }
@@ -133,10 +225,10 @@ FaceScreenProcessor::FaceScreenProcessor(utility::string_t url, const string_t&
 	, m_modelsRootDirectory(filesystem::path(faceModelDBfile).parent_path())
 {
 	m_listener.support(methods::OPTIONS, std::bind(&FaceScreenProcessor::handle_options, this, std::placeholders::_1));
-	m_listener.support(methods::GET, std::bind(&FaceScreenProcessor::handle_get, this, std::placeholders::_1));
-	m_listener.support(methods::PUT, std::bind(&FaceScreenProcessor::handle_put, this, std::placeholders::_1));
-	m_listener.support(methods::POST, std::bind(&FaceScreenProcessor::handle_post, this, std::placeholders::_1));
-	m_listener.support(methods::DEL, std::bind(&FaceScreenProcessor::handle_delete, this, std::placeholders::_1));
+	m_listener.support(methods::GET, captured(&FaceScreenProcessor::handle_get));
+	m_listener.support(methods::PUT, captured(&FaceScreenProcessor::handle_put));
+	m_listener.support(methods::POST, captured(&FaceScreenProcessor::handle_post));
+	m_listener.support(methods::DEL, captured(&FaceScreenProcessor::handle_delete));
 
 	// Load face model DB file (containing description of supported landmark sets and ethnicities.
 	web::json::value v;
@@ -153,14 +245,15 @@ FaceScreenProcessor::FaceScreenProcessor(utility::string_t url, const string_t&
 		}
 		else
 		{
-			std::cerr << "ModelDB file cannot be read. Server will not work! " << std::endl;
+			logError() << "ModelDB file cannot be read. Server will not work! ";
+			logger::flush();
 			exit(EXIT_FAILURE);
 		}
 	}
 	catch (web::json::json_exception ex) 
 	{
-		std::cout << "ERROR Parsing ModelDB file. Invalid JSON format: ";
-		std::cout << ex.what();
+		logError() << "ERROR Parsing ModelDB file. Invalid JSON format: " << ex.what();
+		logger::flush();
 		exit(EXIT_FAILURE);
 	}
 
@@ -171,7 +264,8 @@ FaceScreenProcessor::FaceScreenProcessor(utility::string_t url, const string_t&
 	}
 	else
 	{
-		std::cerr << "ModelDB file invalid: modelDescriptor or landmarkSetTypes missing. Server will not work! " << std::endl;
+		logError() << "ModelDB file invalid: modelDescriptor or landmarkSetTypes missing. Server will not work! ";
+		logger::flush();
 		exit(EXIT_FAILURE);
 	}
 	
@@ -179,6 +273,106 @@ FaceScreenProcessor::FaceScreenProcessor(utility::string_t url, const string_t&
 	
 	readFaceScreenServerConfig();
 	readFaceScreenServerUsers();
+
+	m_computePool = ComputePool::shared(numberOfComputeThreads);
+	if (resultCacheMegabytes > 0)
+	{
+		m_resultCache = std::make_shared<ResultCache>(size_t(resultCacheMegabytes) * 1024 * 1024, resultCacheDirectory);
+	}
+	if (!captureFile.empty())
+	{
+		m_trafficCapture = std::make_shared<TrafficCapture>(captureFile, captureBodies);
+		if (!m_trafficCapture->isOpen())
+		{
+			m_trafficCapture.reset();
+		}
+	}
+}
+
+pplx::task<void> FaceScreenProcessor::close()
+{
+	return m_listener.close().then([this]()
+	{
+		if (m_trafficCapture)
+		{
+			m_trafficCapture->close();
+		}
+	});
+}
+
+std::function<void(http_request)> FaceScreenProcessor::captured(void (FaceScreenProcessor::*handler)(http_request))
+{
+	return [this, handler](http_request message)
+	{
+		if (!m_trafficCapture)
+		{
+			dispatch(handler, message);
+			return;
+		}
+		m_trafficCapture->capture(message).then([this, handler, message]() { dispatch(handler, message); });
+	};
+}
+
+void FaceScreenProcessor::dispatch(void (FaceScreenProcessor::*handler)(http_request), http_request message)
+{
+	RequestTrace::Activation activation(startRequestTrace(message));
+	std::shared_ptr<allocationAccounting::RequestAllocations> allocations;
+	if (allocationAccounting::enabled)
+	{
+		const auto path = uri::split_path(uri::decode(message.relative_uri().path()));
+		allocations = allocationAccounting::startRequest(utility::conversions::to_utf8string(message.method()),
+			path.empty() ? std::string("root") : utility::conversions::to_utf8string(path[0]));
+	}
+	allocationAccounting::Activation allocationActivation(allocations);
+	TraceSpan span("handler", "handler");
+	(this->*handler)(message);
+}
+
+std::shared_ptr<RequestTrace> FaceScreenProcessor::startRequestTrace(const http_request& message)
+{
+	if (traceDirectory.empty())
+	{
+		return nullptr;
+	}
+	const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
+	const auto traceQueryParam = query.find(U("trace"));
+	const bool traceRequested = traceQueryParam != query.end() && (traceQueryParam->second == U("1") || traceQueryParam->second == U("true"));
+	if (!traceRequested)
+	{
+		thread_local std::mt19937 randomGenerator{ std::random_device{}() };
+		if (traceSampleRate <= 0.0 || !std::bernoulli_distribution(traceSampleRate)(randomGenerator))
+		{
+			return nullptr;
+		}
+	}
+
+	static std::atomic<unsigned int> numberOfTraces{ 0 };
+	const auto path = uri::split_path(uri::decode(message.relative_uri().path()));
+	const std::string endpoint = path.empty() ? "root" : utility::conversions::to_utf8string(path[0]);
+	const std::string requestName = utility::conversions::to_utf8string(message.method()) + " /" + endpoint;
+	std::string traceFileName = utility::conversions::to_utf8string(utility::datetime::utc_now().to_string(utility::datetime::ISO_8601))
+		+ "-" + std::to_string(++numberOfTraces) + "-" + endpoint + ".json";
+	std::replace(traceFileName.begin(), traceFileName.end(), ':', '-'); // not permitted in file names on Windows
+
+	auto trace = std::make_shared<RequestTrace>(traceDirectory / traceFileName, requestName);
+	const auto received = RequestTrace::clock::now();
+	const auto threadId = RequestTrace::threadId();
+	const auto processingTokenQueryParam = query.find(U("processingToken"));
+	const std::string processingToken = (processingTokenQueryParam == query.end()) ? std::string() : utility::conversions::to_utf8string(processingTokenQueryParam->second);
+	message.get_response().then([trace, requestName, received, threadId, processingToken](pplx::task<http_response> responseTask)
+	{
+		std::string status = "none";
+		try
+		{
+			status = std::to_string(responseTask.get().status_code());
+		}
+		catch (const std::exception&) // request dropped without response
+		{
+		}
+		trace->addSpan(requestName, "request", received, RequestTrace::clock::now(),
+			{ { "status", status }, { "processingToken", processingToken.substr(processingToken.size() > 4 ? processingToken.size() - 4 : 0) } }, threadId);
+	});
+	return trace;
 }
 
 void FaceScreenProcessor::handle_options(http_request request)
@@ -190,7 +384,7 @@ void FaceScreenProcessor::handle_options(http_request request)
     response.headers().add(U("Allow"), U("GET, POST, OPTIONS, DEL, PUT"));
     response.headers().add(U("Access-Control-Allow-Origin"), CORS_PERMISSIONS); 
     response.headers().add(U("Access-Control-Allow-Methods"), U("GET, POST, PUT, DEL, OPTIONS"));
-    response.headers().add(U("Access-Control-Allow-Headers"), U("Content-Type"));
+    response.headers().add(U("Access-Control-Allow-Headers"), U("Content-Type, X-Deadline-Ms"));
     request.reply(response);
   }
 
@@ -217,6 +411,45 @@ std::optional<std::shared_ptr<FaceScreeningObject>> FaceScreenProcessor::findFac
 
 namespace {
 
+// Returns value of query parameter processingToken of message, empty string if none. Used as context of log records.
+utility::string_t processingTokenOf(const http_request& message)
+{
+	const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
+	const auto processingTokenQueryParam = query.find(U("processingToken"));
+	return (processingTokenQueryParam == query.end()) ? utility::string_t() : processingTokenQueryParam->second;
+}
+
+// Logs method, path and body size of message. Unlike message.to_string(), neither the body (patient data) is read nor the query (tokens) written.
+void logRequest(const http_request& message)
+{
+	logInfo(processingTokenOf(message)) << message.method() << " " << uri::decode(message.relative_uri().path()) << " (" << message.headers().content_length() << " bytes)";
+}
+
+// Names of the facial regions with (split) models in facialModelDataPath, sorted, so that results are merged in a deterministic order.
+std::vector<std::string> facialRegionsIn(const std::filesystem::path& facialModelDataPath)
+{
+	std::vector<std::string> regions;
+	if (std::filesystem::is_directory(facialModelDataPath))
+	{
+		for (const auto& facialRegionModelPath : std::filesystem::directory_iterator(facialModelDataPath))
+		{
+			regions.push_back(std::filesystem::canonical(facialRegionModelPath.path()).filename().string());
+		}
+	}
+	std::sort(regions.begin(), regions.end());
+	return regions;
+}
+
+// Task completing once the precomputation of subject for the models in modelDataPath has finished, if it is running (see Precomputation::claim).
+pplx::task<void> afterPrecomputation(const FaceScreeningObject& subject, const std::filesystem::path& modelDataPath)
+{
+	if (const auto precomputation = subject.currentPrecomputation())
+	{
+		return precomputation->claim(modelDataPath.string());
+	}
+	return pplx::task_from_result();
+}
+
 std::optional<float> sanitizeSubjectAgeInput(const http_request& message, const utility::string_t& subjectAgeQueryParam)
 {
 	auto subjectAge(0.0F);
@@ -247,6 +480,116 @@ std::optional<float> sanitizeSubjectAgeInput(const http_request& message, const
 	return std::optional<float>(subjectAge);
 }
 
+// Creates the cancellation token of a computation requested by message, cancelled together with parent (e.g., the session of the processing token).
+// A deadline in milliseconds from now is taken from header X-Deadline-Ms or, if absent, from query parameter deadlineMs. No deadline is set if neither is given.
+// Replies BadRequest and returns nullptr if the deadline is malformed, not positive or beyond 24 hours.
+std::shared_ptr<const CancellationToken> requestCancellation(const http_request& message, std::shared_ptr<const CancellationToken> parent)
+{
+	utility::string_t deadlineInMilliseconds;
+	if (!message.headers().match(U("X-Deadline-Ms"), deadlineInMilliseconds))
+	{
+		const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
+		const auto deadlineQueryParam = query.find(U("deadlineMs"));
+		if (deadlineQueryParam == query.end())
+		{
+			return std::make_shared<const CancellationToken>(std::move(parent));
+		}
+		deadlineInMilliseconds = deadlineQueryParam->second;
+	}
+
+	long long milliseconds(0);
+	try
+	{
+		milliseconds = std::stoll(deadlineInMilliseconds);
+	}
+	catch (const std::exception&) // std::invalid_argument, std::out_of_range
+	{
+		message_reply(status_codes::BadRequest, U("Deadline (X-Deadline-Ms or deadlineMs) is malformed."));
+		return nullptr;
+	}
+	if (milliseconds <= 0)
+	{
+		message_reply(status_codes::BadRequest, U("Deadline (X-Deadline-Ms or deadlineMs) has to be a positive number of milliseconds."));
+		return nullptr;
+	}
+	const long long maxMilliseconds = 24LL * 60 * 60 * 1000; // 24 h, far beyond any computation, well within the range of the clock
+	if (milliseconds > maxMilliseconds)
+	{
+		message_reply(status_codes::BadRequest, U("Deadline (X-Deadline-Ms or deadlineMs) must not exceed 24 hours (86400000 milliseconds)."));
+		return nullptr;
+	}
+	return std::make_shared<const CancellationToken>(std::move(parent), std::chrono::milliseconds(milliseconds));
+}
+
+// Final continuation of asynchronous handlers: Replies outcome of the processing stage that completed the chain.
+// If the chain was interrupted by an exception (e.g., request body could not be received), replies InternalError with errorMessage instead.
+void replyProcessingStatus(const http_request& message, pplx::task<processingStatus> stage, const utility::string_t& errorMessage)
+{
+	processingStatus status;
+	try
+	{
+		status = stage.get();
+	}
+	catch (const std::exception& ex)
+	{
+		logError(processingTokenOf(message)) << "Processing request failed: " << ex.what();
+		status = { status_codes::InternalError, errorMessage };
+	}
+	message_reply(status.statusCode, status.message);
+}
+
+// Final continuation of asynchronous handlers replying to the client within the chain itself.
+// Replies InternalError with errorMessage only if the chain was interrupted by an exception. Also observes the exception, as pplx terminates on unobserved ones.
+void replyOnException(const http_request& message, pplx::task<void> chain, const utility::string_t& errorMessage)
+{
+	try
+	{
+		chain.get();
+	}
+	catch (const std::exception& ex)
+	{
+		logError(processingTokenOf(message)) << "Processing request failed: " << ex.what();
+		try
+		{
+			message_reply(status_codes::InternalError, errorMessage);
+		}
+		catch (const std::exception&) // Chain may have replied before the exception occurred.
+		{
+		}
+	}
+}
+
+// Subject resampled to the base meshes of the face models of one request (/computeReferenceHeatmaps), by base mesh digest (see
+// vtkSurfacePCA::GetBaseMeshDigest): the first model of a base mesh resamples, the others project once it has finished. Thread-safe.
+class SharedResamples
+{
+public:
+	// Task completing with the subject resampled to the base mesh of reference, nullptr if resampling failed (each model then projects the
+	// subject on its own, reporting the error). Resamples on the pool, with subject, unless a model of the same base mesh has already started it.
+	pplx::task<vtkSmartPointer<vtkPolyData>> resample(const std::shared_ptr<const heatmapReference>& reference, const std::shared_ptr<const FaceScreeningObject>& subject,
+		const std::shared_ptr<const CancellationToken>& cancellation, ComputePool& computePool)
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		const auto resample = resamples.find(reference->baseMeshDigest);
+		if (resample != resamples.end())
+		{
+			return resample->second;
+		}
+		auto resampled = computePool.run([reference, subject, cancellation]()
+		{
+			auto resampledSubject = vtkSmartPointer<vtkPolyData>::New();
+			const auto status = subject->resampleSubject(*reference, resampledSubject, cancellation.get());
+			return status.succeeded() ? resampledSubject : vtkSmartPointer<vtkPolyData>();
+		});
+		resamples.emplace(reference->baseMeshDigest, resampled);
+		return resampled;
+	}
+
+private:
+	InstrumentedMutex mutex{ "sharedResamples" };
+	std::map<std::string, pplx::task<vtkSmartPointer<vtkPolyData>>> resamples;
+};
+
 } // unnamed namespace
 
 
@@ -255,16 +598,21 @@ std::optional<float> sanitizeSubjectAgeInput(const http_request& message, const
 //
 // A GET on endpoint / gives a processing token.
 //                   /computeHeatmap Computes a heatmap or returns an error code if data is insufficient. Landmarks and obj need to be uploaded. params: processingToken, subjectAge
+//                   /computeHeatmapSweep Computes heatmaps for several subject ages at once, returns them as json with base64 coded polydata. params: processingToken, subjectAges (comma separated)
+//                   /computeReferenceHeatmaps Computes heatmaps against the face models of several ethnicity codes concurrently, returns them as json. params: processingToken, subjectAge, ethnicityCodes (optional)
 //                   /heatmapImage Renders heatmap/signature as jpeg and returns this as a stream.  params: processingToken
 //                   /classificationRegions Returns json contraining list of all available classification regions for an ethnicity. params: none
 //                   /computeClassification Computes FASD/Control classification (mean/stdev of cross validation). params: processingToken, facialRegion
+//                   /computeAllClassifications Computes classifications of all facial regions concurrently, returns them as json. params: processingToken
 //                   /classifications Returns classification results for each classification that has been computed with /computeClassifications. params: processingToken
 //                   /PFLstatistics Returns PFL, PFL percentile, and zScore as json. Returns error code if uploaded landmarks are insufficient. params: processingToken, subjectAge, subjectGender
 //                   /FASDreports Retrieves a generated FASD report (pdf file). params: reportID
+//                   /metrics Returns server metrics (request counts, per-stage latency histograms, queue depth, sessions, ...) in Prometheus text format. params: none
+//                   /debug/locks Returns wait and hold times of server locks (see instrumentedMutex.h) as json, most waited for lock first. params: none
 void FaceScreenProcessor::handle_get(http_request message)
 {
-	ucout << "Called GET ... " << endl;
-	ucout << message.to_string() << endl;
+	++serverMetrics::requestsGet;
+	logRequest(message);
 
 	// GET without parameters returns new processing token
 	const auto paths = uri::split_path(uri::decode(message.relative_uri().path()));
@@ -303,6 +651,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 		{
 			const utility::string_t generatedProcessingToken = m_processingToken_generator.generate();
 			faceScreeningObjects[generatedProcessingToken] = std::make_shared<FaceScreeningObject>(); // Should not conflict with other nonce.
+			faceScreeningObjects[generatedProcessingToken]->processingToken = generatedProcessingToken;
 			message_reply(status_codes::OK, generatedProcessingToken);
 		};
 
@@ -311,7 +660,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 		//	- The oldest object can be erased (i.e., has no http_response pending), and this brings the number below max
 		if (faceScreeningObjects.size() < max_Number_FacescreeningObjects)
 		{
-			std::lock_guard<std::mutex> guard(faceScreeningObjects_mutex);
+			std::lock_guard<InstrumentedMutex> guard(faceScreeningObjects_mutex);
 			issueNewToken();
 		}
 		else
@@ -326,7 +675,8 @@ void FaceScreenProcessor::handle_get(http_request message)
 			// TODO?: check second oldest (and so forth) if the oldest is still busy
 			{
 				// Make sure there's sufficient capacity now.
-				std::lock_guard<std::mutex> guard(faceScreeningObjects_mutex);				
+				std::lock_guard<InstrumentedMutex> guard(faceScreeningObjects_mutex);				
+				oldestFaceScreeningObject->second->sessionCancellation->cancel();
 				const auto numberOfTokensErased = faceScreeningObjects.erase(oldestProcessingToken); 				
 				if (numberOfTokensErased > 0 && faceScreeningObjects.size() < max_Number_FacescreeningObjects)
 				{
@@ -357,8 +707,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 		}
 		const auto reportID = reportIDQueryParam->second.c_str();
 
-		std::cout << "Processing request for returning FASD report with reportID: " << reportID;
-		std::cout << " (name of reportID file: " << faceScreeningPDFreports[reportID] << ")" << std::endl;
+		logInfo() << "Processing request for returning FASD report with reportID: " << reportID << " (name of reportID file: " << faceScreeningPDFreports[reportID] << ")";
 
 		// Check existence of pdf file again, as some (e.g., cron) daemon might have erased it meanwhile
 		std::filesystem::path pdfFile(faceScreeningPDFreports[reportID]);
@@ -370,53 +719,97 @@ void FaceScreenProcessor::handle_get(http_request message)
 
 		concurrency::streams::fstream::open_istream(utility::conversions::to_string_t(faceScreeningPDFreports[reportID]), std::ios::in)
 			.then(
-				[&message](concurrency::streams::istream pdfFile) {
+				[message](concurrency::streams::istream pdfFile) {
 					if (!pdfFile.is_valid())
 					{
 						message_reply(status_codes::NotFound, U("FASD report does not exist any more."));
-						std::cerr << "FASD report pdf: no valid stream buffer." << std::endl;
-						return;
+						logError() << "FASD report pdf: no valid stream buffer.";
+						return pplx::task_from_result();
 					}					
 				    	http_response response(status_codes::OK);
 				        response.headers().add(U("Access-Control-Allow-Origin"), CORS_PERMISSIONS);
 				        response.set_body(pdfFile);
-					message.reply(response).then([&message](pplx::task<void> t)
-							{
-								try 
-								{
-									t.get();
-								}
-								catch (...) 
-								{
-									message_reply(status_codes::InternalError, U("INTERNAL ERROR: Cannot stream PDF "));
-								}
-							});
+					return message.reply(response);
 				})
-			.then([&message](pplx::task<void>t)
+			.then([message](pplx::task<void> t)
 				{
-					try 
-					{
-						t.get();
-					}
-					catch (...) 
-					{
-						message_reply(status_codes::InternalError, U("INTERNAL ERROR: Cannot open PDF "));
-					}
-				}).wait();
+					replyOnException(message, t, U("INTERNAL ERROR: Cannot open or stream PDF "));
+				});
 		return;
 	}
 
 
-	// Note: Reference to FaceScreeningObject only required if client request was not for a new processing token or an existing FASD report.
-	const auto requestedFaceScreenObject = findFaceScreeningObject(message)->get();
-	ucout << U("GET: Retrieving FaceScreeningObject: ") << (requestedFaceScreenObject ? U("Successfully retrieved facescreen object.") :
-		U("Facescreen object could not be retrieved.")) << std::endl;
-	if (!requestedFaceScreenObject)
+	if (path.compare(U("metrics")) == 0)
+	{
+		size_t numberOfSessions;
+		{
+			std::lock_guard<InstrumentedMutex> guard(faceScreeningObjects_mutex);
+			numberOfSessions = faceScreeningObjects.size();
+		}
+		std::ostringstream metrics;
+		metrics << serverMetrics::prometheusText()
+			<< "# HELP facescreen_compute_queue_depth Tasks waiting for a thread of the compute pool.\n"
+			<< "# TYPE facescreen_compute_queue_depth gauge\n"
+			<< "facescreen_compute_queue_depth " << (m_computePool ? m_computePool->queueLength() : 0) << "\n"
+			<< "# HELP facescreen_sessions Processing sessions (tokens) currently held.\n"
+			<< "# TYPE facescreen_sessions gauge\n"
+			<< "facescreen_sessions " << numberOfSessions << "\n"
+			<< "# HELP facescreen_log_records_dropped_total Debug and info log records dropped because the log ring buffer was full.\n"
+			<< "# TYPE facescreen_log_records_dropped_total counter\n"
+			<< "facescreen_log_records_dropped_total " << logger::droppedRecords() << "\n";
+		allocationAccounting::appendMetrics(metrics);
+		if (m_computePool)
+		{
+			m_computePool->appendMetrics(metrics);
+		}
+		if (m_resultCache)
+		{
+			metrics << "# HELP facescreen_result_cache_bytes Size of results held in the in-memory tier of the result cache.\n"
+				<< "# TYPE facescreen_result_cache_bytes gauge\n"
+				<< "facescreen_result_cache_bytes " << m_resultCache->memoryBytes() << "\n"
+				<< "# HELP facescreen_result_cache_entries Results held in the in-memory tier of the result cache.\n"
+				<< "# TYPE facescreen_result_cache_entries gauge\n"
+				<< "facescreen_result_cache_entries " << m_resultCache->numberOfEntries() << "\n";
+		}
+		http_response response(status_codes::OK);
+		response.headers().add(U("Access-Control-Allow-Origin"), CORS_PERMISSIONS);
+		response.set_body(metrics.str(), "text/plain; version=0.0.4");
+		message.reply(response);
+		return;
+	}
+
+	if (path.compare(U("debug")) == 0 && paths.size() > 1 && paths[1].compare(U("locks")) == 0)
 	{
-		message_reply(status_codes::Forbidden, U("The processing token is not valid."));
+		// Lock sites ordered by total wait, i.e., the most likely bottleneck first.
+		auto sites = lockSites();
+		std::sort(sites.begin(), sites.end(), [](const LockSite* a, const LockSite* b) { return a->waitTimes.sumInSeconds() > b->waitTimes.sumInSeconds(); });
+		const auto seconds = [](double value) { return std::isinf(value) ? json::value::null() : json::value::number(value); }; // infinity: beyond largest bucket
+		std::vector<json::value> jsonSites;
+		for (const auto* site : sites)
+		{
+			json::value jsonSite;
+			jsonSite[U("lock")] = json::value::string(utility::conversions::to_string_t(site->name));
+			jsonSite[U("acquisitions")] = json::value::number(site->acquisitions.load());
+			jsonSite[U("contendedAcquisitions")] = json::value::number(site->contendedAcquisitions.load());
+			jsonSite[U("waitSecondsTotal")] = json::value::number(site->waitTimes.sumInSeconds());
+			jsonSite[U("waitSecondsP50")] = seconds(site->waitTimes.quantileUpperBoundInSeconds(0.5));
+			jsonSite[U("waitSecondsP99")] = seconds(site->waitTimes.quantileUpperBoundInSeconds(0.99));
+			jsonSite[U("holdSecondsTotal")] = json::value::number(site->holdTimes.sumInSeconds());
+			jsonSite[U("holdSecondsP50")] = seconds(site->holdTimes.quantileUpperBoundInSeconds(0.5));
+			jsonSite[U("holdSecondsP99")] = seconds(site->holdTimes.quantileUpperBoundInSeconds(0.99));
+			jsonSites.push_back(jsonSite);
+		}
+		message_reply(status_codes::OK, json::value::array(jsonSites));
 		return;
 	}
 
+	// Note: Reference to FaceScreeningObject only required if client request was not for a new processing token, an existing FASD report, metrics or lock statistics.
+	const auto requestedFaceScreenObject = findFaceScreeningObject(message).value_or(nullptr); // Shared ownership keeps object alive while its asynchronous stages run.
+	if (!requestedFaceScreenObject)
+	{
+		return; // findFaceScreeningObject has replied.
+	}
+
 	if (path.compare(U("classificationRegions")) == 0)
 	{
 		if (!modelDataDirs.has_field(U("splitModelsPath")))
@@ -442,27 +835,27 @@ void FaceScreenProcessor::handle_get(http_request message)
 	// Case: Return heatmap
 	if (path.compare(U("computeHeatmap")) == 0)
 	{
-		ucout << U("Computing heatmap ... ");
+		logInfo(requestedFaceScreenObject->processingToken) << "Computing heatmap ...";
 		// 1.) Check all data is available: obj, required landmarks, age, ethnicity code. Return error if not. 
 		// 2.) Invoke computation. Give feedback about progress?
 		// 3.) Render image and return it.
 		if (requestedFaceScreenObject->surfaceMesh == nullptr)
 		{
-			ucout << std::endl << U("Facial mesh has not yet been uploaded. (compute heatmap)") << std::endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "Facial mesh has not yet been uploaded. (compute heatmap)";
 			message_reply(status_codes::NotFound, U("Facial mesh has not yet been uploaded."));
 			return;
 		}
 
 		if (requestedFaceScreenObject->landmarks.empty())
 		{
-			ucout << std::endl << U("Landmarks have not yet been uploaded. (compute heatmap)") << std::endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "Landmarks have not yet been uploaded. (compute heatmap)";
 			message_reply(status_codes::NotFound, U("Landmarks have not yet been uploaded."));
 			return;
 		}
 
 		if (requestedFaceScreenObject->ethnicityCode.empty())
 		{
-			ucout << std::endl << U("No ethnicity code specified. Landmark upload may have failed. (compute heatmap)") << std::endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "No ethnicity code specified. Landmark upload may have failed. (compute heatmap)";
 			message_reply(status_codes::Forbidden, U("No ethnicity code specified. Landmark upload may have failed."));
 			return;
 		}
@@ -480,7 +873,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 		
 		if (!subjectAge)
 		{
-			ucout << U("Parameter subjectAge of invalid format or range.") << std::endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "Parameter subjectAge of invalid format or range.";
 			return;
 		}
 		
@@ -492,158 +885,470 @@ void FaceScreenProcessor::handle_get(http_request message)
 
 		const auto facialModelDataPath = m_modelsRootDirectory / filesystem::path(modelDataDirs[U("unsplitModelsPath")].as_string());
 
+		const auto cancellation = requestCancellation(message, requestedFaceScreenObject->sessionCancellation);
+		if (!cancellation)
+		{
+			return;
+		}
 
-        pplx::create_task([=]() -> void
-        {
-    		// Landmarks having been uploaded implies ehtnicityCode is set and valid.									
-    		requestedFaceScreenObject->computeHeatmap(message, facialModelDataPath, requestedFaceScreenObject->ethnicityCode, *subjectAge);
-        }).then([=](auto resultTask)
-        {
-    		ucout << U(" ... done (compute heatmap)!") << std::endl;
-        });
-        return;
-	}
-
-	if (path.compare(U("heatmapImage")) == 0)
-	{
-		//  1.) Check heatmap for given processingToken has been computed.
-		//  2.) Render and return heatmap image.
-		requestedFaceScreenObject->renderHeatmapImage(message);
-		return;
-	}
-	
-	if (path.compare(U("frontPortrait")) == 0)
-	{
-		requestedFaceScreenObject->renderPortraitImage(message, false);
-		return;
-	}
-	
-	if (path.compare(U("profilePortrait")) == 0)
-	{
-		requestedFaceScreenObject->renderPortraitImage(message, true);
+		// A projection being precomputed is waited for, then found in the result cache.
+		afterPrecomputation(*requestedFaceScreenObject, facialModelDataPath).then([=]()
+		{
+			// Landmarks having been uploaded implies ehtnicityCode is set and valid.									
+			requestedFaceScreenObject->computeHeatmap(message, facialModelDataPath, requestedFaceScreenObject->ethnicityCode, *subjectAge, cancellation.get(), m_resultCache.get());
+			logInfo(requestedFaceScreenObject->processingToken) << "... done (compute heatmap)!";
+		}, m_computePool->taskOptions()).then([message](pplx::task<void> t)
+		{
+			replyOnException(message, t, U("INTERNAL ERROR: Heatmap computation failed."));
+		});
 		return;
 	}
 
-	
-	if (path.compare(U("heatmapPolyData")) == 0)
+	// Case: Return heatmaps for several ages, e.g., chronological and developmental age, sharing projection and reference surfaces.
+	if (path.compare(U("computeHeatmapSweep")) == 0)
 	{
-		if (requestedFaceScreenObject->heatmap == nullptr)
+		logInfo(requestedFaceScreenObject->processingToken) << "Computing heatmap sweep ...";
+		if (requestedFaceScreenObject->surfaceMesh == nullptr)
 		{
-			message_reply(web::http::status_codes::NotFound, U("Heatmap has not yet been computed."));
+			logWarning(requestedFaceScreenObject->processingToken) << "Facial mesh has not yet been uploaded. (compute heatmap sweep)";
+			message_reply(status_codes::NotFound, U("Facial mesh has not yet been uploaded."));
 			return;
 		}
-		
-		char heatmapPolyDataFileC[L_tmpnam];
-		if (!std::tmpnam(heatmapPolyDataFileC)) // Defined in header <cstdio>
+
+		if (requestedFaceScreenObject->landmarks.empty())
 		{
-			// std::cout << "temporary file name: " << heatmapPolyDataFileC << '\n';
-			message_reply(web::http::status_codes::InternalError, U("Could not create temp file for heatmap polyData."));
+			logWarning(requestedFaceScreenObject->processingToken) << "Landmarks have not yet been uploaded. (compute heatmap sweep)";
+			message_reply(status_codes::NotFound, U("Landmarks have not yet been uploaded."));
 			return;
 		}
-		
-		vtkNew<vtkXMLPolyDataWriter> writer;
-		writer->SetFileName(heatmapPolyDataFileC);
-		writer->SetInputData(requestedFaceScreenObject->heatmap);
-		writer->SetDataModeToBinary();
-		writer->Write();
 
-		std::filesystem::path heatmapPolyDataFile(heatmapPolyDataFileC);
-
-		if (!std::filesystem::exists(heatmapPolyDataFile))
+		if (requestedFaceScreenObject->ethnicityCode.empty())
 		{
-			message_reply(status_codes::NotFound, U("FASD report pdf file does not exist any more."));
+			logWarning(requestedFaceScreenObject->processingToken) << "No ethnicity code specified. Landmark upload may have failed. (compute heatmap sweep)";
+			message_reply(status_codes::Forbidden, U("No ethnicity code specified. Landmark upload may have failed."));
 			return;
 		}
 
-		concurrency::streams::fstream::open_istream(utility::conversions::to_string_t(heatmapPolyDataFile), std::ios::in)
-			.then(
-				[&message](concurrency::streams::istream heatmapPolyDataFile) {
-					if (!heatmapPolyDataFile.is_valid())
-					{
-						message_reply(status_codes::InternalError, U("Heatmap polydata temp file cannot be read."));
-						std::cerr << "Heatmap stream data: no valid stream buffer." << std::endl;
-						return;
-					}					
-				    	http_response response(status_codes::OK);
-				        response.headers().add(U("Access-Control-Allow-Origin"), CORS_PERMISSIONS);
-				        response.set_body(heatmapPolyDataFile);
-					message.reply(response).then([&message](pplx::task<void> t)
-							{
-								try 
-								{
-									t.get();
-								}
-								catch (...) 
-								{
-									message_reply(status_codes::InternalError, U("INTERNAL ERROR: Cannot stream heatmap polydata "));
-								}
-							});
-				})
-			.then([&message](pplx::task<void>t)
-				{
-					try 
-					{
-						t.get();
-					}
-					catch (...) 
-					{
-						message_reply(status_codes::InternalError, U("INTERNAL ERROR: Cannot open temp heatmap polydata "));
-					}
-				}).wait();
-		return;
-	}
-
-	if (path.compare(U("computeClassification")) == 0)
-	{
-		// TODO: Check that m_faceModelDataDir actually contains a valid dataset of facial models (and extract all available ethnities) 
-		// Call params, e.g.: facialRegion=Face^&ethnicityCode=CAUC
-		
 		const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
-		const auto facialRegionQueryParam = query.find(U("facialRegion"));
-		if (facialRegionQueryParam == query.end())
+
+		const auto subjectAgesQueryParam = query.find(U("subjectAges"));
+		if (subjectAgesQueryParam == query.end())
 		{
-			message_reply(status_codes::Forbidden, U("facialRegion is a required parameter. It is missing in the query."));
+			message_reply(status_codes::Forbidden, U("subjectAges is a required parameter. It is missing in the query."));
 			return;
 		}
-		const auto facialRegionName = utility::conversions::to_utf8string(facialRegionQueryParam->second.c_str());
 
-		if (requestedFaceScreenObject->landmarks.empty())
+		// Each age is validated as parameter subjectAge of /computeHeatmap.
+		const size_t maxSubjectAges = 32;
+		std::vector<float> subjectAges;
+		utility::istringstream_t subjectAgesStream(subjectAgesQueryParam->second);
+		utility::string_t subjectAgeQueryParam;
+		while (std::getline(subjectAgesStream, subjectAgeQueryParam, U(',')))
 		{
-			message_reply(status_codes::Forbidden, U("Landmarks have not yet been uploaded."));
-			return;
+			const auto subjectAge = sanitizeSubjectAgeInput(message, subjectAgeQueryParam);
+			if (!subjectAge)
+			{
+				logWarning(requestedFaceScreenObject->processingToken) << "Parameter subjectAges of invalid format or range.";
+				return;
+			}
+			subjectAges.push_back(*subjectAge);
 		}
-
-		if (requestedFaceScreenObject->ethnicityCode.empty())
+		if (subjectAges.empty() || subjectAges.size() > maxSubjectAges)
 		{
-			message_reply(status_codes::Forbidden, U("No ethnicity code specified. Landmark upload may have failed."));
+			message_reply(status_codes::Forbidden, utility::conversions::to_string_t("Parameter subjectAges must list 1 to " + std::to_string(maxSubjectAges) + " ages."));
 			return;
 		}
 
-		if (!modelDataDirs.has_field(U("splitModelsPath")))
+		if (!modelDataDirs.has_field(U("unsplitModelsPath")))
 		{
-			message_reply(status_codes::NotFound, U("No (split) models for classification available for uploaded set of landmarks and provided ethnicity code."));
+			message_reply(status_codes::NotFound, U("No (unsplit) models for heatmap computation available for uploaded set of landmarks and provided ethnicity code."));
 			return;
 		}
 
-		//const std::string facialModelDataPath = utility::conversions::to_utf8string(modelDataDirs[U("splitModelsPath")].as_string());
-		const filesystem::path facialModelDataPath = m_modelsRootDirectory / 
-                   filesystem::path(utility::conversions::to_utf8string(modelDataDirs[U("splitModelsPath")].as_string()));
-		const filesystem::path facialRegionModelDataPath = facialModelDataPath / filesystem::path(facialRegionName);
-		
-		if (!filesystem::exists(facialRegionModelDataPath))
+		const auto facialModelDataPath = m_modelsRootDirectory / filesystem::path(modelDataDirs[U("unsplitModelsPath")].as_string());
+
+		const auto cancellation = requestCancellation(message, requestedFaceScreenObject->sessionCancellation);
+		if (!cancellation)
 		{
-			message_reply(status_codes::NotFound, U("Model not available for facial region ") + utility::conversions::to_string_t(facialRegionName));
 			return;
 		}
 
-		pplx::create_task([=]()
+		afterPrecomputation(*requestedFaceScreenObject, facialModelDataPath).then([=]()
+		{
+			vtkSmartPointer<vtkPolyData> sweep;
+			const auto status = requestedFaceScreenObject->computeHeatmapSweep(facialModelDataPath, subjectAges, sweep, cancellation.get(), m_resultCache.get());
+			if (!status.succeeded())
+			{
+				message_reply(status.statusCode, status.message);
+				return;
+			}
+
+			json::value jsonResponse;
+			jsonResponse[U("status")] = status.statusCode;
+			jsonResponse[U("message")] = json::value::string(status.message);
+			std::vector<json::value> jsonSubjectAges;
+			for (const auto subjectAge : subjectAges)
+			{
+				jsonSubjectAges.push_back(json::value::number(subjectAge));
+			}
+			jsonResponse[U("subjectAges")] = json::value::array(jsonSubjectAges);
+
+			vtkNew<vtkXMLPolyDataWriter> writer;
+			writer->SetInputData(sweep);
+			writer->SetDataModeToBinary();
+			writer->WriteToOutputStringOn();
+			writer->Write();
+			const auto sweepPolyData = writer->GetOutputString();
+			jsonResponse[U("polyData")] = json::value::string(
+				utility::conversions::to_base64(std::vector<unsigned char>(sweepPolyData.cbegin(), sweepPolyData.cend())));
+			message_reply(status_codes::OK, jsonResponse);
+			logInfo(requestedFaceScreenObject->processingToken) << "... done (compute heatmap sweep)!";
+		}, m_computePool->taskOptions()).then([message](pplx::task<void> t)
 		{
-	    		const bool classificationSuccessful = requestedFaceScreenObject->computeClassification(message, facialRegionModelDataPath, facialRegionName);
+			replyOnException(message, t, U("INTERNAL ERROR: Heatmap sweep computation failed."));
+		});
+		return;
+	}
+
+	// Case: Return heatmaps against the reference populations of several ethnicity codes (see modelDescriptors in modelDB.json).
+	if (path.compare(U("computeReferenceHeatmaps")) == 0)
+	{
+		logInfo(requestedFaceScreenObject->processingToken) << "Computing reference heatmaps ...";
+		if (requestedFaceScreenObject->surfaceMesh == nullptr)
+		{
+			logWarning(requestedFaceScreenObject->processingToken) << "Facial mesh has not yet been uploaded. (compute reference heatmaps)";
+			message_reply(status_codes::NotFound, U("Facial mesh has not yet been uploaded."));
+			return;
+		}
+
+		if (requestedFaceScreenObject->landmarks.empty())
+		{
+			logWarning(requestedFaceScreenObject->processingToken) << "Landmarks have not yet been uploaded. (compute reference heatmaps)";
+			message_reply(status_codes::NotFound, U("Landmarks have not yet been uploaded."));
+			return;
+		}
+
+		const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
+
+		const auto subjectAgeQueryParam = query.find(U("subjectAge"));
+		if (subjectAgeQueryParam == query.end())
+		{
+			message_reply(status_codes::Forbidden, U("subjectAge is a required parameter. It is missing in the query."));
+			return;
+		}
+
+		const auto subjectAge = sanitizeSubjectAgeInput(message, subjectAgeQueryParam->second);
+		if (!subjectAge)
+		{
+			logWarning(requestedFaceScreenObject->processingToken) << "Parameter subjectAge of invalid format or range.";
+			return;
+		}
+
+		// Ethnicity codes requested, all with an unsplit model for the landmark set of the subject if omitted.
+		const auto landmarkSetType = utility::conversions::to_string_t(requestedFaceScreenObject->landmarkSetType);
+		std::vector<utility::string_t> ethnicityCodes;
+		const auto ethnicityCodesQueryParam = query.find(U("ethnicityCodes"));
+		if (ethnicityCodesQueryParam != query.end())
+		{
+			utility::istringstream_t ethnicityCodesStream(ethnicityCodesQueryParam->second);
+			utility::string_t ethnicityCode;
+			while (std::getline(ethnicityCodesStream, ethnicityCode, U(',')))
+			{
+				ethnicityCodes.push_back(ethnicityCode);
+			}
+		}
+		else if (modelDescriptors.is_object())
+		{
+			for (const auto& modelDescriptor : modelDescriptors.as_object())
+			{
+				ethnicityCodes.push_back(modelDescriptor.first);
+			}
+		}
+		std::sort(ethnicityCodes.begin(), ethnicityCodes.end());
+		ethnicityCodes.erase(std::unique(ethnicityCodes.begin(), ethnicityCodes.end()), ethnicityCodes.end());
+
+		std::vector<std::pair<utility::string_t, filesystem::path>> references;
+		for (const auto& ethnicityCode : ethnicityCodes)
+		{
+			const auto referenceModelDataDirs = resolveModelDataDirs(ethnicityCode, landmarkSetType);
+			if (referenceModelDataDirs && referenceModelDataDirs->has_string_field(U("unsplitModelsPath")))
+			{
+				references.emplace_back(ethnicityCode, m_modelsRootDirectory / filesystem::path(referenceModelDataDirs->at(U("unsplitModelsPath")).as_string()));
+			}
+			else if (ethnicityCodesQueryParam != query.end())
+			{
+				message_reply(status_codes::NotFound, U("No (unsplit) model for heatmap computation available for uploaded set of landmarks and ethnicity code ") + ethnicityCode + U("."));
+				return;
+			}
+		}
+		if (references.empty())
+		{
+			message_reply(status_codes::NotFound, U("No (unsplit) models for heatmap computation available for uploaded set of landmarks."));
+			return;
+		}
+
+		const auto cancellation = requestCancellation(message, requestedFaceScreenObject->sessionCancellation);
+		if (!cancellation)
+		{
+			return;
+		}
+
+		// Each reference is computed by tasks of its own, on a copy of the subject (VTK pipelines modify the information of their input):
+		// loading the model, resampling the subject (shared by the models of a base mesh), then projection, signature and transformation.
+		const auto resamples = std::make_shared<SharedResamples>();
+		std::vector<pplx::task<json::value>> referenceTasks;
+		for (const auto& reference : references)
+		{
+			const auto referenceSubject = requestedFaceScreenObject->copyForConcurrentProcessing();
+			const auto referenceModelDataPath = reference.second;
+			referenceTasks.push_back(afterPrecomputation(*requestedFaceScreenObject, referenceModelDataPath).then(
+				[referenceSubject, referenceModelDataPath, subjectAge, cancellation, resamples, computePool = m_computePool, resultCache = m_resultCache]()
+			{
+				const auto statusAsJson = [](const processingStatus& status)
+				{
+					json::value jsonStatus;
+					jsonStatus[U("status")] = status.statusCode;
+					jsonStatus[U("message")] = json::value::string(status.message);
+					return jsonStatus;
+				};
+
+				const auto referenceModel = std::make_shared<heatmapReference>();
+				const auto loadStatus = referenceSubject->loadHeatmapReference(referenceModelDataPath, *referenceModel, resultCache.get());
+				if (!loadStatus.succeeded())
+				{
+					return pplx::task_from_result(statusAsJson(loadStatus));
+				}
+				auto resampled = (referenceModel->projection->GetNumberOfValues() > 0) ? pplx::task_from_result(vtkSmartPointer<vtkPolyData>())
+					: resamples->resample(referenceModel, referenceSubject, cancellation, *computePool);
+				return resampled.then([referenceSubject, referenceModel, subjectAge, cancellation, resultCache, statusAsJson](vtkSmartPointer<vtkPolyData> resampledSubject)
+				{
+					vtkSmartPointer<vtkPolyData> referenceHeatmap;
+					const auto status = referenceSubject->computeReferenceHeatmap(*referenceModel, *subjectAge, resampledSubject, referenceHeatmap, cancellation.get(), resultCache.get());
+					auto jsonHeatmapResult = statusAsJson(status);
+					if (status.succeeded())
+					{
+						vtkNew<vtkXMLPolyDataWriter> writer;
+						writer->SetInputData(referenceHeatmap);
+						writer->SetDataModeToBinary();
+						writer->WriteToOutputStringOn();
+						writer->Write();
+						const auto heatmapPolyData = writer->GetOutputString();
+						jsonHeatmapResult[U("polyData")] = json::value::string(
+							utility::conversions::to_base64(std::vector<unsigned char>(heatmapPolyData.cbegin(), heatmapPolyData.cend())));
+					}
+					return jsonHeatmapResult;
+				}, computePool->taskOptions());
+			}, m_computePool->taskOptions()));
+		}
+
+		// Results are merged in order of the (sorted) ethnicity codes, independent of the order in which the tasks finish.
+		pplx::when_all(referenceTasks.begin(), referenceTasks.end()).then([message, references, processingToken = requestedFaceScreenObject->processingToken](std::vector<json::value> referenceResults)
+		{
+			json::value jsonResponse = json::value::object();
+			for (size_t reference = 0; reference < references.size(); ++reference)
+			{
+				jsonResponse[references[reference].first] = referenceResults.at(reference);
+			}
+			message_reply(status_codes::OK, jsonResponse);
+			logInfo(processingToken) << "... done (compute reference heatmaps)!";
+		}).then([message](pplx::task<void> t)
+		{
+			replyOnException(message, t, U("INTERNAL ERROR: Reference heatmap computation failed."));
+		});
+		return;
+	}
+
+	// Rendering runs on the compute pool. The render functions reply to the client.
+	if (path.compare(U("heatmapImage")) == 0)
+	{
+		//  1.) Check heatmap for given processingToken has been computed.
+		//  2.) Render and return heatmap image.
+		m_computePool->run([=]() { requestedFaceScreenObject->renderHeatmapImage(message); })
+			.then([message](pplx::task<void> t) { replyOnException(message, t, U("INTERNAL ERROR: Heatmap image could not be rendered.")); });
+		return;
+	}
+	
+	if (path.compare(U("frontPortrait")) == 0 || path.compare(U("profilePortrait")) == 0)
+	{
+		const bool renderProfile = (path.compare(U("profilePortrait")) == 0);
+		m_computePool->run([=]() { requestedFaceScreenObject->renderPortraitImage(message, renderProfile); })
+			.then([message](pplx::task<void> t) { replyOnException(message, t, U("INTERNAL ERROR: Portrait could not be rendered.")); });
+		return;
+	}
+
+	
+	if (path.compare(U("heatmapPolyData")) == 0)
+	{
+		if (requestedFaceScreenObject->heatmap == nullptr)
+		{
+			message_reply(web::http::status_codes::NotFound, U("Heatmap has not yet been computed."));
+			return;
+		}
+		
+		// Serialised in memory on the compute pool, instead of through a temp file.
+		const vtkSmartPointer<vtkPolyData> heatmap = requestedFaceScreenObject->heatmap;
+		m_computePool->run([heatmap]()
+		{
+			vtkNew<vtkXMLPolyDataWriter> writer;
+			writer->SetInputData(heatmap);
+			writer->SetDataModeToBinary();
+			writer->WriteToOutputStringOn();
+			writer->Write();
+			const auto heatmapPolyData = writer->GetOutputString();
+			return std::vector<unsigned char>(heatmapPolyData.cbegin(), heatmapPolyData.cend());
+		}).then([message](pplx::task<std::vector<unsigned char>> t)
+		{
+			try
+			{
+				message_reply(status_codes::OK, t.get());
+			}
+			catch (const std::exception& ex)
+			{
+				logError(processingTokenOf(message)) << "Heatmap polydata could not be serialised: " << ex.what();
+				message_reply(status_codes::InternalError, U("INTERNAL ERROR: Cannot serialise heatmap polydata "));
+			}
+		});
+		return;
+	}
+
+	if (path.compare(U("computeClassification")) == 0)
+	{
+		// TODO: Check that m_faceModelDataDir actually contains a valid dataset of facial models (and extract all available ethnities) 
+		// Call params, e.g.: facialRegion=Face^&ethnicityCode=CAUC
+		
+		const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
+		const auto facialRegionQueryParam = query.find(U("facialRegion"));
+		if (facialRegionQueryParam == query.end())
+		{
+			message_reply(status_codes::Forbidden, U("facialRegion is a required parameter. It is missing in the query."));
+			return;
+		}
+		const auto facialRegionName = utility::conversions::to_utf8string(facialRegionQueryParam->second.c_str());
+
+		if (requestedFaceScreenObject->landmarks.empty())
+		{
+			message_reply(status_codes::Forbidden, U("Landmarks have not yet been uploaded."));
+			return;
+		}
+
+		if (requestedFaceScreenObject->ethnicityCode.empty())
+		{
+			message_reply(status_codes::Forbidden, U("No ethnicity code specified. Landmark upload may have failed."));
+			return;
+		}
+
+		if (!modelDataDirs.has_field(U("splitModelsPath")))
+		{
+			message_reply(status_codes::NotFound, U("No (split) models for classification available for uploaded set of landmarks and provided ethnicity code."));
+			return;
+		}
+
+		//const std::string facialModelDataPath = utility::conversions::to_utf8string(modelDataDirs[U("splitModelsPath")].as_string());
+		const filesystem::path facialModelDataPath = m_modelsRootDirectory / 
+                   filesystem::path(utility::conversions::to_utf8string(modelDataDirs[U("splitModelsPath")].as_string()));
+		const filesystem::path facialRegionModelDataPath = facialModelDataPath / filesystem::path(facialRegionName);
+		
+		if (!filesystem::exists(facialRegionModelDataPath))
+		{
+			message_reply(status_codes::NotFound, U("Model not available for facial region ") + utility::conversions::to_string_t(facialRegionName));
+			return;
+		}
+
+		const auto cancellation = requestCancellation(message, requestedFaceScreenObject->sessionCancellation);
+		if (!cancellation)
+		{
+			return;
+		}
+
+		afterPrecomputation(*requestedFaceScreenObject, facialRegionModelDataPath).then([=]()
+		{
+			const auto classifier = m_splitModelStore->classifier(facialRegionModelDataPath, m_resultCache.get());
+			requestedFaceScreenObject->computeClassification(message, *classifier, facialRegionModelDataPath, facialRegionName, cancellation.get(), m_resultCache.get());
+		}, m_computePool->taskOptions()).then([message](pplx::task<void> t)
+		{
+			replyOnException(message, t, U("INTERNAL ERROR: Classification failed."));
+		});
+		return;
+	}
+
+	if (path.compare(U("computeAllClassifications")) == 0)
+	{
+		if (requestedFaceScreenObject->landmarks.empty())
+		{
+			message_reply(status_codes::Forbidden, U("Landmarks have not yet been uploaded."));
+			return;
+		}
+
+		if (requestedFaceScreenObject->ethnicityCode.empty())
+		{
+			message_reply(status_codes::Forbidden, U("No ethnicity code specified. Landmark upload may have failed."));
+			return;
+		}
+
+		if (!modelDataDirs.has_field(U("splitModelsPath")))
+		{
+			message_reply(status_codes::NotFound, U("No (split) models for classification available for uploaded set of landmarks and provided ethnicity code."));
+			return;
+		}
+
+		const filesystem::path facialModelDataPath = m_modelsRootDirectory /
+			filesystem::path(utility::conversions::to_utf8string(modelDataDirs[U("splitModelsPath")].as_string()));
+		const auto facialRegions = facialRegionsIn(facialModelDataPath);
+		if (facialRegions.empty())
+		{
+			message_reply(status_codes::NotFound, U("No facial regions available for classification."));
+			return;
+		}
+
+		const auto cancellation = requestCancellation(message, requestedFaceScreenObject->sessionCancellation);
+		if (!cancellation)
+		{
+			return;
+		}
+
+		// Each facial region is classified by a task of its own, on a copy of the subject (VTK pipelines modify the information of their input),
+		// against the split models of the region shared by all requests (all splits in one pass, unless the legacy classification kernel is selected).
+		std::vector<pplx::task<std::pair<processingStatus, classificationResult>>> regionTasks;
+		for (const auto& facialRegionName : facialRegions)
+		{
+			const auto regionSubject = requestedFaceScreenObject->copyForConcurrentProcessing();
+			const auto facialRegionModelDataPath = facialModelDataPath / filesystem::path(facialRegionName);
+			regionTasks.push_back(afterPrecomputation(*requestedFaceScreenObject, facialRegionModelDataPath).then(
+				[regionSubject, facialRegionModelDataPath, facialRegionName, cancellation, resultCache = m_resultCache, splitModelStore = m_splitModelStore]()
+			{
+				classificationResult result{};
+				const auto classifier = splitModelStore->classifier(facialRegionModelDataPath, resultCache.get());
+				const auto status = regionSubject->computeClassification(*classifier, facialRegionModelDataPath, facialRegionName, result, cancellation.get(), resultCache.get());
+				return std::make_pair(status, result);
+			}, m_computePool->taskOptions()));
+		}
+
+		// Results are merged in order of the (sorted) facial regions, independent of the order in which the tasks finish.
+		pplx::when_all(regionTasks.begin(), regionTasks.end()).then([message, requestedFaceScreenObject, facialRegions](std::vector<std::pair<processingStatus, classificationResult>> regionResults)
+		{
+			json::value jsonResponse = json::value::object();
+			for (size_t region = 0; region < facialRegions.size(); ++region)
+			{
+				const auto& [status, result] = regionResults.at(region);
+				json::value jsonClassificationResult;
+				if (status.succeeded())
+				{
+					requestedFaceScreenObject->storeClassification(facialRegions[region], result);
+					jsonClassificationResult[U("mean")] = result.mean;
+					jsonClassificationResult[U("stdError")] = result.stdDev;
+				}
+				else
+				{
+					jsonClassificationResult[U("status")] = status.statusCode;
+					jsonClassificationResult[U("message")] = json::value::string(status.message);
+				}
+				jsonResponse[utility::conversions::to_string_t(facialRegions[region])] = jsonClassificationResult;
+			}
+			message_reply(status_codes::OK, jsonResponse);
+		}).then([message](pplx::task<void> t)
+		{
+			replyOnException(message, t, U("INTERNAL ERROR: Classification failed."));
 		});
-//        }).then([=](auto resultTask)
-//        {
-//                ....
-//        });
 		return;
 	}
 
@@ -651,7 +1356,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 	{
 		// Generate json object of requestedFaceScreenObject->closestMeanClassifications and return it in response
 		json::value jsonRespsonse;
-		for (const auto& classificationResult : requestedFaceScreenObject->closestMeanClassifications)
+		for (const auto& classificationResult : requestedFaceScreenObject->classifications())
 		{
 			json::value jsonClassificationResult;
 			jsonClassificationResult[U("mean")] = classificationResult.second.mean;
@@ -692,7 +1397,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 
 		if (requestedFaceScreenObject->landmarks.empty())
 		{
-			cerr << "In FaceScreeningObject::computePFLmeasure() : PFL requires landmarks to be uploaded first." << endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "In FaceScreeningObject::computePFLmeasure() : PFL requires landmarks to be uploaded first.";
 			message_reply(status_codes::NotFound, U("PFL computation requires landmarks to be uploaded first."));
 			return;
 		}
@@ -702,7 +1407,7 @@ void FaceScreenProcessor::handle_get(http_request message)
 			requestedFaceScreenObject->landmarks.find("right_en") == requestedFaceScreenObject->landmarks.end() ||
 			requestedFaceScreenObject->landmarks.find("right_ex") == requestedFaceScreenObject->landmarks.end())
 		{
-			cerr << "In FaceScreeningObject::computePFLmeasure() : Not all required landmarks were uploaded." << endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "In FaceScreeningObject::computePFLmeasure() : Not all required landmarks were uploaded.";
 			message_reply(status_codes::NotFound, U("Not all required landmarks were uploaded"));
 			return;
 		}
@@ -722,23 +1427,383 @@ void FaceScreenProcessor::handle_get(http_request message)
 	message_reply(status_codes::NotFound, U("Endpoint is not supported."));
 };
 
+void FaceScreenProcessor::startPrecomputation(const std::shared_ptr<FaceScreeningObject>& subject)
+{
+	if (!precomputeOnUpload || !m_resultCache || subject->surfaceMesh == nullptr || subject->landmarks.empty() || subject->ethnicityCode.empty())
+	{
+		return;
+	}
+	// Resolved from the subject: the shared modelDataDirs are those of whichever session uploaded landmarks last, and are not read by
+	// background tasks.
+	const auto subjectModelDataDirs = resolveModelDataDirs(utility::conversions::to_string_t(subject->ethnicityCode),
+		utility::conversions::to_string_t(subject->landmarkSetType));
+	if (!subjectModelDataDirs)
+	{
+		return;
+	}
+	const auto precomputation = subject->restartPrecomputation();
+	logDebug(subject->processingToken) << "Precomputing projection and classifications.";
+
+	// Each task works on a copy of its own (VTK pipelines modify the information of their input), made from this snapshot once it starts.
+	const std::shared_ptr<const FaceScreeningObject> snapshot = subject->copyForConcurrentProcessing();
+	if (subjectModelDataDirs->has_field(U("unsplitModelsPath")))
+	{
+		const auto heatmapModelDataPath = m_modelsRootDirectory / filesystem::path(subjectModelDataDirs->at(U("unsplitModelsPath")).as_string());
+		m_computePool->runInBackground([precomputation, snapshot, heatmapModelDataPath, resultCache = m_resultCache]()
+		{
+			precomputation->run(heatmapModelDataPath.string(), [&](const CancellationToken* cancellation)
+			{
+				snapshot->copyForConcurrentProcessing()->precomputeProjection(heatmapModelDataPath, cancellation, *resultCache);
+			});
+		});
+	}
+	if (subjectModelDataDirs->has_field(U("splitModelsPath")))
+	{
+		const filesystem::path facialModelDataPath = m_modelsRootDirectory /
+			filesystem::path(utility::conversions::to_utf8string(subjectModelDataDirs->at(U("splitModelsPath")).as_string()));
+		for (const auto& facialRegionName : facialRegionsIn(facialModelDataPath))
+		{
+			const auto facialRegionModelDataPath = facialModelDataPath / filesystem::path(facialRegionName);
+			m_computePool->runInBackground([precomputation, snapshot, facialRegionModelDataPath, facialRegionName, resultCache = m_resultCache, splitModelStore = m_splitModelStore]()
+			{
+				precomputation->run(facialRegionModelDataPath.string(), [&](const CancellationToken* cancellation)
+				{
+					classificationResult result{};
+					const auto classifier = splitModelStore->classifier(facialRegionModelDataPath, resultCache.get());
+					snapshot->copyForConcurrentProcessing()->computeClassification(*classifier, facialRegionModelDataPath, facialRegionName, result, cancellation, resultCache.get());
+				});
+			});
+		}
+	}
+}
+
+std::optional<web::json::value> FaceScreenProcessor::resolveModelDataDirs(const utility::string_t& ethnicityCode, const utility::string_t& landmarkSetType) const
+{
+	if (!modelDescriptors.has_object_field(ethnicityCode))
+	{
+		return {};
+	}
+	const web::json::value& supportedLandmarkSetsForModel = modelDescriptors.at(ethnicityCode);
+	if (!supportedLandmarkSetsForModel.has_object_field(landmarkSetType))
+	{
+		return {};
+	}
+	return supportedLandmarkSetsForModel.at(landmarkSetType);
+}
+
+// POST /screen
+// Multipart/form-data parts: 
+//		mesh - obj file (required)
+//		landmarks - json coded landmarks, as for POST /landmarks (required)
+//		ethnicityCode (required)
+//		subjectAge - required for outputs heatmap and PFL
+//		subjectGender - required for output PFL
+//		regions - comma separated list of facial regions to classify; all available regions if omitted
+//		outputs - comma separated subset of heatmap, classifications, PFL; all of these if omitted
+// Mesh parsing overlaps with landmark parsing and input validation. Heatmap and the classification of each facial region are then computed concurrently.
+void FaceScreenProcessor::handle_screen(http_request message)
+{
+	logInfo() << "Processing single-call screening request...";
+
+	const auto boundary = multipartFormData::boundaryFromContentType(utility::conversions::to_utf8string(message.headers().content_type()));
+	if (!boundary)
+	{
+		message_reply(status_codes::BadRequest, U("Request body must be of content type multipart/form-data."));
+		return;
+	}
+
+	// No session to be cancelled with, but the deadline (if any) starts before receiving the body.
+	const auto cancellation = requestCancellation(message, nullptr);
+	if (!cancellation)
+	{
+		return;
+	}
+
+	message.extract_vector().then([message, boundary, cancellation, this](std::vector<unsigned char> body)
+	{
+		auto parts = multipartFormData::parse(body, *boundary);
+		if (!parts)
+		{
+			message_reply(status_codes::BadRequest, U("Malformed multipart/form-data body."));
+			return;
+		}
+
+		for (const auto& requiredPart : { "mesh", "landmarks", "ethnicityCode" })
+		{
+			if (parts->count(requiredPart) == 0)
+			{
+				message_reply(status_codes::Forbidden, utility::conversions::to_string_t(std::string(requiredPart) + " is a required part. It is missing in the request body."));
+				return;
+			}
+		}
+
+		const auto partAsList = [&parts](const std::string& partName, const std::vector<std::string>& defaultValue)
+		{
+			if (parts->count(partName) == 0)
+			{
+				return defaultValue;
+			}
+			std::vector<std::string> items;
+			std::stringstream itemStream(parts->at(partName).asString());
+			std::string item;
+			while (std::getline(itemStream, item, ','))
+			{
+				item.erase(0, item.find_first_not_of(" \t\r\n"));
+				item.erase(item.find_last_not_of(" \t\r\n") + 1);
+				if (!item.empty())
+				{
+					items.push_back(item);
+				}
+			}
+			return items.empty() ? defaultValue : items;
+		};
+		const auto outputs = partAsList("outputs", { "heatmap", "classifications", "PFL" });
+		const auto outputRequested = [&outputs](const std::string& output) { return std::find(outputs.cbegin(), outputs.cend(), output) != outputs.cend(); };
+
+		auto subject = std::make_shared<FaceScreeningObject>();
+
+		// Stage 1: Start parsing the mesh, which takes longest of all inputs. All other inputs are parsed and validated meanwhile.
+		auto meshLoaded = m_computePool->run([subject, mesh = std::move(parts->at("mesh").data)]()
+		{
+			return subject->loadSurfaceMeshFromObj(mesh);
+		});
+
+		web::json::value landmarksJson;
+		try
+		{
+			landmarksJson = web::json::value::parse(utility::conversions::to_string_t(parts->at("landmarks").asString()));
+		}
+		catch (const web::json::json_exception&)
+		{
+			message_reply(status_codes::BadRequest, U("Landmark data: JSON parsing error."));
+			return;
+		}
+		if (!landmarksJson.is_object())
+		{
+			message_reply(status_codes::BadRequest, U("Landmark data: JSON object expected."));
+			return;
+		}
+
+		const auto identifiedLandmarkSetType = subject->parseLandmarks(landmarksJson, landmarkSetTypes);
+		if (identifiedLandmarkSetType.empty())
+		{
+			message_reply(status_codes::NotFound, U("Provided landmark set could not be decoded to a known landmark set type."));
+			return;
+		}
+		subject->landmarkSetType = utility::conversions::to_utf8string(identifiedLandmarkSetType);
+
+		const auto ethnicityCode = utility::conversions::to_string_t(parts->at("ethnicityCode").asString());
+		const auto subjectModelDataDirs = resolveModelDataDirs(ethnicityCode, identifiedLandmarkSetType);
+		if (!subjectModelDataDirs)
+		{
+			message_reply(status_codes::NotFound, U("No models available for uploaded set of landmarks and provided ethnicity code ") + ethnicityCode);
+			return;
+		}
+		subject->ethnicityCode = utility::conversions::to_utf8string(ethnicityCode);
+
+		std::optional<float> subjectAge;
+		if (outputRequested("heatmap") || outputRequested("PFL"))
+		{
+			if (parts->count("subjectAge") == 0)
+			{
+				message_reply(status_codes::Forbidden, U("subjectAge is a required part for outputs heatmap and PFL. It is missing in the request body."));
+				return;
+			}
+			subjectAge = sanitizeSubjectAgeInput(message, utility::conversions::to_string_t(parts->at("subjectAge").asString()));
+			if (!subjectAge)
+			{
+				return;
+			}
+			subject->subjectAge = *subjectAge;
+		}
+
+		std::filesystem::path heatmapModelDataPath;
+		if (outputRequested("heatmap"))
+		{
+			if (!subjectModelDataDirs->has_field(U("unsplitModelsPath")))
+			{
+				message_reply(status_codes::NotFound, U("No (unsplit) models for heatmap computation available for uploaded set of landmarks and provided ethnicity code."));
+				return;
+			}
+			heatmapModelDataPath = m_modelsRootDirectory / filesystem::path(subjectModelDataDirs->at(U("unsplitModelsPath")).as_string());
+		}
+
+		std::vector<std::pair<std::string, std::filesystem::path>> facialRegions;
+		if (outputRequested("classifications"))
+		{
+			if (!subjectModelDataDirs->has_field(U("splitModelsPath")))
+			{
+				message_reply(status_codes::NotFound, U("No (split) models for classification available for uploaded set of landmarks and provided ethnicity code."));
+				return;
+			}
+			const filesystem::path facialModelDataPath = m_modelsRootDirectory / 
+				filesystem::path(utility::conversions::to_utf8string(subjectModelDataDirs->at(U("splitModelsPath")).as_string()));
+
+			for (const auto& facialRegionName : partAsList("regions", facialRegionsIn(facialModelDataPath)))
+			{
+				const filesystem::path facialRegionModelDataPath = facialModelDataPath / filesystem::path(facialRegionName);
+				if (!filesystem::exists(facialRegionModelDataPath))
+				{
+					message_reply(status_codes::NotFound, U("Model not available for facial region ") + utility::conversions::to_string_t(facialRegionName));
+					return;
+				}
+				facialRegions.emplace_back(facialRegionName, facialRegionModelDataPath);
+			}
+		}
+
+		// PFL only requires landmarks, and takes microseconds. It is computed here, before the subject is shared between concurrent stages.
+		web::json::value jsonResponse;
+		jsonResponse[U("landmarkSetType")] = web::json::value::string(identifiedLandmarkSetType);
+		if (outputRequested("PFL"))
+		{
+			if (parts->count("subjectGender") == 0)
+			{
+				message_reply(status_codes::Forbidden, U("subjectGender is a required part for output PFL. It is missing in the request body."));
+				return;
+			}
+			json::value jsonPFLresult;
+			if (subject->landmarks.count("left_en") == 0 || subject->landmarks.count("left_ex") == 0 ||
+				subject->landmarks.count("right_en") == 0 || subject->landmarks.count("right_ex") == 0)
+			{
+				jsonPFLresult[U("status")] = status_codes::NotFound;
+				jsonPFLresult[U("message")] = json::value::string(U("Not all required landmarks were uploaded"));
+			}
+			else
+			{
+				const auto pfl = subject->computePFLmeasure(message, subject->ethnicityCode, parts->at("subjectGender").asString(), *subjectAge);
+				jsonPFLresult[U("PFL")] = pfl.rawPFL;
+				jsonPFLresult[U("PFLpercentile")] = pfl.percentile;
+				jsonPFLresult[U("PFLzScore")] = pfl.zScore;
+			}
+			jsonResponse[U("PFL")] = jsonPFLresult;
+		}
+
+		// Stage 2: Once the mesh is available, heatmap and each facial region classification run as independent tasks.
+		meshLoaded.then([message, computePool = m_computePool, resultCache = m_resultCache, splitModelStore = m_splitModelStore, cancellation, subject, subjectAge, heatmapModelDataPath, facialRegions, jsonResponse](processingStatus meshStatus) mutable
+		{
+			if (!meshStatus.succeeded())
+			{
+				message_reply(meshStatus.statusCode, meshStatus.message);
+				return;
+			}
+
+			const auto statusAsJson = [](const processingStatus& status)
+			{
+				json::value jsonStatus;
+				jsonStatus[U("status")] = status.statusCode;
+				jsonStatus[U("message")] = json::value::string(status.message);
+				return jsonStatus;
+			};
+
+			std::vector<pplx::task<json::value>> stages;
+			if (!heatmapModelDataPath.empty())
+			{
+				const auto heatmapSubject = subject->copyForConcurrentProcessing();
+				stages.push_back(computePool->run([heatmapSubject, heatmapModelDataPath, subjectAge, cancellation, resultCache, statusAsJson]()
+				{
+					auto jsonHeatmapResult = statusAsJson(heatmapSubject->computeHeatmap(heatmapModelDataPath, heatmapSubject->ethnicityCode, *subjectAge, cancellation.get(), resultCache.get()));
+					if (heatmapSubject->heatmap != nullptr)
+					{
+						vtkNew<vtkXMLPolyDataWriter> writer;
+						writer->SetInputData(heatmapSubject->heatmap);
+						writer->SetDataModeToBinary();
+						writer->WriteToOutputStringOn();
+						writer->Write();
+						const auto heatmapPolyData = writer->GetOutputString();
+						jsonHeatmapResult[U("polyData")] = json::value::string(
+							utility::conversions::to_base64(std::vector<unsigned char>(heatmapPolyData.cbegin(), heatmapPolyData.cend())));
+					}
+					return jsonHeatmapResult;
+				}));
+			}
+			for (const auto& facialRegion : facialRegions)
+			{
+				const auto regionSubject = subject->copyForConcurrentProcessing();
+				stages.push_back(computePool->run([regionSubject, facialRegion, cancellation, resultCache, splitModelStore, statusAsJson]()
+				{
+					classificationResult result;
+					const auto classifier = splitModelStore->classifier(facialRegion.second, resultCache.get());
+					const auto status = regionSubject->computeClassification(*classifier, facialRegion.second, facialRegion.first, result, cancellation.get(), resultCache.get());
+					if (!status.succeeded())
+					{
+						return statusAsJson(status);
+					}
+					json::value jsonClassificationResult;
+					jsonClassificationResult[U("mean")] = result.mean;
+					jsonClassificationResult[U("stdError")] = result.stdDev;
+					return jsonClassificationResult;
+				}));
+			}
+
+			if (stages.empty())
+			{
+				message_reply(status_codes::OK, jsonResponse);
+				return;
+			}
+
+			// Stage 3: Merge results in order of submission, i.e., heatmap first, then facial regions in order requested.
+			pplx::when_all(stages.begin(), stages.end()).then([message, heatmapRequested = !heatmapModelDataPath.empty(), facialRegions, jsonResponse](pplx::task<std::vector<json::value>> stagesTask) mutable
+			{
+				try
+				{
+					const auto stageResults = stagesTask.get();
+					size_t stageIndex = 0;
+					if (heatmapRequested)
+					{
+						jsonResponse[U("heatmap")] = stageResults.at(stageIndex++);
+					}
+					if (!facialRegions.empty())
+					{
+						json::value jsonClassifications = json::value::object();
+						for (const auto& facialRegion : facialRegions)
+						{
+							jsonClassifications[utility::conversions::to_string_t(facialRegion.first)] = stageResults.at(stageIndex++);
+						}
+						jsonResponse[U("classifications")] = jsonClassifications;
+					}
+				}
+				catch (const std::exception& e)
+				{
+					logError() << "Single-call screening failed: " << e.what();
+					message_reply(status_codes::InternalError, U("INTERNAL ERROR: Screening failed."));
+					return;
+				}
+				message_reply(status_codes::OK, jsonResponse);
+				logInfo() << "... done (single-call screening)!";
+			});
+		}).then([message](pplx::task<void> t)
+		{
+			replyOnException(message, t, U("INTERNAL ERROR: Screening failed."));
+		});
+	}).then([message](pplx::task<void> t)
+	{
+		replyOnException(message, t, U("INTERNAL ERROR: Screening request could not be received."));
+	});
+}
+
 // POST 
 // endpoints: /landmarks - Upload landmarks as json - (TODO returns info about validity of landmark set); params: processingToken, ethnicityCode
+//            /screen - Single-call screening; multipart/form-data body, no processingToken required (see handle_screen).
 //            /generateFASDreport - Generate FASD report (pdf format) with all data available at the server (uploaded or computed). Returns reportID string.
 void FaceScreenProcessor::handle_post(http_request message)
 {
-	ucout << message.to_string() << endl;
+	++serverMetrics::requestsPost;
+	logRequest(message);
 
-	const auto requestedFaceScreenObject = findFaceScreeningObject(message)->get();
-	ucout << (requestedFaceScreenObject ? U("Successfully retrieved facescreen object. (POST)") :
-		U("Facescreen object could not be retrieved. (POST)")) << endl;
+	const auto paths = uri::split_path(uri::decode(message.relative_uri().path()));
+	if (!paths.empty() && paths[0].compare(U("screen")) == 0) // Single-call screening does not require a processing token.
+	{
+		handle_screen(message);
+		return;
+	}
+
+	const auto requestedFaceScreenObject = findFaceScreeningObject(message).value_or(nullptr);
 	if (!requestedFaceScreenObject)
 	{
 		return;
 	}
 
 	// Case: Accept landmarks upload
-	const auto paths = uri::split_path(uri::decode(message.relative_uri().path()));
 	const utility::string_t path = paths[0];
 	
 	if (path.compare(U("subjectAge")) == 0)
@@ -755,7 +1820,7 @@ void FaceScreenProcessor::handle_post(http_request message)
 		const auto subjectAge = sanitizeSubjectAgeInput(message, subjectAgeQueryParam->second);				
 		if (!subjectAge)
 		{
-			ucout << U("Parameter subjectAge of invalid format or range.") << std::endl;
+			logWarning(requestedFaceScreenObject->processingToken) << "Parameter subjectAge of invalid format or range.";
 			return;
 		}
 		
@@ -782,11 +1847,13 @@ void FaceScreenProcessor::handle_post(http_request message)
 	
 	if (path.compare(U("landmarks")) == 0)
 	{
-		ucout << U("Processing landmarks upload...") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing landmarks upload...";
 		
 		// In case uploading new landmark set fails, as other computations depend on consistency.
+		requestedFaceScreenObject->cancelPrecomputation();
 		requestedFaceScreenObject->ethnicityCode.clear();
 		requestedFaceScreenObject->landmarks.clear();
+		requestedFaceScreenObject->landmarksChanged();
 
 		const auto query = uri::split_query(uri::decode(message.relative_uri().query()));
 		const auto ethnicityCodeQueryParam = query.find(U("ethnicityCode"));
@@ -796,7 +1863,7 @@ void FaceScreenProcessor::handle_post(http_request message)
 			return;
 		}
 
-		message.extract_json().then([&message, &requestedFaceScreenObject, &ethnicityCodeQueryParam, this](pplx::task<json::value> task) {
+		message.extract_json().then([message, requestedFaceScreenObject, ethnCode = ethnicityCodeQueryParam->second, this](pplx::task<json::value> task) {
 			try
 			{
 				auto const& landmarks = task.get();
@@ -810,14 +1877,13 @@ void FaceScreenProcessor::handle_post(http_request message)
 					if (identifiedLandmarkSetType.empty()) 
 					{
 						message_reply(status_codes::NotFound, U("Provided landmark set could not be decoded to a known landmark set type."));
-						std::cerr << "Parsing landmarks: No match of provided landmark set found in landmark set type database." << std::endl;
+						logWarning(requestedFaceScreenObject->processingToken) << "Parsing landmarks: No match of provided landmark set found in landmark set type database.";
 						return;
 					}
 
 					requestedFaceScreenObject->landmarkSetType = utility::conversions::to_utf8string(identifiedLandmarkSetType);
 
 					// Warning: Heatmap computation relies on consistently set ethnicityCode.
-					const auto ethnCode(ethnicityCodeQueryParam->second);
 					if (!modelDescriptors.has_object_field(ethnCode))
 					{
 						message_reply(status_codes::NotFound, U("No models available for provided ethnicity code ") + ethnCode);
@@ -835,7 +1901,8 @@ void FaceScreenProcessor::handle_post(http_request message)
 					modelDataDirs = supportedLandmarkSetsForModel[identifiedLandmarkSetType]; 
 
 					// Set ethnicity code only if landmark parsing was successful and landmark set was matched to a model.
-					requestedFaceScreenObject->ethnicityCode = utility::conversions::to_utf8string(ethnicityCodeQueryParam->second.c_str());
+					requestedFaceScreenObject->ethnicityCode = utility::conversions::to_utf8string(ethnCode);
+					startPrecomputation(requestedFaceScreenObject);
 					message_reply(status_codes::OK, identifiedLandmarkSetType);
 				}
 				else
@@ -845,15 +1912,17 @@ void FaceScreenProcessor::handle_post(http_request message)
 			}
 			catch (web::json::json_exception ex)
 			{
-				wcout << "ERROR Parsing JSON: " << ex.what();
+				logError(requestedFaceScreenObject->processingToken) << "ERROR Parsing JSON: " << ex.what();
 				message_reply(status_codes::BadRequest, U("Landmark data: JSON parsing error."));
 			}
 			catch (http_exception const& e)
 			{
-				wcout << e.what() << endl;
+				logError(requestedFaceScreenObject->processingToken) << e.what();
 				message_reply(status_codes::BadRequest, U("Landmark upload: HTTP error."));
 			}
-			}).wait();
+			}).then([message](pplx::task<void> t) {
+				replyOnException(message, t, U("INTERNAL ERROR: Landmark upload failed."));
+			});
 			return;
 	}
 
@@ -861,13 +1930,14 @@ void FaceScreenProcessor::handle_post(http_request message)
     // Passed by json: the following report metatdata : Camera ID, Patient ID, Scan_date, DOB, Gender, Classification result ?, 
 	if (path.compare(U("generateFASDreport")) == 0)
 	{
-		ucout << U("Generating partial FASD report...") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Generating partial FASD report...";
 
 		std::srand(std::time(nullptr));
 		std::string tempLatexDir("latexReportDir" + std::to_string(std::rand() * std::rand()));
 		const std::string tempLatexFilename("fasdReport.latex");
 
-		message.extract_json().then([&message, &requestedFaceScreenObject, &tempLatexDir, &tempLatexFilename, this](pplx::task<json::value> task) {
+		// Report generation (latex) runs on the compute pool.
+		message.extract_json().then([message, requestedFaceScreenObject, tempLatexDir, tempLatexFilename, this](pplx::task<json::value> task) {
 			try
 			{
 				auto const& reportInput = task.get();
@@ -891,10 +1961,12 @@ void FaceScreenProcessor::handle_post(http_request message)
 			}
 			catch (http_exception const& e)
 			{
-				wcout << e.what() << endl;
+				logError(requestedFaceScreenObject->processingToken) << e.what();
+				message_reply(status_codes::BadRequest, U("Report input: HTTP error."));
 			}
-			}).
-			wait();
+			}, m_computePool->taskOptions()).then([message](pplx::task<void> t) {
+				replyOnException(message, t, U("INTERNAL ERROR: PDF could not be generated."));
+			});
 			return;
 	}
 
@@ -917,11 +1989,10 @@ void FaceScreenProcessor::handle_post(http_request message)
 
 void FaceScreenProcessor::handle_put(http_request message)
 {
-	ucout << message.to_string() << endl;
+	++serverMetrics::requestsPut;
+	logRequest(message);
 
-	const auto requestedFaceScreenObject = findFaceScreeningObject(message)->get();
-	ucout << (requestedFaceScreenObject ? U("Successfully retrieved facescreen object (PUT).") :
-		U("Facescreen object could not be retrieved (PUT).")) << endl;
+	const auto requestedFaceScreenObject = findFaceScreeningObject(message).value_or(nullptr);
 	if (!requestedFaceScreenObject)
 	{
 		return;
@@ -932,121 +2003,93 @@ void FaceScreenProcessor::handle_put(http_request message)
 	const utility::string_t path = paths[0];
 	if (path.compare(U("objFile")) == 0)
 	{
-		ucout << U("Processing obj file upload.") << endl;
-		// This creates a temporary filename to store face meshes under till we found a way to make vtk read obj directly from the stream coming through the REST api
-		std::srand(std::time(nullptr));
-		std::string tempObjFilename("tempObjFile" + std::to_string(std::rand() * std::rand()) + ".obj");
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing obj file upload.";
 
-		message.extract_vector().then([&tempObjFilename](std::vector<unsigned char> inVec) {
-			//Is there a more direct way to extract the obj data, such as: message.body(). ... ?
-			ofstream fout(tempObjFilename, ios::out | ios::binary);
-			fout.write(reinterpret_cast<const char*>(&inVec[0]), inVec.size() * sizeof(char));
-			fout.close();
-
-			ucout << "wrote to file obj: " << tempObjFilename.c_str() << std::endl;
-		
-			}).then([&requestedFaceScreenObject, &message, &tempObjFilename]() {
-				//read obj file into vtk
-				vtkSmartPointer<vtkOBJReader> objReader = vtkSmartPointer<vtkOBJReader>::New();
-
-				objReader->SetFileName(tempObjFilename.c_str());
-				objReader->Update();
-				std::remove(tempObjFilename.c_str());
-
-				//TODO check validity of data, return non-OK message if not valid
-				try 
-				{
-					requestedFaceScreenObject->surfaceMesh = objReader->GetOutput();
-				}
-				catch (const std::exception& e) 
-				{ 
-					ucout << "A standard exception was caught when vtk reads obj file, with message."
-						<< e.what() << endl;
-					message_reply(status_codes::NotFound, U("An exception was thrown when reading obj file by vtk library."));
-					return;
-				}
-				}).wait();
-				
-		if (!requestedFaceScreenObject->surfaceMesh->GetNumberOfCells() > 0)
-		{
-			requestedFaceScreenObject->surfaceMesh = nullptr;
-			message_reply(status_codes::NotFound, U("Mesh could not be read."));			
-			return;		
-		}
-		ucout << "VTK objReader success." << endl;
-		message_reply(status_codes::OK, U("Mesh upload sucessful."));
+		requestedFaceScreenObject->cancelPrecomputation();
+		message.extract_vector().then([requestedFaceScreenObject, this](std::vector<unsigned char> inVec) {
+			const auto status = requestedFaceScreenObject->loadSurfaceMeshFromObj(inVec);
+			if (status.succeeded())
+			{
+				logInfo(requestedFaceScreenObject->processingToken) << "VTK objReader success.";
+				startPrecomputation(requestedFaceScreenObject);
+			}
+			return status;
+			}, m_computePool->taskOptions()).then([message](pplx::task<processingStatus> t) {
+				replyProcessingStatus(message, t, U("INTERNAL ERROR: Obj file upload failed."));
+			});
 		return;
 	}
 
 	if (path.compare(U("textureFile")) == 0)
 	{
-		ucout << U("Processing texture file upload.") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing texture file upload.";
 		
 		// This creates a temporary filename to store face textures under till we found a way to make vtk read textures directly from the stream coming through the REST api
 
 		std::srand(std::time(nullptr));
 		std::string tempTextureFilename("tempFaceTextureFile" + std::to_string(std::rand() * std::rand()) + ".png");
 		
-		message.extract_vector().then([&tempTextureFilename](std::vector<unsigned char> inVec) {
+		message.extract_vector().then([requestedFaceScreenObject, tempTextureFilename](std::vector<unsigned char> inVec) -> processingStatus {
 			ofstream fout(tempTextureFilename, ios::out | ios::binary);
-			fout.write(reinterpret_cast<const char*>(&inVec[0]), inVec.size() * sizeof(char));
+			fout.write(reinterpret_cast<const char*>(inVec.data()), inVec.size() * sizeof(char));
 			fout.close();
 
-			ucout << "wrote texture to file: " << tempTextureFilename.c_str() << std::endl;
-			}).then([&requestedFaceScreenObject, &message, &tempTextureFilename]() {			
-				requestedFaceScreenObject->facialTexture = vtkTexture::New();
-				if (!requestedFaceScreenObject->facialTexture)
-				{
-					ucout << U("Could not allocate texture.") << endl;
-					message_reply(status_codes::InternalError, U("Could not allocate texture."));
-					std::remove(tempTextureFilename.c_str());
-					return;
-				}
-				vtkNew<vtkPNGReader> imageReaderPng;
-				vtkNew<vtkJPEGReader> imageReaderJpeg;
-				const auto fileIsReadablePng = imageReaderPng->CanReadFile(tempTextureFilename.c_str());
-				const auto fileIsReadableJpg = imageReaderJpeg->CanReadFile(tempTextureFilename.c_str());
-				if (!fileIsReadablePng && !fileIsReadableJpg)
-				{
-					ucout << U("Reading texture: no jpeg or png!") << endl;
-					message_reply(status_codes::BadRequest, U("The image file uploaded cannot be read: no jpeg or png."));
-					std::remove(tempTextureFilename.c_str());
-					return;
-				}
-				if (fileIsReadableJpg)
-				{ 
-					ucout << U("Reading JPG texture ... ") << endl;
-					imageReaderJpeg->SetFileName(tempTextureFilename.c_str());
-					imageReaderJpeg->Update();
-					requestedFaceScreenObject->facialTexture->SetInputData((vtkDataObject*)imageReaderJpeg->GetOutput());
-				}
-				if (fileIsReadablePng)
-				{
-					ucout << U("Reading PNG texture ... ") << endl;
-					imageReaderPng->SetFileName(tempTextureFilename.c_str());
-					imageReaderPng->Update();
-					const auto textr = (vtkDataObject*)imageReaderPng->GetOutput();
-					requestedFaceScreenObject->facialTexture->SetInputData(textr);
-				}
+			logDebug(requestedFaceScreenObject->processingToken) << "wrote texture to file: " << tempTextureFilename;
+
+			requestedFaceScreenObject->facialTexture = vtkTexture::New();
+			if (!requestedFaceScreenObject->facialTexture)
+			{
+				logError(requestedFaceScreenObject->processingToken) << "Could not allocate texture.";
+				std::remove(tempTextureFilename.c_str());
+				return { status_codes::InternalError, U("Could not allocate texture.") };
+			}
+			vtkNew<vtkPNGReader> imageReaderPng;
+			vtkNew<vtkJPEGReader> imageReaderJpeg;
+			const auto fileIsReadablePng = imageReaderPng->CanReadFile(tempTextureFilename.c_str());
+			const auto fileIsReadableJpg = imageReaderJpeg->CanReadFile(tempTextureFilename.c_str());
+			if (!fileIsReadablePng && !fileIsReadableJpg)
+			{
+				logWarning(requestedFaceScreenObject->processingToken) << "Reading texture: no jpeg or png!";
 				std::remove(tempTextureFilename.c_str());
-			}).wait();
+				return { status_codes::BadRequest, U("The image file uploaded cannot be read: no jpeg or png.") };
+			}
+			if (fileIsReadableJpg)
+			{ 
+				logDebug(requestedFaceScreenObject->processingToken) << "Reading JPG texture ... ";
+				imageReaderJpeg->SetFileName(tempTextureFilename.c_str());
+				imageReaderJpeg->Update();
+				requestedFaceScreenObject->facialTexture->SetInputData((vtkDataObject*)imageReaderJpeg->GetOutput());
+			}
+			if (fileIsReadablePng)
+			{
+				logDebug(requestedFaceScreenObject->processingToken) << "Reading PNG texture ... ";
+				imageReaderPng->SetFileName(tempTextureFilename.c_str());
+				imageReaderPng->Update();
+				const auto textr = (vtkDataObject*)imageReaderPng->GetOutput();
+				requestedFaceScreenObject->facialTexture->SetInputData(textr);
+			}
+			std::remove(tempTextureFilename.c_str());
 			//requestedFaceScreenObject->debugViz(requestedFaceScreenObject->surfaceMesh, requestedFaceScreenObject->facialTexture);
-			message_reply(status_codes::OK, U("Texture successfully uploaded"));
+			return { status_codes::OK, U("Texture successfully uploaded") };
+			}, m_computePool->taskOptions()).then([message](pplx::task<processingStatus> t) {
+				replyProcessingStatus(message, t, U("INTERNAL ERROR: Texture upload failed."));
+			});
 			return;
 	}
 
 	if (path.compare(U("Bellus3DzipArchive")) == 0)
 	{
-		ucout << U("Processing Bellus3D data: mesh and texture upload.") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing Bellus3D data: mesh and texture upload.";
 
 		std::srand(std::time(nullptr));
 		std::string tempBellusArchiveFilename("tempBellus3DArchiveFile" + std::to_string(std::rand() * std::rand()) + ".zip");
 
-		message.extract_vector().then([&tempBellusArchiveFilename](std::vector<unsigned char> inVec) {
-			ofstream fout(tempBellusArchiveFilename, ios::out | ios::binary);
-			fout.write(reinterpret_cast<const char*>(&inVec[0]), inVec.size() * sizeof(char));
-			fout.close();
-			}).then([&requestedFaceScreenObject, &message, &tempBellusArchiveFilename]() {
+		requestedFaceScreenObject->cancelPrecomputation();
+		message.extract_vector().then([requestedFaceScreenObject, tempBellusArchiveFilename, this](std::vector<unsigned char> inVec) -> processingStatus {
+				ofstream fout(tempBellusArchiveFilename, ios::out | ios::binary);
+				fout.write(reinterpret_cast<const char*>(inVec.data()), inVec.size() * sizeof(char));
+				fout.close();
+
 				// 1.) Unpack zip archive: Use seperate process or zlib cpp wrapper?
 				// 2.) Load jpg texture
 				// 3.) Load obj mesh
@@ -1060,13 +2103,14 @@ void FaceScreenProcessor::handle_put(http_request message)
 				filesystem::path tempBellus3DmeshFile(tempBellus3Ddir / "head3d.obj");
 				filesystem::path tempBellus3DtextureFile(tempBellus3Ddir / "head3d.jpg");
 
+				processingStatus status{ status_codes::OK, U("Successfully extracted head3d.obj and head3d.jpg.") };
+
 				requestedFaceScreenObject->facialTexture = vtkTexture::New();
 				vtkNew<vtkJPEGReader> imageReader;
 				const auto fileIsReadable = imageReader->CanReadFile(tempBellus3DtextureFile.u8string().c_str());
 				if (!fileIsReadable)
 				{
-					message_reply(status_codes::BadRequest, U("The jpeg image file uploaded with the Bellus3D archive cannot be read."));
-					// TODO: need to catch ?	
+					status = { status_codes::BadRequest, U("The jpeg image file uploaded with the Bellus3D archive cannot be read.") };
 				}
 				else
 				{
@@ -1084,26 +2128,32 @@ void FaceScreenProcessor::handle_put(http_request message)
 				}
 				catch (const std::exception& e) 
 				{
-					ucout << "A standard exception was caught when vtk reads Bellus3D obj file: "
-						<< e.what() << endl;
-					message_reply(status_codes::NotFound, U("An exception was thrown when reading Bellus3D mesh (obj) file by vtk library."));
+					logError(requestedFaceScreenObject->processingToken) << "A standard exception was caught when vtk reads Bellus3D obj file: "
+						<< e.what();
+					requestedFaceScreenObject->surfaceMesh = nullptr;
+					status = { status_codes::NotFound, U("An exception was thrown when reading Bellus3D mesh (obj) file by vtk library.") };
 				}
 
 				std::remove(tempBellus3DmeshFile.u8string().c_str());
 				std::remove(tempBellus3DtextureFile.u8string().c_str());
 				std::remove(tempBellusArchiveFilename.c_str());
 				std::filesystem::remove_all(tempBellus3Ddir); // dir for uncompressing
-				}).wait();
 				// requestedFaceScreenObject->debugViz(requestedFaceScreenObject->surfaceMesh, requestedFaceScreenObject->facialTexture);
 				
-				if (!requestedFaceScreenObject->surfaceMesh->GetNumberOfCells() > 0)
+				if (requestedFaceScreenObject->surfaceMesh != nullptr && !(requestedFaceScreenObject->surfaceMesh->GetNumberOfCells() > 0))
 				{
 					requestedFaceScreenObject->surfaceMesh = nullptr;
-					message_reply(status_codes::NotFound, U("Could not read mesh file head3d.obj."));				
-					return;
+					status = { status_codes::NotFound, U("Could not read mesh file head3d.obj.") };
 				}
-				
-				message_reply(status_codes::OK, U("Successfully extracted head3d.obj and head3d.jpg."));
+				requestedFaceScreenObject->meshChanged();
+				if (requestedFaceScreenObject->surfaceMesh != nullptr)
+				{
+					startPrecomputation(requestedFaceScreenObject);
+				}
+				return status;
+				}, m_computePool->taskOptions()).then([message](pplx::task<processingStatus> t) {
+					replyProcessingStatus(message, t, U("INTERNAL ERROR: Bellus3D archive upload failed."));
+				});
 				return;
 	}
 
@@ -1112,10 +2162,10 @@ void FaceScreenProcessor::handle_put(http_request message)
 	// nasion interpolation on request by param.
 	if (path.compare(U("BellusFaceLandmarksToJSON")) == 0)
 	{
-		ucout << U("Processing Bellus3D data: Convert facial landmarks in yaml format to json where key is landmark name. Interpolate nasion landmark.") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing Bellus3D data: Convert facial landmarks in yaml format to json where key is landmark name. Interpolate nasion landmark.";
 
 		//message.extract_string().then([&requestedFaceScreenObject, &message](std::wstring bellusLandmarksYaml) {
-		message.extract_vector().then([&requestedFaceScreenObject, &message](std::vector<unsigned char> bellusLandmarksYaml) {
+		message.extract_vector().then([requestedFaceScreenObject, message](std::vector<unsigned char> bellusLandmarksYaml) {
 			
 			web::json::value jsonLandmarks;
 			
@@ -1126,7 +2176,7 @@ void FaceScreenProcessor::handle_put(http_request message)
 			const auto numberOfConvertedLandmarks = jsonLandmarks.size();
 			if (!(numberOfConvertedLandmarks > 0))
 			{
-				ucout << "Bellus YAML face landmarks could not be converted to JSON." << std::endl;
+				logWarning(requestedFaceScreenObject->processingToken) << "Bellus YAML face landmarks could not be converted to JSON.";
 				message_reply(status_codes::BadRequest, U("Bellus YAML face landmarks could not be converted to JSON."));
 				return;
 			}
@@ -1138,14 +2188,14 @@ void FaceScreenProcessor::handle_put(http_request message)
 				// Check if facial mesh available for interpolating nasion. If not, return.
 				if (requestedFaceScreenObject->surfaceMesh == nullptr)
 				{
-					ucout << "Bellus3D facial landmark yaml data cannot be converted to json: Facial mesh missing for nasion interpolation." << std::endl;
+					logWarning(requestedFaceScreenObject->processingToken) << "Bellus3D facial landmark yaml data cannot be converted to json: Facial mesh missing for nasion interpolation.";
 					message_reply(status_codes::BadRequest, U("Bellus3D facial landmark yaml data cannot be converted to json: Facial mesh missing for nasion interpolation."));
 					return;
 				}
 				
 				if (!bellusLandmarksProcessing::interpolateNasion(message, jsonLandmarks, requestedFaceScreenObject->surfaceMesh))
 				{
-					ucout << "Bellus3D facial landmark yaml data: Facial mesh is available, but interpolatino of nasion landmark still failed." << std::endl;
+					logWarning(requestedFaceScreenObject->processingToken) << "Bellus3D facial landmark yaml data: Facial mesh is available, but interpolatino of nasion landmark still failed.";
 					message_reply(status_codes::BadRequest, U("Bellus3D facial landmark yaml data: Facial mesh is available, but interpolatino of nasion landmark still failed."));
 					return;
 				}
@@ -1163,16 +2213,18 @@ void FaceScreenProcessor::handle_put(http_request message)
 
 			message_reply(status_codes::OK, jsonLandmarks.serialize());
 
-			}).wait();
+			}, m_computePool->taskOptions()).then([message](pplx::task<void> t) {
+				replyOnException(message, t, U("INTERNAL ERROR: Bellus3D face landmarks could not be converted."));
+			});
 			return;
 	}
 
 	// only extracts the 4 ear landmarks (2 on each side) of inteterst to typical models
 	if (path.compare(U("BellusEarLandmarksToJSON")) == 0)
 	{
-		ucout << U("Processing Bellus3D data: Convert ear landmarks in yaml format to json where key is landmark name.") << endl;
+		logInfo(requestedFaceScreenObject->processingToken) << "Processing Bellus3D data: Convert ear landmarks in yaml format to json where key is landmark name.";
 
-		message.extract_vector().then([&requestedFaceScreenObject, &message](std::vector<unsigned char> bellusLandmarksYaml) {
+		message.extract_vector().then([message](std::vector<unsigned char> bellusLandmarksYaml) {
 
 			web::json::value jsonLandmarks;
 			if (!bellusLandmarksProcessing::convertBellusEarYamlToJson(message, std::string(bellusLandmarksYaml.begin(), bellusLandmarksYaml.end()), jsonLandmarks))
@@ -1187,7 +2239,9 @@ void FaceScreenProcessor::handle_put(http_request message)
 			}
 
 			message_reply(status_codes::OK, jsonLandmarks.serialize());
-			}).wait();
+			}).then([message](pplx::task<void> t) {
+				replyOnException(message, t, U("INTERNAL ERROR: Bellus3D ear landmarks could not be converted."));
+			});
 			return;
 	}
 
@@ -1196,10 +2250,9 @@ void FaceScreenProcessor::handle_put(http_request message)
 
 void FaceScreenProcessor::handle_delete(http_request message)
 {
-	ucout << message.to_string() << endl;
-	const auto requestedFaceScreenObject = findFaceScreeningObject(message)->get();
-	ucout << (requestedFaceScreenObject ? U("Successfully retrieved facescreen object (DEL).") :
-		U("Facescreen object could not be retrieved (DEL).")) << endl;
+	++serverMetrics::requestsDelete;
+	logRequest(message);
+	const auto requestedFaceScreenObject = findFaceScreeningObject(message).value_or(nullptr);
 	if (!requestedFaceScreenObject)
 	{
     	http_response response(status_codes::NotFound);
@@ -1225,6 +2278,8 @@ void FaceScreenProcessor::handle_delete(http_request message)
 			// THis should not happen, as findFaceScreeningObject would have failed already.
 		}
 	
+		// Computations still running for this token stop at their next cancellation check, replying 410 (Gone).
+		requestedFaceScreenObject->sessionCancellation->cancel();
 		faceScreeningObjects.erase(processingTokenQueryParam->second);
 
     	http_response response(status_codes::OK);
@@ -3,11 +3,19 @@
 #include <cpprest/json.h>
 
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 
 #include "faceScreeningObject.h"
+#include "subjectClassification/splitModelStore.h"
+#include "utils/computePool.h"
+#include "utils/instrumentedMutex.h"
+#include "utils/requestTrace.h"
+#include "utils/resultCache.h"
+#include "utils/trafficCapture.h"
 
 using namespace std;
 using namespace web;
@@ -22,7 +30,8 @@ public:
 	FaceScreenProcessor(utility::string_t url, const string_t& faceModelDBfile);
 
 	pplx::task<void> open() { return m_listener.open(); }
-	pplx::task<void> close() { return m_listener.close(); }
+	// Stops listening, then closes the traffic capture (if enabled).
+	pplx::task<void> close();
 
 private:
 	void handle_options(http_request request);
@@ -31,6 +40,20 @@ private:
 	void handle_post(http_request message);
 	void handle_delete(http_request message);
 
+	// Returns listener callback running handler, after recording the request if traffic capture is enabled.
+	std::function<void(http_request)> captured(void (FaceScreenProcessor::*handler)(http_request));
+
+	// Runs handler on message, with a request trace active if the request is traced.
+	void dispatch(void (FaceScreenProcessor::*handler)(http_request), http_request message);
+
+	// Starts a trace of message if requested by query parameter trace=1 or sampled (see traceSampleRate). Returns nullptr otherwise,
+	// and always if no trace directory is configured. The request span ends when the response has been sent.
+	std::shared_ptr<RequestTrace> startRequestTrace(const http_request& message);
+
+	// Handles POST on /screen: Single-call screening of a subject submitted as multipart/form-data, without requiring a processing token.
+	// Parsing, heatmap computation, classification of all requested facial regions and PFL are pipelined within the server and returned as one json response.
+	void handle_screen(http_request message);
+
 	// Reads configuration values from a file named faceScreenServerConfig.json located in the same directory as server binary.
 	void readFaceScreenServerConfig();
 	
@@ -45,10 +68,62 @@ private:
 	//Returns with http error response if no token in message or no faceScreeningObject with specified token exists.
 	std::optional<std::shared_ptr<FaceScreeningObject>> findFaceScreeningObject(const http_request& message);
 
+	// Starts precomputing what does not depend on subject age (see Precomputation): the projection of the mesh onto the face model for heatmaps
+	// and the classifications of all facial regions, as low-priority tasks on the compute pool, once mesh, landmarks and ethnicity code of subject
+	// are present. Results go to the result cache, hence nothing is precomputed without it.
+	void startPrecomputation(const std::shared_ptr<FaceScreeningObject>& subject);
+
+	// Looks up paths to split and unsplit models (as configured in modelDB.json) for an ethnicity code and landmark set type.
+	// Returns empty optional if no models are available for this combination.
+	std::optional<web::json::value> resolveModelDataDirs(const utility::string_t& ethnicityCode, const utility::string_t& landmarkSetType) const;
+
 	http_listener m_listener;
 
 	utility::nonce_generator m_processingToken_generator;
 
+	// Threads running CPU-heavy processing stages, so that threads serving network I/O never block on computations. The shared pool of the process
+	// (see ComputePool::shared), which also runs the parallel loops within stages. Created after reading the server config.
+	std::shared_ptr<ComputePool> m_computePool;
+
+	// Number of threads of m_computePool. 0 selects number of hardware threads.
+	unsigned int numberOfComputeThreads = 0;
+
+	// Results (projections, heatmaps, classifications) shared across processing sessions. nullptr if disabled in server config.
+	std::shared_ptr<ResultCache> m_resultCache;
+
+	// Capacity of in-memory tier of m_resultCache. 0 disables the result cache.
+	unsigned int resultCacheMegabytes = 256;
+
+	// Root directory of on-disk tier of m_resultCache. Empty: in-memory tier only.
+	std::filesystem::path resultCacheDirectory;
+
+	// Split models of the facial regions, loaded once and shared by all classifications.
+	std::shared_ptr<SplitModelStore> m_splitModelStore = std::make_shared<SplitModelStore>();
+
+	// Whether results are precomputed after uploads (startPrecomputation).
+	bool precomputeOnUpload = true;
+
+	// Records requests for replay by faceScreenReplay. nullptr unless a capture file is set in server config.
+	std::shared_ptr<TrafficCapture> m_trafficCapture;
+
+	// Capture file of m_trafficCapture. Empty: traffic capture disabled.
+	std::filesystem::path captureFile;
+
+	// Whether m_trafficCapture stores request bodies (patient data!) or their digests only.
+	bool captureBodies = false;
+
+	// Minimum level of log records: debug, info, warning or error.
+	std::string logLevelName = "info";
+
+	// Destination of log records. Empty: stdout.
+	std::filesystem::path logFile;
+
+	// Directory request traces (Chrome trace event json) are written to. Empty: tracing disabled.
+	std::filesystem::path traceDirectory;
+
+	// Fraction of requests traced without query parameter trace=1, between 0 and 1.
+	double traceSampleRate = 0.0;
+
 	// Unique processing token returned by server upon request by GET on /. 
 	int nextProcessingToken = 0; //TODO: Permit this in debug mode only, use nonce otherwise.
 
@@ -56,7 +131,7 @@ private:
 	map<utility::string_t, std::shared_ptr<FaceScreeningObject>> faceScreeningObjects; 
 
 	// Mutex for faceScreeningObjects ... to be used when requesting new processingTokens while potentially deleting older faceScreeningObjects
-	std::mutex faceScreeningObjects_mutex;
+	InstrumentedMutex faceScreeningObjects_mutex{ "faceScreeningObjects" };
 	
 	// Map: reportID token to pdf file. Used for retrieving FASD reports.
 	map<utility::string_t, std::string> faceScreeningPDFreports; 
@@ -0,0 +1,533 @@
+// Deterministic replay of traffic recorded by the server (see utils/trafficCapture.h), for reproducing performance problems seen in production.
+//
+// Invocation: faceScreenReplay [capture file] [server URL | path to modelDB.json] [speedup] [results.json] [baseline results.json]
+//
+// Target is a running server (URL, e.g., http://localhost:34568/faceScreen/processor/) or, given the path to modelDB.json, a server started
+// within this process at http://127.0.0.1:34599/faceScreen/processor/ (configured by faceScreenServerConfig.json in the working directory).
+// Requests are grouped into processing sessions. Sessions run concurrently, requests of a session one after the other, each request not before
+// its original time divided by speedup (default 1: original pace; 0: as fast as possible). Processing tokens issued during replay are substituted
+// for the captured ones. Requests whose body was not stored in the capture are sent without body (and will fail).
+// Reported per endpoint: requests, status codes differing from the capture, and p50/p95 latency of capture and replay.
+// Results of all requests (status, latency, digest of response body) are written to results.json (optional). Given the results of a previous
+// replay of the same capture, e.g., with an earlier build, latencies are compared and any request with a different status or response body is
+// listed. Exits with failure if outputs differ from the baseline.
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "faceScreenProcessor.h"
+#include "toolUtilities.h"
+#include "utils/sha256.h"
+#include "utils/zstr/zstr.hpp"
+
+namespace {
+
+struct capturedRequest
+{
+	size_t index = 0; // position in capture, ordered by time of receipt
+	double t = 0.0;
+	utility::string_t method;
+	utility::string_t path;
+	utility::string_t query;
+	utility::string_t contentType;
+	utility::string_t deadline;
+	size_t bodyBytes = 0;
+	std::optional<std::vector<unsigned char>> body;
+	int status = 0;
+	double latencyMs = 0.0;
+	utility::string_t processingToken; // as captured, empty if none in query
+
+	bool issuesProcessingToken() const { return method == web::http::methods::GET && endpointPath() == U("processingToken"); }
+
+	utility::string_t endpointPath() const
+	{
+		const auto paths = web::uri::split_path(web::uri::decode(path));
+		return paths.empty() ? utility::string_t() : paths[0];
+	}
+
+	std::string endpoint() const { return utility::conversions::to_utf8string(method + U(" ") + endpointPath()); }
+};
+
+struct replayResult
+{
+	bool replayed = false;
+	int status = 0;
+	double latencyMs = 0.0;
+	std::string responseSha256; // empty for processingToken (nonce)
+	size_t responseBytes = 0;
+};
+
+// Requests of one processing session, in order. The request issuing the processing token comes first, if it was captured.
+struct session
+{
+	std::vector<const capturedRequest*> requests;
+	bool requestsProcessingToken = false; // Session started before capture: a token is requested first (not reported).
+};
+
+std::optional<std::vector<capturedRequest>> readCapture(const std::filesystem::path& captureFile)
+{
+	std::vector<capturedRequest> requests;
+	try
+	{
+		zstr::ifstream in(captureFile.string());
+		std::string line;
+		if (!std::getline(in, line) || !web::json::value::parse(utility::conversions::to_string_t(line)).has_field(U("faceScreenCapture")))
+		{
+			std::cerr << "File " << captureFile << " is not a capture file." << std::endl;
+			return {};
+		}
+		while (std::getline(in, line))
+		{
+			if (line.empty())
+			{
+				continue;
+			}
+			const auto entry = web::json::value::parse(utility::conversions::to_string_t(line));
+			capturedRequest request;
+			request.t = entry.at(U("t")).as_double();
+			request.method = entry.at(U("method")).as_string();
+			request.path = entry.at(U("path")).as_string();
+			request.query = entry.at(U("query")).as_string();
+			request.contentType = entry.has_string_field(U("contentType")) ? entry.at(U("contentType")).as_string() : utility::string_t();
+			request.deadline = entry.has_string_field(U("deadline")) ? entry.at(U("deadline")).as_string() : utility::string_t();
+			request.bodyBytes = entry.at(U("bodyBytes")).as_number().to_uint64();
+			if (entry.has_string_field(U("body")))
+			{
+				request.body = utility::conversions::from_base64(entry.at(U("body")).as_string());
+			}
+			request.status = entry.at(U("status")).as_integer();
+			request.latencyMs = entry.at(U("latencyMs")).as_double();
+			const auto query = web::uri::split_query(web::uri::decode(request.query));
+			const auto token = query.find(U("processingToken"));
+			if (token != query.end())
+			{
+				request.processingToken = token->second;
+			}
+			requests.push_back(std::move(request));
+		}
+	}
+	catch (const std::exception& ex) // strict_fstream::Exception, json_exception, truncated gzip stream
+	{
+		if (requests.empty())
+		{
+			std::cerr << "Capture file " << captureFile << " cannot be read: " << ex.what() << std::endl;
+			return {};
+		}
+		std::cerr << "Capture file " << captureFile << " truncated after " << requests.size() << " requests: " << ex.what() << std::endl;
+	}
+
+	std::stable_sort(requests.begin(), requests.end(), [](const auto& r1, const auto& r2) { return r1.t < r2.t; });
+	for (size_t i = 0; i < requests.size(); ++i)
+	{
+		requests[i].index = i;
+	}
+	return requests;
+}
+
+// Groups requests into sessions by processing token. Processing tokens are nonces, so any successful token request preceding the first use
+// of a token can stand in for the one that issued it. Requests without token (e.g., /screen, failed token requests) are sessions of their own.
+std::vector<session> groupSessions(const std::vector<capturedRequest>& requests)
+{
+	std::vector<session> sessions;
+	std::map<utility::string_t, size_t> sessionOfToken;
+	std::deque<const capturedRequest*> unusedTokenRequests;
+	for (const auto& request : requests)
+	{
+		if (request.issuesProcessingToken() && request.status == web::http::status_codes::OK)
+		{
+			unusedTokenRequests.push_back(&request);
+			continue;
+		}
+		if (request.processingToken.empty())
+		{
+			sessions.push_back({ { &request }, false });
+			continue;
+		}
+		auto found = sessionOfToken.find(request.processingToken);
+		if (found == sessionOfToken.end())
+		{
+			session newSession;
+			if (unusedTokenRequests.empty())
+			{
+				newSession.requestsProcessingToken = true;
+			}
+			else
+			{
+				newSession.requests.push_back(unusedTokenRequests.front());
+				unusedTokenRequests.pop_front();
+			}
+			found = sessionOfToken.emplace(request.processingToken, sessions.size()).first;
+			sessions.push_back(std::move(newSession));
+		}
+		sessions[found->second].requests.push_back(&request);
+	}
+	for (const auto request : unusedTokenRequests)
+	{
+		sessions.push_back({ { request }, false });
+	}
+	std::sort(sessions.begin(), sessions.end(), [](const auto& s1, const auto& s2) { return s1.requests.front()->t < s2.requests.front()->t; });
+	return sessions;
+}
+
+// Returns query with the value of parameter processingToken replaced by token.
+utility::string_t substituteProcessingToken(const utility::string_t& query, const utility::string_t& token)
+{
+	utility::string_t substituted;
+	std::basic_istringstream<utility::char_t> parameters(query);
+	utility::string_t parameter;
+	while (std::getline(parameters, parameter, U('&')))
+	{
+		if (parameter.rfind(U("processingToken="), 0) == 0)
+		{
+			parameter = U("processingToken=") + web::uri::encode_data_string(token);
+		}
+		substituted += (substituted.empty() ? U("") : U("&")) + parameter;
+	}
+	return substituted;
+}
+
+class sessionReplay
+{
+public:
+	sessionReplay(const utility::string_t& serverUrl, const session& replayedSession, std::chrono::steady_clock::time_point start, double speedup,
+		std::vector<replayResult>& results)
+		: client(serverUrl, clientConfig())
+		, replayedSession(replayedSession)
+		, start(start)
+		, speedup(speedup)
+		, results(results)
+	{}
+
+	void run()
+	{
+		if (replayedSession.requestsProcessingToken)
+		{
+			try
+			{
+				processingToken = client.request(web::http::methods::GET, U("processingToken")).get().extract_string().get();
+			}
+			catch (const std::exception& ex)
+			{
+				std::cerr << "Processing token cannot be requested: " << ex.what() << std::endl;
+			}
+		}
+		for (const auto request : replayedSession.requests)
+		{
+			if (speedup > 0.0)
+			{
+				std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(request->t / speedup)));
+			}
+			results[request->index] = replay(*request);
+		}
+	}
+
+private:
+	static web::http::client::http_client_config clientConfig()
+	{
+		web::http::client::http_client_config config;
+		config.set_timeout(std::chrono::seconds(300));
+		return config;
+	}
+
+	replayResult replay(const capturedRequest& request)
+	{
+		web::http::http_request message(request.method);
+		web::uri_builder uri;
+		uri.set_path(request.path);
+		uri.set_query(request.processingToken.empty() ? request.query : substituteProcessingToken(request.query, processingToken));
+		message.set_request_uri(uri.to_uri());
+		if (!request.deadline.empty())
+		{
+			message.headers().add(U("X-Deadline-Ms"), request.deadline);
+		}
+		if (request.body)
+		{
+			message.set_body(*request.body);
+			if (!request.contentType.empty())
+			{
+				message.headers().set_content_type(request.contentType);
+			}
+		}
+
+		replayResult result;
+		result.replayed = true;
+		const auto sent = std::chrono::steady_clock::now();
+		try
+		{
+			const auto response = client.request(message).get();
+			result.status = response.status_code();
+			const auto body = response.extract_vector().get();
+			result.latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+			result.responseBytes = body.size();
+			if (request.issuesProcessingToken())
+			{
+				if (result.status == web::http::status_codes::OK)
+				{
+					processingToken = utility::conversions::to_string_t(std::string(body.cbegin(), body.cend()));
+				}
+			}
+			else
+			{
+				result.responseSha256 = Sha256().update(body.data(), body.size()).hexDigest();
+			}
+		}
+		catch (const std::exception& ex)
+		{
+			result.latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+			std::cerr << request.endpoint() << ": " << ex.what() << std::endl;
+		}
+		return result;
+	}
+
+	web::http::client::http_client client;
+	const session& replayedSession;
+	const std::chrono::steady_clock::time_point start;
+	const double speedup;
+	std::vector<replayResult>& results; // by index of request, each element written by one session only
+	utility::string_t processingToken;
+};
+
+double quantile(std::vector<double> values, const double q)
+{
+	if (values.empty())
+	{
+		return 0.0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, static_cast<size_t>(q * static_cast<double>(values.size() - 1) + 0.5))];
+}
+
+web::json::value toJson(const capturedRequest& request, const replayResult& result)
+{
+	web::json::value json = web::json::value::object();
+	json[U("index")] = web::json::value::number(static_cast<uint64_t>(request.index));
+	json[U("endpoint")] = web::json::value::string(utility::conversions::to_string_t(request.endpoint()));
+	json[U("capturedStatus")] = web::json::value::number(request.status);
+	json[U("capturedLatencyMs")] = web::json::value::number(request.latencyMs);
+	json[U("status")] = web::json::value::number(result.status);
+	json[U("latencyMs")] = web::json::value::number(result.latencyMs);
+	json[U("responseBytes")] = web::json::value::number(static_cast<uint64_t>(result.responseBytes));
+	json[U("responseSha256")] = web::json::value::string(utility::conversions::to_string_t(result.responseSha256));
+	return json;
+}
+
+} // unnamed namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Invocation : " << argv[0] << " [capture file] [server URL | path to modelDB.json] [speedup] [results.json] [baseline results.json]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::filesystem::path captureFile(argv[1]);
+	const std::string target(argv[2]);
+	double speedup = 1.0;
+	try
+	{
+		if (argc >= 4)
+		{
+			speedup = std::max(0.0, std::stod(argv[3]));
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "faceScreenReplay Error: Speedup - argument invalid. " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	const std::filesystem::path resultsFile((argc >= 5) ? argv[4] : "");
+	const std::filesystem::path baselineFile((argc >= 6) ? argv[5] : "");
+
+	const auto requests = readCapture(captureFile);
+	if (!requests || requests->empty())
+	{
+		std::cerr << "No requests to replay. Exiting ..." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const auto sessions = groupSessions(*requests);
+	const auto missingBodies = std::count_if(requests->cbegin(), requests->cend(), [](const auto& request) { return request.bodyBytes > 0 && !request.body; });
+	std::cout << "faceScreenReplay: " << requests->size() << " requests in " << sessions.size() << " sessions, speedup " << speedup << std::endl;
+	if (missingBodies > 0)
+	{
+		std::cout << "Bodies of " << missingBodies << " requests were not stored in the capture (server config captureBodies). These requests are sent without body." << std::endl;
+	}
+
+	// In-process target: server on loopback, sharing nothing with the replaying clients but the process.
+	std::unique_ptr<FaceScreenProcessor> inProcessServer;
+	utility::string_t serverUrl = utility::conversions::to_string_t(target);
+	if (target.rfind("http", 0) != 0)
+	{
+		serverUrl = U("http://127.0.0.1:34599/faceScreen/processor/");
+		inProcessServer = std::make_unique<FaceScreenProcessor>(serverUrl, utility::conversions::to_string_t(target));
+		try
+		{
+			inProcessServer->open().wait();
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << "In-process server cannot be started: " << ex.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Sessions are started at the time of their first request, so that concurrency follows the capture.
+	std::vector<replayResult> results(requests->size());
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> sessionThreads;
+	for (const auto& replayedSession : sessions)
+	{
+		if (speedup > 0.0)
+		{
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double, std::milli>(replayedSession.requests.front()->t / speedup)));
+		}
+		sessionThreads.emplace_back([&]()
+		{
+			sessionReplay(serverUrl, replayedSession, start, speedup, results).run();
+		});
+	}
+	for (auto& sessionThread : sessionThreads)
+	{
+		sessionThread.join();
+	}
+	const auto elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (inProcessServer)
+	{
+		inProcessServer->close().wait();
+	}
+
+	// Baseline results of an earlier replay, by index of request.
+	std::map<uint64_t, web::json::value> baseline;
+	if (!baselineFile.empty())
+	{
+		const auto baselineJson = readJsonFile(baselineFile);
+		if (!baselineJson || !baselineJson->has_array_field(U("requests")))
+		{
+			std::cerr << "Baseline file " << baselineFile << " cannot be read." << std::endl;
+			return EXIT_FAILURE;
+		}
+		for (const auto& request : baselineJson->at(U("requests")).as_array())
+		{
+			baseline[request.at(U("index")).as_number().to_uint64()] = request;
+		}
+	}
+
+	struct endpointLatencies
+	{
+		std::vector<double> captured, replayed, baseline;
+		size_t statusMismatches = 0;
+		size_t outputMismatches = 0;
+	};
+	std::map<std::string, endpointLatencies> endpoints;
+	web::json::value requestsJson = web::json::value::array();
+	web::json::value outputMismatchesJson = web::json::value::array();
+	size_t numberOfReplayed = 0;
+	for (const auto& request : *requests)
+	{
+		const auto& result = results[request.index];
+		if (!result.replayed)
+		{
+			continue;
+		}
+		auto& latencies = endpoints[request.endpoint()];
+		latencies.captured.push_back(request.latencyMs);
+		latencies.replayed.push_back(result.latencyMs);
+		latencies.statusMismatches += (result.status != request.status) ? 1 : 0;
+		requestsJson[numberOfReplayed++] = toJson(request, result);
+
+		const auto baselineRequest = baseline.find(request.index);
+		if (baselineRequest != baseline.end())
+		{
+			latencies.baseline.push_back(baselineRequest->second.at(U("latencyMs")).as_double());
+			if (baselineRequest->second.at(U("status")).as_integer() != result.status
+				|| utility::conversions::to_utf8string(baselineRequest->second.at(U("responseSha256")).as_string()) != result.responseSha256)
+			{
+				++latencies.outputMismatches;
+				outputMismatchesJson[outputMismatchesJson.size()] = web::json::value::number(static_cast<uint64_t>(request.index));
+			}
+		}
+	}
+
+	std::cout << std::fixed << std::setprecision(1) << "Replayed " << numberOfReplayed << " requests in " << elapsedSeconds << " s" << std::endl
+		<< std::left << std::setw(28) << "endpoint" << std::right << std::setw(10) << "requests" << std::setw(10) << "status !=" << std::setw(14) << "captured p50"
+		<< std::setw(14) << "captured p95" << std::setw(10) << "p50 ms" << std::setw(10) << "p95 ms";
+	if (!baseline.empty())
+	{
+		std::cout << std::setw(14) << "baseline p50" << std::setw(14) << "baseline p95" << std::setw(10) << "output !=";
+	}
+	std::cout << std::endl;
+
+	web::json::value endpointsJson = web::json::value::array();
+	size_t numberOfOutputMismatches = 0;
+	for (const auto& [name, latencies] : endpoints)
+	{
+		web::json::value endpointJson = web::json::value::object();
+		endpointJson[U("endpoint")] = web::json::value::string(utility::conversions::to_string_t(name));
+		endpointJson[U("requests")] = web::json::value::number(static_cast<uint64_t>(latencies.replayed.size()));
+		endpointJson[U("statusMismatches")] = web::json::value::number(static_cast<uint64_t>(latencies.statusMismatches));
+		endpointJson[U("capturedP50Ms")] = web::json::value::number(quantile(latencies.captured, 0.50));
+		endpointJson[U("capturedP95Ms")] = web::json::value::number(quantile(latencies.captured, 0.95));
+		endpointJson[U("p50Ms")] = web::json::value::number(quantile(latencies.replayed, 0.50));
+		endpointJson[U("p95Ms")] = web::json::value::number(quantile(latencies.replayed, 0.95));
+		std::cout << std::left << std::setw(28) << name << std::right << std::setw(10) << latencies.replayed.size() << std::setw(10) << latencies.statusMismatches
+			<< std::setw(14) << quantile(latencies.captured, 0.50) << std::setw(14) << quantile(latencies.captured, 0.95)
+			<< std::setw(10) << quantile(latencies.replayed, 0.50) << std::setw(10) << quantile(latencies.replayed, 0.95);
+		if (!baseline.empty())
+		{
+			endpointJson[U("baselineP50Ms")] = web::json::value::number(quantile(latencies.baseline, 0.50));
+			endpointJson[U("baselineP95Ms")] = web::json::value::number(quantile(latencies.baseline, 0.95));
+			endpointJson[U("outputMismatches")] = web::json::value::number(static_cast<uint64_t>(latencies.outputMismatches));
+			std::cout << std::setw(14) << quantile(latencies.baseline, 0.50) << std::setw(14) << quantile(latencies.baseline, 0.95) << std::setw(10) << latencies.outputMismatches;
+			numberOfOutputMismatches += latencies.outputMismatches;
+		}
+		std::cout << std::endl;
+		endpointsJson[endpointsJson.size()] = endpointJson;
+	}
+
+	if (!resultsFile.empty())
+	{
+		web::json::value resultsJson = web::json::value::object();
+		resultsJson[U("captureFile")] = web::json::value::string(utility::conversions::to_string_t(captureFile.string()));
+		resultsJson[U("target")] = web::json::value::string(utility::conversions::to_string_t(target));
+		resultsJson[U("speedup")] = web::json::value::number(speedup);
+		resultsJson[U("elapsedSeconds")] = web::json::value::number(elapsedSeconds);
+		resultsJson[U("endpoints")] = endpointsJson;
+		resultsJson[U("requests")] = requestsJson;
+		if (!baseline.empty())
+		{
+			resultsJson[U("outputMismatches")] = outputMismatchesJson; // indices of requests
+		}
+		std::ofstream out(resultsFile);
+		out << utility::conversions::to_utf8string(resultsJson.serialize()) << std::endl;
+		if (!out)
+		{
+			std::cerr << "Results file " << resultsFile << " cannot be written." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (numberOfOutputMismatches > 0)
+	{
+		std::cout << numberOfOutputMismatches << " requests differ in status or response from baseline " << baselineFile << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
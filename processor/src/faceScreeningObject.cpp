@@ -5,17 +5,28 @@
 #include "heatmapProcessing/vtkSurfacePCA.h"
 #include "subjectClassification/classificationTools.h"
 #include "PFLcomputation/msPFLMeasure.h"
+#include "utils/logger.h"
+#include "utils/serverMetrics.h"
+#include "utils/sha256.h"
+#include "utils/stageTimer.h"
 
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
 #include <algorithm>
 #include <array>
+#include <cstdio> // C-style I/O used for temp files
+#include <cstring>
 #include <filesystem>
 #include <map>
 #include <vector>
 #include <iostream>     // std::cout
 #include <fstream>      // std::ifstream
+#include <iomanip>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
 
 #include <vtkPolyDataMapper.h>
 #include <vtkActor.h>
@@ -25,6 +36,7 @@
 #include <vtkRenderer.h>
 #include <vtkRenderWindowInteractor.h>
 #include <vtkPolyData.h>
+#include <vtkPointData.h> // for heatmap sweeps
 #include <vtkProperty.h>
 #include <vtkScalarBarActor.h>
 #include <vtkSphereSource.h>
@@ -37,6 +49,9 @@
 #include <vtkXMLImageDataWriter.h>
 #include <vtkImageCast.h>
 #include <vtkJPEGWriter.h>
+#include <vtkOBJReader.h>
+#include <vtkXMLPolyDataReader.h> // for cached heatmaps
+#include <vtkXMLPolyDataWriter.h> // for cached heatmaps
 
 #include <cpprest/asyncrt_utils.h>
 #include <cpprest/rawptrstream.h>
@@ -118,8 +133,8 @@ void FaceScreeningObject::renderToJpgFile(vtkSmartPointer<vtkPolyData> graphicOb
 		}
 		catch(const std::exception& ex)
 		{
-			std::cerr << "Error in rendering profile image: Camera coordinates could not be set due to missing landmarks right_ex or left_ex (required for registration). " 
-			<< ex.what() << std::endl;
+			logError(this->processingToken) << "Error in rendering profile image: Camera coordinates could not be set due to missing landmarks right_ex or left_ex (required for registration). " 
+			<< ex.what();
 			return;
 		}
 	}
@@ -172,6 +187,7 @@ void FaceScreeningObject::renderToJpgFile(vtkSmartPointer<vtkPolyData> graphicOb
 	renderWindowInteractor->SetRenderWindow(renderWindow);
 	renderer->AddActor(actor);
 	renderer->SetBackground(1, 1, 1); // Background color white
+	ScopedStageTimer renderingTimer(Stage::Rendering);
 	renderWindow->Render();  // the cast filter below does not work without this call
 
 	vtkNew<vtkRenderLargeImage> lir;
@@ -183,10 +199,12 @@ void FaceScreeningObject::renderToJpgFile(vtkSmartPointer<vtkPolyData> graphicOb
 	castFilter->SetOutputScalarTypeToUnsignedChar();
 	castFilter->SetInputConnection(lir->GetOutputPort());
 	castFilter->Update();
+	renderingTimer.stop();
 
 	vtkNew<vtkJPEGWriter> writer;
 	writer->SetFileName(tmpImageFilename.c_str());
 	writer->SetInputConnection(castFilter->GetOutputPort());
+	ScopedStageTimer jpegEncodeTimer(Stage::JpegEncode);
 	writer->Write();
 }
 
@@ -231,8 +249,8 @@ vtkSmartPointer<vtkUnsignedCharArray> FaceScreeningObject::renderToJpg(vtkSmartP
 		}
 		catch(const std::exception& ex)
 		{
-			std::cerr << "Error in rendering profile image: Camera coordinates could not be set due to missing landmarks right_ex or left_ex (required for registration). " 
-			<< ex.what() << std::endl;
+			logError(this->processingToken) << "Error in rendering profile image: Camera coordinates could not be set due to missing landmarks right_ex or left_ex (required for registration). " 
+			<< ex.what();
 		}
 	}
 
@@ -262,6 +280,7 @@ vtkSmartPointer<vtkUnsignedCharArray> FaceScreeningObject::renderToJpg(vtkSmartP
 	renderWindowInteractor->SetRenderWindow(renderWindow);
 	renderer->AddActor(actor);
 	renderer->SetBackground(1, 1, 1); // Background color white
+	ScopedStageTimer renderingTimer(Stage::Rendering);
 	renderWindow->Render();  // the cast filter below does not work without this call
 
 	vtkNew<vtkRenderLargeImage> lir;
@@ -273,11 +292,14 @@ vtkSmartPointer<vtkUnsignedCharArray> FaceScreeningObject::renderToJpg(vtkSmartP
 	castFilter->SetOutputScalarTypeToUnsignedChar();
 	castFilter->SetInputConnection(lir->GetOutputPort());
 	castFilter->Update();
+	renderingTimer.stop();
 
 	vtkNew<vtkJPEGWriter> writer;
 	writer->WriteToMemoryOn();
 	writer->SetInputConnection(castFilter->GetOutputPort());
+	ScopedStageTimer jpegEncodeTimer(Stage::JpegEncode);
 	writer->Write();
+	jpegEncodeTimer.stop();
 	return writer->GetResult();
 }
 
@@ -315,6 +337,7 @@ vtkSmartPointer<vtkUnsignedCharArray> FaceScreeningObject::renderToJpg(vtkSmartP
 	renderWindowInteractor->SetRenderWindow(renderWindow);
 	renderer->AddActor(actor);
 	renderer->SetBackground(1, 1, 1); // Background color white
+	ScopedStageTimer renderingTimer(Stage::Rendering);
 	renderWindow->Render();  // the cast filter below does not work without this call
 
 	vtkNew<vtkRenderLargeImage> lir;
@@ -327,19 +350,29 @@ vtkSmartPointer<vtkUnsignedCharArray> FaceScreeningObject::renderToJpg(vtkSmartP
 	castFilter->SetOutputScalarTypeToUnsignedChar();
 	castFilter->SetInputConnection(lir->GetOutputPort());
 	castFilter->Update();
+	renderingTimer.stop();
 
 	vtkNew<vtkJPEGWriter> writer;
 	writer->WriteToMemoryOn();
 	//writer->SetResult(this->pngHeatmap);				// ISSUES  H E R E   ! ! ! (solved below)
 	writer->SetInputConnection(castFilter->GetOutputPort());
+	ScopedStageTimer jpegEncodeTimer(Stage::JpegEncode);
 	writer->Write();
+	jpegEncodeTimer.stop();
 
 	return writer->GetResult();
 }
 
+utility::string_t FaceScreeningObject::parseLandmarks(const web::json::value& landmarksASjson, const web::json::value& landmarksSetTypesFromModelDB)
+{
+	const auto identifiedLandmarkSetType = decodeLandmarks(landmarksASjson, landmarksSetTypesFromModelDB);
+	landmarksChanged(); // also if decoding failed part way
+	return identifiedLandmarkSetType;
+}
+
 // Decodes json string into std::map of facial landmarks, stores a copy of this in VTK compatible format
 // Returns the type of landmark set identified from the modelDB server config file.
-utility::string_t FaceScreeningObject::parseLandmarks(const web::json::value& landmarksASjson, const web::json::value& landmarksSetTypesFromModelDB)
+utility::string_t FaceScreeningObject::decodeLandmarks(const web::json::value& landmarksASjson, const web::json::value& landmarksSetTypesFromModelDB)
 {
 	utility::string_t identifiedLandmarkSetType; // return value; remains empty if landmark set could not be identified
 
@@ -352,8 +385,8 @@ utility::string_t FaceScreeningObject::parseLandmarks(const web::json::value& la
 
 		if (landmarkCoordinates.size() != 3)
 		{
-			ucout << "Landmark " << landmarkName
-				<< " does not have exactly 3 coordintes. Ignoring landmark. " << endl;
+			logWarning(this->processingToken) << "Landmark " << landmarkName
+				<< " does not have exactly 3 coordintes. Ignoring landmark. ";
 			continue;
 		}
 
@@ -368,8 +401,8 @@ utility::string_t FaceScreeningObject::parseLandmarks(const web::json::value& la
 		}
 		catch (const web::json::json_exception& ex)
 		{
-			ucout << "Landmark coordinate conversion of landmark " << landmarkName
-				<< " failed due to unsuitable data type in one of the point coordinates: " << ex.what() << endl;
+			logWarning(this->processingToken) << "Landmark coordinate conversion of landmark " << landmarkName
+				<< " failed due to unsuitable data type in one of the point coordinates: " << ex.what();
 			return identifiedLandmarkSetType; // empty return for indicating no match to landmark sets
 		}
 	}
@@ -452,21 +485,305 @@ utility::string_t FaceScreeningObject::parseLandmarks(const web::json::value& la
 		}
 		landmarks_InVTKFormat_TMP->SetPoints(landmark_points_tmp);
 		landmarks_InVTKFormat = landmarks_InVTKFormat_TMP;
-		std::cout << "Landmark parsing successful. Identified LANDMARK_SETTYPE: " << identifiedLandmarkSetType << std::endl;
+		logInfo(this->processingToken) << "Landmark parsing successful. Identified LANDMARK_SETTYPE: " << identifiedLandmarkSetType;
 	}
 	catch(const std::exception& e) // out_of_range exception if map element did not exist.
 	{
-		std::cout << "Internal error transforming landmarks into VTK format. This should not happen! "	<< std::endl;
+		logError(this->processingToken) << "Internal error transforming landmarks into VTK format. This should not happen! ";
 		return utility::string_t(); // Empty return is magic value for: decoding failed.
 	}
 
 	return identifiedLandmarkSetType;
 }
 
-void FaceScreeningObject::computeHeatmap(const web::http::http_request& message, const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age)
+std::shared_ptr<FaceScreeningObject> FaceScreeningObject::copyForConcurrentProcessing() const
 {
-	std::cout << "In FaceScreeningObject::computeHeatmap(...): modeFilesRootDir = " << modelFilesRootDir << std::endl;
-	this->subjectAge = subject_age;
+	auto copy = std::make_shared<FaceScreeningObject>(*this);
+	if (surfaceMesh != nullptr)
+	{
+		copy->surfaceMesh = vtkSmartPointer<vtkPolyData>::New();
+		copy->surfaceMesh->DeepCopy(surfaceMesh);
+	}
+	if (landmarks_InVTKFormat != nullptr)
+	{
+		copy->landmarks_InVTKFormat = vtkSmartPointer<vtkPolyData>::New();
+		copy->landmarks_InVTKFormat->DeepCopy(landmarks_InVTKFormat);
+	}
+	return copy;
+}
+
+void FaceScreeningObject::meshChanged()
+{
+	subjectDataChanged("mesh");
+}
+
+void FaceScreeningObject::landmarksChanged()
+{
+	subjectDataChanged("landmarks");
+	pflResult = PFLresult();
+}
+
+void FaceScreeningObject::subjectDataChanged(const std::string& input)
+{
+	artefacts->invalidate(input);
+	subjectVersions[input] = artefacts->version(input);
+	this->heatmap = nullptr;
+	std::lock_guard<InstrumentedMutex> guard(*classificationsMutex);
+	closestMeanClassifications.clear();
+}
+
+std::string FaceScreeningObject::contentDigest() const
+{
+	// Memoised, as the mesh is hashed for every cached result otherwise. The landmark set type is assigned by the caller of parseLandmarks(..).
+	const auto inputs = subjectVersions;
+	if (const auto memoised = artefacts->get<std::string>("digest", landmarkSetType))
+	{
+		return *memoised;
+	}
+
+	Sha256 digest;
+	const auto hashArray = [&digest](vtkDataArray* array)
+	{
+		if (array != nullptr)
+		{
+			digest.updateValue(array->GetDataType()).updateValue(array->GetNumberOfValues())
+				.update(array->GetVoidPointer(0), static_cast<size_t>(array->GetNumberOfValues()) * array->GetDataTypeSize());
+		}
+	};
+	if (surfaceMesh != nullptr)
+	{
+		hashArray(surfaceMesh->GetPoints() != nullptr ? surfaceMesh->GetPoints()->GetData() : nullptr);
+		hashArray(surfaceMesh->GetPolys()->GetOffsetsArray());
+		hashArray(surfaceMesh->GetPolys()->GetConnectivityArray());
+	}
+	digest.update(landmarkSetType).update("\n", 1);
+	for (const auto& landmark : landmarks) // std::map, hence ordered by name
+	{
+		digest.update(landmark.first).update("\n", 1).updateValue(landmark.second.x).updateValue(landmark.second.y).updateValue(landmark.second.z);
+	}
+	const auto hexDigest = std::make_shared<const std::string>(digest.hexDigest());
+	artefacts->put("digest", landmarkSetType, hexDigest, inputs);
+	return *hexDigest;
+}
+
+processingStatus FaceScreeningObject::loadSurfaceMeshFromObj(const std::vector<unsigned char>& objFileContent)
+{
+	// vtkOBJReader reads from files only, hence the obj data is stored in a temporary file first.
+	// The file is created exclusively ("x"), under a random name, so that concurrent uploads never share (or hijack) a file.
+	std::filesystem::path tempObjFilename;
+	std::FILE* tempObjFile = nullptr;
+	std::random_device randomDevice;
+	for (int attempt = 0; attempt < 16 && tempObjFile == nullptr; ++attempt)
+	{
+		std::ostringstream name;
+		name << "faceScreenMesh_" << std::hex << randomDevice() << randomDevice() << ".obj";
+		std::error_code error;
+		tempObjFilename = std::filesystem::temp_directory_path(error) / name.str();
+		if (error)
+		{
+			break;
+		}
+		tempObjFile = std::fopen(tempObjFilename.string().c_str(), "wbx");
+	}
+	if (tempObjFile == nullptr)
+	{
+		return { web::http::status_codes::InternalError, U("Could not create temp file for obj mesh.") };
+	}
+	// Removes the temp file on every path out of this function, including exceptions.
+	const std::unique_ptr<const std::filesystem::path, void(*)(const std::filesystem::path*)> tempObjFileRemoval(&tempObjFilename, [](const std::filesystem::path* file)
+	{
+		std::error_code error;
+		std::filesystem::remove(*file, error);
+	});
+	const bool written = std::fwrite(objFileContent.data(), sizeof(unsigned char), objFileContent.size(), tempObjFile) == objFileContent.size();
+	if (std::fclose(tempObjFile) != 0 || !written)
+	{
+		return { web::http::status_codes::InternalError, U("Could not write temp file for obj mesh.") };
+	}
+
+	vtkNew<vtkOBJReader> objReader;
+	objReader->SetFileName(tempObjFilename.string().c_str());
+	try 
+	{
+		objReader->Update();
+		this->surfaceMesh = objReader->GetOutput();
+	}
+	catch (const std::exception& e) 
+	{ 
+		this->surfaceMesh = nullptr;
+		meshChanged();
+		logError(this->processingToken) << "A standard exception was caught when vtk reads obj file, with message." << e.what();
+		return { web::http::status_codes::NotFound, U("An exception was thrown when reading obj file by vtk library.") };
+	}
+	meshChanged();
+
+	if (!(this->surfaceMesh->GetNumberOfCells() > 0))
+	{
+		this->surfaceMesh = nullptr;
+		return { web::http::status_codes::NotFound, U("Mesh could not be read.") };
+	}
+	return { web::http::status_codes::OK, U("Mesh upload sucessful.") };
+}
+
+namespace
+{
+	// Outcome of a computation stopped early by its cancellation token. Counted in the metrics served by endpoint /metrics.
+	processingStatus cancelledStatus(const CancellationToken& cancellation, const std::string& computation)
+	{
+		if (cancellation.deadlineExceeded())
+		{
+			++serverMetrics::computationsDeadlineExceeded;
+			return { web::http::status_codes::GatewayTimeout, utility::conversions::to_string_t(computation + " stopped: Request deadline exceeded.") };
+		}
+		++serverMetrics::computationsCancelled;
+		return { web::http::status_codes::Gone, utility::conversions::to_string_t(computation + " stopped: Processing token has been deleted.") };
+	}
+
+	// Session artefacts of heatmap computation (see FaceScreeningObject::artefacts). Signatures are memoised for the most recent age per model.
+	struct signatureArtefact
+	{
+		vtkSmartPointer<vtkPolyData> signature;
+		vtkSmartPointer<vtkPolyData> landmarks_onParameterisedDSM;
+	};
+
+	struct heatmapArtefact
+	{
+		processingStatus status;
+		vtkSmartPointer<vtkPolyData> heatmap;
+	};
+
+	// Age as matched by msNormalisationTools::CalculateMatchedMeanSignificance, in whole years (truncated). Ages within the same year give the
+	// same heatmap, so heatmaps and signatures are cached and memoised by this bucket.
+	int ageBucket(const float age)
+	{
+		return static_cast<int>(age);
+	}
+
+	// Parameter of artefacts depending on age.
+	std::string ageParameter(const float age)
+	{
+		return std::to_string(ageBucket(age));
+	}
+
+	// Key of the projection of a subject onto a face model (shape parameters, as raw doubles), which does not depend on age.
+	std::string projectionCacheKey(const std::string& modelFingerprint, const std::string& subjectDigest)
+	{
+		return Sha256().update("projection\n").update(modelFingerprint).update(subjectDigest).hexDigest();
+	}
+
+	// Outcome of msNormalisationTools::CalculateMatchedMeanSignificance(s) by its error code, logged in the context of processingToken.
+	processingStatus matchedMeanSignificanceStatus(const int errorCode, const utility::string_t& processingToken)
+	{
+		if (errorCode == -1) 
+		{
+			logError(processingToken) << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Calculation failed: 'from_var' missing or not set to 'control'";
+			return { web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...):  Calculation failed: 'from_var' missing or not set to 'control'") };
+		}
+		if (errorCode == -2) 
+		{
+			logError(processingToken) << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Calculation failed: N_refs < 2 (Insuficient reference surfaces)";
+			return { web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...):  Calculation failed: N_refs < 2 (Insuficient reference surfaces)") };
+		}
+		if (errorCode == -3) 
+		{
+			logError(processingToken) << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Age column 'age' missing in projection file.";
+			return { web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...): Age column 'age' missing in projection file.") };
+		}
+		if (errorCode == -4) 
+		{
+			logError(processingToken) << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Syndrome/Dx column 'Dx' missing in projection file.";
+			return { web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...): Syndrome/Dx column 'Dx' missing in projection file.") };
+		}
+		return { web::http::status_codes::OK, U("Signature computed successfully.") };
+	}
+
+	// Cached heatmap: status code, status message and heatmap as raw (appended, unencoded) VTK XML polydata, separated by newlines.
+	std::string serialiseHeatmap(const processingStatus& status, vtkPolyData* heatmap)
+	{
+		vtkNew<vtkXMLPolyDataWriter> writer;
+		writer->SetInputData(heatmap);
+		writer->SetDataModeToAppended();
+		writer->EncodeAppendedDataOff();
+		writer->WriteToOutputStringOn();
+		writer->Write();
+		return std::to_string(status.statusCode) + "\n" + utility::conversions::to_utf8string(status.message) + "\n" + writer->GetOutputString();
+	}
+
+	// Returns empty optional if cachedHeatmap is malformed.
+	std::optional<processingStatus> deserialiseHeatmap(const std::string& cachedHeatmap, vtkSmartPointer<vtkPolyData>& heatmap)
+	{
+		const auto endOfStatusCode = cachedHeatmap.find('\n');
+		const auto endOfMessage = cachedHeatmap.find('\n', endOfStatusCode + 1);
+		if (endOfStatusCode == std::string::npos || endOfMessage == std::string::npos)
+		{
+			return {};
+		}
+		vtkNew<vtkXMLPolyDataReader> reader;
+		reader->ReadFromInputStringOn();
+		reader->SetInputString(cachedHeatmap.substr(endOfMessage + 1));
+		reader->Update();
+		if (reader->GetOutput()->GetNumberOfPoints() <= 0)
+		{
+			return {};
+		}
+		heatmap = vtkSmartPointer<vtkPolyData>::New();
+		heatmap->DeepCopy(reader->GetOutput());
+		const auto statusCode = static_cast<web::http::status_code>(std::stoi(cachedHeatmap.substr(0, endOfStatusCode)));
+		return processingStatus{ statusCode, utility::conversions::to_string_t(cachedHeatmap.substr(endOfStatusCode + 1, endOfMessage - endOfStatusCode - 1)) };
+	}
+}
+
+void FaceScreeningObject::computeHeatmap(const web::http::http_request& message, const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age, const CancellationToken* cancellation, ResultCache* resultCache)
+{
+	const auto status = computeHeatmap(modelFilesRootDir, ethnicity_code, subject_age, cancellation, resultCache);
+	message_reply(status.statusCode, status.message);
+}
+
+processingStatus FaceScreeningObject::computeHeatmap(const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age, const CancellationToken* cancellation, ResultCache* resultCache)
+{
+	logDebug(this->processingToken) << "In FaceScreeningObject::computeHeatmap(...): modeFilesRootDir = " << modelFilesRootDir;
+
+	// Stages memoised in the session artefacts: projection/<model> (from mesh and landmarks), signature/<model> (from projection and age),
+	// heatmap (from signature and landmarks). Each stage is reused unless its inputs changed.
+	const auto inputs = subjectVersions;
+	const auto signatureArtefactKey = "signature/" + modelFilesRootDir.generic_string();
+	const auto heatmapParameters = modelFilesRootDir.generic_string() + "\n" + ageParameter(subject_age);
+	if (const auto memoised = artefacts->get<heatmapArtefact>("heatmap", heatmapParameters))
+	{
+		this->heatmap = memoised->heatmap;
+		this->subjectAge = subject_age;
+		return memoised->status;
+	}
+
+	// The heatmap depends on subject data, model files and age. The projection onto the face model (the slow part) does not depend on age.
+	std::string heatmapKey, projectionKey;
+	if (resultCache != nullptr && surfaceMesh != nullptr)
+	{
+		const auto modelFingerprint = resultCache->modelFingerprint(modelFilesRootDir);
+		const auto subjectDigest = contentDigest();
+		projectionKey = projectionCacheKey(modelFingerprint, subjectDigest);
+		heatmapKey = Sha256().update("heatmap\n").update(modelFingerprint).update(subjectDigest).update("ageYears\n").updateValue(ageBucket(subject_age)).hexDigest();
+
+		if (const auto cachedHeatmap = resultCache->get(modelFilesRootDir, heatmapKey))
+		{
+			if (const auto status = deserialiseHeatmap(*cachedHeatmap, this->heatmap))
+			{
+				this->subjectAge = subject_age;
+				artefacts->put("heatmap", heatmapParameters, std::make_shared<const heatmapArtefact>(heatmapArtefact{ *status, this->heatmap }), inputs);
+				return *status;
+			}
+		}
+	}
+
+	// Only the landmark transformation is left if the signature for this age is memoised.
+	auto heatmapDependencies = inputs;
+	if (const auto memoised = artefacts->get<signatureArtefact>(signatureArtefactKey, ageParameter(subject_age), &heatmapDependencies))
+	{
+		this->subjectAge = subject_age;
+		const auto status = transformSignature(memoised->signature, memoised->landmarks_onParameterisedDSM);
+		artefacts->put("heatmap", heatmapParameters, std::make_shared<const heatmapArtefact>(heatmapArtefact{ status, this->heatmap }), heatmapDependencies);
+		return status;
+	}
 
 	// derived from: void CFaceMarkDoc::CalcualateFacialSignature(int example, vtkSmartPointer<vtkPolyData> signature)
 	// TODO: 
@@ -474,94 +791,398 @@ void FaceScreeningObject::computeHeatmap(const web::http::http_request& message,
 	// - speed up model file loading
 	// - speed up resample function
 
-	const filesystem::path model_FileName = modelFilesRootDir / filesystem::path("model.dat");
-
 	vtkNew<vtkSurfacePCA> pca;
-	if (!pca->LoadFile(model_FileName.string()))
+	msNormalisationTools norm;
+	const auto loadStatus = loadModel(modelFilesRootDir, pca, norm);
+	if (!loadStatus.succeeded())
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap() : Failed to load model file." << endl;
-		message_reply(web::http::status_codes::NotFound, U("Face model file could not be loaded."));
-		return;
+		return loadStatus;
 	}
 
-	if (this->surfaceMesh->GetNumberOfPoints() <= 0) 
-	{ 
-		cerr << "In FaceScreeningObject::computeHeatmap(): Failed to read face mesh correctly! Results may be wrong" << endl; 
-		message_reply(web::http::status_codes::NotFound, U("The face mesh of the subject is not available."));
-		return; 
+	vtkNew<vtkDoubleArray> projection;
+	ArtefactGraph::Versions signatureDependencies;
+	const bool projectionCached = findProjection(modelFilesRootDir, projectionKey, resultCache, projection, signatureDependencies);
+
+	vtkNew<vtkPolyData> signature;
+	vtkNew<vtkPolyData> landmarks_onParameterisedDSM;
+	auto status = computeSignature(pca, norm, subject_age, cancellation, projection, signature, landmarks_onParameterisedDSM);
+
+	storeProjection(modelFilesRootDir, projectionKey, resultCache, projectionCached, inputs, projection, cancellation, signatureDependencies);
+	if (!status.succeeded())
+	{
+		return status;
 	}
-	if (landmarks_InVTKFormat->GetNumberOfPoints() <= 0)
-	{ 
-		cerr << "In FaceScreeningObject::computeHeatmap(): Failed to read landmarks correctly! Results may be wrong" << endl; 
-		message_reply(web::http::status_codes::NotFound, U("The landmarks of the subject are not available."));
-		return;
+	if (!signatureDependencies.empty())
+	{
+		const auto memoisedSignature = std::make_shared<const signatureArtefact>(signatureArtefact{ signature.GetPointer(), landmarks_onParameterisedDSM.GetPointer() });
+		artefacts->put(signatureArtefactKey, ageParameter(subject_age), memoisedSignature, signatureDependencies, &heatmapDependencies);
 	}
-	// This should compare against data in 'landmarks_InVTKFormat', and the 'landmarks' map!
-	if (pca->Getnlandmarks() != this->landmarks.size())
+
+	status = transformSignature(signature, landmarks_onParameterisedDSM);
+	if (heatmapDependencies.count(signatureArtefactKey) > 0)
+	{
+		artefacts->put("heatmap", heatmapParameters, std::make_shared<const heatmapArtefact>(heatmapArtefact{ status, this->heatmap }), heatmapDependencies);
+	}
+	if (!heatmapKey.empty() && status.succeeded())
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap(): Wrong number of landmarks! Model uses " << pca->Getnlandmarks() << "but number of landmarks submitted is: " << landmarks.size() << endl;
-		message_reply(web::http::status_codes::NotFound, U("The face model with the specified number of landmarks was not found."));
-		return; 
+		resultCache->put(modelFilesRootDir, heatmapKey, serialiseHeatmap(status, this->heatmap));
 	}
+	return status;
+}
 
-	// Compute shape params. Synthesize surface from model.
-	// (Legacy code did surface cleaning and stripping at this point. TODO Check if necessary.)
-	vtkNew<vtkDoubleArray> b;
-	pca->GetApproximateShapeParameters(this->surfaceMesh, landmarks_InVTKFormat, b, true);
+processingStatus FaceScreeningObject::computeHeatmapSweep(const std::filesystem::path modelFilesRootDir, const std::vector<float>& subject_ages, vtkSmartPointer<vtkPolyData>& sweep, const CancellationToken* cancellation, ResultCache* resultCache)
+{
+	logDebug(this->processingToken) << "In FaceScreeningObject::computeHeatmapSweep(...): modeFilesRootDir = " << modelFilesRootDir << ", " << subject_ages.size() << " ages";
+	if (subject_ages.empty())
+	{
+		return { web::http::status_codes::BadRequest, U("No subject age specified.") };
+	}
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Heatmap sweep");
+	}
+
+	// The projection is shared with computeHeatmap(..), through the session artefacts and resultCache (optional).
+	const auto inputs = subjectVersions;
+	std::string projectionKey;
+	if (resultCache != nullptr && surfaceMesh != nullptr)
+	{
+		projectionKey = projectionCacheKey(resultCache->modelFingerprint(modelFilesRootDir), contentDigest());
+	}
+
+	vtkNew<vtkSurfacePCA> pca;
+	msNormalisationTools norm;
+	const auto loadStatus = loadModel(modelFilesRootDir, pca, norm);
+	if (!loadStatus.succeeded())
+	{
+		return loadStatus;
+	}
+
+	vtkNew<vtkDoubleArray> projection;
+	ArtefactGraph::Versions observed;
+	const bool projectionCached = findProjection(modelFilesRootDir, projectionKey, resultCache, projection, observed);
 
 	vtkNew<vtkPolyData> signature;
-	pca->ParameteriseShape(b, signature);
+	vtkNew<vtkPolyData> landmarks_onParameterisedDSM;
+	auto status = parameteriseSubject(pca, cancellation, projection, signature, landmarks_onParameterisedDSM);
+	storeProjection(modelFilesRootDir, projectionKey, resultCache, projectionCached, inputs, projection, cancellation, observed);
+	if (!status.succeeded())
+	{
+		return status;
+	}
+
+	// Ages are matched as whole years, as by computeHeatmap(..).
+	const std::vector<int> ages(subject_ages.cbegin(), subject_ages.cend());
+	std::vector<vtkSmartPointer<vtkDoubleArray>> significances;
+	norm.SetCancellationToken(cancellation);
+	const auto errorCode_calcMatchMeanSignificances = norm.CalculateMatchedMeanSignificances(signature, projection, ages, significances);
+	norm.SetCancellationToken(nullptr);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Heatmap sweep");
+	}
+	status = matchedMeanSignificanceStatus(errorCode_calcMatchMeanSignificances, this->processingToken);
+	if (!status.succeeded())
+	{
+		return status;
+	}
+
+	// One scalar array per age, in the order requested, on the geometry shared by all of them.
+	for (size_t i = 0; i < significances.size(); ++i)
+	{
+		significances[i]->SetName(("Stdv_" + std::to_string(i)).c_str());
+		signature->GetPointData()->AddArray(significances[i]);
+	}
+	signature->GetPointData()->SetActiveScalars("Stdv_0");
+	return transformToSubject(signature, landmarks_onParameterisedDSM, sweep);
+}
+
+processingStatus FaceScreeningObject::loadHeatmapReference(const std::filesystem::path modelFilesRootDir, heatmapReference& reference, ResultCache* resultCache) const
+{
+	reference.modelFilesRootDir = modelFilesRootDir;
+	reference.pca = vtkSmartPointer<vtkSurfacePCA>::New();
+	reference.norm = std::make_shared<msNormalisationTools>();
+	const auto status = loadModel(modelFilesRootDir, reference.pca, *reference.norm);
+	if (!status.succeeded())
+	{
+		return status;
+	}
+	reference.baseMeshDigest = reference.pca->GetBaseMeshDigest();
+
+	reference.inputs = subjectVersions;
+	if (resultCache != nullptr && surfaceMesh != nullptr)
+	{
+		reference.projectionKey = projectionCacheKey(resultCache->modelFingerprint(modelFilesRootDir), contentDigest());
+	}
+	reference.projectionCached = findProjection(modelFilesRootDir, reference.projectionKey, resultCache, reference.projection, reference.observed);
+	return status;
+}
 
+processingStatus FaceScreeningObject::resampleSubject(const heatmapReference& reference, vtkPolyData* resampled, const CancellationToken* cancellation) const
+{
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Resampling");
+	}
+	if (surfaceMesh == nullptr || landmarks_InVTKFormat == nullptr || surfaceMesh->GetNumberOfPoints() <= 0 || landmarks_InVTKFormat->GetNumberOfPoints() <= 0)
+	{
+		return { web::http::status_codes::NotFound, U("Resampling requires face surface mesh and landmarks to be uploaded first.") };
+	}
+	if (reference.pca->Getnlandmarks() != this->landmarks.size())
+	{
+		return { web::http::status_codes::NotFound, U("The face model with the specified number of landmarks was not found.") };
+	}
+
+	reference.pca->ResampleShape(this->surfaceMesh, landmarks_InVTKFormat, resampled, cancellation);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Resampling");
+	}
+	if (resampled->GetNumberOfPoints() <= 0)
+	{
+		return { web::http::status_codes::InternalError, U("Resampling onto the face model failed.") };
+	}
+	return { web::http::status_codes::OK, U("Subject resampled successfully.") };
+}
+
+processingStatus FaceScreeningObject::computeReferenceHeatmap(heatmapReference& reference, const float subject_age, vtkPolyData* resampled, vtkSmartPointer<vtkPolyData>& referenceHeatmap,
+	const CancellationToken* cancellation, ResultCache* resultCache)
+{
+	logDebug(this->processingToken) << "In FaceScreeningObject::computeReferenceHeatmap(...): modeFilesRootDir = " << reference.modelFilesRootDir;
+	if (reference.projection->GetNumberOfValues() == 0 && resampled != nullptr && !CancellationToken::isCancelled(cancellation))
+	{
+		// The resampled subject is shared by the models of its base mesh, and filters register with their input: projected from a shallow copy.
+		vtkNew<vtkPolyData> projectionInput;
+		projectionInput->ShallowCopy(resampled);
+		reference.pca->GetApproximateShapeParametersFromResampledSurface(projectionInput, reference.projection, true);
+	}
+
+	vtkNew<vtkPolyData> signature;
 	vtkNew<vtkPolyData> landmarks_onParameterisedDSM;
-	pca->GetParameterisedLandmarks(signature, landmarks_onParameterisedDSM); // rh: function is setting a field "current_landmarks" in vtkSurfacePCA. 
-																			
-	if (signature->GetNumberOfPoints() <= 0) 
-	{ 
-		cerr << "In FaceScreeningObject::computeHeatmap(): Error in reading face model parameters and generating reference face mesh." << endl; 
-		message_reply(web::http::status_codes::NotFound, U("Error in reading face model parameters and generating reference face mesh."));
-		return;
+	const auto status = computeSignature(reference.pca, *reference.norm, subject_age, cancellation, reference.projection, signature, landmarks_onParameterisedDSM);
+	storeProjection(reference.modelFilesRootDir, reference.projectionKey, resultCache, reference.projectionCached, reference.inputs, reference.projection, cancellation, reference.observed);
+	if (!status.succeeded())
+	{
+		return status;
+	}
+	return transformToSubject(signature, landmarks_onParameterisedDSM, referenceHeatmap);
+}
+
+processingStatus FaceScreeningObject::loadModel(const std::filesystem::path& modelFilesRootDir, vtkSurfacePCA* pca, msNormalisationTools& norm) const
+{
+	const filesystem::path model_FileName = modelFilesRootDir / filesystem::path("model.dat");
+
+	ScopedStageTimer modelLoadTimer(Stage::ModelLoad);
+	if (!pca->LoadFile(model_FileName.string()))
+	{
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap() : Failed to load model file.";
+		return { web::http::status_codes::NotFound, U("Face model file could not be loaded.") };
 	}
 
 	// For NORMALISATION: Load projection file (i.e., collection of subjects with diagnostic outcome) 
 	const filesystem::path projection_FileName = modelFilesRootDir / filesystem::path("projection.csv");
 
-	msNormalisationTools norm;
 	norm.SetPCAModel(pca);
 	if (!norm.LoadProjectionFile(projection_FileName.string()))
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap() : Failed to load project file." << endl;
-		message_reply(web::http::status_codes::NotFound, U("Projection file could not be loaded."));
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap() : Failed to load project file.";
+		return { web::http::status_codes::NotFound, U("Projection file could not be loaded.") };
+	}
+	return { web::http::status_codes::OK, U("Face model loaded successfully.") };
+}
+
+bool FaceScreeningObject::findProjection(const std::filesystem::path& modelFilesRootDir, const std::string& projectionKey, ResultCache* resultCache, vtkDoubleArray* projection, ArtefactGraph::Versions& observed) const
+{
+	if (const auto memoised = artefacts->get<std::vector<double>>("projection/" + modelFilesRootDir.generic_string(), "", &observed))
+	{
+		projection->SetNumberOfValues(static_cast<vtkIdType>(memoised->size()));
+		std::copy(memoised->cbegin(), memoised->cend(), projection->GetPointer(0));
+		return !memoised->empty();
+	}
+	if (!projectionKey.empty())
+	{
+		if (const auto cachedProjection = resultCache->get(modelFilesRootDir, projectionKey))
+		{
+			projection->SetNumberOfValues(static_cast<vtkIdType>(cachedProjection->size() / sizeof(double)));
+			std::memcpy(projection->GetPointer(0), cachedProjection->data(), projection->GetNumberOfValues() * sizeof(double));
+			return projection->GetNumberOfValues() > 0;
+		}
+	}
+	return false;
+}
+
+void FaceScreeningObject::storeProjection(const std::filesystem::path& modelFilesRootDir, const std::string& projectionKey, ResultCache* resultCache, const bool projectionCached,
+	const ArtefactGraph::Versions& inputs, vtkDoubleArray* projection, const CancellationToken* cancellation, ArtefactGraph::Versions& observed) const
+{
+	const auto projectionArtefactKey = "projection/" + modelFilesRootDir.generic_string();
+	if (observed.count(projectionArtefactKey) > 0 || projection->GetNumberOfValues() <= 0 || CancellationToken::isCancelled(cancellation))
+	{
 		return;
 	}
+	auto values = std::make_shared<std::vector<double>>(projection->GetPointer(0), projection->GetPointer(0) + projection->GetNumberOfValues());
+	artefacts->put<std::vector<double>>(projectionArtefactKey, "", std::move(values), inputs, &observed);
+	if (!projectionKey.empty() && !projectionCached)
+	{
+		resultCache->put(modelFilesRootDir, projectionKey, std::string(reinterpret_cast<const char*>(projection->GetPointer(0)), projection->GetNumberOfValues() * sizeof(double)));
+	}
+}
+
+processingStatus FaceScreeningObject::precomputeProjection(const std::filesystem::path modelFilesRootDir, const CancellationToken* cancellation, ResultCache& resultCache) const
+{
+	if (surfaceMesh == nullptr || landmarks_InVTKFormat == nullptr)
+	{
+		return { web::http::status_codes::NotFound, U("Projection requires face surface mesh and landmarks to be uploaded first.") };
+	}
+	const auto inputs = subjectVersions;
+	const auto projectionArtefactKey = "projection/" + modelFilesRootDir.generic_string();
+	const auto projectionKey = projectionCacheKey(resultCache.modelFingerprint(modelFilesRootDir), contentDigest());
+	if (artefacts->get<std::vector<double>>(projectionArtefactKey, "") || resultCache.get(modelFilesRootDir, projectionKey))
+	{
+		return { web::http::status_codes::OK, U("Projection has been computed.") };
+	}
+
+	ScopedStageTimer modelLoadTimer(Stage::ModelLoad);
+	vtkNew<vtkSurfacePCA> pca;
+	if (!pca->LoadFile((modelFilesRootDir / filesystem::path("model.dat")).string()))
+	{
+		return { web::http::status_codes::NotFound, U("Face model file could not be loaded.") };
+	}
+	modelLoadTimer.stop();
+	if (pca->Getnlandmarks() != this->landmarks.size())
+	{
+		return { web::http::status_codes::NotFound, U("The face model with the specified number of landmarks was not found.") };
+	}
+
+	vtkNew<vtkDoubleArray> projection;
+	pca->GetApproximateShapeParameters(this->surfaceMesh, landmarks_InVTKFormat, projection, true, cancellation);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Projection");
+	}
+	if (projection->GetNumberOfValues() <= 0)
+	{
+		return { web::http::status_codes::InternalError, U("Projection onto the face model failed.") };
+	}
+	resultCache.put(modelFilesRootDir, projectionKey, std::string(reinterpret_cast<const char*>(projection->GetPointer(0)), projection->GetNumberOfValues() * sizeof(double)));
+	artefacts->put(projectionArtefactKey, "", std::make_shared<const std::vector<double>>(projection->GetPointer(0), projection->GetPointer(0) + projection->GetNumberOfValues()), inputs);
+	return { web::http::status_codes::OK, U("Projection has been computed.") };
+}
+
+std::shared_ptr<Precomputation> FaceScreeningObject::restartPrecomputation()
+{
+	const auto next = std::make_shared<Precomputation>(sessionCancellation);
+	if (const auto previous = std::atomic_exchange(&precomputation, next))
+	{
+		previous->cancel();
+	}
+	return next;
+}
+
+void FaceScreeningObject::cancelPrecomputation()
+{
+	if (const auto previous = std::atomic_exchange(&precomputation, std::shared_ptr<Precomputation>()))
+	{
+		previous->cancel();
+	}
+}
+
+processingStatus FaceScreeningObject::computeHeatmap(vtkSurfacePCA* pca, msNormalisationTools& norm, const float subject_age, const CancellationToken* cancellation, vtkDoubleArray* projection)
+{
+	vtkSmartPointer<vtkDoubleArray> b = projection;
+	if (b == nullptr)
+	{
+		b = vtkSmartPointer<vtkDoubleArray>::New();
+	}
+	vtkNew<vtkPolyData> signature;
+	vtkNew<vtkPolyData> landmarks_onParameterisedDSM;
+	const auto status = computeSignature(pca, norm, subject_age, cancellation, b, signature, landmarks_onParameterisedDSM);
+	if (!status.succeeded())
+	{
+		return status;
+	}
+	return transformSignature(signature, landmarks_onParameterisedDSM);
+}
 
-	const auto errorCode_calcMatchMeanSignificance = norm.CalculateMatchedMeanSignificance(signature, b, subject_age);
-	if (errorCode_calcMatchMeanSignificance == -1) 
+processingStatus FaceScreeningObject::computeSignature(vtkSurfacePCA* pca, msNormalisationTools& norm, const float subject_age, const CancellationToken* cancellation, vtkDoubleArray* b, vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM)
+{
+	if (CancellationToken::isCancelled(cancellation))
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Calculation failed: 'from_var' missing or not set to 'control'" << endl;
-		message_reply(web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...):  Calculation failed: 'from_var' missing or not set to 'control'"));
-		return; 
+		return cancelledStatus(*cancellation, "Heatmap computation");
 	}
-	if (errorCode_calcMatchMeanSignificance == -2) 
+	this->subjectAge = subject_age;
+
+	const auto status = parameteriseSubject(pca, cancellation, b, signature, landmarks_onParameterisedDSM);
+	if (!status.succeeded())
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Calculation failed: N_refs < 2 (Insuficient reference surfaces)" << endl;
-		message_reply(web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...):  Calculation failed: N_refs < 2 (Insuficient reference surfaces)"));
-		return; 
+		return status;
+	}
+
+	norm.SetCancellationToken(cancellation);
+	const auto errorCode_calcMatchMeanSignificance = norm.CalculateMatchedMeanSignificance(signature, b, ageBucket(subject_age));
+	norm.SetCancellationToken(nullptr);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Heatmap computation");
+	}
+	return matchedMeanSignificanceStatus(errorCode_calcMatchMeanSignificance, this->processingToken);
+}
+
+processingStatus FaceScreeningObject::parameteriseSubject(vtkSurfacePCA* pca, const CancellationToken* cancellation, vtkDoubleArray* b, vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM) const
+{
+	if (this->surfaceMesh->GetNumberOfPoints() <= 0) 
+	{ 
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap(): Failed to read face mesh correctly! Results may be wrong"; 
+		return { web::http::status_codes::NotFound, U("The face mesh of the subject is not available.") };
+	}
+	if (landmarks_InVTKFormat->GetNumberOfPoints() <= 0)
+	{ 
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap(): Failed to read landmarks correctly! Results may be wrong"; 
+		return { web::http::status_codes::NotFound, U("The landmarks of the subject are not available.") };
 	}
-	if (errorCode_calcMatchMeanSignificance == -3) 
+	// This should compare against data in 'landmarks_InVTKFormat', and the 'landmarks' map!
+	if (pca->Getnlandmarks() != this->landmarks.size())
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Age column 'age' missing in projection file." << endl;
-		message_reply(web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...): Age column 'age' missing in projection file."));
-		return; 
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap(): Wrong number of landmarks! Model uses " << pca->Getnlandmarks() << "but number of landmarks submitted is: " << landmarks.size();
+		return { web::http::status_codes::NotFound, U("The face model with the specified number of landmarks was not found.") };
 	}
-	if (errorCode_calcMatchMeanSignificance == -4) 
+
+	// Compute shape params. Synthesize surface from model.
+	// (Legacy code did surface cleaning and stripping at this point. TODO Check if necessary.)
+	if (b->GetNumberOfValues() == 0)
 	{
-		cerr << "In FaceScreeningObject::computeHeatmap(): computation failed : norm->CalculateMatchedMeanSignificance(...). Syndrome/Dx column 'Dx' missing in projection file." << endl;
-		message_reply(web::http::status_codes::NotFound, U("ComputeHeatmap/CalculateMatchedMeanSignificance(...): Syndrome/Dx column 'Dx' missing in projection file."));
-		return; 
+		pca->GetApproximateShapeParameters(this->surfaceMesh, landmarks_InVTKFormat, b, true, cancellation);
+		if (CancellationToken::isCancelled(cancellation))
+		{
+			b->Initialize(); // incomplete projection must not be reused
+			return cancelledStatus(*cancellation, "Heatmap computation");
+		}
 	}
 
+	pca->ParameteriseShape(b, signature);
+
+	pca->GetParameterisedLandmarks(signature, landmarks_onParameterisedDSM); // rh: function is setting a field "current_landmarks" in vtkSurfacePCA. 
+																			
+	if (signature->GetNumberOfPoints() <= 0) 
+	{ 
+		logError(this->processingToken) << "In FaceScreeningObject::computeHeatmap(): Error in reading face model parameters and generating reference face mesh."; 
+		return { web::http::status_codes::NotFound, U("Error in reading face model parameters and generating reference face mesh.") };
+	}
+	return { web::http::status_codes::OK, U("Subject parameterised successfully.") };
+}
+
+processingStatus FaceScreeningObject::transformSignature(vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM)
+{
+	vtkSmartPointer<vtkPolyData> transformedHeatmap;
+	const auto status = transformToSubject(signature, landmarks_onParameterisedDSM, transformedHeatmap);
+	// The heatmap artefact is replaced (or dropped, if not stored by the caller) once the new heatmap has been assigned.
+	this->heatmap = transformedHeatmap;
+	artefacts->invalidate("heatmap");
+	return status;
+}
+
+processingStatus FaceScreeningObject::transformToSubject(vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM, vtkSmartPointer<vtkPolyData>& transformedHeatmap) const
+{
 	// Transfrom DSM representation to match original image (helps with orientation issues!)
-	// rh: TODO: check if completeness of corresponding landmarks have to be checked here again.  TODO: if not complete: just dont do the tranform!
 	vtkNew<vtkPoints> sourcePoints; // DSM
 	vtkNew<vtkPoints> targetPoints; // Subject
 
@@ -574,59 +1195,61 @@ void FaceScreeningObject::computeHeatmap(const web::http::http_request& message,
 		if (it == std::end(orderedLandmarkNames))
 		{
 			landmarkCorrespondencesIncomplete = true;
+			break;
 		}
 		const auto index = distance(orderedLandmarkNames.cbegin(), it);
-		sourcePoints->InsertNextPoint(landmarks_onParameterisedDSM->GetPoint(index));
-		const auto& targetLandmark = landmarks[landmarkName];
+		double sourceLandmark[3]; // not through the shared tuple buffer of GetPoint(index), as memoised signatures are transformed concurrently
+		landmarks_onParameterisedDSM->GetPoint(index, sourceLandmark);
+		sourcePoints->InsertNextPoint(sourceLandmark);
+		const auto& targetLandmark = landmarks.at(landmarkName);
 		const double targetLandmark_[3] = { targetLandmark.x, targetLandmark.y, targetLandmark.z };
 		targetPoints->InsertNextPoint(targetLandmark_);
 	}
 
+	transformedHeatmap = vtkSmartPointer<vtkPolyData>::New();
+
+	// If not all correspondences are available, the heatmap is kept in the orientation of the model.
 	if (landmarkCorrespondencesIncomplete)
 	{
-		message_reply(web::http::status_codes::OK, U("Heatmap computed successfully, but orientation not registered to input mesh due to missing landmarks."));
+		transformedHeatmap->DeepCopy(signature);
+		return { web::http::status_codes::OK, U("Heatmap computed successfully, but orientation not registered to input mesh due to missing landmarks.") };
 	}
 
+	ScopedStageTimer landmarkTransformTimer(Stage::LandmarkTransform);
 	vtkNew<vtkLandmarkTransform> landmarkTransform;
 	landmarkTransform->SetSourceLandmarks(sourcePoints);
 	landmarkTransform->SetTargetLandmarks(targetPoints);
 	landmarkTransform->SetModeToRigidBody();
 	landmarkTransform->Update();
 
+	// Filters register with their input, hence the (possibly memoised) signature is shared with a shallow copy only.
+	vtkNew<vtkPolyData> transformInput;
+	transformInput->ShallowCopy(signature);
 	vtkNew<vtkTransformPolyDataFilter> transformFilter;
-	transformFilter->SetInputData(signature);
+	transformFilter->SetInputData(transformInput);
 	transformFilter->SetTransform(landmarkTransform);
 	transformFilter->Update();
 
 	const auto transformedMesh = transformFilter->GetOutput();
-	heatmap = vtkSmartPointer<vtkPolyData>::New();
-	this->heatmap->DeepCopy(transformedMesh); // rh TODO: Is this really necessary? Use move semantics?
+	transformedHeatmap->DeepCopy(transformedMesh); // rh TODO: Is this really necessary? Use move semantics?
+	landmarkTransformTimer.stop();
 
-	message_reply(web::http::status_codes::OK, U("Heatmap computed successfully."));
+	return { web::http::status_codes::OK, U("Heatmap computed successfully.") };
 }
 
 void FaceScreeningObject::renderHeatmapImage(const web::http::http_request& message)
 {
-	if (this->heatmap == nullptr)
+	std::vector<uint8_t> imageData;
+	const auto status = renderHeatmapImage(imageData);
+	if (!status.succeeded())
 	{
-		message_reply(web::http::status_codes::NotFound, U("Heatmap has not yet been computed."));
+		message_reply(status.statusCode, status.message);
 		return;
 	}
-	
-	this->jpgHeatmapImage = renderToJpg(this->heatmap);
-	char* imageData = (char*)jpgHeatmapImage->GetVoidPointer(0);
-	size_t imageSize = (size_t)(jpgHeatmapImage->GetSize() * jpgHeatmapImage->GetDataTypeSize());
-	std::cout << "Writing JPEG to mem... size: " << imageSize << endl;
-
-	std::vector<uint8_t> imageData2;
-	imageData2.reserve(imageSize);
-	for (int i = 0; i < imageSize; ++i)
-	{
-		imageData2.push_back(imageData[i]);
-	}
+	logDebug(this->processingToken) << "Writing JPEG to mem... size: " << imageData.size();
 
 	concurrency::streams::bytestream byteStream = concurrency::streams::bytestream();
-	concurrency::streams::istream imageStream = byteStream.open_istream(imageData2);
+	concurrency::streams::istream imageStream = byteStream.open_istream(imageData);
 
 //	message.reply(web::http::status_codes::OK, imageStream, _XPLATSTR("application/octet-stream"));
     	web::http::http_response response(web::http::status_codes::OK);
@@ -635,6 +1258,29 @@ void FaceScreeningObject::renderHeatmapImage(const web::http::http_request& mess
         message.reply(response);
 }
 
+processingStatus FaceScreeningObject::renderHeatmapImage(std::vector<uint8_t>& jpegImage)
+{
+	// Version read before the heatmap, so that an image of a heatmap replaced meanwhile is not memoised.
+	const ArtefactGraph::Versions dependencies{ { "heatmap", artefacts->version("heatmap") } };
+	const auto heatmap = this->heatmap;
+	if (heatmap == nullptr)
+	{
+		return { web::http::status_codes::NotFound, U("Heatmap has not yet been computed.") };
+	}
+	if (const auto memoised = artefacts->get<std::vector<uint8_t>>("heatmapImage", ""))
+	{
+		jpegImage = *memoised;
+		return { web::http::status_codes::OK, U("Heatmap image rendered successfully.") };
+	}
+
+	const auto jpgHeatmapImage = renderToJpg(heatmap);
+	const auto imageData = static_cast<const uint8_t*>(jpgHeatmapImage->GetVoidPointer(0));
+	const auto imageSize = static_cast<size_t>(jpgHeatmapImage->GetSize() * jpgHeatmapImage->GetDataTypeSize());
+	jpegImage.assign(imageData, imageData + imageSize);
+	artefacts->put("heatmapImage", "", std::make_shared<const std::vector<uint8_t>>(jpegImage), dependencies);
+	return { web::http::status_codes::OK, U("Heatmap image rendered successfully.") };
+}
+
 void FaceScreeningObject::renderPortraitImage(const web::http::http_request& message, const bool renderProfile)
 {
 	if (surfaceMesh == nullptr || facialTexture == nullptr)
@@ -647,7 +1293,7 @@ void FaceScreeningObject::renderPortraitImage(const web::http::http_request& mes
 	
 	char* imageData = (char*)jpgImage->GetVoidPointer(0);
 	size_t imageSize = (size_t)(jpgImage->GetSize() * jpgImage->GetDataTypeSize());
-	std::cout << "Writing JPEG to mem... size: " << imageSize << endl;
+	logDebug(this->processingToken) << "Writing JPEG to mem... size: " << imageSize;
 
 	std::vector<uint8_t> imageData2;
 	imageData2.reserve(imageSize);
@@ -665,37 +1311,96 @@ void FaceScreeningObject::renderPortraitImage(const web::http::http_request& mes
         message.reply(response);
 }
 					       
-bool FaceScreeningObject::computeClassification(const web::http::http_request& message, const filesystem::path facialRegionModelDataPath, const std::string facialRegionName)
+bool FaceScreeningObject::computeClassification(const web::http::http_request& message, ClassificationTools& classifier, const filesystem::path facialRegionModelDataPath, const std::string facialRegionName, const CancellationToken* cancellation, ResultCache* resultCache)
+{	
+	classificationResult result;
+	const auto status = computeClassification(classifier, facialRegionModelDataPath, facialRegionName, result, cancellation, resultCache);
+	if (status.succeeded())
+	{
+		storeClassification(facialRegionName, result);
+	}
+	message_reply(status.statusCode, status.message);
+	return status.succeeded();
+}
+
+void FaceScreeningObject::storeClassification(const std::string& facialRegion, const classificationResult& result)
+{
+	std::lock_guard<InstrumentedMutex> guard(*classificationsMutex);
+	closestMeanClassifications[facialRegion] = result;
+}
+
+std::map<std::string, classificationResult> FaceScreeningObject::classifications() const
+{
+	std::lock_guard<InstrumentedMutex> guard(*classificationsMutex);
+	return closestMeanClassifications;
+}
+
+processingStatus FaceScreeningObject::computeClassification(const filesystem::path facialRegionModelDataPath, const std::string facialRegionName, classificationResult& result, const CancellationToken* cancellation, ResultCache* resultCache) const
 {	
+	// Classifier state is local to this call, so that several facial regions can be classified concurrently.
+	ClassificationTools closestMeanClassifier;
+	return computeClassification(closestMeanClassifier, facialRegionModelDataPath, facialRegionName, result, cancellation, resultCache);
+}
+
+processingStatus FaceScreeningObject::computeClassification(ClassificationTools& closestMeanClassifier, const filesystem::path facialRegionModelDataPath, const std::string facialRegionName, classificationResult& result, const CancellationToken* cancellation, ResultCache* resultCache) const
+{	
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return cancelledStatus(*cancellation, "Classification of facial region " + facialRegionName);
+	}
+
 	if (surfaceMesh == nullptr)
 	{
-		cerr << "In FaceScreeningObject::computeClassification() : Classification requires face surface mesh." << endl;
-		message_reply(web::http::status_codes::NotFound, U("Classification requires face surface mesh to be uploaded first."));
-		return false;
+		logError(this->processingToken) << "In FaceScreeningObject::computeClassification() : Classification requires face surface mesh.";
+		return { web::http::status_codes::NotFound, U("Classification requires face surface mesh to be uploaded first.") };
 	}
 
 	if (landmarks_InVTKFormat == nullptr)
 	{
-		cerr << "In FaceScreeningObject::computeClassification() : Classification requires landmarks to be uploaded first." << endl;
-		message_reply(web::http::status_codes::NotFound, U(" Classification requires landmarks to be uploaded first"));
-		return false;
+		logError(this->processingToken) << "In FaceScreeningObject::computeClassification() : Classification requires landmarks to be uploaded first.";
+		return { web::http::status_codes::NotFound, U(" Classification requires landmarks to be uploaded first") };
+	}
+
+	const auto inputs = subjectVersions;
+	const auto classificationArtefactKey = "classification/" + facialRegionModelDataPath.generic_string();
+	if (const auto memoised = artefacts->get<classificationResult>(classificationArtefactKey, ""))
+	{
+		result = *memoised;
+		return { web::http::status_codes::OK, U("Classification has been computed.") };
+	}
+
+	// Cached as "mean stdDev", with enough digits to restore the floats exactly.
+	std::string classificationKey;
+	if (resultCache != nullptr)
+	{
+		classificationKey = Sha256().update("classification\n").update(resultCache->modelFingerprint(facialRegionModelDataPath)).update(contentDigest()).hexDigest();
+		if (const auto cachedClassification = resultCache->get(facialRegionModelDataPath, classificationKey))
+		{
+			std::istringstream cachedValues(*cachedClassification);
+			if (cachedValues >> result.mean >> result.stdDev)
+			{
+				artefacts->put(classificationArtefactKey, "", std::make_shared<const classificationResult>(result), inputs);
+				return { web::http::status_codes::OK, U("Classification has been computed.") };
+			}
+		}
 	}
 
-	closestMeanClassifiers.emplace(facialRegionName, ClassificationTools());
-	closestMeans.emplace(facialRegionName, 0.0F);
-	closestStdDevs.emplace(facialRegionName, 0.0F);
-	if (closestMeanClassifiers.at(facialRegionName).OnProjectIndividualsInSplitFolders(facialRegionModelDataPath, surfaceMesh, landmarks_InVTKFormat, 
-		closestMeans[facialRegionName], closestStdDevs[facialRegionName]))
+	if (!closestMeanClassifier.OnProjectIndividualsInSplitFolders(facialRegionModelDataPath, surfaceMesh, landmarks_InVTKFormat, result.mean, result.stdDev, cancellation))
 	{
-            closestMeanClassifications.insert(std::pair<std::string, classificationResult>(facialRegionName, {closestMeans[facialRegionName], closestStdDevs[facialRegionName]}));
-            message_reply(web::http::status_codes::OK, U("Classification has been computed.")); 
-            return true;
-        }
-        else
-        {
-            message_reply(web::http::status_codes::InternalError, U("Classification failed for facial region " + facialRegionName + ". Corrupted model file!"));		        
-            return false; 
-        }        
+		if (CancellationToken::isCancelled(cancellation))
+		{
+			return cancelledStatus(*cancellation, "Classification of facial region " + facialRegionName);
+		}
+		return { web::http::status_codes::InternalError, utility::conversions::to_string_t("Classification failed for facial region " + facialRegionName + ". Corrupted model file!") };
+	}
+	if (!classificationKey.empty())
+	{
+		std::ostringstream values;
+		values << std::setprecision(9) << result.mean << " " << result.stdDev;
+		resultCache->put(facialRegionModelDataPath, classificationKey, values.str());
+	}
+	artefacts->put(classificationArtefactKey, "", std::make_shared<const classificationResult>(result), inputs);
+	return { web::http::status_codes::OK, U("Classification has been computed.") };
 }
 
 PFLresult FaceScreeningObject::computePFLmeasure(const web::http::http_request& message, std::string ethnicity_code, std::string subjectGender, const float age)
@@ -719,6 +1424,8 @@ PFLresult FaceScreeningObject::computePFLmeasure(const web::http::http_request&
 
 void FaceScreeningObject::GeneratePartialLatexReport(const web::http::http_request& message, web::json::value reportInput, std::string tempLatexDir, std::string tempLatexFilename)
 {
+	ScopedStageTimer reportBuildTimer(Stage::ReportBuild); // includes rendering of images and pdflatex
+
 	// reportInput needs to be sanitized to prevent the latex compilter choking or pdfs turning out unsightly:  
 	// no   # $ % & ~ _ ^ \ { }  , etc., max. length, e.g,  40 bytes
 	auto ReplaceAll = [](std::string& str, const std::string& from, const std::string& to) 
@@ -756,7 +1463,7 @@ void FaceScreeningObject::GeneratePartialLatexReport(const web::http::http_reque
 	std::filesystem::create_directory(path);
 	std::filesystem::current_path(path);
 
-	ucout << "Writing FASD report to PDF" << endl;
+	logInfo(this->processingToken) << "Writing FASD report to PDF";
 	std::ofstream ofs(tempLatexFilename);
 
 	// Print report title and scan metadata
@@ -860,14 +1567,15 @@ void FaceScreeningObject::GeneratePartialLatexReport(const web::http::http_reque
 	}
 
 	// Print classification results and plot
-	if (!closestMeanClassifications.empty())
+	const auto computedClassifications = classifications(); // classifications may still be running
+	if (!computedClassifications.empty())
 	{
 		ofs << "Classification results: \n"
 			<< "\\newline \n" 
 			<< "\\begin{tabular}{l|r|r} \n"
 			<< "Region & Mean & Stdev \\\\ \n"
 			<< "\\hline \n";
-		for (const auto& classificationResult : closestMeanClassifications)
+		for (const auto& classificationResult : computedClassifications)
 		{
 			ofs << classificationResult.first << " & " << classificationResult.second.mean << " & " << classificationResult.second.stdDev <<"\\\\ \n";
 		}
@@ -876,7 +1584,7 @@ void FaceScreeningObject::GeneratePartialLatexReport(const web::http::http_reque
 			<< "\\vspace{8mm}\n"
 			<< "\\newline \n";
 
-		auto nClassicications = closestMeanClassifications.size();
+		auto nClassicications = computedClassifications.size();
 		auto minX(-3);
 		auto maxX(3);
 		auto restrictRange = [](float min, float max, float value) -> float
@@ -893,7 +1601,7 @@ void FaceScreeningObject::GeneratePartialLatexReport(const web::http::http_reque
 			<< "\\node [below] at(" << -1 << ", " << 0 << ") { FAS };\n"
 			<< "\\node [below] at(" << 1 << ", " << 0 << ") { Control };\n";
 			size_t classificationLine(0);
-			for (const auto& classificationResult : closestMeanClassifications)
+			for (const auto& classificationResult : computedClassifications)
 			{
 				classificationLine++;
 				ofs << "\\node [left] at(" << minX - 1 << ", " << classificationLine << ") {" << classificationResult.first << "};\n";
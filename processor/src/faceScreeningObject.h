@@ -4,6 +4,8 @@
 #include <filesystem>
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include <cpprest/asyncrt_utils.h>
 #include <cpprest/json.h>
@@ -13,8 +15,15 @@
 #include <vtkTexture.h>
 #include <vtkUnsignedCharArray.h>
 
+#include "heatmapProcessing/msNormalisationTools.h"
+#include "heatmapProcessing/vtkSurfacePCA.h"
 #include "mathUtils/Point_3D.h"
 #include "subjectClassification/classificationTools.h"
+#include "utils/artefactGraph.h"
+#include "utils/cancellationToken.h"
+#include "utils/instrumentedMutex.h"
+#include "utils/precomputation.h"
+#include "utils/resultCache.h"
 
 struct classificationResult
 {
@@ -29,6 +38,35 @@ struct PFLresult
 	float zScore = 0.0F;
 };
 
+// Outcome of a processing step, independent of the http_request that triggered it.
+// Allows composing several processing steps into one request (e.g., endpoint /screen), replying once all of them have finished.
+struct processingStatus
+{
+	web::http::status_code statusCode = web::http::status_codes::OK;
+	utility::string_t message;
+
+	bool succeeded() const { return statusCode == web::http::status_codes::OK; }
+};
+
+// Face model (with projection file) loaded for computing the heatmap of a subject against it, e.g., one of several reference populations
+// (see FaceScreeningObject::loadHeatmapReference).
+struct heatmapReference
+{
+	std::filesystem::path modelFilesRootDir;
+	vtkSmartPointer<vtkSurfacePCA> pca;
+	std::shared_ptr<msNormalisationTools> norm;
+
+	// Models with equal digests resample the subject alike (see vtkSurfacePCA::GetBaseMeshDigest), so that the resampled surface can be shared.
+	std::string baseMeshDigest;
+
+	// Projection of the subject onto the model, if found in the session artefacts or result cache. Empty otherwise.
+	vtkSmartPointer<vtkDoubleArray> projection = vtkSmartPointer<vtkDoubleArray>::New();
+	bool projectionCached = false;
+	std::string projectionKey;
+	ArtefactGraph::Versions observed; // versions read, and subject data held, at loading
+	ArtefactGraph::Versions inputs;
+};
+
 // Struct for processing an individual subject - structure used for processing data corresponding to a REST API processing token
 struct FaceScreeningObject
 {
@@ -43,18 +81,81 @@ struct FaceScreeningObject
 	// Returns the type of landmark set identified from the modelDB server config file.
 	utility::string_t parseLandmarks(const web::json::value& landmarksASjson, const web::json::value& landmarksSetTypesFromModelDB);
 
+	// Returns a copy of this object holding its own (deep copied) mesh and landmarks.
+	// VTK filters register themselves with their input data, hence pipelines running concurrently must not share input meshes.
+	// The copy shares the session artefacts, to which it contributes as long as the mesh and landmarks it holds are current.
+	std::shared_ptr<FaceScreeningObject> copyForConcurrentProcessing() const;
+
+	// Drop the results and session artefacts derived from the previous mesh (or landmarks), to be called whenever surfaceMesh (or landmarks) is
+	// replaced. loadSurfaceMeshFromObj(..) and parseLandmarks(..) call these themselves.
+	void meshChanged();
+	void landmarksChanged();
+
+	// SHA-256 digest of mesh geometry and landmarks. Identifies the subject data of cached results, independent of session and upload route.
+	std::string contentDigest() const;
+
+	// Reads obj file content (as uploaded by client) into surfaceMesh. On failure, surfaceMesh is reset to nullptr.
+	processingStatus loadSurfaceMeshFromObj(const std::vector<unsigned char>& objFileContent);
+
 	// Selects (server-side) model and projection file and computes heatmap (a.k.a. facial signature).
-	void computeHeatmap(const web::http::http_request& message, const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age);
+	// Stops early if cancellation (optional) is cancelled, replying 410 (Gone) or, if its deadline passed, 504 (Gateway Timeout).
+	// Stages memoised in the session artefacts (projection onto the model, signature for the age, transformed heatmap) are reused, so that,
+	// e.g., a heatmap for another age recomputes the signature onwards only.
+	// If resultCache (optional) holds the heatmap, or the projection of the subject onto the face model, for the same subject data and model files, these are reused.
+	void computeHeatmap(const web::http::http_request& message, const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr);
+
+	// Same as above, but returns outcome to caller instead of replying to a http_request.
+	processingStatus computeHeatmap(const std::filesystem::path modelFilesRootDir, const std::string ethnicity_code, const float subject_age, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr);
+
+	// Same as above, but with face model and projection file already loaded (and norm set to use pca), e.g., for reuse across subjects in batch processing.
+	// Models must not be used concurrently by several computations.
+	// If projection (optional) holds values, these are used as shape parameters of the subject instead of projecting the face mesh onto the model. Otherwise, it receives them.
+	processingStatus computeHeatmap(vtkSurfacePCA* pca, msNormalisationTools& norm, const float subject_age, const CancellationToken* cancellation = nullptr, vtkDoubleArray* projection = nullptr);
+
+	// Computes the heatmap of the subject for each of subject_ages (e.g., chronological and developmental age) against the same face model in one pass:
+	// sweep receives the heatmap geometry once, with one significance array per age named "Stdv_<i>" in the order of subject_ages ("Stdv_0" active).
+	// Ages matched to the same reference set share their significance (see msNormalisationTools::CalculateMatchedMeanSignificances).
+	// The projection is reused and memoised as by computeHeatmap(..); heatmap and subjectAge are left unchanged.
+	processingStatus computeHeatmapSweep(const std::filesystem::path modelFilesRootDir, const std::vector<float>& subject_ages, vtkSmartPointer<vtkPolyData>& sweep, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr);
+
+	// Stages of a heatmap against one of several face models (reference populations), scheduled independently by the caller, which can share the
+	// resampled subject between models of the same base mesh:
+	// - loadHeatmapReference(..) loads the face model in modelFilesRootDir into reference, with the projection of the subject if reused (as by computeHeatmap(..)).
+	// - resampleSubject(..) resamples the face mesh to the base mesh of reference, unless its projection has been reused.
+	// - computeReferenceHeatmap(..) computes the heatmap for subject_age into referenceHeatmap, projecting resampled (if reference holds no projection).
+	// The projection is memoised and cached as by computeHeatmap(..); heatmap is left unchanged. Each stage works on a copy of its own (copyForConcurrentProcessing).
+	processingStatus loadHeatmapReference(const std::filesystem::path modelFilesRootDir, heatmapReference& reference, ResultCache* resultCache = nullptr) const;
+	processingStatus resampleSubject(const heatmapReference& reference, vtkPolyData* resampled, const CancellationToken* cancellation = nullptr) const;
+	processingStatus computeReferenceHeatmap(heatmapReference& reference, const float subject_age, vtkPolyData* resampled, vtkSmartPointer<vtkPolyData>& referenceHeatmap,
+		const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr);
+
+	// Projects the face mesh onto the face model in modelFilesRootDir and stores the projection in resultCache, where computeHeatmap(..) finds it,
+	// unless already stored. The age-independent part of a heatmap, for precomputing it before the subject age is known (see Precomputation).
+	processingStatus precomputeProjection(const std::filesystem::path modelFilesRootDir, const CancellationToken* cancellation, ResultCache& resultCache) const;
 
 	// Produces an image of the computed heatmap with color scale and sends it back to client jpeg coded via http_response.
+	// The image is memoised in the session artefacts until the heatmap changes.
 	void renderHeatmapImage(const web::http::http_request& message);
+
+	// Same as above, but returns outcome to caller and jpeg coded image in parameter jpegImage instead of replying to a http_request.
+	processingStatus renderHeatmapImage(std::vector<uint8_t>& jpegImage);
 	
 	// Produces an image of the face frontal view with texture and sends it back to client jpeg coded via http_response.
 	void renderPortraitImage(const web::http::http_request& message, bool renderProfile);
 	
 	// Computes FASD classification (mean, stdev) as class posterior (-1 control, 1 FASD), selecting model for facial subregion located at facialRegionModelDataPath
 	// Returns true if classification was successful for specified facial region, false otherwise.
-	bool computeClassification(const web::http::http_request& message, std::filesystem::path facialRegionModelDataPath, std::string facial_Region);
+	// Stops early if cancellation (optional) is cancelled, replying as computeHeatmap(..) does.
+	// Classification results are reused from resultCache (optional) as for computeHeatmap(..).
+	// Classifies with classifier, e.g., sharing split models preloaded by the server (see SplitModelStore).
+	bool computeClassification(const web::http::http_request& message, ClassificationTools& classifier, std::filesystem::path facialRegionModelDataPath, std::string facial_Region, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr);
+
+	// Same as above, but returns outcome to caller and classification result in parameter result instead of storing it in closestMeanClassifications.
+	// Does not modify the object, so that classifications of several facial regions can be computed concurrently.
+	processingStatus computeClassification(const std::filesystem::path facialRegionModelDataPath, const std::string facial_Region, classificationResult& result, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr) const;
+
+	// Same as above, but classifying with classifier, e.g., holding split models preloaded by ClassificationTools::LoadSplitModels.
+	processingStatus computeClassification(ClassificationTools& classifier, const std::filesystem::path facialRegionModelDataPath, const std::string facial_Region, classificationResult& result, const CancellationToken* cancellation = nullptr, ResultCache* resultCache = nullptr) const;
 
 	// Computes and stores PFL, percentile, and zScore.
 	PFLresult computePFLmeasure(const web::http::http_request& message, std::string ethnicity_code, std::string subjectGender, const float age);
@@ -70,6 +171,22 @@ struct FaceScreeningObject
 	// FaceScreening object shall be deleted only while not running a job for a client.
 	bool busyComputing; 
 
+	// Cancelled when the processing token is deleted (or evicted), stopping computations still running for it.
+	// Shared with copies made by copyForConcurrentProcessing(), and parent of the per-request deadline tokens.
+	std::shared_ptr<CancellationToken> sessionCancellation = std::make_shared<CancellationToken>();
+
+	// Speculative precomputation for the current mesh and landmarks, nullptr if none is running. Shared with copies. Thread-safe.
+	std::shared_ptr<Precomputation> currentPrecomputation() const { return std::atomic_load(&precomputation); }
+
+	// Starts a new precomputation for the current mesh and landmarks, cancelling the previous one. Thread-safe.
+	std::shared_ptr<Precomputation> restartPrecomputation();
+
+	// Cancels the precomputation, e.g., once mesh or landmarks are being replaced. Thread-safe.
+	void cancelPrecomputation();
+
+	// Processing token of the session, used as context of log records only. Empty for sessions without token (e.g., single-call screening).
+	utility::string_t processingToken;
+
 	// Ethnicity code submitted through REST API.
 	std::string ethnicityCode;
 
@@ -86,9 +203,16 @@ struct FaceScreeningObject
 	std::map<std::string, Point3D> landmarks;
 
 	// Classification results (mean, stdev) for each computed facial region.
+	// Written concurrently when facial regions are classified in parallel: access through storeClassification and classifications.
 	std::map<std::string, classificationResult> closestMeanClassifications;
 
-	// 3D Heatmap, not nullptr if computed
+	// Stores classification result of facial region in closestMeanClassifications. Thread-safe.
+	void storeClassification(const std::string& facialRegion, const classificationResult& result);
+
+	// Copy of closestMeanClassifications. Thread-safe.
+	std::map<std::string, classificationResult> classifications() const;
+
+	// 3D Heatmap, not nullptr if computed. Reset when mesh or landmarks change.
 	vtkSmartPointer<vtkPolyData> heatmap = nullptr;
 
 	// Subject age, not of invalid value if set by client TODO: consider nullopt value for unset age.
@@ -113,8 +237,44 @@ private:
 	// Create in-memory jpeg coded image from vtkPolyData. Used, e.g., to render jpeg image from 3D heatmap.
 	vtkSmartPointer<vtkUnsignedCharArray> renderToJpg(vtkSmartPointer<vtkPolyData> surface);
 
-	// Heatmap image, not nullptr if rendered from 3D heatmap
-	vtkSmartPointer<vtkUnsignedCharArray> jpgHeatmapImage = nullptr;
+	// Implementation of parseLandmarks(..).
+	utility::string_t decodeLandmarks(const web::json::value& landmarksASjson, const web::json::value& landmarksSetTypesFromModelDB);
+
+	// Stages of heatmap computation: signature of the subject (with landmarks on it) for projection b and subject_age, then transformation of the
+	// signature to the orientation of the face mesh into heatmap.
+	processingStatus computeSignature(vtkSurfacePCA* pca, msNormalisationTools& norm, const float subject_age, const CancellationToken* cancellation, vtkDoubleArray* b, vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM);
+	processingStatus transformSignature(vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM);
+
+	// Age-independent part of computeSignature(..): shape of the subject on the model (projecting the face mesh if b is empty), with landmarks on it.
+	processingStatus parameteriseSubject(vtkSurfacePCA* pca, const CancellationToken* cancellation, vtkDoubleArray* b, vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM) const;
+
+	// Transformation part of transformSignature(..), into transformed instead of heatmap.
+	processingStatus transformToSubject(vtkPolyData* signature, vtkPolyData* landmarks_onParameterisedDSM, vtkSmartPointer<vtkPolyData>& transformed) const;
+
+	// Loads face model and projection file in modelFilesRootDir, setting norm to use pca.
+	processingStatus loadModel(const std::filesystem::path& modelFilesRootDir, vtkSurfacePCA* pca, msNormalisationTools& norm) const;
+
+	// Projection of the subject onto the face model in modelFilesRootDir from the session artefacts (adding its version to observed) or resultCache
+	// (optional, under projectionKey). Returns true if found. storeProjection(..) memoises (and caches) a projection that was not found.
+	bool findProjection(const std::filesystem::path& modelFilesRootDir, const std::string& projectionKey, ResultCache* resultCache, vtkDoubleArray* projection, ArtefactGraph::Versions& observed) const;
+	void storeProjection(const std::filesystem::path& modelFilesRootDir, const std::string& projectionKey, ResultCache* resultCache, const bool projectionCached,
+		const ArtefactGraph::Versions& inputs, vtkDoubleArray* projection, const CancellationToken* cancellation, ArtefactGraph::Versions& observed) const;
+
+	// Invalidates input (mesh or landmarks) in artefacts and records the new versions of the subject data held.
+	void subjectDataChanged(const std::string& input);
+
+	// Memoised intermediate results of the session, by stage: digest, projection/<model>, signature/<model>, heatmap, heatmapImage,
+	// classification/<model>. Shared by copies (copyForConcurrentProcessing).
+	std::shared_ptr<ArtefactGraph> artefacts = std::make_shared<ArtefactGraph>();
+
+	// Versions of mesh and landmarks (in artefacts) held by this object, the dependencies of artefacts derived from them.
+	ArtefactGraph::Versions subjectVersions{ { "mesh", 0 }, { "landmarks", 0 } };
+
+	// Accessed through std::atomic_load and std::atomic_exchange only.
+	std::shared_ptr<Precomputation> precomputation = nullptr;
+
+	// Guards closestMeanClassifications. Shared by copies (copyForConcurrentProcessing), which is harmless as their maps are separate.
+	std::shared_ptr<InstrumentedMutex> classificationsMutex = std::make_shared<InstrumentedMutex>("faceScreeningObjectClassifications");
 
 	// Vector of landmark names in order required to create VTK landmarks vector (landmarks_InVTKFormat)
 	std::vector<std::string> orderedLandmarkNames;
@@ -124,12 +284,6 @@ private:
 
 	// PFL result, not null if computed
 	PFLresult pflResult;
-	
-//	std::map<std::string, std::unique_ptr<ClassificationTools>> closestMeanClassifiers;
-	std::map<std::string, ClassificationTools> closestMeanClassifiers;
-	std::map<std::string, float> closestMeans;
-	std::map<std::string, float> closestStdDevs;	
-
 };
 
 #endif // FACESCREENINGOBJECT_H
@@ -0,0 +1,282 @@
+#include "modelTopology.h"
+#include "../utils/computePool.h"
+#include "../utils/instrumentedMutex.h"
+#include "../utils/logger.h"
+#include "../utils/scratchArena.h"
+
+#include <vtkMath.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <numeric>
+#include <system_error>
+#include <tuple>
+
+namespace
+{
+	// Unit normal of each triangle as vtkTriangle::ComputeNormal, rounded to float like the polygon normals of vtkPolyDataNormals.
+	template<typename PointType>
+	void computeTriangleNormals(const PointType* xyz, const std::vector<vtkIdType>& triangles, float* triangleNormals)
+	{
+		const size_t numberOfTriangles = triangles.size() / 3;
+		parallelFor(0, numberOfTriangles, 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t t = begin; t < end; ++t)
+			{
+				const PointType* v1 = xyz + 3 * triangles[3 * t];
+				const PointType* v2 = xyz + 3 * triangles[3 * t + 1];
+				const PointType* v3 = xyz + 3 * triangles[3 * t + 2];
+				const double ax = static_cast<double>(v3[0]) - v2[0], ay = static_cast<double>(v3[1]) - v2[1], az = static_cast<double>(v3[2]) - v2[2];
+				const double bx = static_cast<double>(v1[0]) - v2[0], by = static_cast<double>(v1[1]) - v2[1], bz = static_cast<double>(v1[2]) - v2[2];
+				double n[3] = { ay * bz - az * by, az * bx - ax * bz, ax * by - ay * bx };
+				const double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length != 0.0)
+				{
+					n[0] /= length;
+					n[1] /= length;
+					n[2] /= length;
+				}
+				triangleNormals[3 * t] = static_cast<float>(n[0]);
+				triangleNormals[3 * t + 1] = static_cast<float>(n[1]);
+				triangleNormals[3 * t + 2] = static_cast<float>(n[2]);
+			}
+		});
+	}
+
+	// Disjoint sets of indexes with path halving.
+	struct disjointSets
+	{
+		std::vector<size_t> parent;
+
+		explicit disjointSets(size_t size) : parent(size) { std::iota(parent.begin(), parent.end(), size_t(0)); }
+
+		size_t find(size_t i)
+		{
+			while (parent[i] != i)
+			{
+				parent[i] = parent[parent[i]];
+				i = parent[i];
+			}
+			return i;
+		}
+
+		void join(size_t i, size_t j) { parent[find(i)] = find(j); }
+	};
+}
+
+std::shared_ptr<const ModelTopology> ModelTopology::create(const int numberOfPoints, const int numberOfTriangles, const vtkIdType* triangles,
+	std::vector<vtkIdType> pseudoLandmarkCells, const double pseudoLandmarkSeed[3])
+{
+	auto topology = std::make_shared<ModelTopology>();
+	topology->numberOfPoints = numberOfPoints;
+	topology->triangles.assign(triangles, triangles + 3 * static_cast<size_t>(numberOfTriangles));
+	topology->landmarkCells = std::move(pseudoLandmarkCells);
+	std::copy(pseudoLandmarkSeed, pseudoLandmarkSeed + 3, topology->landmarkSeed);
+
+	bool supported = true;
+	for (const vtkIdType id : topology->triangles)
+	{
+		supported = supported && id >= 0 && id < numberOfPoints;
+	}
+	if (!supported)
+	{
+		logWarning() << "In ModelTopology::create: Triangles refer to points out of range; normals are computed with vtkPolyDataNormals.";
+		return topology;
+	}
+
+	// Incident triangles per point, ascending as they are added in order of the triangles.
+	const size_t points = static_cast<size_t>(numberOfPoints);
+	topology->incidentOffsets.assign(points + 1, 0);
+	for (const vtkIdType id : topology->triangles)
+	{
+		++topology->incidentOffsets[static_cast<size_t>(id) + 1];
+	}
+	std::partial_sum(topology->incidentOffsets.begin(), topology->incidentOffsets.end(), topology->incidentOffsets.begin());
+	topology->incidentTriangles.resize(topology->triangles.size());
+	std::vector<size_t> filled(topology->incidentOffsets.begin(), topology->incidentOffsets.end() - 1);
+	for (size_t t = 0; t < static_cast<size_t>(numberOfTriangles); ++t)
+	{
+		const vtkIdType* triangle = &topology->triangles[3 * t];
+		supported = supported && triangle[0] != triangle[1] && triangle[1] != triangle[2] && triangle[2] != triangle[0];
+		for (int corner = 0; corner < 3; ++corner)
+		{
+			topology->incidentTriangles[filled[static_cast<size_t>(triangle[corner])]++] = static_cast<vtkIdType>(t);
+		}
+	}
+
+	// Edges (lower point, higher point, triangle, traversed from lower to higher point), grouped by edge.
+	std::vector<std::tuple<vtkIdType, vtkIdType, vtkIdType, bool>> edges;
+	edges.reserve(topology->triangles.size());
+	for (size_t t = 0; t < static_cast<size_t>(numberOfTriangles); ++t)
+	{
+		for (int corner = 0; corner < 3; ++corner)
+		{
+			const vtkIdType from = topology->triangles[3 * t + corner];
+			const vtkIdType to = topology->triangles[3 * t + (corner + 1) % 3];
+			edges.emplace_back(std::min(from, to), std::max(from, to), static_cast<vtkIdType>(t), from < to);
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+
+	// Triangles around each point have to be connected across edges, otherwise vtkPolyDataNormals splits the point.
+	disjointSets fans(topology->incidentTriangles.size());
+	auto incidence = [&topology](const vtkIdType point, const vtkIdType triangle)
+	{
+		const auto first = topology->incidentTriangles.begin() + topology->incidentOffsets[static_cast<size_t>(point)];
+		const auto last = topology->incidentTriangles.begin() + topology->incidentOffsets[static_cast<size_t>(point) + 1];
+		return static_cast<size_t>(std::lower_bound(first, last, triangle) - topology->incidentTriangles.begin());
+	};
+	for (size_t e = 0; e < edges.size();)
+	{
+		size_t next = e + 1;
+		while (next < edges.size() && std::get<0>(edges[next]) == std::get<0>(edges[e]) && std::get<1>(edges[next]) == std::get<1>(edges[e]))
+		{
+			++next;
+		}
+		if (next - e == 2)
+		{
+			// Consistently oriented neighbours traverse their shared edge in opposite directions.
+			supported = supported && std::get<3>(edges[e]) != std::get<3>(edges[e + 1]);
+			const vtkIdType t1 = std::get<2>(edges[e]);
+			const vtkIdType t2 = std::get<2>(edges[e + 1]);
+			topology->adjacentTriangles.push_back(t1);
+			topology->adjacentTriangles.push_back(t2);
+			for (const vtkIdType point : { std::get<0>(edges[e]), std::get<1>(edges[e]) })
+			{
+				fans.join(incidence(point, t1), incidence(point, t2));
+			}
+		}
+		else if (next - e > 2)
+		{
+			supported = false; // non-manifold edge
+		}
+		e = next;
+	}
+	for (size_t p = 0; p < points && supported; ++p)
+	{
+		const size_t first = topology->incidentOffsets[p];
+		for (size_t i = first + 1; i < topology->incidentOffsets[p + 1]; ++i)
+		{
+			supported = supported && fans.find(i) == fans.find(first);
+		}
+	}
+
+	topology->normalsSupported = supported;
+	if (!supported)
+	{
+		logInfo() << "In ModelTopology::create: Triangles of the model are not consistently oriented, not manifold or meet at single points; "
+			<< "normals are computed with vtkPolyDataNormals.";
+	}
+	return topology;
+}
+
+std::shared_ptr<const ModelTopology> ModelTopology::forModelFile(const std::string& modelFileName, const std::function<std::shared_ptr<const ModelTopology>()>& create)
+{
+	if (modelFileName.empty())
+	{
+		return create();
+	}
+
+	struct cachedTopology
+	{
+		std::uintmax_t size;
+		std::filesystem::file_time_type modified;
+		std::shared_ptr<const ModelTopology> topology;
+	};
+	static InstrumentedMutex cacheMutex("modelTopologyCache");
+	static std::map<std::string, cachedTopology> cache;
+
+	std::error_code error;
+	const auto size = std::filesystem::file_size(modelFileName, error);
+	const auto modified = std::filesystem::last_write_time(modelFileName, error);
+	if (error)
+	{
+		return create();
+	}
+	{
+		std::lock_guard<InstrumentedMutex> guard(cacheMutex);
+		const auto cached = cache.find(modelFileName);
+		if (cached != cache.end() && cached->second.size == size && cached->second.modified == modified)
+		{
+			return cached->second.topology;
+		}
+	}
+
+	// Created without holding the lock. Concurrent first requests for a file may each create it; one of them is kept.
+	auto topology = create();
+	if (topology)
+	{
+		std::lock_guard<InstrumentedMutex> guard(cacheMutex);
+		cache[modelFileName] = cachedTopology{ size, modified, topology };
+	}
+	return topology;
+}
+
+bool ModelTopology::computePointNormals(vtkPoints* points, vtkFloatArray* normals) const
+{
+	if (!this->normalsSupported || !points || points->GetNumberOfPoints() != this->numberOfPoints
+		|| (points->GetDataType() != VTK_FLOAT && points->GetDataType() != VTK_DOUBLE))
+	{
+		return false;
+	}
+
+	const size_t numberOfTriangles = this->triangles.size() / 3;
+	ScratchVector<float> triangleNormals(3 * numberOfTriangles);
+	if (points->GetDataType() == VTK_FLOAT)
+	{
+		computeTriangleNormals(static_cast<const float*>(points->GetVoidPointer(0)), this->triangles, triangleNormals.data());
+	}
+	else
+	{
+		computeTriangleNormals(static_cast<const double*>(points->GetVoidPointer(0)), this->triangles, triangleNormals.data());
+	}
+
+	// vtkPolyDataNormals splits points where adjacent triangles meet at more than its feature angle (default 30 degrees).
+	const double cosFeatureAngle = std::cos(vtkMath::RadiansFromDegrees(30.0));
+	std::atomic<bool> sharpEdge(false);
+	parallelFor(0, this->adjacentTriangles.size() / 2, 4096, [&](size_t begin, size_t end)
+	{
+		for (size_t pair = begin; pair < end && !sharpEdge.load(std::memory_order_relaxed); ++pair)
+		{
+			const float* n1 = &triangleNormals[3 * static_cast<size_t>(this->adjacentTriangles[2 * pair])];
+			const float* n2 = &triangleNormals[3 * static_cast<size_t>(this->adjacentTriangles[2 * pair + 1])];
+			if (static_cast<double>(n1[0]) * n2[0] + static_cast<double>(n1[1]) * n2[1] + static_cast<double>(n1[2]) * n2[2] <= cosFeatureAngle)
+			{
+				sharpEdge = true;
+			}
+		}
+	});
+	if (sharpEdge)
+	{
+		return false;
+	}
+
+	normals->SetNumberOfComponents(3);
+	normals->SetNumberOfTuples(this->numberOfPoints);
+	normals->SetName("Normals");
+	float* pointNormals = normals->GetPointer(0);
+	parallelFor(0, static_cast<size_t>(this->numberOfPoints), 4096, [&](size_t begin, size_t end)
+	{
+		for (size_t p = begin; p < end; ++p)
+		{
+			float sum[3] = { 0.0F, 0.0F, 0.0F };
+			for (size_t i = this->incidentOffsets[p]; i < this->incidentOffsets[p + 1]; ++i)
+			{
+				const float* n = &triangleNormals[3 * static_cast<size_t>(this->incidentTriangles[i])];
+				sum[0] += n[0];
+				sum[1] += n[1];
+				sum[2] += n[2];
+			}
+			const double length = std::sqrt(static_cast<double>(sum[0]) * sum[0] + static_cast<double>(sum[1]) * sum[1] + static_cast<double>(sum[2]) * sum[2]);
+			for (int a = 0; a < 3; ++a)
+			{
+				pointNormals[3 * p + a] = (length != 0.0) ? static_cast<float>(sum[a] / length) : sum[a];
+			}
+		}
+	});
+	return true;
+}
@@ -0,0 +1,54 @@
+#ifndef MODELTOPOLOGY_H
+#define MODELTOPOLOGY_H
+
+#include <vtkFloatArray.h>
+#include <vtkPoints.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Data of a face model (vtkSurfacePCA) that depends only on its triangulation and mean shape, computed once per model file and shared by all
+// instances loading it (the server loads the model for each request):
+// - Triangles incident to each vertex (ascending), and the pairs of triangles sharing an edge, for point normals of any shape of the model
+//   in one pass over the fixed triangle list, instead of running vtkPolyDataNormals on each synthesised surface.
+// - Cells of the mean surface closest to the mean landmarks (pseudo landmarks, see vtkSurfacePCA::GetParameterisedLandmarks), formerly located
+//   with a vtkCellLocator built over the mean surface by every instance.
+//
+// Instances are immutable once created, hence may be used concurrently.
+class ModelTopology
+{
+public:
+	// Topology of numberOfTriangles triangles (3 point ids each) over numberOfPoints points, with the cells and seed of the pseudo landmarks.
+	static std::shared_ptr<const ModelTopology> create(int numberOfPoints, int numberOfTriangles, const vtkIdType* triangles,
+		std::vector<vtkIdType> pseudoLandmarkCells, const double pseudoLandmarkSeed[3]);
+
+	// Topology of the model loaded from modelFileName, calling create on first request for the file and again once the file has changed
+	// (size or modification time). Without file name (model not loaded from a file), create is called every time. Thread-safe.
+	static std::shared_ptr<const ModelTopology> forModelFile(const std::string& modelFileName, const std::function<std::shared_ptr<const ModelTopology>()>& create);
+
+	// Writes the point normals vtkPolyDataNormals computes (default settings) for a surface with these triangles and points to normals:
+	// unit normals of the triangles summed per point in order of the triangles, normalised. Returns false, leaving normals unchanged, where
+	// vtkPolyDataNormals could compute others, i.e., if the number of points differs, if the triangles are not consistently oriented or not
+	// manifold (it would reorder or split them), or if any two adjacent triangles meet at more than its feature angle (it could split points).
+	bool computePointNormals(vtkPoints* points, vtkFloatArray* normals) const;
+
+	const std::vector<vtkIdType>& pseudoLandmarkCells() const { return this->landmarkCells; }
+
+	// Start point for evaluating the pseudo landmarks, i.e., the last landmark on the mean surface.
+	const double* pseudoLandmarkSeed() const { return this->landmarkSeed; }
+
+private:
+	int numberOfPoints = 0;
+	std::vector<vtkIdType> triangles; // 3 point ids per triangle
+	std::vector<size_t> incidentOffsets; // triangles incident to point p: incidentTriangles[incidentOffsets[p] .. incidentOffsets[p + 1])
+	std::vector<vtkIdType> incidentTriangles;
+	std::vector<vtkIdType> adjacentTriangles; // pairs of triangles sharing an edge
+	bool normalsSupported = false; // consistently oriented, manifold triangles, each point's triangles connected across edges
+
+	std::vector<vtkIdType> landmarkCells;
+	double landmarkSeed[3] = { 0.0, 0.0, 0.0 };
+};
+
+#endif // MODELTOPOLOGY_H
@@ -4,23 +4,37 @@
 #include "msNormalisationTools.h"
 
 #include "../mathUtils/C3dVector.h" 
+#include "../utils/cancellationToken.h"
+#include "../utils/computePool.h"
+#include "../utils/kernelSelection.h"
+#include "../utils/logger.h"
+#include "../utils/scratchArena.h"
+#include "../utils/stageTimer.h"
 
 //#include <vtkAutoInit.h>
 //VTK_MODULE_INIT(vtkRenderingOpenGL);
 //VTK_MODULE_INIT(vtkInteractionStyle); 
 //VTK_MODULE_INIT(vtkRenderingFreeType);
+#include <vtkFloatArray.h>
 #include <vtkMath.h>
+#include <vtkNew.h>
 #include <vtkPointData.h>
+#include <vtkPoints.h>
 
-#define mfcGUImessage(X) std::cout << "In msNormalisationTools.cpp: GUI message: " << X << endl;
+#define mfcGUImessage(X) logWarning() << "In msNormalisationTools.cpp: GUI message: " << X;
 
 using namespace std;
 
 // Free function for std::string formatting a la printf, replacing call to .Format method on MFC CStrings
 // May become obsolete when 'fields' datastructure is replaced.
 // Also used in classificationTools.cpp
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
 #include <memory>
 #include <stdexcept>
+#include <vector>
 template<typename ... Args>
 std::string string_format(const std::string& format, Args ... args)
 {
@@ -45,6 +59,7 @@ msNormalisationTools::msNormalisationTools(void)
 
 	this->current_ref_class ="";
 	this->ref_surfaces = NULL;
+	this->cancellation = NULL;
 }
 
 msNormalisationTools::~msNormalisationTools(void)
@@ -134,8 +149,60 @@ int msNormalisationTools::GetColumnIndex(CString column_label)
 	return -1; // didn't find!
 }
 
+msNormalisationTools::matchedMeanWindows msNormalisationTools::SelectMatchedMeanWindows(int *ref_indexes, int N_refs, int mm_n, int idxAgeColumn)
+{
+	matchedMeanWindows windows;
+	windows.size = std::min(mm_n, N_refs);
+	windows.all_examples = (mm_n >= N_refs);
+	if(windows.all_examples)
+		return windows;
+
+	//uses much the same code as moving avergae in rapid phenotyping 
+	const int n_moving_averages = N_refs - mm_n + 1;
+	std::vector<double> control_ages(N_refs); // array of ages for the control set
+	for(int i = 0; i < N_refs; i++)
+		control_ages[i] = std::stof(this->GetField(ref_indexes[i] + 1, idxAgeColumn));
+	//Sort the set so we have a sorted list of index's for matched mean calculation
+	double *control_age_array = control_ages.data();
+	SortSet(ref_indexes, control_age_array, N_refs);
+	// Calculate running mean ages 
+	windows.moving_average_ages.resize(n_moving_averages);
+	for(int i = 0; i < n_moving_averages; i++)
+	{
+		float mean_age = 0;
+		for(int m = 0; m < mm_n; m++)
+			mean_age += control_ages[i + m];
+		windows.moving_average_ages[i] = mean_age / (double)mm_n;
+	}
+	return windows;
+}
+
+int msNormalisationTools::matchedMeanWindows::StartForAge(int age) const
+{
+	if(all_examples)
+		return 0;
+	const int n_moving_averages = (int)moving_average_ages.size();
+	const float target_age = age;
+	int ma_index = 0;
+	//Find the closest moving average age
+	while(target_age > moving_average_ages[ma_index] && ma_index < n_moving_averages - 1)
+		ma_index++;
+	//if not the first in the list then find the closest
+	if(ma_index != 0)
+	{
+		double ma1 = target_age - moving_average_ages[ma_index - 1];
+		double ma2 = moving_average_ages[ma_index] - target_age;
+		if(ma1 < ma2)
+			ma_index--; // change index to reflect the choice
+		//index remains the same otherwise
+	}
+	return ma_index;
+}
+
 int msNormalisationTools::CalculateMatchedMeanSignificance(vtkPolyData *surface, vtkSmartPointer<vtkDoubleArray> b, int age, int mm_n, CString from_class, CString from_var, C3dVector axes[3],int which_axis, bool write_to_file)
 {
+	// Selection of the matched mean includes generating the reference surfaces of the selected set.
+	ScopedStageTimer matchedMeanSelectionTimer(Stage::MatchedMeanSelection);
 	std::vector<CString> example_filter_values;
 	std::vector<CString> example_filter_classes;
 
@@ -172,7 +239,8 @@ int msNormalisationTools::CalculateMatchedMeanSignificance(vtkPolyData *surface,
 			filters+="-"+example_filter_values.at(i); //cstring list of filter vars used
 	// in the format "MM-AGE-VAR-FILTER1-FILTER2-FILTER3";
 
-	if(mm_n>=N_refs) //use them all IF USER param exceeds that of the n_ref surfaces
+	const matchedMeanWindows windows = this->SelectMatchedMeanWindows(this->ref_example_indexes, N_refs, mm_n, idxAgeColumn);
+	if(windows.all_examples) //use them all IF USER param exceeds that of the n_ref surfaces
 	{
 		//Calculate mean surface, add it to the current_matched_mean_mode_values  
 		this->GetMeanModesForSet(this->ref_example_indexes, N_refs, this->mode_values[this->N_EXAMPLES-1]);
@@ -191,45 +259,15 @@ int msNormalisationTools::CalculateMatchedMeanSignificance(vtkPolyData *surface,
 			this->fields[this->N_EXAMPLES][this->N_CLASSIFICATIONS - this->GetNumTrainingModes() + 1 + i] = string_format("%f", this->mode_values[this->N_EXAMPLES - 1]->GetValue(i)); 
 				//MFC: this->fields[this->N_EXAMPLES][this->N_CLASSIFICATIONS-this->GetNumTrainingModes()+1+i].Format("%f",this->mode_values[this->N_EXAMPLES-1]->GetValue(i));
 				//return CalculateSignature(example_index, axes, which_axis, write_to_file, 1);
-		CalculateSignature(surface, b, this->ref_example_indexes, N_refs, axes, which_axis, write_to_file, 1);
+		this->GenerateRefClassSurfaces(this->ref_example_indexes, N_refs);
+		matchedMeanSelectionTimer.stop();
+		CalculateSignature(surface, b, axes, which_axis, write_to_file, 1);
 		return 0;
 	}
 
-	int n_moving_averages = N_refs-mm_n+1;
-	double *moving_average_ages= new double[n_moving_averages];
-	//else grab the correct N of examples and the best matched age
-	double *control_age_array = new double[N_refs]; // array of ages for the control set
-	//int *background_examples_index_array = new int[mm_n]; // resulting background exaamples for this target example
-	for(int i=0;i<N_refs;i++)	 // get array of ages
-		control_age_array[i] = std::stof(this->GetField( this->ref_example_indexes[i]+1,idxAgeColumn )); 
-	//Sort the set so we have a sorted list of index's for matched mean calculation
-	SortSet(this->ref_example_indexes, control_age_array, N_refs );
-	// Calculate running mean ages 
-	for(int i = 0; i < n_moving_averages; i++)
-	{
-		mean_age = 0;
-		for(int m = 0; m<mm_n; m++)
-			mean_age+=control_age_array[i+m];
-		moving_average_ages[i] = mean_age/(double)mm_n;
-	}
-	delete[] control_age_array;
-
 	int *matched_mean_set = new int[mm_n];
-	float target_age = age;
-	int ma_index = 0;
-	//Find the closest moving average age and add appropriate to the moving average set
-	while(target_age > moving_average_ages[ma_index] && ma_index<n_moving_averages-1)
-		ma_index++;
-	//if not the first in the list then find the closest
-	if(ma_index != 0)
-	{
-		double ma1 = target_age-moving_average_ages[ma_index-1];
-		double ma2 = moving_average_ages[ma_index]-target_age;
-		if(ma1<ma2)
-			ma_index--; // change index to reflect the choice
-		//index remains the same otherwise
-	}
-	mean_age = moving_average_ages[ma_index];
+	int ma_index = windows.StartForAge(age);
+	mean_age = windows.moving_average_ages[ma_index];
 	//  We now have the target individual data and the age of it age matched mean
 	//	create a set of moving averages by accessing the sorted control set
 	//	works out as indexes from ma_index to ma_index+i_ma in sorted list
@@ -238,8 +276,6 @@ int msNormalisationTools::CalculateMatchedMeanSignificance(vtkPolyData *surface,
 		matched_mean_set[index] = this->ref_example_indexes[ma_index];
 		ma_index++;
 	}
-	//clean up
-	delete []moving_average_ages;
 	//Calculate mean surface, add it to the current_matched_mean_mode_values  
 	{
 		mean_age = floor(mean_age * 10 + 0.5)/10 ;
@@ -254,10 +290,158 @@ int msNormalisationTools::CalculateMatchedMeanSignificance(vtkPolyData *surface,
 	}
 	 
 	//return significance
-	CalculateSignature(surface, b, matched_mean_set, mm_n, axes, which_axis, write_to_file, 1);
+	this->GenerateRefClassSurfaces(matched_mean_set, mm_n);
+	matchedMeanSelectionTimer.stop();
+	CalculateSignature(surface, b, axes, which_axis, write_to_file, 1);
 	return 0;
  }
   
+int msNormalisationTools::CalculateMatchedMeanSignificances(vtkPolyData *surface, vtkSmartPointer<vtkDoubleArray> b, const std::vector<int> &ages, std::vector<vtkSmartPointer<vtkDoubleArray>> &scalars, int mm_n, CString from_class, CString from_var)
+{
+	scalars.assign(ages.size(), nullptr);
+	if(ages.empty())
+		return 0;
+
+	//Legacy kernel: each distinct age as computed by CalculateMatchedMeanSignificance, restoring the scalars of the surface afterwards.
+	if(kernelSelection::useLegacy(Kernel::Signature))
+	{
+		vtkSmartPointer<vtkDataArray> surface_scalars = surface->GetPointData()->GetScalars();
+		std::map<int, vtkSmartPointer<vtkDoubleArray>> scalars_by_age;
+		for(const int age : ages)
+		{
+			if(scalars_by_age.count(age) > 0)
+				continue;
+			const int error_code = this->CalculateMatchedMeanSignificance(surface, b, age, mm_n, from_class, from_var);
+			if(error_code != 0 || CancellationToken::isCancelled(this->cancellation))
+			{
+				surface->GetPointData()->SetScalars(surface_scalars);
+				return error_code;
+			}
+			scalars_by_age[age] = vtkDoubleArray::SafeDownCast(surface->GetPointData()->GetScalars());
+		}
+		surface->GetPointData()->SetScalars(surface_scalars);
+		for(size_t i = 0; i < ages.size(); i++)
+		{
+			scalars[i] = vtkSmartPointer<vtkDoubleArray>::New();
+			scalars[i]->DeepCopy(scalars_by_age[ages[i]]);
+		}
+		return 0;
+	}
+
+	// Selection of the matched means as in CalculateMatchedMeanSignificance, sorting the reference set and averaging its ages once for all ages.
+	ScopedStageTimer matchedMeanSelectionTimer(Stage::MatchedMeanSelection);
+	if(from_var.compare("") == 0)
+		return -1;
+	const int idx_from_class_Column = GetColumnIndex(from_class);
+	if(idx_from_class_Column == -1)
+		return -4;
+	int *ref_indexes = NULL;
+	int N_refs(0);
+	this->GenerateFilteredRefIndexes(idx_from_class_Column, from_var, std::vector<CString>(), std::vector<CString>(), ref_indexes, N_refs);
+	const std::unique_ptr<int[]> ref_indexes_owner(ref_indexes);
+	if(N_refs < 2)
+		return -2;
+	const int idxAgeColumn = this->GetColumnIndex("age");
+	if(idxAgeColumn == -1)
+		return -3;
+
+	// Each age is matched to the window of window_size consecutive reference examples (in ref_indexes) starting at window_start_by_age[age].
+	const matchedMeanWindows windows = this->SelectMatchedMeanWindows(ref_indexes, N_refs, mm_n, idxAgeColumn);
+	const int window_size = windows.size;
+	std::map<int, int> window_start_by_age;
+	for(const int age : ages)
+		window_start_by_age[age] = windows.StartForAge(age);
+
+	// Distinct windows, and the reference surfaces of all of them.
+	std::vector<int> window_starts;
+	std::map<int, size_t> window_by_start;
+	for(const auto &age_window : window_start_by_age)
+	{
+		if(window_by_start.emplace(age_window.second, window_starts.size()).second)
+			window_starts.push_back(age_window.second);
+	}
+	const int first = *std::min_element(window_starts.begin(), window_starts.end());
+	const int last = *std::max_element(window_starts.begin(), window_starts.end()) + window_size;
+	std::vector<vtkSmartPointer<vtkPolyData>> reference_surfaces(N_refs);
+	parallelFor(first, last, 1, [&](size_t example, size_t)
+	{
+		reference_surfaces[example] = vtkSmartPointer<vtkPolyData>::New();
+		if(CancellationToken::isCancelled(this->cancellation))
+			return;
+		this->pca->GetParameterisedShape(this->mode_values[ref_indexes[example]], reference_surfaces[example]);
+	});
+	matchedMeanSelectionTimer.stop();
+	if(CancellationToken::isCancelled(this->cancellation))
+		return 0; // callers check the token
+
+	// Mean surface and its normals per window, as in CalculateSignature.
+	ScopedStageTimer signatureTimer(Stage::Signature);
+	const size_t W = window_starts.size();
+	std::vector<vtkSmartPointer<vtkPolyData>> mean_surfaces(W);
+	std::vector<vtkSmartPointer<vtkDataArray>> mean_normals(W);
+	std::vector<vtkSmartPointer<vtkDoubleArray>> window_scalars(W);
+	parallelFor(0, W, 1, [&](size_t w, size_t)
+	{
+		vtkNew<vtkDoubleArray> mean_mode_values;
+		mean_mode_values->SetNumberOfComponents(1);
+		mean_mode_values->SetNumberOfValues(this->GetNumTrainingModes());
+		vtkDoubleArray *mean_modes = mean_mode_values;
+		GetMeanModesForSet(ref_indexes + window_starts[w], window_size, mean_modes);
+		mean_surfaces[w] = vtkSmartPointer<vtkPolyData>::New();
+		this->pca->GetParameterisedShape(mean_mode_values, mean_surfaces[w]);
+	});
+	for(size_t w = 0; w < W; w++) // the model's topology is loaded by the first call
+	{
+		vtkNew<vtkFloatArray> topology_normals;
+		if(this->pca->ComputeSurfaceNormals(mean_surfaces[w], topology_normals))
+			mean_normals[w] = topology_normals.GetPointer();
+		else
+		{
+			vtkSmartPointer<vtkPolyData> temp_mean = vtkSmartPointer<vtkPolyData>::New();
+			temp_mean->DeepCopy(mean_surfaces[w]);
+			vtkNew<vtkPolyDataNormals> surface_normals;
+			surface_normals->SetInputData(temp_mean);
+			surface_normals->Update();
+			mean_normals[w] = surface_normals->GetOutput()->GetPointData()->GetNormals();
+		}
+
+		window_scalars[w] = vtkSmartPointer<vtkDoubleArray>::New();
+		window_scalars[w]->SetNumberOfComponents(1);
+		window_scalars[w]->SetNumberOfValues(mean_surfaces[w]->GetNumberOfPoints());
+		window_scalars[w]->SetName("Stdv");
+	}
+
+	std::atomic<bool> cancelled(false);
+	const std::vector<vtkPolyData*> reference_surface_pointers(reference_surfaces.begin(), reference_surfaces.end());
+	const std::vector<vtkPolyData*> mean_surface_pointers(mean_surfaces.begin(), mean_surfaces.end());
+	const std::vector<vtkDataArray*> normal_pointers(mean_normals.begin(), mean_normals.end());
+	const std::vector<vtkDoubleArray*> scalar_pointers(window_scalars.begin(), window_scalars.end());
+	if(!this->CalculateSignificanceOfWindowsInBlocks(surface, reference_surface_pointers, window_starts, window_size, mean_surface_pointers, normal_pointers, scalar_pointers, cancelled))
+	{
+		// Points or normals not float or double triples: one by one, with the legacy loop.
+		C3dVector no_axis(0, 0, 0);
+		for(size_t w = 0; w < W && !cancelled && !CancellationToken::isCancelled(this->cancellation); w++)
+		{
+			vtkNew<vtkPolyData> window_surface;
+			window_surface->ShallowCopy(surface);
+			int *matched_mean_set = new int[window_size]; // kept by ref_example_indexes, as in CalculateMatchedMeanSignificance
+			std::copy(ref_indexes + window_starts[w], ref_indexes + window_starts[w] + window_size, matched_mean_set);
+			this->GenerateRefClassSurfaces(matched_mean_set, window_size);
+			this->CalculateSignature(window_surface, b, &no_axis, -1, false, 1);
+			window_scalars[w] = vtkDoubleArray::SafeDownCast(window_surface->GetPointData()->GetScalars());
+		}
+	}
+	if(cancelled || CancellationToken::isCancelled(this->cancellation))
+		return 0;
+
+	for(size_t i = 0; i < ages.size(); i++)
+	{
+		scalars[i] = vtkSmartPointer<vtkDoubleArray>::New();
+		scalars[i]->DeepCopy(window_scalars[window_by_start[window_start_by_age[ages[i]]]]);
+	}
+	return 0;
+}
+
 void msNormalisationTools::GenerateRefClassSurfaces(int from_class, CString from_var)
 {
 	if(this->current_ref_class.compare(from_var)==0)
@@ -408,13 +592,14 @@ void msNormalisationTools::GenerateRefClassSurfaces(int *ref_class_index_array,
 	this->ref_surfaces = new vtkSmartPointer<vtkPolyData>[this->N_ref_surfaces];
 	 
  	// Create array of vtkpolydata for the reference surfaces
-	#pragma omp parallel for
-	for(int example = 0; example<n_ma; example++)
+	parallelFor(0, n_ma, 1, [&](size_t example, size_t)
 	{
 			this->ref_surfaces[example] = vtkSmartPointer<vtkPolyData>::New();	
+			if(CancellationToken::isCancelled(this->cancellation))
+				return; // CalculateSignature(..) returns early
 			int index = ref_class_index_array[example];
 			this->pca->GetParameterisedShape(this->mode_values[index],this->ref_surfaces[example]);	
-	}
+	});
 	this->ref_example_indexes = ref_class_index_array;
 }
    
@@ -586,6 +771,9 @@ void msNormalisationTools::CalculateSignature(vtkPolyData *surface,  vtkSmartPoi
 {
 	if(!this->ref_surfaces)
 		return; // there should be surfaces!
+	if(CancellationToken::isCancelled(this->cancellation))
+		return;
+	ScopedStageTimer signatureTimer(Stage::Signature);
 	//Obtain PCA modes
 	//Create the required mean surface
 	vtkPolyData *mean_surface = vtkPolyData::New();
@@ -598,26 +786,28 @@ void msNormalisationTools::CalculateSignature(vtkPolyData *surface,  vtkSmartPoi
 	//Calculate mean surface  
 	GetMeanModesForSet(this->ref_example_indexes, N, mean_mode_values);
 	//Get mean and individual surface from mode values
-	#pragma omp parallel sections
-	{
-		#pragma omp section
-			this->pca->GetParameterisedShape(mean_mode_values, mean_surface);
-	}
+	this->pca->GetParameterisedShape(mean_mode_values, mean_surface);
 
 	//Mean and sd mode values no longer needed dump them	
 	mean_mode_values->Delete(); 
 	//Get num of points
 	const int N_POINTS = mean_surface->GetNumberOfPoints();
 	const int euclidean_option = 2;
-	//TO CORRECT A  PIPELINE BUG
-	vtkSmartPointer<vtkPolyData> temp_mean = 
-		vtkSmartPointer<vtkPolyData>::New();
-	temp_mean->DeepCopy(mean_surface);
-
-	//Generate surface normals for mean ref surface
-	vtkPolyDataNormals *surface_normals = vtkPolyDataNormals::New();
-	surface_normals->SetInputData(temp_mean);
-	surface_normals->Update(); // since we will bypass the pipeline soon
+	//Surface normals for mean ref surface, generated with vtkPolyDataNormals only where the model's cached topology cannot (see ModelTopology).
+	vtkPolyDataNormals *surface_normals = NULL;
+	auto GenerateSurfaceNormals = [&]()
+	{
+		if(surface_normals)
+			return;
+		//TO CORRECT A  PIPELINE BUG
+		vtkSmartPointer<vtkPolyData> temp_mean = 
+			vtkSmartPointer<vtkPolyData>::New();
+		temp_mean->DeepCopy(mean_surface);
+
+		surface_normals = vtkPolyDataNormals::New();
+		surface_normals->SetInputData(temp_mean);
+		surface_normals->Update(); // since we will bypass the pipeline soon
+	};
 	
 	//Result stdv scalar array/curvature values
 	vtkDoubleArray *scalars = vtkDoubleArray::New();
@@ -625,50 +815,81 @@ void msNormalisationTools::CalculateSignature(vtkPolyData *surface,  vtkSmartPoi
     scalars->SetNumberOfValues(N_POINTS);
 	scalars->SetName("Stdv");
   
-	float min_found=FLT_MAX,max_found=-FLT_MAX;
- 
 	//Calculate scalar values for mean d
-
-	for(int i = 0; i<N_POINTS; i++)
+	const int CANCELLATION_CHECK_INTERVAL = 1024; // polling the token costs a clock read
+	std::atomic<bool> cancelled(false);
+	bool computedInBlocks = false;
+	if(!kernelSelection::useLegacy(Kernel::Signature) && !this->b_use_curvature && euclidean_option == 2 && (which_axis < 0 || which_axis >= 3))
 	{
-		float d=0;
-		float sum_squares = 0;
-		#pragma omp parallel for reduction(+:d) reduction(+:sum_squares)
-		for(int example = 0; example<N; example++)
+		vtkNew<vtkFloatArray> mean_normals;
+		if(this->pca->ComputeSurfaceNormals(mean_surface, mean_normals))
+			computedInBlocks = this->CalculateSignificanceInBlocks(surface, mean_surface, mean_normals, scalars, cancelled);
+		else
 		{
-			float dist(0.0F);
-				if(!this->b_use_curvature)
-					dist = this->CalculateDBetweenSurfaces(i, euclidean_option, surface_normals, mean_surface->GetPoint(i), ref_surfaces[example]->GetPoint(i), axes, which_axis);	 
-	 
-			d+=dist; 
-			sum_squares += pow(dist,2);
+			GenerateSurfaceNormals();
+			computedInBlocks = this->CalculateSignificanceInBlocks(surface, mean_surface, surface_normals->GetOutput()->GetPointData()->GetNormals(), scalars, cancelled);
 		}
+	}
+	//Legacy: points are processed in chunks on the compute pool, reading points with the thread-safe GetPoint(i, x) rather than GetPoint(i).
+	if(!computedInBlocks && !cancelled)
+	{
+		GenerateSurfaceNormals();
+		parallelFor(0, N_POINTS, CANCELLATION_CHECK_INTERVAL, [&](size_t chunkBegin, size_t chunkEnd)
+		{
+			if(cancelled || CancellationToken::isCancelled(this->cancellation))
+			{
+				cancelled = true;
+				return;
+			}
+			for(int i = static_cast<int>(chunkBegin); i<static_cast<int>(chunkEnd); i++)
+			{
+				double p_on_mean[3];
+				mean_surface->GetPoint(i, p_on_mean);
+				float d=0;
+				float sum_squares = 0;
+				for(int example = 0; example<N; example++)
+				{
+					float dist(0.0F);
+						if(!this->b_use_curvature)
+						{
+							double p_on_reference[3];
+							ref_surfaces[example]->GetPoint(i, p_on_reference);
+							dist = this->CalculateDBetweenSurfaces(i, euclidean_option, surface_normals, p_on_mean, p_on_reference, axes, which_axis);	 
+						}
+	 
+					d+=dist; 
+					sum_squares += pow(dist,2);
+				}
 		
-		//divide d by n to get the mean d for this point
-		float sd_d = sqrt(sum_squares/(N-1));
- 		float mean_d = d/N;
+				//divide d by n to get the mean d for this point
+				float sd_d = sqrt(sum_squares/(N-1));
+	 			float mean_d = d/N;
 	 
-		//Calculate surface d for this point
-		float surface_d ;
-		if(!this->b_use_curvature)
-			surface_d = CalculateDBetweenSurfaces(i, euclidean_option, surface_normals, mean_surface->GetPoint(i), surface->GetPoint(i),axes, which_axis);
-		else 
-			surface_d = surface->GetPointData()->GetScalars()->GetTuple(i)[0] - mean_surface->GetPointData()->GetScalars()->GetTuple(i)[0];
-		//Calcualte statistical significance dist
-		float dist = 0;
-		if(sd_d!= 0) //check we're not dividing by 0! Can happen if curvature at a point on example is equal to that of the mean. Dist then  =0 ;
-		 dist = (surface_d-mean_d)/sd_d;
+				//Calculate surface d for this point
+				float surface_d ;
+				if(!this->b_use_curvature)
+				{
+					double p_on_surface[3];
+					surface->GetPoint(i, p_on_surface);
+					surface_d = CalculateDBetweenSurfaces(i, euclidean_option, surface_normals, p_on_mean, p_on_surface, axes, which_axis);
+				}
+				else 
+					surface_d = surface->GetPointData()->GetScalars()->GetComponent(i,0) - mean_surface->GetPointData()->GetScalars()->GetComponent(i,0);
+				//Calcualte statistical significance dist
+				float dist = 0;
+				if(sd_d!= 0) //check we're not dividing by 0! Can happen if curvature at a point on example is equal to that of the mean. Dist then  =0 ;
+				 dist = (surface_d-mean_d)/sd_d;
  
-		if(dist<min_found)
-			min_found=dist;
-		if(dist>max_found)
-			max_found=dist;	
-		// assign the scalar at this vertex
-		scalars->SetValue(i,dist); 
+				// assign the scalar at this vertex
+				scalars->SetValue(i,dist); 
+			}
+		});
 	}
 	mean_surface->Delete();
-	surface_normals->Delete();
-	surface->GetPointData()->SetScalars(scalars);
+	if(surface_normals)
+		surface_normals->Delete();
+	if(!cancelled)
+		surface->GetPointData()->SetScalars(scalars);
 	
     scalars->Delete();
 }
@@ -722,6 +943,188 @@ float msNormalisationTools::CalculateDBetweenSurfaces(int i, int euclidean_optio
 	return dist;
 }
 
+namespace
+{
+	// Copies triples [begin, end) of an array of float or double triples (e.g., the data of vtkPoints) to x, y, z.
+	template<typename ValueType>
+	void GatherTriples(const ValueType *xyz, size_t begin, size_t end, double *x, double *y, double *z)
+	{
+		for(size_t i = begin; i < end; i++)
+		{
+			x[i - begin] = static_cast<double>(xyz[3 * i]);
+			y[i - begin] = static_cast<double>(xyz[3 * i + 1]);
+			z[i - begin] = static_cast<double>(xyz[3 * i + 2]);
+		}
+	}
+
+	// Raw buffer of a data array of triples; data is nullptr if the array is not of float or double triples or has fewer than n tuples.
+	struct TripleBuffer
+	{
+		const void *data = nullptr;
+		int type = 0;
+
+		TripleBuffer(vtkDataArray *array, vtkIdType n)
+		{
+			if(array && array->GetNumberOfComponents() == 3 && array->GetNumberOfTuples() >= n && (array->GetDataType() == VTK_FLOAT || array->GetDataType() == VTK_DOUBLE))
+			{
+				this->data = array->GetVoidPointer(0);
+				this->type = array->GetDataType();
+			}
+		}
+
+		void Gather(size_t begin, size_t end, double *x, double *y, double *z) const
+		{
+			if(this->type == VTK_FLOAT)
+				GatherTriples(static_cast<const float*>(this->data), begin, end, x, y, z);
+			else
+				GatherTriples(static_cast<const double*>(this->data), begin, end, x, y, z);
+		}
+	};
+
+	// CalculateDBetweenSurfaces with euclidean_option 2 for n points p_on_surface (px, py, pz) and p_on_reference (rx, ry, rz), with the
+	// surface normals (nx, ny, nz) already normalised: |d| (d/|d|).n, d = p_on_surface - p_on_reference, rounded to float like the legacy code.
+	inline void DistancesAlongNormals(size_t n, const double *px, const double *py, const double *pz, const double *nx, const double *ny, const double *nz,
+		const double *rx, const double *ry, const double *rz, float *dist)
+	{
+		#pragma omp simd
+		for(size_t v = 0; v < n; v++)
+		{
+			const double dx = px[v] - rx[v];
+			const double dy = py[v] - ry[v];
+			const double dz = pz[v] - rz[v];
+			const double length = std::sqrt(dx * dx + dy * dy + dz * dz);
+			const float d = static_cast<float>(length);
+			// vtkMath::Normalize leaves a zero vector unchanged, so coinciding points have distance 0.
+			const double cosine = (length != 0.0) ? (dx / length) * nx[v] + (dy / length) * ny[v] + (dz / length) * nz[v] : 0.0;
+			dist[v] = static_cast<float>(d * cosine);
+		}
+	}
+}
+
+bool msNormalisationTools::CalculateSignificanceInBlocks(vtkPolyData *surface, vtkPolyData *mean_surface, vtkDataArray *normals, vtkDoubleArray *scalars, std::atomic<bool> &cancelled)
+{
+	const std::vector<vtkPolyData*> reference_surfaces(this->ref_surfaces, this->ref_surfaces + this->N_ref_surfaces);
+	return this->CalculateSignificanceOfWindowsInBlocks(surface, reference_surfaces, { 0 }, this->N_ref_surfaces, { mean_surface }, { normals }, { scalars }, cancelled);
+}
+
+bool msNormalisationTools::CalculateSignificanceOfWindowsInBlocks(vtkPolyData *surface, const std::vector<vtkPolyData*> &reference_surfaces, const std::vector<int> &window_starts, int window_size,
+	const std::vector<vtkPolyData*> &mean_surfaces, const std::vector<vtkDataArray*> &normals, const std::vector<vtkDoubleArray*> &scalars, std::atomic<bool> &cancelled)
+{
+	const size_t W = window_starts.size();
+	const int N = window_size;
+	if(W == 0 || mean_surfaces.size() != W || normals.size() != W || scalars.size() != W)
+		return false;
+	const vtkIdType N_POINTS = mean_surfaces[0]->GetNumberOfPoints();
+	if(!surface->GetPoints() || surface->GetNumberOfPoints() != N_POINTS)
+		return false;
+	const TripleBuffer surfacePoints(surface->GetPoints()->GetData(), N_POINTS);
+	if(!surfacePoints.data)
+		return false;
+	std::vector<TripleBuffer> meanPoints, normalVectors;
+	meanPoints.reserve(W);
+	normalVectors.reserve(W);
+	for(size_t w = 0; w < W; w++)
+	{
+		if(!mean_surfaces[w]->GetPoints() || mean_surfaces[w]->GetNumberOfPoints() != N_POINTS || window_starts[w] < 0
+			|| window_starts[w] + N > static_cast<int>(reference_surfaces.size()))
+			return false;
+		meanPoints.emplace_back(mean_surfaces[w]->GetPoints()->GetData(), N_POINTS);
+		normalVectors.emplace_back(normals[w], N_POINTS);
+		if(!meanPoints.back().data || !normalVectors.back().data)
+			return false;
+	}
+	// Reference surfaces of any window, in the order of the windows (ascending age for matched means).
+	const int first = *std::min_element(window_starts.begin(), window_starts.end());
+	const int last = *std::max_element(window_starts.begin(), window_starts.end()) + N;
+	std::vector<TripleBuffer> referencePoints;
+	referencePoints.reserve(last - first);
+	for(int example = first; example < last; example++)
+	{
+		vtkPoints *points = reference_surfaces[example]->GetPoints();
+		referencePoints.emplace_back(points ? points->GetData() : nullptr, N_POINTS);
+		if(!referencePoints.back().data || reference_surfaces[example]->GetNumberOfPoints() != N_POINTS)
+			return false;
+	}
+
+	const size_t BLOCK_SIZE = 1024; // also the interval of polling the token, which costs a clock read
+	parallelFor(0, static_cast<size_t>(N_POINTS), BLOCK_SIZE, [&](size_t blockBegin, size_t blockEnd)
+	{
+		if(cancelled || CancellationToken::isCancelled(this->cancellation))
+		{
+			cancelled = true;
+			return;
+		}
+		const size_t n = blockEnd - blockBegin;
+		ScratchVector<double> buffer((3 + 6 * W) * n);
+		double *rx = buffer.data(), *ry = rx + n, *rz = ry + n; // points of a reference surface, then of the surface
+		double *windowBuffers = rz + n; // per window: mean points, normalised normals of the mean
+		ScratchVector<float> accumulators((1 + 2 * W) * n);
+		float *dist = accumulators.data();
+		float *windowAccumulators = dist + n; // per window: d, sum_squares
+
+		for(size_t w = 0; w < W; w++)
+		{
+			double *mx = windowBuffers + 6 * w * n, *my = mx + n, *mz = my + n;
+			double *nx = mz + n, *ny = nx + n, *nz = ny + n;
+			float *d = windowAccumulators + 2 * w * n, *sum_squares = d + n;
+			meanPoints[w].Gather(blockBegin, blockEnd, mx, my, mz);
+			normalVectors[w].Gather(blockBegin, blockEnd, nx, ny, nz);
+			#pragma omp simd
+			for(size_t v = 0; v < n; v++)
+			{
+				const double length = std::sqrt(nx[v] * nx[v] + ny[v] * ny[v] + nz[v] * nz[v]);
+				if(length != 0.0)
+				{
+					nx[v] /= length;
+					ny[v] /= length;
+					nz[v] /= length;
+				}
+				d[v] = 0.0F;
+				sum_squares[v] = 0.0F;
+			}
+		}
+
+		// Examples in the order of the legacy loop, which accumulates in float.
+		for(int example = first; example < last; example++)
+		{
+			referencePoints[example - first].Gather(blockBegin, blockEnd, rx, ry, rz);
+			for(size_t w = 0; w < W; w++)
+			{
+				if(example < window_starts[w] || example >= window_starts[w] + N)
+					continue;
+				const double *mx = windowBuffers + 6 * w * n, *my = mx + n, *mz = my + n;
+				const double *nx = mz + n, *ny = nx + n, *nz = ny + n;
+				float *d = windowAccumulators + 2 * w * n, *sum_squares = d + n;
+				DistancesAlongNormals(n, mx, my, mz, nx, ny, nz, rx, ry, rz, dist);
+				#pragma omp simd
+				for(size_t v = 0; v < n; v++)
+				{
+					d[v] += dist[v];
+					sum_squares[v] = static_cast<float>(sum_squares[v] + static_cast<double>(dist[v]) * dist[v]);
+				}
+			}
+		}
+
+		surfacePoints.Gather(blockBegin, blockEnd, rx, ry, rz);
+		for(size_t w = 0; w < W; w++)
+		{
+			const double *mx = windowBuffers + 6 * w * n, *my = mx + n, *mz = my + n;
+			const double *nx = mz + n, *ny = nx + n, *nz = ny + n;
+			const float *d = windowAccumulators + 2 * w * n, *sum_squares = d + n;
+			double *stdv = scalars[w]->GetPointer(0);
+			DistancesAlongNormals(n, mx, my, mz, nx, ny, nz, rx, ry, rz, dist);
+			#pragma omp simd
+			for(size_t v = 0; v < n; v++)
+			{
+				const float sd_d = std::sqrt(sum_squares[v] / (N - 1));
+				const float mean_d = d[v] / N;
+				stdv[blockBegin + v] = (sd_d != 0.0F) ? (dist[v] - mean_d) / sd_d : 0.0F;
+			}
+		}
+	});
+	return true;
+}
+
 bool msNormalisationTools::LoadProjectionFile(string projection_FileName)
 {
 	// formerly CFaceMarkDoc::OpenAugmentedDatasetFile(CString filename)
@@ -779,7 +1182,7 @@ bool msNormalisationTools::LoadProjectionFile(string projection_FileName)
 		}
 		else //(!in)
 		{
-			cerr << "In FaceScreeningObject::openProjectionFile (msNormalisationTools.cpp): Could not open file for reading!" << endl;
+			logError() << "In FaceScreeningObject::openProjectionFile (msNormalisationTools.cpp): Could not open file for reading!";
 			return false;
 		}
 	};
@@ -788,7 +1191,7 @@ bool msNormalisationTools::LoadProjectionFile(string projection_FileName)
 	FILE* projectionFile = fopen(projection_FileName.c_str(), "rt");
 	if (!projectionFile)
 	{
-		std::cerr << "In msNormalisationTools.cpp: Could not open projection file. File not found. " << std::endl;
+		logError() << "In msNormalisationTools.cpp: Could not open projection file. File not found. ";
 		return false;
 	}
 	// Warning: Don't try to close projectionFile. That's done already in the lambda 'openProjectionFile' above. 
@@ -796,7 +1199,7 @@ bool msNormalisationTools::LoadProjectionFile(string projection_FileName)
 
 	if (!openProjectionFile(projectionFile))
 	{
-		std::cerr << "In msNormalisationTools.cpp: Could not open projection file. " << std::endl;
+		logError() << "In msNormalisationTools.cpp: Could not open projection file. ";
 		return false;
 	}
 
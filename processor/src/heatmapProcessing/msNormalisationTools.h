@@ -1,7 +1,9 @@
 #ifndef MSNORMALISATIONTOOLS_H
 #define MSNORMALISATIONTOOLS_H
 
+#include <atomic>
 #include <string>
+#include <vector>
 #define CString std::string //TODO remove
 
 #include <vtkPolyData.h>
@@ -11,6 +13,8 @@
 #include "../mathUtils/C3dVector.h"
 #include "vtkSurfacePCA.h"
 
+class CancellationToken;
+
 using namespace std;
 
 //rh TODO: address all these memory leaks: fields, mode_values, C3dVector etc.
@@ -38,9 +42,26 @@ protected:
 	CString current_ref_class;
 	int GetNumTrainingModes() { return this->pca->GetTotalNumModes(); } //this->N_MODES; }
 	void GetMeanModesForSet(int *set,int n_set, vtkDoubleArray *&mean_modes );
+	const CancellationToken* cancellation;
+
+	// Moving average windows of a reference set for matching an age, as selected by SelectMatchedMeanWindows.
+	struct matchedMeanWindows
+	{
+		int size; // reference examples per window
+		bool all_examples; // mm_n >= N_refs: one window of all reference examples, unsorted
+		std::vector<double> moving_average_ages; // mean age of the window starting at each index of the sorted set, unless all_examples
+		// Start of the window whose mean age is closest to age.
+		int StartForAge(int age) const;
+	};
+	// Sorts ref_indexes (N_refs reference examples) by age, unless mm_n >= N_refs, and averages the ages of its windows of mm_n consecutive examples.
+	// Shared by CalculateMatchedMeanSignificance and CalculateMatchedMeanSignificances.
+	matchedMeanWindows SelectMatchedMeanWindows(int *ref_indexes, int N_refs, int mm_n, int idxAgeColumn);
 
 public:
 	void SetPCAModel(vtkSurfacePCA *pca) { this->pca = pca; };
+	// Token polled by the long loops of the signature computation; nullptr (default) never cancels.
+	// If it is cancelled during CalculateSignature(..), the surface scalars are left unchanged. Callers check the token after returning.
+	void SetCancellationToken(const CancellationToken* cancellation) { this->cancellation = cancellation; };
 	msNormalisationTools(void);
 	bool is_model_loaded;
 	
@@ -62,6 +83,14 @@ public:
 		int which_axis = -1, 
 		bool write_to_file = false);
 
+	// CalculateMatchedMeanSignificance for several ages of the same surface at once, e.g., chronological and developmental age: the reference set is
+	// selected and sorted by age once, ages matched to the same moving average window share their significance, reference surfaces are generated
+	// once for the union of all windows, and the significance of all windows is computed in one pass over the vertex blocks (see
+	// CalculateSignificanceOfWindowsInBlocks). On success, scalars holds one "Stdv" array per age; the scalars of surface are left unchanged.
+	// Returns the error codes of CalculateMatchedMeanSignificance. With the legacy signature kernel (see kernelSelection.h), the ages are computed one by one.
+	int CalculateMatchedMeanSignificances(vtkPolyData *surface, vtkSmartPointer<vtkDoubleArray> b, const std::vector<int> &ages, std::vector<vtkSmartPointer<vtkDoubleArray>> &scalars,
+		int mm_n = 35, CString from_class = std::string("Dx"), CString from_var = std::string("control"));
+
 	void GenerateMatchedMeanForAge(std::vector<CString> mm_filter_classes, int mm_n, CString from_class, CString from_var, int age);
 	void CalculateSignature(vtkPolyData *surface, vtkSmartPointer<vtkDoubleArray> b, int from_class, CString from_var, C3dVector axes[3],int which_axis, bool write_to_file);
 	void CalculateSignature(vtkPolyData *surface, vtkSmartPointer<vtkDoubleArray> b, int *example_index_array, int ma, C3dVector axes[3],int which_axis, bool write_to_file, float scale_factor);
@@ -77,6 +106,15 @@ public:
 	void GenerateRefClassSurfaces(int *example_index_array, int ma);
 	//Calculate dist between two surfaces based on euclidean_option
 	float CalculateDBetweenSurfaces(int i, int euclidean_option, vtkPolyDataNormals *surface_normals, double p_on_surface[3],double p_on_reference[3], C3dVector axes[3],int which_axis); 
+	// Optimised significance ("Stdv") computation of CalculateSignature (Kernel::Signature, see kernelSelection.h) for euclidean_option 2 without axis:
+	// vertex blocks run in parallel, copying mean, normal, reference and surface points to struct-of-arrays buffers, so that the loops over
+	// the vertices of a block vectorise. Arithmetic follows CalculateDBetweenSurfaces, so scalars match the legacy loop.
+	// Returns false, leaving scalars unchanged, if the point or normal arrays are not float or double triples; cancelled is set if the token is cancelled.
+	bool CalculateSignificanceInBlocks(vtkPolyData *surface, vtkPolyData *mean_surface, vtkDataArray *normals, vtkDoubleArray *scalars, std::atomic<bool> &cancelled);
+	// As above, for several windows of reference surfaces at once: window w consists of window_size reference surfaces from reference_surfaces[window_starts[w]] on,
+	// compared to mean_surfaces[w] along normals[w], into scalars[w]. Each reference surface is gathered once per vertex block, for all windows containing it.
+	bool CalculateSignificanceOfWindowsInBlocks(vtkPolyData *surface, const std::vector<vtkPolyData*> &reference_surfaces, const std::vector<int> &window_starts, int window_size,
+		const std::vector<vtkPolyData*> &mean_surfaces, const std::vector<vtkDataArray*> &normals, const std::vector<vtkDoubleArray*> &scalars, std::atomic<bool> &cancelled);
 	
 
 	//GetColumnIndex
@@ -27,10 +27,17 @@
 
 #include "vtkSurfacePCA.h"
 #include "../mathUtils/faceScreenMath.h"
+#include "../mathUtils/procrustes.h"
+#include "../utils/cancellationToken.h"
+#include "../utils/kernelSelection.h"
+#include "../utils/logger.h"
+#include "../utils/scratchArena.h"
+#include "../utils/sha256.h"
+#include "../utils/stageTimer.h"
 
-#define vtkErrorMacro_pca(X) std::cout << "In vtkSurfacePCA.cpp: VTK error message: " X << endl;
-#define vtkDebugMacro_pca(X) std::cout << "In vtkSurfacePCA.cpp: VTK debug message: " X << endl;
-#define mfcGUImessage_pca(X) std::cout << "In vtkSurfacePCA.cpp: GUI message: " << X << endl;
+#define vtkErrorMacro_pca(X) logError() << "In vtkSurfacePCA.cpp: VTK error message: " X;
+#define vtkDebugMacro_pca(X) logDebug() << "In vtkSurfacePCA.cpp: VTK debug message: " X;
+#define mfcGUImessage_pca(X) logWarning() << "In vtkSurfacePCA.cpp: GUI message: " << X;
 
 // TODO: required ??  vtkCxxRevisionMacro(vtkSurfacePCA, "$Revision: 1.5 $");
 vtkStandardNewMacro(vtkSurfacePCA);
@@ -61,8 +68,6 @@ vtkSurfacePCA::vtkSurfacePCA()
     this->mean_surface_landmarks = NULL;
 	this->mean_landmarks = NULL;
 	this->current_landmarks = NULL;
-	this->pseudo_landmarks_loaded = false;
-	this->pseudo_landmark_indexes = NULL;
 }
 
 //----------------------------------------------------------------------------
@@ -99,7 +104,6 @@ vtkSurfacePCA::~vtkSurfacePCA()
     if(this->example_landmarks)        this->example_landmarks->Delete();
     if(this->example_surface)	       this->example_surface->Delete();
 	if(this->mean_landmarks)	       delete []this->mean_landmarks; //for some reason crashes everythign!? Even though it's not deleted anywhere else.
-    if(this->pseudo_landmark_indexes)  delete []this->pseudo_landmark_indexes;
 	if(this->current_landmarks)        delete []this->current_landmarks;
 }
 
@@ -168,16 +172,14 @@ void vtkSurfacePCA::ParameteriseShape(vtkSmartPointer<vtkDoubleArray> b, vtkSmar
 	}
 
 	const int bsize = b->GetNumberOfTuples();
-	std::vector<double> weights;
-	weights.resize(bsize);
+	ScratchVector<double> weights(bsize);
 	for (int i = 0; i < bsize; i++) 
 	{
 		const double eigenValue = this->Evals->GetValue(i);
 		weights[i] = sqrt(eigenValue) * b->GetValue(i);
 	}
 	
-	std::vector<double> shapeVector;
-	shapeVector.resize(N * 3);
+	ScratchVector<double> shapeVector(N * 3);
 	for (int j = 0; j < this->N * 3; j++) {
 		shapeVector[j] = meanshape[j];
 		for (int i = 0; i < bsize; i++) {
@@ -228,9 +230,9 @@ void vtkSurfacePCA::GetParameterisedShape(vtkDoubleArray *b, vtkPolyData* shape)
     
     // b is weighted by the eigenvals
     // make weigth vector for speed reasons
-    double *shapevec = NewVector(this->N*3);
+    ScratchVector<double> shapevec(this->N*3);
     const int bsize = std::min(b->GetNumberOfTuples(),this->Evals->GetNumberOfTuples());
-    double *w = NewVector(bsize);
+    ScratchVector<double> w(bsize);
     double eval;
     for (int i = 0; i < bsize; i++) {
         eval = this->Evals->GetValue(i);
@@ -250,9 +252,6 @@ void vtkSurfacePCA::GetParameterisedShape(vtkDoubleArray *b, vtkPolyData* shape)
     for (int i = 0; i < this->N; i++) {
         shape->GetPoints()->SetPoint(i,shapevec[i*3  ], shapevec[i*3+1], shapevec[i*3+2]);
     }
-
-    DeleteVector(shapevec);
-    DeleteVector(w);
 }
 
 void vtkSurfacePCA::GetParameterisedLandmarks(vtkPolyData* surface, vtkPolyData* landmarks)
@@ -266,96 +265,180 @@ void vtkSurfacePCA::GetParameterisedLandmarks(vtkPolyData* surface, vtkPolyData*
         landmarks->SetPoints(points);
     }
 
-	vtkIdType cellId;
+	const ModelTopology& topology = this->GetTopology();
 	int subId;
 	double dist2,p[3];
 	double pcoords[3];
 	double weights[3];
 
-	if(!pseudo_landmarks_loaded)
-	{
-		pseudo_landmark_indexes = new vtkIdType[this->n_landmarks];
-	
-		vtkSmartPointer<vtkCellLocator> locator = vtkSmartPointer<vtkCellLocator>::New();
-		vtkSmartPointer<vtkPolyData> mean_surface = vtkSmartPointer<vtkPolyData>::New();
-		vtkDoubleArray *b = vtkDoubleArray::New();
-		b->SetNumberOfValues(0);
-		this->GetParameterisedShape(b, mean_surface);
-		locator->SetDataSet(mean_surface);
-		locator->Update();
-
-		vtkSmartPointer<vtkGenericCell> cell = vtkSmartPointer<vtkGenericCell>::New();
- 
-		for(int i=0;i<this->n_landmarks;i++)
-		{
-			p[0]=this->mean_landmarks[i*3+0];
-			p[1]=this->mean_landmarks[i*3+1];
-			p[2]=this->mean_landmarks[i*3+2];
-			locator->FindClosestPoint(p,p,cell,cellId,subId,dist2);
-			// find the dataset coords for point p
-			cell->EvaluatePosition(p,p,subId,pcoords,dist2,weights);
-			pseudo_landmark_indexes[i]=cellId;
-		}
-		pseudo_landmarks_loaded = true;		
-	}
-
-	for(int i=0;i<this->n_landmarks;i++)
+	// Each landmark is evaluated starting from the previous one, the first from the last landmark on the mean surface.
+	const std::vector<vtkIdType>& cells = topology.pseudoLandmarkCells();
+	p[0] = topology.pseudoLandmarkSeed()[0];
+	p[1] = topology.pseudoLandmarkSeed()[1];
+	p[2] = topology.pseudoLandmarkSeed()[2];
+	for(int i=0;i<this->n_landmarks && i<static_cast<int>(cells.size());i++)
 	{	//cell->EvaluatePosition(p,p,subId,pcoords,dist2,weights);
-		surface->GetCell(pseudo_landmark_indexes[i])->EvaluatePosition(p,p,subId,pcoords,dist2,weights);
+		surface->GetCell(cells[i])->EvaluatePosition(p,p,subId,pcoords,dist2,weights);
 		landmarks->GetPoints()->SetPoint(i,p[0], p[1], p[2]);
 	}
 
 	this->SetCurrentLandmarks(landmarks);
 }
 
-void vtkSurfacePCA::GetShapeParameters(vtkPolyData *triangularSubjectMesh, vtkDoubleArray *b, int nmodes, int rigid_body)
-{ 
-    vtkNew<vtkPoints> mean_points;
-    mean_points->SetNumberOfPoints(this->N);
+const ModelTopology& vtkSurfacePCA::GetTopology()
+{
+	if(!this->topology)
+	{
+		this->topology = ModelTopology::forModelFile(this->model_file_name, [this]()
+		{
+			// Pseudo landmarks: cells of the mean surface closest to the mean landmarks
+			std::vector<vtkIdType> cells(this->n_landmarks);
+			vtkIdType cellId;
+			int subId;
+			double dist2,p[3] = {0.0, 0.0, 0.0};
+			double pcoords[3];
+			double weights[3];
 
-	//#pragma omp parallel for
-	for (int i = 0; i < this->N; i++)
+			vtkSmartPointer<vtkCellLocator> locator = vtkSmartPointer<vtkCellLocator>::New();
+			vtkSmartPointer<vtkPolyData> mean_surface = vtkSmartPointer<vtkPolyData>::New();
+			vtkSmartPointer<vtkDoubleArray> b = vtkSmartPointer<vtkDoubleArray>::New();
+			b->SetNumberOfValues(0);
+			this->GetParameterisedShape(b, mean_surface);
+			locator->SetDataSet(mean_surface);
+			locator->Update();
+
+			vtkSmartPointer<vtkGenericCell> cell = vtkSmartPointer<vtkGenericCell>::New();
+			for(int i=0;i<this->n_landmarks;i++)
+			{
+				p[0]=this->mean_landmarks[i*3+0];
+				p[1]=this->mean_landmarks[i*3+1];
+				p[2]=this->mean_landmarks[i*3+2];
+				locator->FindClosestPoint(p,p,cell,cellId,subId,dist2);
+				// find the dataset coords for point p
+				cell->EvaluatePosition(p,p,subId,pcoords,dist2,weights);
+				cells[i]=cellId;
+			}
+			return ModelTopology::create(this->N, this->n_cells, this->polys, std::move(cells), p);
+		});
+	}
+	return *this->topology;
+}
+
+bool vtkSurfacePCA::ComputeSurfaceNormals(vtkPolyData* shape, vtkFloatArray* normals)
+{
+	if(!shape->GetPolys() || shape->GetPolys()->GetNumberOfCells() != this->n_cells)
+		return false; // triangles other than the model's
+	return this->GetTopology().computePointNormals(shape->GetPoints(), normals);
+}
+
+std::string vtkSurfacePCA::GetBaseMeshDigest()
+{
+	Sha256 digest;
+	digest.updateValue(this->N).updateValue(this->n_cells).updateValue(this->n_landmarks);
+	if(this->meanshape)
+		digest.update(this->meanshape, sizeof(double) * 3 * this->N);
+	if(this->tcoords)
+		digest.update(this->tcoords, sizeof(double) * 2 * this->N);
+	if(this->polys)
+		digest.update(this->polys, sizeof(vtkIdType) * 3 * this->n_cells);
+	if(this->mean_landmarks)
+		digest.update(this->mean_landmarks, sizeof(float) * 3 * this->n_landmarks);
+	return digest.hexDigest();
+}
+
+// Subject points x aligned to the mean shape, minus the mean shape, in one pass over x after the alignment.
+template<typename PointType>
+static bool AlignedShapeVector(const PointType *x, const double *meanshape, int N, int rigid_body, double *shapevec)
+{
+	procrustes::Transform transform;
+	if (!procrustes::align(x, meanshape, static_cast<size_t>(N), rigid_body != 0, transform))
 	{
-		mean_points->SetPoint(i, this->meanshape[i * 3 + 0], this->meanshape[i * 3 + 1], this->meanshape[i * 3 + 2]);
+		return false;
 	}
-	
-    vtkNew<vtkLandmarkTransform> ls;
-    ls->SetSourceLandmarks(triangularSubjectMesh->GetPoints());
-    ls->SetTargetLandmarks(mean_points);
-	if (rigid_body)
+	for (int i = 0; i < N; i++)
 	{
-		ls->SetModeToRigidBody();
+		const double p[3] = { static_cast<double>(x[i * 3]), static_cast<double>(x[i * 3 + 1]), static_cast<double>(x[i * 3 + 2]) };
+		double aligned[3];
+		transform.apply(p, aligned);
+		shapevec[i * 3] = aligned[0] - meanshape[i * 3];
+		shapevec[i * 3 + 1] = aligned[1] - meanshape[i * 3 + 1];
+		shapevec[i * 3 + 2] = aligned[2] - meanshape[i * 3 + 2];
 	}
-	else
+	return true;
+}
+
+bool vtkSurfacePCA::GetAlignedShapeVector(vtkPolyData *triangularSubjectMesh, int rigid_body, double *shapevec)
+{
+	vtkPoints *points = triangularSubjectMesh->GetPoints();
+	if (!points || points->GetNumberOfPoints() != this->N)
 	{
-		ls->SetModeToSimilarity();
+		return false;
+	}
+
+	// Aligns on the point buffer itself; the transformed mesh is never materialised.
+	switch (points->GetDataType())
+	{
+	case VTK_FLOAT:
+		return AlignedShapeVector(static_cast<const float*>(points->GetVoidPointer(0)), this->meanshape, this->N, rigid_body, shapevec);
+	case VTK_DOUBLE:
+		return AlignedShapeVector(static_cast<const double*>(points->GetVoidPointer(0)), this->meanshape, this->N, rigid_body, shapevec);
+	default:
+		return false;
+	}
+}
+
+void vtkSurfacePCA::GetShapeParameters(vtkPolyData *triangularSubjectMesh, vtkDoubleArray *b, int nmodes, int rigid_body)
+{ 
+	// Shape aligned to the mean shape, minus the mean shape.
+	ScratchVector<double> shapevec(this->N * 3);
+	if (kernelSelection::useLegacy(Kernel::ShapeProjection) || !this->GetAlignedShapeVector(triangularSubjectMesh, rigid_body, shapevec.data()))
+	{
+	    ScratchVtkObject<vtkPoints> mean_points; // capacity of previous call on this thread is reused
+	    mean_points->SetNumberOfPoints(this->N);
+
+		//#pragma omp parallel for
+		for (int i = 0; i < this->N; i++)
+		{
+			mean_points->SetPoint(i, this->meanshape[i * 3 + 0], this->meanshape[i * 3 + 1], this->meanshape[i * 3 + 2]);
+		}
+
+	    vtkNew<vtkLandmarkTransform> ls;
+	    ls->SetSourceLandmarks(triangularSubjectMesh->GetPoints());
+	    ls->SetTargetLandmarks(mean_points);
+		if (rigid_body)
+		{
+			ls->SetModeToRigidBody();
+		}
+		else
+		{
+			ls->SetModeToSimilarity();
+		}
+
+	    vtkNew<vtkTransformFilter> transformSubjectToMeanMesh;
+		transformSubjectToMeanMesh->SetTransform(ls);
+		transformSubjectToMeanMesh->SetInputData(triangularSubjectMesh);
+		transformSubjectToMeanMesh->Update();
+
+		if(transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints() != this->N) {
+	        vtkErrorMacro_pca(<<"In vtkSurfacePCA::GetShapeParameters: Subject triangle mesh does not have the correct number of points. Comparison: "
+				<< "transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints(): " << transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints() << " , this->N: " << this->N);
+	        return;
+	    }
+
+	    // Copy shape and subtract mean shape
+	    for (int i = 0; i < this->N; i++) {
+	        //double *p = trans->GetOutput()->GetPoint(i); //old
+			double p[3];
+			transformSubjectToMeanMesh->GetOutput()->GetPoint(i, p);
+	        shapevec[i*3  ] = p[0] - meanshape[i*3];
+	        shapevec[i*3+1] = p[1] - meanshape[i*3+1];
+	        shapevec[i*3+2] = p[2] - meanshape[i*3+2];
+	    }
 	}
 
-    vtkNew<vtkTransformFilter> transformSubjectToMeanMesh;
-	transformSubjectToMeanMesh->SetTransform(ls);
-	transformSubjectToMeanMesh->SetInputData(triangularSubjectMesh);
-	transformSubjectToMeanMesh->Update();
-     
-	if(transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints() != this->N) {
-        vtkErrorMacro_pca(<<"In vtkSurfacePCA::GetShapeParameters: Subject triangle mesh does not have the correct number of points. Comparison: "
-			<< "transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints(): " << transformSubjectToMeanMesh->GetOutput()->GetNumberOfPoints() << " , this->N: " << this->N);
-        return;
-    }
-    
-    // Copy shape and subtract mean shape
-	double* shapevec = NewVector(this->N * 3);
-    for (int i = 0; i < this->N; i++) {
-        //double *p = trans->GetOutput()->GetPoint(i); //old
-		double p[3];
-		transformSubjectToMeanMesh->GetOutput()->GetPoint(i, p);
-        shapevec[i*3  ] = p[0] - meanshape[i*3];
-        shapevec[i*3+1] = p[1] - meanshape[i*3+1];
-        shapevec[i*3+2] = p[2] - meanshape[i*3+2];
-    }
-    
 	// Local variant of b for fast access.
 	const auto bsize = static_cast<vtkIdType>(nmodes);
-	double* bloc = NewVector(bsize);
+	ScratchVector<double> bloc(bsize);
     for (int i = 0; i < bsize; i++) 
 	{
         bloc[i] = 0;
@@ -381,9 +464,6 @@ void vtkSurfacePCA::GetShapeParameters(vtkPolyData *triangularSubjectMesh, vtkDo
 			b->SetValue(i, 0);
 		}
 	}
-    
-    DeleteVector(shapevec);
-    DeleteVector(bloc);
 }
 
 vtkPolyData* vtkSurfacePCA::GetInput(int idx) 
@@ -522,6 +602,8 @@ bool vtkSurfacePCA::LoadFile(const std::string model_FileName)
 	}
 	bool ret = LoadFromFile(modelFile);
 	fclose(modelFile);
+	this->model_file_name = model_FileName;
+	this->topology.reset();
 	return ret;
 }
 
@@ -950,7 +1032,7 @@ bool vtkSurfacePCA::LoadFromFile(FILE *in)
 }
 
 void vtkSurfacePCA::ApplyResampleSurfaceFilter(vtkSmartPointer<vtkPolyData> in, vtkSmartPointer<vtkPolyData> outputMesh,
-	vtkSmartPointer<vtkPolyData> mean_surface, vtkSmartPointer<vtkThinPlateSplineTransform> tps)
+	vtkSmartPointer<vtkPolyData> mean_surface, vtkSmartPointer<vtkThinPlateSplineTransform> tps, const CancellationToken* cancellation)
 {
 	const int N_BASE_MESH_POINTS = mean_surface->GetNumberOfPoints();
 	vtkNew<vtkFloatArray> distances;
@@ -967,13 +1049,19 @@ void vtkSurfacePCA::ApplyResampleSurfaceFilter(vtkSmartPointer<vtkPolyData> in,
 	vtkNew<vtkTransformPolyDataFilter> trans;
 	trans->SetInputData(copy);
 	trans->SetTransform(tps);
-	trans->Update(); // (else locator thinks it has no input)
+	{
+		ScopedStageTimer timer(Stage::TpsWarp);
+		trans->Update(); // (else locator thinks it has no input)
+	}
 	// -- resample the warped mesh using the target mesh and then unwarp --
 
 	// create a locator to help us find the closest point on the warped surface
 	vtkNew<vtkCellLocator> locator;
 	locator->SetDataSet(trans->GetOutput());
-	locator->Update(); // else FindClosestPoint etc. don't work
+	{
+		ScopedStageTimer timer(Stage::LocatorBuild);
+		locator->Update(); // else FindClosestPoint etc. don't work
+	}
 
 	typedef double vtkFloatingPointType;
 	// for each point in the target mesh:
@@ -983,11 +1071,20 @@ void vtkSurfacePCA::ApplyResampleSurfaceFilter(vtkSmartPointer<vtkPolyData> in,
 	vtkFloatingPointType dist2;
 	vtkFloatingPointType pcoords[3];
 	vtkFloatingPointType interpolationWeights[3];
-	vtkNew<vtkGenericCell> cell;  // to avoid repeated allocation within FindClosestPoint inside loop below
+	ScratchVtkObject<vtkGenericCell> cell;  // to avoid repeated allocation within FindClosestPoint inside loop below, and across calls on this thread
+
+	// Polling the token costs a clock read, so it is only checked every CANCELLATION_CHECK_INTERVAL points.
+	const int CANCELLATION_CHECK_INTERVAL = 1024;
 
+	ScopedStageTimer resampleTimer(Stage::ClosestPointResample);
 	// #pragma omp parallel for
 	for (int i = 0; i < N_BASE_MESH_POINTS; i++)
 	{
+		if (i % CANCELLATION_CHECK_INTERVAL == 0 && CancellationToken::isCancelled(cancellation))
+		{
+			return;
+		}
+
 		// -- resample the warped mesh using the target mesh --
 		// retrieve the location of the point
 		//p = this->GetOutput()->GetPoint(i);..// old !! dont use double pointers
@@ -1017,7 +1114,7 @@ void vtkSurfacePCA::ApplyResampleSurfaceFilter(vtkSmartPointer<vtkPolyData> in,
 //----------------------------------------------------------------------------
 // public
 // Transforms the subject mesh into triangular mesh with same number of points N as model.
-void vtkSurfacePCA::Resample(vtkPolyData *in, vtkPointSet *landmarks, vtkPolyData *out)
+void vtkSurfacePCA::Resample(vtkPolyData *in, vtkPointSet *landmarks, vtkPolyData *out, const CancellationToken* cancellation)
 {
     if(!this->mean_landmarks)
     {
@@ -1048,21 +1145,33 @@ void vtkSurfacePCA::Resample(vtkPolyData *in, vtkPointSet *landmarks, vtkPolyDat
     tps->SetBasisToR(); // since we're in 3D
     tps->Update();
 
-	ApplyResampleSurfaceFilter(in, out, mean_surface, tps);
+	ApplyResampleSurfaceFilter(in, out, mean_surface, tps, cancellation);
  }
  
-void vtkSurfacePCA::GetApproximateShapeParameters(vtkPolyData *subjectMesh, vtkPointSet *landmarks,
-                                                  vtkDoubleArray *b,int rigid_body)
+void vtkSurfacePCA::ResampleShape(vtkPolyData *subjectMesh, vtkPointSet *landmarks, vtkPolyData *out, const CancellationToken* cancellation)
 {
 	// certain bits of the resampling rely on the surface consisting of only triangles
 	// tjh added Jan 2006
 	vtkNew<vtkTriangleFilter> tri;
 	tri->SetInputData(subjectMesh);
-	tri->Update();
+	{
+		ScopedStageTimer timer(Stage::TriangleFilter);
+		tri->Update();
+	}
 
     // resample the supplied surface using the base mesh
+    Resample(tri->GetOutput(), landmarks, out, cancellation);
+}
+
+void vtkSurfacePCA::GetApproximateShapeParameters(vtkPolyData *subjectMesh, vtkPointSet *landmarks,
+                                                  vtkDoubleArray *b,int rigid_body, const CancellationToken* cancellation)
+{
     vtkNew<vtkPolyData> triangularSubjectMesh;
-    Resample(tri->GetOutput(), landmarks, triangularSubjectMesh);
+    ResampleShape(subjectMesh, landmarks, triangularSubjectMesh, cancellation);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return;
+	}
     
     // find the parameters that best model the resampled surface
 	GetApproximateShapeParametersFromResampledSurface(triangularSubjectMesh, b, rigid_body);
@@ -1071,6 +1180,7 @@ void vtkSurfacePCA::GetApproximateShapeParameters(vtkPolyData *subjectMesh, vtkP
 void vtkSurfacePCA::GetApproximateShapeParametersFromResampledSurface(vtkPolyData *triangularSubjectMesh,
                                                   vtkDoubleArray *b,int rigid_body)
 {
+	ScopedStageTimer timer(Stage::Projection);
     const vtkIdType nmodes = this->GetTotalNumModes();
     b->SetNumberOfValues(nmodes);
     this->GetShapeParameters(triangularSubjectMesh, b, nmodes, rigid_body);
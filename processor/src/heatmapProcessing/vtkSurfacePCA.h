@@ -8,6 +8,9 @@
 #include <vtkThinPlateSplineTransform.h> // for param of fct. ApplyResampleFilter
 
 #include "vtkPCAModel.h"
+#include "modelTopology.h"
+
+class CancellationToken;
 
 class vtkPolyData;
 class vtkPointSet;
@@ -53,9 +56,10 @@ public:
 	// Return number of landmarks in face model
 	int Getnlandmarks() { return this->n_landmarks; }
 
-	// for an unseen surface, return the parameters that best model it
+	// for an unseen surface, return the parameters that best model it.
+	// If cancellation is cancelled while resampling, b is left unchanged.
 	void GetApproximateShapeParameters(vtkPolyData* shape, vtkPointSet* landmarks,
-		vtkDoubleArray* b, int rigid_body = true);
+		vtkDoubleArray* b, int rigid_body = true, const CancellationToken* cancellation = nullptr);
 
 	// Take vector b (input param) and apply it to mean shape. Output param: signature.
 	void ParameteriseShape(vtkSmartPointer<vtkDoubleArray> b, vtkSmartPointer<vtkPolyData> shape);
@@ -63,6 +67,10 @@ public:
 	// Fills the landmark with point using nearest cellID from mean shape
 	void GetParameterisedLandmarks(vtkPolyData* shape, vtkPolyData* landmarks);
 
+	// Point normals of shape (a shape of this model, e.g., from GetParameterisedShape) as vtkPolyDataNormals computes them, from the
+	// triangulation cached per model file. Returns false where vtkPolyDataNormals has to be used instead (see ModelTopology::computePointNormals).
+	bool ComputeSurfaceNormals(vtkPolyData* shape, vtkFloatArray* normals);
+
 	// Description:
 	  // Fills the shape with:
 	  //
@@ -79,13 +87,29 @@ public:
 	  // Retrieve how many modes there are available (may not be s-1 since we typically only store 98%)
 	int GetTotalNumModes() { return this->Evals->GetNumberOfTuples(); } //consumed in msNormalisationTools.h
 
-	void Resample(vtkPolyData* in, vtkPointSet* landmarks, vtkPolyData* out);
+	// Loaded model, read-only, e.g., for classifiers precomputed from it (stackedSplitClassifier.h).
+	// Number of points N of the base mesh, mean shape (3N values, x y z per point), eigenvalues sorted in descending order, eigenvectors (3N x modes).
+	int GetNumberOfModelPoints() { return this->N; }
+	double* GetMeanshape() { return this->meanshape; }
+	vtkDoubleArray* GetEvals() { return this->Evals; }
+	double** GetEvecMat2() { return this->evecMat2; }
+
+	// SHA-256 digest of what Resample(..) depends on: base mesh (mean shape, texture coordinates, triangles) and mean landmarks.
+	// Models with equal digests (e.g., models of several ethnicities built on the same base mesh) resample a surface alike.
+	std::string GetBaseMeshDigest();
+
+	// Stops early, leaving out incomplete, if cancellation is cancelled. Callers check the token before using out.
+	void Resample(vtkPolyData* in, vtkPointSet* landmarks, vtkPolyData* out, const CancellationToken* cancellation = nullptr);
+
+	// Resampling part of GetApproximateShapeParameters(..): triangulates shape, then resamples it. out is then projected by
+	// GetApproximateShapeParametersFromResampledSurface(..), e.g., onto several models of the same base mesh (see GetBaseMeshDigest()).
+	void ResampleShape(vtkPolyData* shape, vtkPointSet* landmarks, vtkPolyData* out, const CancellationToken* cancellation = nullptr);
 
 
 private:
 	// Function resamples mesh passes through param 'in' to topology of mean mesh. Invoked by function 'Resample'.
 	void ApplyResampleSurfaceFilter(vtkSmartPointer<vtkPolyData> in, vtkSmartPointer<vtkPolyData> outputMesh,
-		vtkSmartPointer<vtkPolyData> mean_surface, vtkSmartPointer<vtkThinPlateSplineTransform> tps);
+		vtkSmartPointer<vtkPolyData> mean_surface, vtkSmartPointer<vtkThinPlateSplineTransform> tps, const CancellationToken* cancellation);
 
 	// Mean landmarks: the original sparse ones
 	void GetMeanLandmarks(vtkPolyData* landmarks);
@@ -94,8 +118,6 @@ private:
 	void SetCurrentLandmarks(vtkPolyData* landmarks);
 	void GetCurrentLandmarks(vtkPolyData* landmarks);
 
-	double* GetMeanshape() { return this->meanshape; }
-
 	// Retrieve the input with index idx (usually only used for pipeline tracing).
 	vtkPolyData* GetInput(int idx);
 
@@ -104,14 +126,14 @@ private:
 
 	void Update();
 
-	// Get the vector of eigenvalues sorted in descending order
-	vtkDoubleArray* GetEvals() { return this->Evals; }
 	float* GetMeanLandmarks() { return this->mean_landmarks; }
-	double** GetEvecMat2() { return this->evecMat2; }
 
 	// As GetParameteriseShape, but vector b is empty. So, just write meanshape into out param shape. (rh)
 	void InitialiseParameterisedShape(vtkSmartPointer<vtkPolyData> shape);
 
+	// Topology of the loaded model, created on first use and shared by all instances loading the same model file.
+	const ModelTopology& GetTopology();
+
 	// Description:
 		// Return the bsize parameters b that best model the given shape
 		// (in standard deviations). 
@@ -125,6 +147,11 @@ private:
 		// 200521rh: only used in functions not called from FaceScreen 
 	void GetShapeParameters(vtkPolyData* shape, vtkDoubleArray* b, int bsize, int rigid_body = true);
 
+	// Optimised alignment of GetShapeParameters (Kernel::ShapeProjection): writes shape aligned to the mean shape (rigid body or similarity, as
+	// vtkLandmarkTransform) minus the mean shape to shapevec (3N values), without transform filter or copy of the mesh.
+	// Returns false if shape does not have N float or double points or its alignment is ambiguous; GetShapeParameters then aligns with VTK.
+	bool GetAlignedShapeVector(vtkPolyData* shape, int rigid_body, double* shapevec);
+
 public:
 	// for an unseen RESAMPLED surface, return the parameters that best model it
 	void GetApproximateShapeParametersFromResampledSurface(vtkPolyData* shape,
@@ -163,8 +190,8 @@ protected:
 	float* current_landmarks; // 200516rh: This seem to be the subject landmarks, snapped to the computed mean surface, ...
 							  // .... having assigned a pseudo_landmark_index (see fct, vtkSurfacePCA::GetParameterisedLandmarks).
 
-	vtkIdType* pseudo_landmark_indexes;  // ?????????? 200516rh: This seems to be arbitrarily made up, see fct. vtkSurfacePCA::GetParameterisedLandmarks(vtkPolyData* surface, vtkPolyData* landmarks)
-	bool pseudo_landmarks_loaded; // ???????? 200516rh: true, if pseudo_landmark_indexes have been created in fct. GeTParameterisedLandmarks(..), false (set by ctor) otherwise 
+	std::string model_file_name; // set by LoadFile, keys the cached topology
+	std::shared_ptr<const ModelTopology> topology; // triangles for point normals, and the cells of the pseudo landmarks (see fct. GetParameterisedLandmarks)
 
 	float* mean_surface_landmarks; // ?????????? 200516rh: This seems to be mean_landmarks associated to the mesh surface for the subject under investigation.
 	// where the landmarks would be on the mean shape (3*n_landmarks x 1)
@@ -0,0 +1,142 @@
+#ifndef PROCRUSTES_H
+#define PROCRUSTES_H
+
+#include "vtkMath.h"
+
+#include <cmath>
+#include <cstddef>
+
+// Rigid-body and similarity Procrustes alignment of corresponding point sets, computing the transform of vtkLandmarkTransform
+// (modes RigidBody and Similarity) directly from contiguous x y z buffers: two reductions over the points (centroids, then the
+// centred correlation matrix) and Horn's quaternion method on a 4x4 matrix. No vtkPoints, transform or filter objects are involved,
+// so the transform can be applied in place, fused with whatever consumes the aligned points.
+namespace procrustes
+{
+	// Maps source points onto target points: aligned = scale * rotation * (source - sourceCentroid) + targetCentroid.
+	struct Transform
+	{
+		double rotation[3][3];
+		double scale = 1.0;
+		double sourceCentroid[3];
+		double targetCentroid[3];
+
+		void apply(const double source[3], double aligned[3]) const
+		{
+			const double x = source[0] - sourceCentroid[0];
+			const double y = source[1] - sourceCentroid[1];
+			const double z = source[2] - sourceCentroid[2];
+			for (int a = 0; a < 3; ++a)
+			{
+				aligned[a] = scale * (rotation[a][0] * x + rotation[a][1] * y + rotation[a][2] * z) + targetCentroid[a];
+			}
+		}
+	};
+
+	// Rotation best mapping centred source onto centred target points for their correlation M = sum (source - centroid) (target - centroid)^T,
+	// as determined by vtkLandmarkTransform. Returns false if the rotation is ambiguous (equal largest eigenvalues, e.g., collinear points),
+	// where vtkLandmarkTransform chooses the smallest rotation instead.
+	inline bool rotationFromCorrelation(const double M[3][3], double rotation[3][3])
+	{
+		double Ndata[4][4] = {};
+		double* N[4] = { Ndata[0], Ndata[1], Ndata[2], Ndata[3] };
+		N[0][0] = M[0][0] + M[1][1] + M[2][2];
+		N[1][1] = M[0][0] - M[1][1] - M[2][2];
+		N[2][2] = -M[0][0] + M[1][1] - M[2][2];
+		N[3][3] = -M[0][0] - M[1][1] + M[2][2];
+		N[0][1] = N[1][0] = M[1][2] - M[2][1];
+		N[0][2] = N[2][0] = M[2][0] - M[0][2];
+		N[0][3] = N[3][0] = M[0][1] - M[1][0];
+		N[1][2] = N[2][1] = M[0][1] + M[1][0];
+		N[1][3] = N[3][1] = M[2][0] + M[0][2];
+		N[2][3] = N[3][2] = M[1][2] + M[2][1];
+
+		double eigenvectorData[4][4];
+		double* eigenvectors[4] = { eigenvectorData[0], eigenvectorData[1], eigenvectorData[2], eigenvectorData[3] };
+		double eigenvalues[4];
+		vtkMath::JacobiN(N, 4, eigenvalues, eigenvectors); // sorted in decreasing order
+		if (eigenvalues[0] == eigenvalues[1])
+		{
+			return false;
+		}
+
+		// The eigenvector of the largest eigenvalue is the quaternion of the rotation.
+		const double w = eigenvectors[0][0];
+		const double x = eigenvectors[1][0];
+		const double y = eigenvectors[2][0];
+		const double z = eigenvectors[3][0];
+		const double ww = w * w, wx = w * x, wy = w * y, wz = w * z;
+		const double xx = x * x, yy = y * y, zz = z * z;
+		const double xy = x * y, xz = x * z, yz = y * z;
+		rotation[0][0] = ww + xx - yy - zz;
+		rotation[1][0] = 2.0 * (wz + xy);
+		rotation[2][0] = 2.0 * (-wy + xz);
+		rotation[0][1] = 2.0 * (-wz + xy);
+		rotation[1][1] = ww - xx + yy - zz;
+		rotation[2][1] = 2.0 * (wx + yz);
+		rotation[0][2] = 2.0 * (wy + xz);
+		rotation[1][2] = 2.0 * (-wx + yz);
+		rotation[2][2] = ww - xx - yy + zz;
+		return true;
+	}
+
+	// Transform aligning numberOfPoints source points onto the target points (x y z per point, e.g., the data of vtkPoints or a model's mean shape).
+	// With rigidBody false, the source is also scaled (similarity transform). Returns false if there are fewer than 3 points or the rotation is ambiguous.
+	// Usage: procrustes::Transform transform; if (procrustes::align(points, meanshape, N, true, transform)) { transform.apply(p, aligned); }
+	template<typename SourceType, typename TargetType>
+	bool align(const SourceType* source, const TargetType* target, const size_t numberOfPoints, const bool rigidBody, Transform& transform)
+	{
+		if (numberOfPoints < 3)
+		{
+			return false;
+		}
+
+		double sx = 0.0, sy = 0.0, sz = 0.0, tx = 0.0, ty = 0.0, tz = 0.0;
+		#pragma omp simd reduction(+:sx,sy,sz,tx,ty,tz)
+		for (size_t i = 0; i < numberOfPoints; ++i)
+		{
+			sx += source[3 * i];
+			sy += source[3 * i + 1];
+			sz += source[3 * i + 2];
+			tx += target[3 * i];
+			ty += target[3 * i + 1];
+			tz += target[3 * i + 2];
+		}
+		const double n = static_cast<double>(numberOfPoints);
+		transform.sourceCentroid[0] = sx / n;
+		transform.sourceCentroid[1] = sy / n;
+		transform.sourceCentroid[2] = sz / n;
+		transform.targetCentroid[0] = tx / n;
+		transform.targetCentroid[1] = ty / n;
+		transform.targetCentroid[2] = tz / n;
+
+		// Correlation of the centred point sets, M[i][j] = sum a_i b_j, and their sums of squares (for the scale).
+		const double* sc = transform.sourceCentroid;
+		const double* tc = transform.targetCentroid;
+		double m00 = 0.0, m01 = 0.0, m02 = 0.0, m10 = 0.0, m11 = 0.0, m12 = 0.0, m20 = 0.0, m21 = 0.0, m22 = 0.0;
+		double sourceSquares = 0.0, targetSquares = 0.0;
+		#pragma omp simd reduction(+:m00,m01,m02,m10,m11,m12,m20,m21,m22,sourceSquares,targetSquares)
+		for (size_t i = 0; i < numberOfPoints; ++i)
+		{
+			const double a0 = source[3 * i] - sc[0];
+			const double a1 = source[3 * i + 1] - sc[1];
+			const double a2 = source[3 * i + 2] - sc[2];
+			const double b0 = target[3 * i] - tc[0];
+			const double b1 = target[3 * i + 1] - tc[1];
+			const double b2 = target[3 * i + 2] - tc[2];
+			m00 += a0 * b0; m01 += a0 * b1; m02 += a0 * b2;
+			m10 += a1 * b0; m11 += a1 * b1; m12 += a1 * b2;
+			m20 += a2 * b0; m21 += a2 * b1; m22 += a2 * b2;
+			sourceSquares += a0 * a0 + a1 * a1 + a2 * a2;
+			targetSquares += b0 * b0 + b1 * b1 + b2 * b2;
+		}
+		const double M[3][3] = { { m00, m01, m02 }, { m10, m11, m12 }, { m20, m21, m22 } };
+		if (!rotationFromCorrelation(M, transform.rotation))
+		{
+			return false;
+		}
+		transform.scale = rigidBody ? 1.0 : std::sqrt(targetSquares / sourceSquares);
+		return true;
+	}
+}
+
+#endif // PROCRUSTES_H
@@ -4,6 +4,7 @@
 
 #include "../mathUtils/C2dVector.h"
 #include "CFloatMatrix.h"
+#include "../utils/logger.h"
 
 #include <string.h>
 #include <math.h>
@@ -325,7 +326,7 @@ void CFloatMatrix::PCA(CFloatMatrix& eigenvectors, CFloatMatrix& eigenvalues) co
 		// check that the matrix is symmetric
 		if(!T.IsSymmetric())
 		{
-			std::cerr << "In CFloatMatrix.cpp::PCA :  Internal error, covariance matrix T is not symmetric!" << std::endl;
+			logError() << "In CFloatMatrix.cpp::PCA :  Internal error, covariance matrix T is not symmetric!";
 			ASSERT(false);
 			exit(-1);
 		}
@@ -373,7 +374,7 @@ void CFloatMatrix::PCA(CFloatMatrix& eigenvectors, CFloatMatrix& eigenvalues) co
 		// check that the matrix is symmetric
 		if(!S.IsSymmetric())
 		{
-			std::cerr << "In CFloatMatrix.cpp::PCA :  Internal error, covariance matrix S is not symmetric!" << std::endl;
+			logError() << "In CFloatMatrix.cpp::PCA :  Internal error, covariance matrix S is not symmetric!";
 			ASSERT(false);
 			exit(-1);
 		}
@@ -924,7 +925,7 @@ In either case, the kth column of z returns the normalized eigenvector correspon
 				if (iter++ == 300) {
 					//nrerror("Too many iterations in tqli");
 					//ASSERT(false);
-					std::cerr << "In CFloatMatrix.cpp::tqli (QL algorithm):  Too many iterations in tqli! Crashing out..." << std::endl; 
+					logError() << "In CFloatMatrix.cpp::tqli (QL algorithm):  Too many iterations in tqli! Crashing out..."; 
 					return;
 				}
 				g=(d[l+1]-d[l])/(2.0F*e[l]); //Form shift.
@@ -1,5 +1,13 @@
 #include "classificationTools.h"
+#include "stackedSplitClassifier.h"
 #include "../heatmapProcessing/vtkSurfacePCA.h"
+#include "../utils/cancellationToken.h"
+#include "../utils/computePool.h"
+#include "../utils/kernelSelection.h"
+#include "../utils/logger.h"
+#include "../utils/requestTrace.h"
+#include "../utils/scratchArena.h"
+#include "../utils/stageTimer.h"
 
 //#include <vtkAutoInit.h>
 //VTK_MODULE_INIT(vtkRenderingOpenGL);
@@ -30,6 +38,7 @@
 #include <iterator>
 
 
+#include <atomic>
 #include <cstdio>
 #include <filesystem>
 #include <fstream>
@@ -83,8 +92,8 @@ void ClassificationTools::ProjectIndividualInSplit(CString model_filename, vtkSm
 	const int n_modes = pca->GetTotalNumModes();
 	//initialise  
  
-	if(surface->GetNumberOfPoints()<=0) { std::cerr << "In ClassificationTools::ProjectIndividualInSplit: Failed to read surface correctly! Results may be wrong" << std::endl; }
-	if(landmarks->GetNumberOfPoints()<=0) { std::cerr << "In ClassificationTools::ProjectIndividualInSplit: Failed to read landmarks correctly! Results may be wrong" << std::endl; }
+	if(surface->GetNumberOfPoints()<=0) { logError() << "In ClassificationTools::ProjectIndividualInSplit: Failed to read surface correctly! Results may be wrong"; }
+	if(landmarks->GetNumberOfPoints()<=0) { logError() << "In ClassificationTools::ProjectIndividualInSplit: Failed to read landmarks correctly! Results may be wrong"; }
 	
 	vtkSmartPointer<vtkDoubleArray> b = vtkSmartPointer<vtkDoubleArray>::New();
     //get mode values
@@ -105,21 +114,65 @@ void ClassificationTools::ProjectIndividualInSplit(CString model_filename, vtkSm
 	this->OnClassifyIndividualsUsingClosestMean(root_folder, split_num);
 }
 
+vtkSmartPointer<vtkSurfacePCA> ClassificationTools::GetSplitModel(const filesystem::path root_folder, int split_num)
+{
+	if (this->splitModels && this->splitModels->root_folder == root_folder && split_num < static_cast<int>(this->splitModels->models.size()))
+	{
+		return this->splitModels->models[split_num];
+	}
+
+	const std::filesystem::path splitDirName(string_format("split%02d", split_num + 1));
+	const std::filesystem::path model_filename = root_folder / splitDirName / "model.csv";
+	ScopedStageTimer modelLoadTimer(Stage::ModelLoad);
+	vtkSmartPointer<vtkSurfacePCA> pca = vtkSmartPointer<vtkSurfacePCA>::New();
+	if (!pca->LoadFile(model_filename.string()))
+	{
+		return nullptr;
+	}
+	return pca;
+}
+
+bool ClassificationTools::LoadSplitModels(const filesystem::path root_folder)
+{
+	ScopedStageTimer modelLoadTimer(Stage::ModelLoad);
+	auto loadedModels = std::make_shared<SplitModels>();
+	loadedModels->root_folder = root_folder;
+	loadedModels->models.resize(this->N_SPLITS);
+
+	std::atomic<bool> loadingSuccessful(true);
+	parallelFor(0, this->N_SPLITS, 1, [&](size_t split, size_t)
+	{
+		TraceSpan span("load split model");
+		const std::filesystem::path splitDirName(string_format("split%02d", static_cast<int>(split) + 1));
+		loadedModels->models[split] = vtkSmartPointer<vtkSurfacePCA>::New();
+		if (!loadedModels->models[split]->LoadFile((root_folder / splitDirName / "model.csv").string()))
+		{
+			loadingSuccessful = false;
+		}
+	});
+	if (!loadingSuccessful)
+	{
+		logError() << "In ClassificationTools::LoadSplitModels: Split models in " << root_folder << " failed to load.";
+		return false;
+	}
+	loadedModels->stacked = StackedSplitClassifier::create(root_folder, loadedModels->models);
+	this->splitModels = loadedModels;
+	return true;
+}
+
 bool ClassificationTools::ProjectResampledIndividualInSplit(const filesystem::path root_folder, const filesystem::path model_filename, vtkSmartPointer<vtkPolyData> surface, int split_num)
 {   
-	vtkNew<vtkSurfacePCA> pca;
+	const auto pca = this->GetSplitModel(root_folder, split_num);
+	if (!pca) // possibly wrong type
 	{
-		bool ret = pca->LoadFile(model_filename.string());        
-		if(!ret) { // possibly wrong type
-			std::cerr << "In ClassificationTools::ProjectResampledIndividualInSplit: Model " << model_filename <<
-				" failed to load. Aborting." << std::endl;
-			return false;
-		}
+		logError() << "In ClassificationTools::ProjectResampledIndividualInSplit: Model " << model_filename <<
+			" failed to load. Aborting.";
+		return false;
 	} 
 	 
 	if(surface->GetNumberOfPoints()<=0) 
 	{ 
-		std::cerr << "In ClassificationTools::ProjectResampledIndividualInSplit: Failed to read surface correctly! Results may be wrong" << std::endl; 
+		logError() << "In ClassificationTools::ProjectResampledIndividualInSplit: Failed to read surface correctly! Results may be wrong"; 
 		// TODO pass back error message to http_response
 		return false;
 	}
@@ -141,7 +194,7 @@ bool ClassificationTools::ProjectResampledIndividualInSplit(const filesystem::pa
 	return classificationSuccessful;
 }
  
-bool ClassificationTools::OnProjectIndividualsInSplitFolders(const std::filesystem::path root_folder, const vtkSmartPointer<vtkPolyData> example_surface, vtkSmartPointer<vtkPolyData> example_landmarks, float &meanRetVal, float &standardErrRetVal)
+bool ClassificationTools::OnProjectIndividualsInSplitFolders(const std::filesystem::path root_folder, const vtkSmartPointer<vtkPolyData> example_surface, vtkSmartPointer<vtkPolyData> example_landmarks, float &meanRetVal, float &standardErrRetVal, const CancellationToken* cancellation)
 {    
 	//check if all desired models and dat files can be found
 //	#pragma omp parallel for
@@ -156,11 +209,11 @@ bool ClassificationTools::OnProjectIndividualsInSplitFolders(const std::filesyst
 		struct stat buffer;   
 		if (stat(model_filename.string().c_str(), &buffer) != 0)
 		{
-			std::cerr << "In ClassificationTools::OnProjectIndividualsInSplitFolders: Cannot find model file: " << model_filename << std::endl;
+			logError() << "In ClassificationTools::OnProjectIndividualsInSplitFolders: Cannot find model file: " << model_filename;
 		}
 		if (stat(trainingdata_filename.string().c_str(), &buffer) != 0)
 		{
-			std::cerr << "In ClassificationTools::OnProjectIndividualsInSplitFolders: Cannot find training.dat file: " << trainingdata_filename << std::endl;
+			logError() << "In ClassificationTools::OnProjectIndividualsInSplitFolders: Cannot find training.dat file: " << trainingdata_filename;
 		}
 	}
 	
@@ -188,53 +241,83 @@ bool ClassificationTools::OnProjectIndividualsInSplitFolders(const std::filesyst
  	vtkSmartPointer<vtkPolyData> resampled_surface = vtkSmartPointer<vtkPolyData>::New();
 	const std::filesystem::path splitDirName(string_format("split%02d", 1));
 	const std::filesystem::path model_filename = root_folder / splitDirName / "model.csv";
-	vtkSurfacePCA *pca = vtkSurfacePCA::New();
+	const auto pca = this->GetSplitModel(root_folder, 0);
 	{
-		bool ret = pca->LoadFile(model_filename.string());
-        
-		if(!ret) { // model failed to load! (possibly wrong type)
-			std::cerr << "In ClassificationTools::OnProjectIndividualsInSplitFolders:Model failed to load. Aborting: " << model_filename<< std::endl;
+		if(!pca) { // model failed to load! (possibly wrong type)
+			logError() << "In ClassificationTools::OnProjectIndividualsInSplitFolders:Model failed to load. Aborting: " << model_filename;
 			return false;
 		}
 		//check number of landmarks
 		if(example_landmarks->GetNumberOfPoints() != pca->Getnlandmarks())
 		{
-			std::cerr << "Model failed: Wrong number of landmarks, example has " << example_landmarks->GetNumberOfPoints() << ", model has " << pca->Getnlandmarks() << std::endl;
+			logError() << "Model failed: Wrong number of landmarks, example has " << example_landmarks->GetNumberOfPoints() << ", model has " << pca->Getnlandmarks();
 			return false;
 		}
 		 
 		vtkSmartPointer<vtkTriangleFilter> tri = vtkSmartPointer<vtkTriangleFilter>::New();
 		tri->SetInputData(example_surface);
-		tri->Update();
+		{
+			ScopedStageTimer timer(Stage::TriangleFilter);
+			tri->Update();
+		}
 
 		// resample the supplied surface using the base mesh   
-		pca->Resample(tri->GetOutput(), example_landmarks, resampled_surface); // rh: note: example_landmarks should be vtkPointSet*, not vtkPolyData*
+		pca->Resample(tri->GetOutput(), example_landmarks, resampled_surface, cancellation); // rh: note: example_landmarks should be vtkPointSet*, not vtkPolyData*
+		if (CancellationToken::isCancelled(cancellation))
+		{
+			return false;
+		}
 	} 
-	pca->Delete();
 	 
-	bool classificationSuccessful = true;
-	#pragma omp parallel for
-	for(int split=0;split<this->N_SPLITS;split++)
-	{ 	 
-		const std::filesystem::path splitDirName(string_format("split%02d", split + 1));
-		const std::filesystem::path model_filename = root_folder / splitDirName / "model.csv";
+	// Optimised: all splits in one pass over the resampled surface, using the discriminants precomputed by LoadSplitModels.
+	bool classifiedStacked = false;
+	if (!kernelSelection::useLegacy(Kernel::Classification) && this->splitModels && this->splitModels->root_folder == root_folder
+		&& this->splitModels->stacked && this->splitModels->stacked->numberOfSplits() == this->N_SPLITS)
+	{
+		ScopedStageTimer timer(Stage::Projection);
+		TraceSpan span("classify splits (stacked)");
+		classifiedStacked = this->splitModels->stacked->classify(resampled_surface, this->CMValues);
+	}
 
-	 	vtkSmartPointer<vtkPolyData> landmarks = vtkSmartPointer<vtkPolyData>::New();
-	 	landmarks->DeepCopy(example_landmarks);
-		
-		vtkSmartPointer<vtkPolyData> surface = vtkSmartPointer<vtkPolyData>::New();
-		surface->DeepCopy(resampled_surface);
-		
-		if (!(this->ProjectResampledIndividualInSplit(root_folder, model_filename, surface, split)))
+	bool classificationSuccessful = true;
+	if (!classifiedStacked)
+	{
+		// Splits run as tasks of the compute pool, with the trace and allocation accounting of this request active.
+		std::atomic<bool> splitsSuccessful(true);
+		parallelFor(0, this->N_SPLITS, 1, [&](size_t splitIndex, size_t)
 		{
-			classificationSuccessful = false; // Cannot return directly from OMP structured block.
-		}
+			const int split = static_cast<int>(splitIndex);
+			TraceSpan span("classify split");
+			if (CancellationToken::isCancelled(cancellation))
+			{
+				splitsSuccessful = false; // skip remaining splits
+				return;
+			}
+
+			const std::filesystem::path splitDirName(string_format("split%02d", split + 1));
+			const std::filesystem::path model_filename = root_folder / splitDirName / "model.csv";
+
+			// Projection only reads the points of the surface, so the arrays are shared. Each split still requires a data object of its own,
+			// as VTK pipelines modify the information of their input. Formerly, surface and (unused) landmarks were deep copied per split.
+			ScratchVtkObject<vtkPolyData> surface;
+			surface->ShallowCopy(resampled_surface);
+		
+			if (!(this->ProjectResampledIndividualInSplit(root_folder, model_filename, surface.get(), split)))
+			{
+				splitsSuccessful = false;
+			}
 		
-		//this->ProjectIndividualInSplit(model_filename, surface, landmarks, split);
+			//this->ProjectIndividualInSplit(model_filename, surface, landmarks, split);
+		});
+		classificationSuccessful = splitsSuccessful;
 	}
- 
+
 	//Needs to be set back as vtkResampler sets to 1
     	vtkDataObject::SetGlobalReleaseDataFlag(0);
+	if (CancellationToken::isCancelled(cancellation))
+	{
+		return false;
+	}
 	float mean = 0.0;
 	//calulate mean and SD
 	for(int split = 0; split < this->N_SPLITS; split++)  
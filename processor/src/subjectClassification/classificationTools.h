@@ -13,10 +13,17 @@
 #include "vtkImageData.h"
 
 #include <filesystem>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "../heatmapProcessing/vtkSurfacePCA.h"
 
 #define CString std::string //TODO: substitute - keep it now only for easier review of legacy code
 
+class CancellationToken;
+class StackedSplitClassifier;
+
 class ClassificationTools
 {
 public:
@@ -27,14 +34,29 @@ public:
  	// Compute closest mean classification of face mesh.
  	// Returns false if classification was not possible, e.g., due to error reading model files, true otherwise.
  	// Closest mean classification result is returned in float parameters mean and standardErr.
+ 	// Returns false without result if cancellation (optional) was cancelled during resampling or projection.
 	 bool OnProjectIndividualsInSplitFolders(std::filesystem::path root_folder, const vtkSmartPointer<vtkPolyData> example_surface, 
-	     vtkSmartPointer<vtkPolyData> example_landmarks, float &mean, float &standardErr);
+	     vtkSmartPointer<vtkPolyData> example_landmarks, float &mean, float &standardErr, const CancellationToken* cancellation = nullptr);
 	 void SetNSplits(int n) { this->N_SPLITS = n; };
 
+	// Loads the models of all splits in root_folder. Subsequent calls of OnProjectIndividualsInSplitFolders for this root_folder do not read model files again.
+	// Returns false if a model could not be loaded.
+	bool LoadSplitModels(std::filesystem::path root_folder);
+
+	// Split models loaded by LoadSplitModels. Models are only read during classification, hence copies of this object may be used concurrently, sharing the loaded models.
+	struct SplitModels
+	{
+		std::filesystem::path root_folder;
+		std::vector<vtkSmartPointer<vtkSurfacePCA>> models;
+		std::shared_ptr<const StackedSplitClassifier> stacked; // all splits in one pass (Kernel::Classification), nullptr if the splits cannot be stacked
+	};
+	std::shared_ptr<const SplitModels> splitModels;
+
 	CString root_folder;	//root folder containing splits
 	int N_SPLITS;			//number of splits default 20
 	
   	//table/matrix containing projected mode values for each split [split][mode_number]	
+  	// Only filled by the legacy classification; the stacked classifier does not compute mode values.
   	//std::vector<std::vector<float>> projected_table; 
   	typedef std::vector<float> classificationValuesFromSplit;
   	typedef std::vector<classificationValuesFromSplit> splitClassificationValueMatrix;
@@ -51,6 +73,9 @@ public:
 	bool ProjectResampledIndividualInSplit(std::filesystem::path root_folder, std::filesystem::path model_filename, vtkSmartPointer<vtkPolyData> surface, int split_num);
 
 protected:	
+	// Returns model of split split_num from splitModels if loaded for root_folder, loads it from file otherwise. Returns nullptr if loading failed.
+	vtkSmartPointer<vtkSurfacePCA> GetSplitModel(std::filesystem::path root_folder, int split_num);
+
 	vtkContextView *contextView; // Most likely going to be unused: Generating 2D graphic.
 };
 
@@ -0,0 +1,29 @@
+#include "splitModelStore.h"
+
+#include "../utils/resultCache.h"
+
+std::unique_ptr<ClassificationTools> SplitModelStore::classifier(const std::filesystem::path& facialRegionModelDataPath, ResultCache* resultCache)
+{
+	std::shared_ptr<region> entry;
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		auto& found = regions[facialRegionModelDataPath];
+		if (!found)
+		{
+			found = std::make_shared<region>();
+		}
+		entry = found;
+	}
+
+	auto classifier = std::make_unique<ClassificationTools>();
+	const auto fingerprint = (resultCache != nullptr) ? resultCache->modelFingerprint(facialRegionModelDataPath) : std::string();
+	std::lock_guard<std::mutex> guard(entry->loading);
+	if (!entry->models || entry->fingerprint != fingerprint)
+	{
+		ClassificationTools loader;
+		entry->models = loader.LoadSplitModels(facialRegionModelDataPath) ? loader.splitModels : nullptr;
+		entry->fingerprint = fingerprint;
+	}
+	classifier->splitModels = entry->models;
+	return classifier;
+}
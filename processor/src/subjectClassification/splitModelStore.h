@@ -0,0 +1,38 @@
+#ifndef SPLITMODELSTORE_H
+#define SPLITMODELSTORE_H
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "classificationTools.h"
+#include "../utils/instrumentedMutex.h"
+
+class ResultCache;
+
+// Split models of the facial regions (ClassificationTools::LoadSplitModels), loaded once and shared by all classifications of the server,
+// so that a classification neither reads the model files of all splits again nor projects onto each split on its own (stacked classifier,
+// see stackedSplitClassifier.h). Thread-safe.
+class SplitModelStore
+{
+public:
+	// Returns a classifier sharing the split models of facialRegionModelDataPath, which are loaded on first use, and reloaded once the files of the
+	// region have changed (ResultCache::modelFingerprint; without resultCache, they are never reloaded). Concurrent calls for a region wait for a
+	// single load. If the models cannot be loaded, the classifier loads the model of each split itself and reports the error; the next call retries.
+	std::unique_ptr<ClassificationTools> classifier(const std::filesystem::path& facialRegionModelDataPath, ResultCache* resultCache);
+
+private:
+	struct region
+	{
+		std::mutex loading; // held while the models are (re)loaded
+		std::string fingerprint; // of the model files the models were loaded from; guarded by loading
+		std::shared_ptr<const ClassificationTools::SplitModels> models; // nullptr until loaded; guarded by loading
+	};
+
+	InstrumentedMutex mutex{ "splitModelStore" };
+	std::map<std::filesystem::path, std::shared_ptr<region>> regions; // guarded by mutex
+};
+
+#endif // SPLITMODELSTORE_H
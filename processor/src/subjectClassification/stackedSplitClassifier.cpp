@@ -0,0 +1,252 @@
+#include "stackedSplitClassifier.h"
+#include "../mathUtils/procrustes.h"
+#include "../utils/logger.h"
+
+#include "vtkDoubleArray.h"
+#include "vtkPoints.h"
+
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+	struct trainingMeans
+	{
+		std::vector<float> positive;
+		std::vector<float> negative;
+	};
+
+	// Class means of the mode values in training.dat ("1"/"-1" followed by mode:value pairs per line), accumulated in float like
+	// ClassificationTools::OnClassifyIndividualsUsingClosestMean. Returns false if the file cannot be read or is malformed.
+	bool readTrainingMeans(const std::filesystem::path& trainingFile, trainingMeans& means)
+	{
+		std::ifstream inFile(trainingFile);
+		if (!inFile)
+		{
+			return false;
+		}
+		size_t numberOfPositive = 0;
+		size_t numberOfNegative = 0;
+		std::string line;
+		std::vector<float> modeValues;
+		while (std::getline(inFile, line))
+		{
+			std::istringstream iss(line);
+			std::string classLabel;
+			if (!(iss >> classLabel))
+			{
+				break;
+			}
+			modeValues.clear();
+			std::string modeValuePair;
+			while (iss >> modeValuePair)
+			{
+				const auto separator = modeValuePair.find(':');
+				try
+				{
+					modeValues.push_back(std::stof(modeValuePair.substr(separator == std::string::npos ? 0 : separator + 1)));
+				}
+				catch (const std::exception&)
+				{
+					return false;
+				}
+			}
+			if (means.positive.empty())
+			{
+				means.positive.assign(modeValues.size(), 0.0F);
+				means.negative.assign(modeValues.size(), 0.0F);
+			}
+			if (modeValues.size() < means.positive.size())
+			{
+				return false;
+			}
+			auto& sum = (classLabel == "1") ? means.positive : means.negative;
+			if (classLabel == "1")
+			{
+				++numberOfPositive;
+			}
+			else if (classLabel == "-1")
+			{
+				++numberOfNegative;
+			}
+			else
+			{
+				return false;
+			}
+			for (size_t mode = 0; mode < sum.size(); ++mode)
+			{
+				sum[mode] += modeValues[mode];
+			}
+		}
+		if (numberOfPositive == 0 || numberOfNegative == 0 || means.positive.empty())
+		{
+			return false;
+		}
+		for (size_t mode = 0; mode < means.positive.size(); ++mode)
+		{
+			means.positive[mode] /= numberOfPositive;
+			means.negative[mode] /= numberOfNegative;
+		}
+		return true;
+	}
+}
+
+std::shared_ptr<const StackedSplitClassifier> StackedSplitClassifier::create(const std::filesystem::path& root_folder, const std::vector<vtkSmartPointer<vtkSurfacePCA>>& models)
+{
+	if (models.empty() || !models[0])
+	{
+		return nullptr;
+	}
+	auto classifier = std::make_shared<StackedSplitClassifier>();
+	classifier->numberOfPoints = models[0]->GetNumberOfModelPoints();
+	const size_t numberOfPoints = static_cast<size_t>(classifier->numberOfPoints);
+	const size_t columns = columnsPerSplit * models.size();
+	classifier->stacked.assign(numberOfPoints * columns, 0.0);
+	classifier->splits.resize(models.size());
+
+	for (size_t s = 0; s < models.size(); ++s)
+	{
+		const auto& model = models[s];
+		char splitDirName[16];
+		std::snprintf(splitDirName, sizeof(splitDirName), "split%02d", static_cast<int>(s) + 1);
+		trainingMeans means;
+		if (!model || model->GetNumberOfModelPoints() != classifier->numberOfPoints || !readTrainingMeans(root_folder / splitDirName / "training.dat", means)
+			|| static_cast<int>(means.positive.size()) > model->GetTotalNumModes())
+		{
+			logWarning() << "In StackedSplitClassifier::create: Split " << splitDirName << " in " << root_folder
+				<< " does not match the other splits or its training.dat, classifying with legacy implementation.";
+			return nullptr;
+		}
+
+		// Closest-mean discriminant in mode space: classification value is 2 m1m2.(b - neg) / |m1m2|^2 - 1.
+		auto& split = classifier->splits[s];
+		std::vector<double> scaledM1m2(means.positive.size());
+		vtkDoubleArray* evals = model->GetEvals();
+		for (size_t mode = 0; mode < means.positive.size(); ++mode)
+		{
+			const float m1m2 = means.positive[mode] - means.negative[mode];
+			split.m1m2DotNegativeMean += static_cast<double>(m1m2) * means.negative[mode];
+			split.m1m2SquaredNorm += static_cast<double>(m1m2) * m1m2;
+			const double eval = evals->GetValue(static_cast<vtkIdType>(mode));
+			scaledM1m2[mode] = eval ? m1m2 / std::sqrt(eval) : 0.0; // modes of zero variance are projected to 0
+		}
+		if (split.m1m2SquaredNorm == 0.0)
+		{
+			logWarning() << "In StackedSplitClassifier::create: Class means of split " << splitDirName << " in " << root_folder << " coincide.";
+			return nullptr;
+		}
+
+		// Discriminant in shape space and centred mean shape, stacked per point.
+		const double* meanshape = model->GetMeanshape();
+		double** evecMat2 = model->GetEvecMat2();
+		double meanCentroid[3] = { 0.0, 0.0, 0.0 };
+		for (size_t p = 0; p < numberOfPoints; ++p)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				meanCentroid[a] += meanshape[p * 3 + a];
+			}
+		}
+		for (int a = 0; a < 3; ++a)
+		{
+			meanCentroid[a] /= numberOfPoints;
+		}
+		for (size_t p = 0; p < numberOfPoints; ++p)
+		{
+			double* row = classifier->stacked.data() + p * columns + columnsPerSplit * s;
+			for (int a = 0; a < 3; ++a)
+			{
+				const double* evec = evecMat2[p * 3 + a];
+				double discriminant = 0.0;
+				for (size_t mode = 0; mode < scaledM1m2.size(); ++mode)
+				{
+					discriminant += evec[mode] * scaledM1m2[mode];
+				}
+				row[a] = meanshape[p * 3 + a] - meanCentroid[a];
+				row[3 + a] = discriminant;
+				split.discriminantDotCentredMean += discriminant * row[a];
+			}
+		}
+	}
+	return classifier;
+}
+
+bool StackedSplitClassifier::classify(vtkPolyData* surface, std::vector<float>& classificationValues) const
+{
+	vtkPoints* points = surface->GetPoints();
+	if (!points || points->GetNumberOfPoints() != this->numberOfPoints)
+	{
+		return false;
+	}
+	const size_t numberOfPoints = static_cast<size_t>(this->numberOfPoints);
+	const size_t columns = columnsPerSplit * this->splits.size();
+
+	double centroid[3] = { 0.0, 0.0, 0.0 };
+	for (size_t p = 0; p < numberOfPoints; ++p)
+	{
+		double x[3];
+		points->GetPoint(static_cast<vtkIdType>(p), x);
+		for (int a = 0; a < 3; ++a)
+		{
+			centroid[a] += x[a];
+		}
+	}
+	for (int a = 0; a < 3; ++a)
+	{
+		centroid[a] /= numberOfPoints;
+	}
+
+	// products[a][c] = sum_p (x_p - xc)_a stacked[p][c]: correlation with the centred mean shape and with the discriminant of every split.
+	std::vector<std::array<double, 3>> products(columns, { 0.0, 0.0, 0.0 });
+	for (size_t p = 0; p < numberOfPoints; ++p)
+	{
+		double x[3];
+		points->GetPoint(static_cast<vtkIdType>(p), x);
+		const double x0 = x[0] - centroid[0];
+		const double x1 = x[1] - centroid[1];
+		const double x2 = x[2] - centroid[2];
+		const double* row = this->stacked.data() + p * columns;
+		for (size_t c = 0; c < columns; ++c)
+		{
+			products[c][0] += x0 * row[c];
+			products[c][1] += x1 * row[c];
+			products[c][2] += x2 * row[c];
+		}
+	}
+
+	classificationValues.resize(this->splits.size());
+	for (size_t s = 0; s < this->splits.size(); ++s)
+	{
+		const auto* product = &products[columnsPerSplit * s];
+		double M[3][3];
+		for (int a = 0; a < 3; ++a)
+		{
+			for (int b = 0; b < 3; ++b)
+			{
+				M[a][b] = product[b][a];
+			}
+		}
+		double rotation[3][3];
+		if (!procrustes::rotationFromCorrelation(M, rotation))
+		{
+			return false;
+		}
+
+		// w.(y - mu) = sum_p w_p.(R (x_p - xc)) - w.(mu - muc)
+		double discriminantDotShape = -this->splits[s].discriminantDotCentredMean;
+		for (int a = 0; a < 3; ++a)
+		{
+			for (int b = 0; b < 3; ++b)
+			{
+				discriminantDotShape += rotation[a][b] * product[3 + a][b];
+			}
+		}
+		const auto& split = this->splits[s];
+		classificationValues[s] = static_cast<float>(2.0 * (discriminantDotShape - split.m1m2DotNegativeMean) / split.m1m2SquaredNorm - 1.0);
+	}
+	return true;
+}
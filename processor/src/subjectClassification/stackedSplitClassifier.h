@@ -0,0 +1,54 @@
+#ifndef STACKEDSPLITCLASSIFIER_H
+#define STACKEDSPLITCLASSIFIER_H
+
+#include "vtkPolyData.h"
+#include "vtkSmartPointer.h"
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "../heatmapProcessing/vtkSurfacePCA.h"
+
+// Closest-mean classification of a resampled surface against all splits of a facial region in a single pass over its points
+// (optimised implementation of Kernel::Classification, see kernelSelection.h).
+//
+// The legacy path aligns the surface rigidly to the mean shape of each split (vtkLandmarkTransform), projects it onto all modes of the
+// split model and compares the mode values b with the class means of training.dat, which is read on every call:
+//		c = 2 m1m2.(b - neg) / |m1m2|^2 - 1,   b_i = e_i.(y - mu) / sqrt(lambda_i)
+// c is linear in the aligned shape y, so the modes collapse into one discriminant per split, computed once when the models are loaded:
+//		c = 2 (w.(y - mu) - m1m2.neg) / |m1m2|^2 - 1,   w = sum_i m1m2_i / sqrt(lambda_i) e_i
+// With y = R (x - xc) + muc, both the rotation R (Horn's method, from M = sum_p (x_p - xc) (mu_p - muc)^T, as vtkLandmarkTransform)
+// and w.(y - mu) (from G = sum_p (x_p - xc) w_p^T) follow from small 3x3 matrices. M and G of all splits are the product of the centred
+// subject points with the stacked, centred mean shapes and discriminants of all splits, a single (3 x N) x (N x 6 splits) product.
+//
+// Instances are immutable once created, hence may be used concurrently.
+class StackedSplitClassifier
+{
+public:
+	// Stacks the models of all splits in root_folder and computes their discriminants from the training.dat files.
+	// Returns nullptr (logging why) if the splits cannot be stacked, e.g., if the models differ in number of points; classification then uses the legacy path.
+	static std::shared_ptr<const StackedSplitClassifier> create(const std::filesystem::path& root_folder, const std::vector<vtkSmartPointer<vtkSurfacePCA>>& models);
+
+	int numberOfSplits() const { return static_cast<int>(this->splits.size()); }
+
+	// Writes the closest-mean classification value of surface (resampled to the base mesh of the models) for each split to classificationValues.
+	// Returns false if surface does not match the models or its alignment is ambiguous (e.g., collinear points). The legacy path handles these cases.
+	bool classify(vtkPolyData* surface, std::vector<float>& classificationValues) const;
+
+private:
+	struct split
+	{
+		double discriminantDotCentredMean = 0.0; // w.(mu - muc)
+		double m1m2DotNegativeMean = 0.0; // m1m2.neg
+		double m1m2SquaredNorm = 0.0; // m1m2.m1m2
+	};
+
+	static constexpr int columnsPerSplit = 6; // centred mean shape (x, y, z), discriminant (x, y, z)
+
+	int numberOfPoints = 0;
+	std::vector<double> stacked; // numberOfPoints x (columnsPerSplit * splits), row major, i.e., contiguous per point
+	std::vector<split> splits;
+};
+
+#endif // STACKEDSPLITCLASSIFIER_H
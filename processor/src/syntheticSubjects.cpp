@@ -0,0 +1,124 @@
+#include "syntheticSubjects.h"
+
+#include <vtkCellArray.h>
+#include <vtkDoubleArray.h>
+#include <vtkIdList.h>
+#include <vtkLinearSubdivisionFilter.h>
+#include <vtkNew.h>
+#include <vtkPoints.h>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+std::vector<std::unique_ptr<syntheticSubject>> synthesiseSubjects(vtkSurfacePCA* pca, const web::json::value& landmarkSetTypes, const utility::string_t& landmarkSetType,
+	const size_t numberOfSubjects, const int subdivisions, const double noiseMm, const unsigned int seed)
+{
+	if (!landmarkSetTypes.has_array_field(landmarkSetType))
+	{
+		std::cerr << "In synthesiseSubjects: Unknown landmark set type." << std::endl;
+		return {};
+	}
+	const auto& landmarkNames = landmarkSetTypes.at(landmarkSetType).as_array();
+
+	std::mt19937 randomGenerator(seed);
+	std::normal_distribution<double> standardNormal(0.0, 1.0);
+	std::normal_distribution<double> noise(0.0, std::max(noiseMm, 1e-12));
+	std::uniform_real_distribution<float> ageDistribution(4.0F, 18.0F);
+	const auto addNoise = [&](double point[3])
+	{
+		if (noiseMm > 0.0)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				point[axis] += noise(randomGenerator);
+			}
+		}
+	};
+
+	std::vector<std::unique_ptr<syntheticSubject>> subjects;
+	for (size_t s = 0; s < numberOfSubjects; ++s)
+	{
+		vtkNew<vtkDoubleArray> b;
+		b->SetNumberOfValues(pca->GetTotalNumModes());
+		for (vtkIdType mode = 0; mode < b->GetNumberOfValues(); ++mode)
+		{
+			b->SetValue(mode, std::clamp(standardNormal(randomGenerator), -3.0, 3.0));
+		}
+		vtkNew<vtkPolyData> shape;
+		pca->ParameteriseShape(b, shape);
+		vtkNew<vtkPolyData> modelLandmarks;
+		pca->GetParameterisedLandmarks(shape, modelLandmarks);
+
+		auto subject = std::make_unique<syntheticSubject>();
+		subject->age = ageDistribution(randomGenerator);
+		subject->data.surfaceMesh = vtkSmartPointer<vtkPolyData>::New();
+		if (subdivisions > 0)
+		{
+			vtkNew<vtkLinearSubdivisionFilter> subdivisionFilter;
+			subdivisionFilter->SetInputData(shape);
+			subdivisionFilter->SetNumberOfSubdivisions(subdivisions);
+			subdivisionFilter->Update();
+			subject->data.surfaceMesh->DeepCopy(subdivisionFilter->GetOutput());
+		}
+		else
+		{
+			subject->data.surfaceMesh->DeepCopy(shape);
+		}
+		const auto mesh = subject->data.surfaceMesh;
+		for (vtkIdType i = 0; i < mesh->GetNumberOfPoints(); ++i)
+		{
+			double point[3];
+			mesh->GetPoint(i, point);
+			addNoise(point);
+			mesh->GetPoints()->SetPoint(i, point);
+		}
+
+		vtkNew<vtkPoints> landmarkPoints;
+		web::json::value landmarksJson = web::json::value::object();
+		for (size_t l = 0; l < landmarkNames.size() && l < static_cast<size_t>(modelLandmarks->GetNumberOfPoints()); ++l)
+		{
+			double point[3];
+			modelLandmarks->GetPoint(static_cast<vtkIdType>(l), point);
+			addNoise(point);
+			landmarkPoints->InsertNextPoint(point);
+			landmarksJson[landmarkNames.at(l).as_string()] = web::json::value::array({ web::json::value(point[0]), web::json::value(point[1]), web::json::value(point[2]) });
+		}
+		subject->landmarks = vtkSmartPointer<vtkPolyData>::New();
+		subject->landmarks->SetPoints(landmarkPoints);
+
+		subject->landmarksJson = landmarksJson;
+		if (subject->data.parseLandmarks(landmarksJson, landmarkSetTypes).empty())
+		{
+			std::cerr << "In synthesiseSubjects: Landmarks of synthesised subject do not match a landmark set type of modelDB." << std::endl;
+			return {};
+		}
+		subjects.push_back(std::move(subject));
+	}
+	return subjects;
+}
+
+std::string objFileContent(vtkPolyData* mesh)
+{
+	std::ostringstream obj;
+	obj.precision(9);
+	for (vtkIdType i = 0; i < mesh->GetNumberOfPoints(); ++i)
+	{
+		double point[3];
+		mesh->GetPoint(i, point);
+		obj << "v " << point[0] << ' ' << point[1] << ' ' << point[2] << '\n';
+	}
+	vtkNew<vtkIdList> cellPoints;
+	mesh->GetPolys()->InitTraversal();
+	while (mesh->GetPolys()->GetNextCell(cellPoints))
+	{
+		obj << 'f';
+		for (vtkIdType p = 0; p < cellPoints->GetNumberOfIds(); ++p)
+		{
+			obj << ' ' << cellPoints->GetId(p) + 1; // obj indices are 1-based
+		}
+		obj << '\n';
+	}
+	return obj.str();
+}
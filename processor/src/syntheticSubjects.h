@@ -0,0 +1,36 @@
+#ifndef SYNTHETICSUBJECTS_H
+#define SYNTHETICSUBJECTS_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <vtkPolyData.h>
+#include <vtkSmartPointer.h>
+
+#include "faceScreeningObject.h"
+#include "heatmapProcessing/vtkSurfacePCA.h"
+
+// Subject synthesised from a face model, for benchmarking and testing without patient data.
+struct syntheticSubject
+{
+	FaceScreeningObject data; // mesh and parsed landmarks
+	vtkSmartPointer<vtkPolyData> landmarks; // landmarks in model order
+	web::json::value landmarksJson; // landmarks by name, formatted as for upload to endpoint /landmarks
+	float age = 0.0F;
+};
+
+// Synthesises subjects by applying random mode vectors (standard normal, clamped to +-3) to the mean shape of pca.
+// Landmarks are the model's pseudo landmarks on the synthesised shape, named as in landmarkSetTypes[landmarkSetType] (model order).
+// To mimic scanner output, meshes are optionally densified by linear subdivision (each subdivision quadruples the number of triangles)
+// and displaced by Gaussian noise (standard deviation noiseMm), landmarks included. Ages are uniform in [4, 18].
+// Subjects are identical for identical arguments (seed). Returns empty vector if landmarks do not match landmarkSetType.
+std::vector<std::unique_ptr<syntheticSubject>> synthesiseSubjects(vtkSurfacePCA* pca, const web::json::value& landmarkSetTypes, const utility::string_t& landmarkSetType,
+	size_t numberOfSubjects, int subdivisions = 0, double noiseMm = 0.0, unsigned int seed = 20210301);
+
+// Returns mesh as content of an obj file (vertices and triangles only), e.g., for upload to endpoint /objFile.
+std::string objFileContent(vtkPolyData* mesh);
+
+#endif // SYNTHETICSUBJECTS_H
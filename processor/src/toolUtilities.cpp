@@ -0,0 +1,48 @@
+#include "toolUtilities.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+std::optional<web::json::value> readJsonFile(const std::filesystem::path& jsonFile)
+{
+	std::ifstream inFile(jsonFile);
+	if (!inFile)
+	{
+		return {};
+	}
+	std::stringstream inStream;
+	inStream << inFile.rdbuf();
+	try
+	{
+		return web::json::value::parse(utility::conversions::to_string_t(inStream.str()));
+	}
+	catch (const web::json::json_exception& ex)
+	{
+		std::cerr << "Invalid JSON format in " << jsonFile << ": " << ex.what() << std::endl;
+		return {};
+	}
+}
+
+std::optional<web::json::value> readModelDB(const std::filesystem::path& faceModelDBfile)
+{
+	auto modelDB = readJsonFile(faceModelDBfile);
+	if (!modelDB || !modelDB->has_field(U("modelDescriptors")) || !modelDB->has_field(U("landmarkSetTypes")))
+	{
+		std::cerr << "ModelDB file " << faceModelDBfile << " invalid: modelDescriptor or landmarkSetTypes missing. Exiting ..." << std::endl;
+		return {};
+	}
+	return modelDB;
+}
+
+std::optional<web::json::value> faceModelDataDirs(const web::json::value& modelDB, const utility::string_t& ethnicityCode, const utility::string_t& landmarkSetType)
+{
+	const auto& modelDescriptors = modelDB.at(U("modelDescriptors"));
+	if (!modelDescriptors.has_object_field(ethnicityCode) || !modelDescriptors.at(ethnicityCode).has_object_field(landmarkSetType)
+		|| !modelDescriptors.at(ethnicityCode).at(landmarkSetType).has_string_field(U("unsplitModelsPath")) || !modelDB.at(U("landmarkSetTypes")).has_array_field(landmarkSetType))
+	{
+		std::cerr << "ModelDB has no face model for ethnicity code and landmark set type." << std::endl;
+		return {};
+	}
+	return modelDescriptors.at(ethnicityCode).at(landmarkSetType);
+}
@@ -0,0 +1,22 @@
+#ifndef TOOLUTILITIES_H
+#define TOOLUTILITIES_H
+
+#include <filesystem>
+#include <optional>
+
+#include <cpprest/json.h>
+
+// Helpers shared by the command line tools (faceScreenBatch, faceScreenBench, faceScreenEquivalence, faceScreenLoadGen, faceScreenReplay).
+// Errors are reported on std::cerr.
+
+// Returns empty optional if jsonFile cannot be read or is not valid json.
+std::optional<web::json::value> readJsonFile(const std::filesystem::path& jsonFile);
+
+// Reads the modelDB file. Returns empty optional if it cannot be read, or modelDescriptors or landmarkSetTypes are missing.
+std::optional<web::json::value> readModelDB(const std::filesystem::path& faceModelDBfile);
+
+// Model data directories (unsplitModelsPath and, if available, splitModelsPath; relative to the directory of the modelDB file) of the face model
+// for ethnicityCode and landmarkSetType in modelDB (see readModelDB). Returns empty optional if there is no such model or landmark set type.
+std::optional<web::json::value> faceModelDataDirs(const web::json::value& modelDB, const utility::string_t& ethnicityCode, const utility::string_t& landmarkSetType);
+
+#endif // TOOLUTILITIES_H
@@ -0,0 +1,225 @@
+#include "allocationAccounting.h"
+#include "stageTimer.h"
+
+#include <array>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace
+{
+	// Plain pointer, so that it is usable within operator new at any time, e.g., during thread start and exit.
+	thread_local allocationAccounting::RequestAllocations* activeRequest = nullptr;
+
+	// Totals over all threads, including allocations outside requests. Constant-initialised, hence usable before main().
+	std::atomic<std::uint64_t> totalCount{ 0 };
+	std::atomic<std::uint64_t> totalBytes{ 0 };
+
+	// Index Stage::NumberOfStages: allocations outside any stage.
+	std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Stage::NumberOfStages) + 1> stageCounts{};
+	std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Stage::NumberOfStages) + 1> stageBytes{};
+
+	struct endpointTotals
+	{
+		std::uint64_t requests = 0;
+		std::uint64_t count = 0;
+		std::uint64_t bytes = 0;
+	};
+
+	// Paths are chosen by clients, so the number of endpoints reported is bounded. Further endpoints are reported as "other".
+	constexpr size_t maxNumberOfEndpoints = 64;
+
+	std::mutex endpointsMutex;
+	std::map<std::pair<std::string, std::string>, endpointTotals>& endpoints() // (method, endpoint)
+	{
+		static std::map<std::pair<std::string, std::string>, endpointTotals> totals;
+		return totals;
+	}
+
+	// Escapes a label value of the Prometheus text format.
+	std::string labelValue(const std::string& value)
+	{
+		std::string escaped;
+		escaped.reserve(value.size());
+		for (const char c : value)
+		{
+			if (c == '\\' || c == '"')
+			{
+				escaped += '\\';
+			}
+			if (c == '\n')
+			{
+				escaped += "\\n";
+				continue;
+			}
+			escaped += c;
+		}
+		return escaped;
+	}
+
+#ifdef FACESCREEN_ALLOCATION_ACCOUNTING
+	// Lock-free: called for every allocation of the process.
+	void account(const std::size_t size)
+	{
+		totalCount.fetch_add(1, std::memory_order_relaxed);
+		totalBytes.fetch_add(size, std::memory_order_relaxed);
+		const auto stage = static_cast<size_t>(activeStage());
+		stageCounts[stage].fetch_add(1, std::memory_order_relaxed);
+		stageBytes[stage].fetch_add(size, std::memory_order_relaxed);
+		if (activeRequest)
+		{
+			activeRequest->count.fetch_add(1, std::memory_order_relaxed);
+			activeRequest->bytes.fetch_add(size, std::memory_order_relaxed);
+		}
+	}
+
+	void* allocate(std::size_t size)
+	{
+		account(size);
+		if (size == 0)
+		{
+			size = 1;
+		}
+		for (;;)
+		{
+			if (void* memory = std::malloc(size))
+			{
+				return memory;
+			}
+			const auto handler = std::get_new_handler();
+			if (!handler)
+			{
+				throw std::bad_alloc();
+			}
+			handler();
+		}
+	}
+#endif
+}
+
+#ifdef FACESCREEN_ALLOCATION_ACCOUNTING
+// Replacements of the global allocation functions. Over-aligned allocations (align_val_t) keep the default implementation and are not counted.
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	try { return allocate(size); }
+	catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	try { return allocate(size); }
+	catch (...) { return nullptr; }
+}
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete[](void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::size_t) noexcept { std::free(memory); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+#endif
+
+allocationAccounting::RequestAllocations::RequestAllocations(std::string method, std::string endpoint)
+	: method(std::move(method))
+	, endpoint(std::move(endpoint))
+{
+}
+
+allocationAccounting::RequestAllocations::~RequestAllocations()
+{
+	std::lock_guard<std::mutex> guard(endpointsMutex);
+	auto& totals = endpoints();
+	auto found = totals.find({ method, endpoint });
+	if (found == totals.end())
+	{
+		found = totals.emplace(std::make_pair(method, totals.size() < maxNumberOfEndpoints ? endpoint : std::string("other")), endpointTotals()).first;
+	}
+	++found->second.requests;
+	found->second.count += count.load(std::memory_order_relaxed);
+	found->second.bytes += bytes.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<allocationAccounting::RequestAllocations> allocationAccounting::startRequest(std::string method, std::string endpoint)
+{
+	if (!enabled)
+	{
+		return nullptr;
+	}
+	return std::make_shared<RequestAllocations>(std::move(method), std::move(endpoint));
+}
+
+std::shared_ptr<allocationAccounting::RequestAllocations> allocationAccounting::currentRequest()
+{
+	return activeRequest ? activeRequest->shared_from_this() : nullptr;
+}
+
+allocationAccounting::Activation::Activation(std::shared_ptr<RequestAllocations> request)
+	: request(std::move(request))
+	, previous(activeRequest)
+{
+	activeRequest = this->request.get();
+}
+
+allocationAccounting::Activation::~Activation()
+{
+	activeRequest = previous;
+}
+
+void allocationAccounting::appendMetrics(std::ostringstream& text)
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	text << "# HELP facescreen_allocations_total Heap allocations (operator new) of the process.\n"
+		<< "# TYPE facescreen_allocations_total counter\n"
+		<< "facescreen_allocations_total " << totalCount.load(std::memory_order_relaxed) << "\n"
+		<< "# HELP facescreen_allocated_bytes_total Bytes requested from operator new by the process.\n"
+		<< "# TYPE facescreen_allocated_bytes_total counter\n"
+		<< "facescreen_allocated_bytes_total " << totalBytes.load(std::memory_order_relaxed) << "\n";
+
+	text << "# HELP facescreen_stage_allocations_total Heap allocations by processing stage (none: outside any stage).\n"
+		<< "# TYPE facescreen_stage_allocations_total counter\n";
+	for (size_t s = 0; s <= static_cast<size_t>(Stage::NumberOfStages); ++s)
+	{
+		const char* name = (s < static_cast<size_t>(Stage::NumberOfStages)) ? stageName(static_cast<Stage>(s)) : "none";
+		text << "facescreen_stage_allocations_total{stage=\"" << name << "\"} " << stageCounts[s].load(std::memory_order_relaxed) << "\n";
+	}
+	text << "# HELP facescreen_stage_allocated_bytes_total Bytes requested from operator new by processing stage (none: outside any stage).\n"
+		<< "# TYPE facescreen_stage_allocated_bytes_total counter\n";
+	for (size_t s = 0; s <= static_cast<size_t>(Stage::NumberOfStages); ++s)
+	{
+		const char* name = (s < static_cast<size_t>(Stage::NumberOfStages)) ? stageName(static_cast<Stage>(s)) : "none";
+		text << "facescreen_stage_allocated_bytes_total{stage=\"" << name << "\"} " << stageBytes[s].load(std::memory_order_relaxed) << "\n";
+	}
+
+	std::map<std::pair<std::string, std::string>, endpointTotals> totals;
+	{
+		std::lock_guard<std::mutex> guard(endpointsMutex);
+		totals = endpoints();
+	}
+	text << "# HELP facescreen_request_allocations_total Heap allocations of completed requests, by endpoint.\n"
+		<< "# TYPE facescreen_request_allocations_total counter\n";
+	for (const auto& endpoint : totals)
+	{
+		text << "facescreen_request_allocations_total{method=\"" << labelValue(endpoint.first.first) << "\",endpoint=\"" << labelValue(endpoint.first.second) << "\"} "
+			<< endpoint.second.count << "\n";
+	}
+	text << "# HELP facescreen_request_allocated_bytes_total Bytes requested from operator new by completed requests, by endpoint.\n"
+		<< "# TYPE facescreen_request_allocated_bytes_total counter\n";
+	for (const auto& endpoint : totals)
+	{
+		text << "facescreen_request_allocated_bytes_total{method=\"" << labelValue(endpoint.first.first) << "\",endpoint=\"" << labelValue(endpoint.first.second) << "\"} "
+			<< endpoint.second.bytes << "\n";
+	}
+	text << "# HELP facescreen_requests_accounted_total Completed requests whose allocations were counted, by endpoint.\n"
+		<< "# TYPE facescreen_requests_accounted_total counter\n";
+	for (const auto& endpoint : totals)
+	{
+		text << "facescreen_requests_accounted_total{method=\"" << labelValue(endpoint.first.first) << "\",endpoint=\"" << labelValue(endpoint.first.second) << "\"} "
+			<< endpoint.second.requests << "\n";
+	}
+}
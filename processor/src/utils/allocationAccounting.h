@@ -0,0 +1,72 @@
+#ifndef ALLOCATIONACCOUNTING_H
+#define ALLOCATIONACCOUNTING_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+
+// Counting of heap allocations (number and bytes requested from operator new) by request and by processing stage, reported by /metrics,
+// for finding allocations worth eliminating on hot paths with evidence rather than guesswork.
+//
+// Only built with CMake option FACESCREEN_ALLOCATION_ACCOUNTING, which replaces the global operator new and delete and therefore slows
+// down every allocation. Otherwise, no request is accounted and nothing is reported. Memory VTK allocates with malloc (e.g., data arrays
+// of vtkPoints) is not counted, allocations of VTK objects and filters are.
+//
+// Allocations are attributed to the stage running on the allocating thread (innermost ScopedStageTimer, see stageTimer.h) and to the
+// request active on it. Like request traces, the active request follows tasks and parallel loops onto the ComputePool.
+namespace allocationAccounting
+{
+#ifdef FACESCREEN_ALLOCATION_ACCOUNTING
+	constexpr bool enabled = true;
+#else
+	constexpr bool enabled = false;
+#endif
+
+	// Allocations of one request. Added to the totals of its endpoint when the last reference is released,
+	// i.e., after all work started by the request has finished.
+	class RequestAllocations : public std::enable_shared_from_this<RequestAllocations>
+	{
+	public:
+		RequestAllocations(std::string method, std::string endpoint);
+		~RequestAllocations();
+
+		RequestAllocations(const RequestAllocations&) = delete;
+		RequestAllocations& operator=(const RequestAllocations&) = delete;
+
+		std::atomic<std::uint64_t> count{ 0 };
+		std::atomic<std::uint64_t> bytes{ 0 };
+
+	private:
+		const std::string method;
+		const std::string endpoint;
+	};
+
+	// Starts accounting of a request. Returns nullptr unless built with FACESCREEN_ALLOCATION_ACCOUNTING.
+	std::shared_ptr<RequestAllocations> startRequest(std::string method, std::string endpoint);
+
+	// Request active on the calling thread, nullptr if none.
+	std::shared_ptr<RequestAllocations> currentRequest();
+
+	// Makes request the active request of the calling thread until destruction (restoring the previously active request).
+	// A nullptr request leaves the thread's allocations unaccounted to any request until then.
+	class Activation
+	{
+	public:
+		explicit Activation(std::shared_ptr<RequestAllocations> request);
+		~Activation();
+
+		Activation(const Activation&) = delete;
+		Activation& operator=(const Activation&) = delete;
+
+	private:
+		std::shared_ptr<RequestAllocations> request;
+		RequestAllocations* previous;
+	};
+
+	// Renders allocations by endpoint and by stage in Prometheus text format. Appends nothing unless enabled.
+	void appendMetrics(std::ostringstream& text);
+}
+
+#endif // ALLOCATIONACCOUNTING_H
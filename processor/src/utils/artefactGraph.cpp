@@ -0,0 +1,78 @@
+#include "artefactGraph.h"
+
+#include <vector>
+
+uint64_t ArtefactGraph::version(const std::string& key) const
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	const auto node = nodes.find(key);
+	return node != nodes.end() ? node->second.version : 0;
+}
+
+void ArtefactGraph::invalidate(const std::string& key)
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	invalidateLocked(key);
+}
+
+bool ArtefactGraph::store(const std::string& key, const std::string& parameters, std::shared_ptr<const void> artefact, const std::type_index type, const Versions& dependencies, Versions* stored)
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	for (const auto& dependency : dependencies)
+	{
+		const auto node = nodes.find(dependency.first);
+		if (dependency.first == key || (node != nodes.end() ? node->second.version : 0) != dependency.second)
+		{
+			return false; // stale
+		}
+	}
+
+	invalidateLocked(key);
+	auto& node = nodes[key];
+	node.parameters = parameters;
+	node.artefact = std::move(artefact);
+	node.type = type;
+	node.dependencies = dependencies;
+	for (const auto& dependency : dependencies)
+	{
+		dependents[dependency.first].insert(key);
+	}
+	if (stored != nullptr)
+	{
+		(*stored)[key] = node.version;
+	}
+	return true;
+}
+
+void ArtefactGraph::invalidateLocked(const std::string& key)
+{
+	std::vector<std::string> pending{ key };
+	while (!pending.empty())
+	{
+		const auto current = std::move(pending.back());
+		pending.pop_back();
+
+		auto& node = nodes[current];
+		++node.version;
+		node.parameters.clear();
+		node.artefact = nullptr;
+		node.type = typeid(void);
+		for (const auto& dependency : node.dependencies)
+		{
+			const auto derived = dependents.find(dependency.first);
+			if (derived != dependents.end())
+			{
+				derived->second.erase(current);
+			}
+		}
+		node.dependencies.clear();
+
+		// Each artefact is derived from current versions only, hence the graph is acyclic and this terminates.
+		const auto derived = dependents.find(current);
+		if (derived != dependents.end())
+		{
+			pending.insert(pending.end(), derived->second.begin(), derived->second.end());
+			dependents.erase(derived);
+		}
+	}
+}
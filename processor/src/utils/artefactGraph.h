@@ -0,0 +1,86 @@
+#ifndef ARTEFACTGRAPH_H
+#define ARTEFACTGRAPH_H
+
+#include "instrumentedMutex.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+
+// Memoised intermediate results (artefacts) of one processing session, e.g., projection, signature and heatmap of the uploaded subject, with the
+// artefacts and inputs (e.g., the uploaded mesh) each of them has been derived from. Each artefact is stored under a key naming its stage, e.g.,
+// "projection/<model directory>", together with the parameters it was computed with (e.g., the subject age), replacing the previous one:
+// - Changing an input or replacing an artefact drops all artefacts derived from it, directly or transitively, and only these, so that
+//   subsequent requests recompute the affected stages only.
+// - Every key has a version, incremented whenever it changes. Computations record the versions of what they read and store their result
+//   only if none of these has changed meanwhile, so that a result computed from data replaced concurrently is never memoised.
+// Unlike ResultCache, artefacts are kept as objects (not serialised) and are lost with the session. Thread-safe.
+class ArtefactGraph
+{
+public:
+	// Versions of artefacts and inputs read by a computation, by key.
+	using Versions = std::map<std::string, uint64_t>;
+
+	ArtefactGraph() = default;
+	ArtefactGraph(const ArtefactGraph&) = delete;
+	ArtefactGraph& operator=(const ArtefactGraph&) = delete;
+
+	// Current version of the artefact or input stored under key, 0 if it has never changed.
+	uint64_t version(const std::string& key) const;
+
+	// Returns the artefact stored under key if it has been computed with parameters, nullptr otherwise.
+	// On success, adds its version to observed (optional), for storing an artefact derived from it.
+	template<typename T>
+	std::shared_ptr<const T> get(const std::string& key, const std::string& parameters, Versions* observed = nullptr) const
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		const auto node = nodes.find(key);
+		if (node == nodes.end() || node->second.artefact == nullptr || node->second.parameters != parameters || node->second.type != typeid(T))
+		{
+			return nullptr;
+		}
+		if (observed != nullptr)
+		{
+			(*observed)[key] = node->second.version;
+		}
+		return std::static_pointer_cast<const T>(node->second.artefact);
+	}
+
+	// Stores artefact, computed with parameters from dependencies (keys and versions as read by the computation), under key.
+	// Returns false, storing nothing, if any of dependencies has changed since. Otherwise drops the artefacts derived from the replaced one
+	// and adds the version of artefact to stored (optional), for storing artefacts derived from it.
+	template<typename T>
+	bool put(const std::string& key, const std::string& parameters, std::shared_ptr<const T> artefact, const Versions& dependencies, Versions* stored = nullptr)
+	{
+		return store(key, parameters, std::move(artefact), typeid(T), dependencies, stored);
+	}
+
+	// Drops the artefact stored under key, and all artefacts derived from it. Called for inputs (e.g., "mesh") whenever they change.
+	void invalidate(const std::string& key);
+
+private:
+	struct node
+	{
+		uint64_t version = 0;
+		std::string parameters;
+		std::shared_ptr<const void> artefact;
+		std::type_index type = typeid(void);
+		Versions dependencies;
+	};
+
+	bool store(const std::string& key, const std::string& parameters, std::shared_ptr<const void> artefact, std::type_index type, const Versions& dependencies, Versions* stored);
+
+	// Requires lock on mutex.
+	void invalidateLocked(const std::string& key);
+
+	mutable InstrumentedMutex mutex{ "artefactGraph" };
+	std::map<std::string, node> nodes;
+	std::map<std::string, std::set<std::string>> dependents; // keys of artefacts derived from key, by key
+};
+
+#endif // ARTEFACTGRAPH_H
@@ -0,0 +1,56 @@
+#ifndef CANCELLATIONTOKEN_H
+#define CANCELLATIONTOKEN_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+// Shared between a request and the computations it started. Long-running computations poll isCancelled() at stage boundaries
+// and inside long loops, and stop early once the request was cancelled (e.g., its processing token deleted) or its deadline passed.
+// Has no dependencies beyond the standard library, so that it can be passed into model code (vtkSurfacePCA, ClassificationTools).
+class CancellationToken
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	CancellationToken() = default;
+
+	// Token cancelled together with parent (if any), or once timeout has passed.
+	// Timeouts beyond the range of clock never expire (the deadline saturates at time_point::max()), instead of overflowing.
+	template<typename Rep, typename Period>
+	CancellationToken(std::shared_ptr<const CancellationToken> parent, std::chrono::duration<Rep, Period> timeout)
+		: parent(std::move(parent))
+		, deadline(deadlineAfter(timeout))
+	{}
+
+	// Token cancelled together with parent (if any), without deadline of its own.
+	explicit CancellationToken(std::shared_ptr<const CancellationToken> parent)
+		: parent(std::move(parent))
+	{}
+
+	void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+	bool isCancelled() const { return cancelled.load(std::memory_order_relaxed) || deadlineExceeded() || (parent && parent->isCancelled()); }
+
+	// True if cancelled because a deadline passed, rather than by a call to cancel().
+	bool deadlineExceeded() const { return clock::now() > deadline || (parent && parent->deadlineExceeded()); }
+
+	// Convenience for the optional token parameters of computations: nullptr never cancels.
+	static bool isCancelled(const CancellationToken* token) { return token != nullptr && token->isCancelled(); }
+
+private:
+	template<typename Rep, typename Period>
+	static clock::time_point deadlineAfter(std::chrono::duration<Rep, Period> timeout)
+	{
+		const auto now = clock::now();
+		// Remaining range, in the unit of timeout rounded down, so that a timeout below it converts to clock::duration without overflow.
+		const auto remaining = std::chrono::duration_cast<std::chrono::duration<Rep, Period>>(clock::time_point::max() - now);
+		return (timeout >= remaining) ? clock::time_point::max() : now + std::chrono::duration_cast<clock::duration>(timeout);
+	}
+
+	std::atomic<bool> cancelled{ false };
+	std::shared_ptr<const CancellationToken> parent;
+	clock::time_point deadline = clock::time_point::max();
+};
+
+#endif // CANCELLATIONTOKEN_H
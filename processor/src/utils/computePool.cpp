@@ -0,0 +1,558 @@
+#include "computePool.h"
+#include "allocationAccounting.h"
+#include "requestTrace.h"
+#include "stageTimer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+
+namespace
+{
+	// Pool and index of the worker running on the calling thread.
+	thread_local ComputePool* currentPool = nullptr;
+	thread_local size_t currentWorker = 0;
+
+	// Set by SequentialParallelLoops.
+	thread_local bool sequentialLoops = false;
+
+	// Schedules onto the pool, activating the request trace and allocation accounting of the scheduling request while the task runs.
+	class requestScheduler : public pplx::scheduler_interface
+	{
+	public:
+		requestScheduler(ComputePool& pool, std::shared_ptr<RequestTrace> trace, std::shared_ptr<allocationAccounting::RequestAllocations> allocations)
+			: pool(pool)
+			, trace(std::move(trace))
+			, allocations(std::move(allocations))
+		{}
+
+		void schedule(pplx::TaskProc_t procedure, void* parameter) override
+		{
+			pool.schedule(&requestScheduler::run, new requestTask{ procedure, parameter, trace, allocations, RequestTrace::clock::now() });
+		}
+
+	private:
+		struct requestTask
+		{
+			pplx::TaskProc_t procedure;
+			void* parameter;
+			std::shared_ptr<RequestTrace> trace;
+			std::shared_ptr<allocationAccounting::RequestAllocations> allocations;
+			RequestTrace::clock::time_point scheduled;
+		};
+
+		static void _pplx_cdecl run(void* parameter)
+		{
+			const std::unique_ptr<requestTask> task(static_cast<requestTask*>(parameter));
+			if (task->trace)
+			{
+				task->trace->addSpan("compute pool queue", "queue", task->scheduled, RequestTrace::clock::now());
+			}
+			RequestTrace::Activation activation(task->trace);
+			allocationAccounting::Activation allocationActivation(task->allocations);
+			TraceSpan span("compute pool task", "task");
+			task->procedure(task->parameter);
+		}
+
+		ComputePool& pool;
+		const std::shared_ptr<RequestTrace> trace;
+		const std::shared_ptr<allocationAccounting::RequestAllocations> allocations;
+	};
+}
+
+// State of a parallel loop, shared by the calling thread and the helper tasks scheduled for it. Helper tasks may start after the loop has
+// returned; they find no chunk left, and only touch this state, which they keep alive.
+struct ComputePool::parallelLoop : public std::enable_shared_from_this<parallelLoop>
+{
+	const std::function<void(size_t, size_t)>* body; // only called for claimed chunks, i.e., while parallelFor is waiting for them
+	size_t begin;
+	size_t end;
+	size_t grainSize;
+	size_t numberOfChunks;
+	std::atomic<size_t> nextChunk{ 0 };
+	std::atomic<size_t> finishedChunks{ 0 };
+	std::atomic<bool> failed{ false };
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::exception_ptr exception; // guarded by mutex
+
+	// Context of the calling thread, activated on helper threads.
+	std::shared_ptr<RequestTrace> trace;
+	std::shared_ptr<allocationAccounting::RequestAllocations> allocations;
+	Stage stage;
+
+	// Loop whose chunk called this one, if any. Kept alive by nested loops, whose helper tasks may outlive it.
+	std::shared_ptr<parallelLoop> parent;
+
+	bool isNestedIn(const parallelLoop& other) const
+	{
+		for (const parallelLoop* loop = this; loop; loop = loop->parent.get())
+		{
+			if (loop == &other)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Schedules onto the low-priority queue of the pool (runInBackground).
+struct ComputePool::lowPriorityScheduler : public pplx::scheduler_interface
+{
+	explicit lowPriorityScheduler(ComputePool& pool) : pool(pool) {}
+
+	void schedule(pplx::TaskProc_t procedure, void* parameter) override
+	{
+		pool.pushBackground({ procedure, parameter });
+	}
+
+	ComputePool& pool;
+};
+
+ComputePool::ComputePool(unsigned int numberOfThreads)
+{
+	if (numberOfThreads == 0)
+	{
+		numberOfThreads = std::max(1U, std::thread::hardware_concurrency());
+	}
+	maxRunningBackgroundTasks = std::max(1U, numberOfThreads / 2);
+	backgroundScheduler = std::make_shared<lowPriorityScheduler>(*this);
+	workers.reserve(numberOfThreads);
+	for (unsigned int i = 0; i < numberOfThreads; ++i)
+	{
+		workers.push_back(std::make_unique<worker>());
+	}
+	// Started once all workers exist, as they steal from each other.
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		workers[i]->thread = std::thread(&ComputePool::workerLoop, this, i);
+	}
+}
+
+ComputePool::~ComputePool()
+{
+	{
+		std::lock_guard<std::mutex> guard(sleepMutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+	for (auto& worker : workers)
+	{
+		worker->thread.join();
+	}
+}
+
+std::shared_ptr<ComputePool> ComputePool::shared(unsigned int numberOfThreads)
+{
+	static const auto pool = std::make_shared<ComputePool>(numberOfThreads);
+	return pool;
+}
+
+ComputePool* ComputePool::current()
+{
+	return currentPool;
+}
+
+pplx::task_options ComputePool::taskOptions()
+{
+	auto trace = RequestTrace::current();
+	auto allocations = allocationAccounting::currentRequest();
+	if (trace || allocations)
+	{
+		return pplx::task_options(pplx::scheduler_ptr(std::make_shared<requestScheduler>(*this, std::move(trace), std::move(allocations))));
+	}
+	return pplx::task_options(pplx::scheduler_ptr(this));
+}
+
+void ComputePool::schedule(pplx::TaskProc_t procedure, void* parameter)
+{
+	push({ procedure, parameter });
+}
+
+void ComputePool::push(task next)
+{
+	// Counted before it is published, so that workers taking it never decrement the counter below zero.
+	pendingTasks.fetch_add(1);
+	if (currentPool == this)
+	{
+		auto& own = *workers[currentWorker];
+		std::lock_guard<std::mutex> guard(own.mutex);
+		own.tasks.push_back(next);
+	}
+	else
+	{
+		std::lock_guard<InstrumentedMutex> guard(queueMutex);
+		queue.push_back(next);
+	}
+	{
+		// Taking the lock orders this notification after the check of a worker about to sleep, so that it is not lost.
+		std::lock_guard<std::mutex> guard(sleepMutex);
+	}
+	wakeUp.notify_one();
+}
+
+void ComputePool::pushBackground(task next)
+{
+	pendingBackgroundTasks.fetch_add(1); // before publishing, as in push
+	{
+		std::lock_guard<InstrumentedMutex> guard(queueMutex);
+		backgroundQueue.push_back(next);
+	}
+	{
+		std::lock_guard<std::mutex> guard(sleepMutex);
+	}
+	wakeUp.notify_one();
+}
+
+bool ComputePool::tryTake(size_t index, task& next)
+{
+	{
+		auto& own = *workers[index];
+		std::lock_guard<std::mutex> guard(own.mutex);
+		if (!own.tasks.empty())
+		{
+			next = own.tasks.back();
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	{
+		std::lock_guard<InstrumentedMutex> guard(queueMutex);
+		if (!queue.empty())
+		{
+			next = queue.front();
+			queue.pop_front();
+			return true;
+		}
+	}
+	for (size_t offset = 1; offset < workers.size(); ++offset)
+	{
+		auto& victim = *workers[(index + offset) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			next = victim.tasks.front();
+			victim.tasks.pop_front();
+			tasksStolen.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ComputePool::tryRunOne(size_t index)
+{
+	task next;
+	if (pendingTasks.load() == 0 || !tryTake(index, next))
+	{
+		return false;
+	}
+	pendingTasks.fetch_sub(1);
+	run(index, next);
+	return true;
+}
+
+// Runs a helper task of loop, or of a loop nested in it, queued on any worker (own tasks first, newest first). Other tasks are left to other
+// threads: a thread waiting for a parallel loop would otherwise delay it by work of other requests, and nest unrelated tasks on its stack.
+bool ComputePool::tryRunNested(size_t index, const parallelLoop& loop)
+{
+	if (pendingTasks.load() == 0)
+	{
+		return false;
+	}
+	task next;
+	bool taken = false;
+	for (size_t offset = 0; offset < workers.size() && !taken; ++offset)
+	{
+		auto& victim = *workers[(index + offset) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.mutex);
+		for (size_t i = victim.tasks.size(); i-- > 0;)
+		{
+			const task& candidate = victim.tasks[i];
+			// A helper task owns a reference to its loop, so the loop is alive while the task is queued.
+			if (candidate.first == &ComputePool::runHelper && (*static_cast<std::shared_ptr<parallelLoop>*>(candidate.second))->isNestedIn(loop))
+			{
+				next = candidate;
+				victim.tasks.erase(victim.tasks.begin() + static_cast<std::ptrdiff_t>(i));
+				taken = true;
+				if (offset > 0)
+				{
+					tasksStolen.fetch_add(1, std::memory_order_relaxed);
+				}
+				break;
+			}
+		}
+	}
+	if (!taken)
+	{
+		return false;
+	}
+	pendingTasks.fetch_sub(1);
+	runHelper(next.second); // busy time is that of the waiting task
+	tasksRun.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool ComputePool::tryRunBackground(size_t index)
+{
+	if (pendingBackgroundTasks.load() == 0)
+	{
+		return false;
+	}
+	size_t running = runningBackgroundTasks.load();
+	do
+	{
+		if (running >= maxRunningBackgroundTasks)
+		{
+			return false;
+		}
+	} while (!runningBackgroundTasks.compare_exchange_weak(running, running + 1));
+
+	task next;
+	bool taken = false;
+	{
+		std::lock_guard<InstrumentedMutex> guard(queueMutex);
+		if (!backgroundQueue.empty())
+		{
+			next = backgroundQueue.front();
+			backgroundQueue.pop_front();
+			taken = true;
+		}
+	}
+	if (taken)
+	{
+		pendingBackgroundTasks.fetch_sub(1);
+		run(index, next);
+		backgroundTasksRun.fetch_add(1, std::memory_order_relaxed);
+	}
+	runningBackgroundTasks.fetch_sub(1);
+	if (pendingBackgroundTasks.load() > 0)
+	{
+		// Workers may be asleep because all low-priority slots were taken.
+		{
+			std::lock_guard<std::mutex> guard(sleepMutex);
+		}
+		wakeUp.notify_one();
+	}
+	return taken;
+}
+
+void ComputePool::run(size_t index, task next)
+{
+	// Each task starts without request trace, allocation accounting, stage or parallel loop of the thread, and leaves them as it found them.
+	RequestTrace::Activation activation(nullptr);
+	allocationAccounting::Activation allocationActivation(nullptr);
+	const Stage previousStage = activeStage();
+	activeStage() = Stage::NumberOfStages;
+	parallelLoop* const previousLoop = runningLoop();
+	runningLoop() = nullptr;
+
+	const auto started = std::chrono::steady_clock::now();
+	next.first(next.second);
+	workers[index]->busyNanoseconds.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()),
+		std::memory_order_relaxed);
+	tasksRun.fetch_add(1, std::memory_order_relaxed);
+
+	runningLoop() = previousLoop;
+	activeStage() = previousStage;
+}
+
+void ComputePool::workerLoop(size_t index)
+{
+	currentPool = this;
+	currentWorker = index;
+	while (true)
+	{
+		if (tryRunOne(index) || tryRunBackground(index))
+		{
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this]()
+		{
+			return stopping || pendingTasks.load() > 0 || (pendingBackgroundTasks.load() > 0 && runningBackgroundTasks.load() < maxRunningBackgroundTasks);
+		});
+		if (stopping && pendingTasks.load() == 0 && pendingBackgroundTasks.load() == 0) // Tasks already scheduled are still run when stopping.
+		{
+			return;
+		}
+	}
+}
+
+// Loop whose chunk runs on the calling thread (innermost), nullptr if none. Parent of loops called by the chunk.
+ComputePool::parallelLoop*& ComputePool::runningLoop()
+{
+	thread_local parallelLoop* loop = nullptr;
+	return loop;
+}
+
+void ComputePool::runChunks(parallelLoop& loop)
+{
+	parallelLoop* const previousLoop = runningLoop();
+	runningLoop() = &loop;
+	while (true)
+	{
+		const size_t chunk = loop.nextChunk.fetch_add(1);
+		if (chunk >= loop.numberOfChunks)
+		{
+			break;
+		}
+		if (!loop.failed.load(std::memory_order_relaxed))
+		{
+			const size_t chunkBegin = loop.begin + chunk * loop.grainSize;
+			try
+			{
+				(*loop.body)(chunkBegin, std::min(loop.end, chunkBegin + loop.grainSize));
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> guard(loop.mutex);
+				if (!loop.exception)
+				{
+					loop.exception = std::current_exception();
+				}
+				loop.failed = true;
+			}
+		}
+		if (loop.finishedChunks.fetch_add(1) + 1 == loop.numberOfChunks)
+		{
+			std::lock_guard<std::mutex> guard(loop.mutex);
+			loop.finished.notify_all();
+		}
+	}
+	runningLoop() = previousLoop;
+}
+
+void _pplx_cdecl ComputePool::runHelper(void* parameter)
+{
+	const std::unique_ptr<std::shared_ptr<parallelLoop>> loop(static_cast<std::shared_ptr<parallelLoop>*>(parameter));
+	if ((*loop)->nextChunk.load() >= (*loop)->numberOfChunks)
+	{
+		return; // all chunks taken by the time this helper ran
+	}
+	RequestTrace::Activation activation((*loop)->trace);
+	allocationAccounting::Activation allocationActivation((*loop)->allocations);
+	const Stage previousStage = activeStage();
+	activeStage() = (*loop)->stage;
+	runChunks(**loop);
+	activeStage() = previousStage;
+}
+
+void ComputePool::parallelFor(const size_t begin, const size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+	if (end <= begin)
+	{
+		return;
+	}
+	grainSize = std::max<size_t>(grainSize, 1);
+	auto loop = std::make_shared<parallelLoop>();
+	loop->body = &body;
+	loop->begin = begin;
+	loop->end = end;
+	loop->grainSize = grainSize;
+	loop->numberOfChunks = (end - begin + grainSize - 1) / grainSize;
+	loop->stage = activeStage();
+	if (parallelLoop* const parent = runningLoop())
+	{
+		loop->parent = parent->shared_from_this();
+	}
+	parallelLoops.fetch_add(1, std::memory_order_relaxed);
+
+	// One helper task per further thread that may take part, the calling thread taking part itself.
+	const bool calledByWorker = (currentPool == this);
+	const size_t helpers = std::min(loop->numberOfChunks - 1, workers.size() - (calledByWorker ? 1 : 0));
+	if (helpers > 0)
+	{
+		loop->trace = RequestTrace::current();
+		loop->allocations = allocationAccounting::currentRequest();
+	}
+	for (size_t helper = 0; helper < helpers; ++helper)
+	{
+		push({ &ComputePool::runHelper, new std::shared_ptr<parallelLoop>(loop) });
+	}
+
+	runChunks(*loop);
+
+	// Chunks taken by other threads may still be running. Workers meanwhile run chunks of loops nested in this one, but no other tasks.
+	while (loop->finishedChunks.load() < loop->numberOfChunks)
+	{
+		if (calledByWorker && tryRunNested(currentWorker, *loop))
+		{
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(loop->mutex);
+		loop->finished.wait_for(lock, std::chrono::milliseconds(1), [&loop]() { return loop->finishedChunks.load() >= loop->numberOfChunks; });
+	}
+	// Taken out of the loop state, which helper tasks yet to run may release on another thread.
+	std::exception_ptr exception;
+	{
+		std::lock_guard<std::mutex> guard(loop->mutex);
+		exception = std::move(loop->exception);
+	}
+	if (exception)
+	{
+		std::rethrow_exception(exception);
+	}
+}
+
+void ComputePool::appendMetrics(std::ostringstream& text) const
+{
+	std::uint64_t busyNanoseconds = 0;
+	for (const auto& worker : workers)
+	{
+		busyNanoseconds += worker->busyNanoseconds.load(std::memory_order_relaxed);
+	}
+	text << "# HELP facescreen_compute_pool_threads Number of threads of the compute pool.\n"
+		<< "# TYPE facescreen_compute_pool_threads gauge\n"
+		<< "facescreen_compute_pool_threads " << workers.size() << "\n"
+		<< "# HELP facescreen_compute_pool_busy_seconds_total Time spent by compute pool threads running tasks, summed over threads.\n"
+		<< "# TYPE facescreen_compute_pool_busy_seconds_total counter\n"
+		<< "facescreen_compute_pool_busy_seconds_total " << busyNanoseconds / 1e9 << "\n"
+		<< "# HELP facescreen_compute_pool_tasks_total Tasks run by the compute pool.\n"
+		<< "# TYPE facescreen_compute_pool_tasks_total counter\n"
+		<< "facescreen_compute_pool_tasks_total " << tasksRun.load(std::memory_order_relaxed) << "\n"
+		<< "# HELP facescreen_compute_pool_steals_total Tasks taken by compute pool threads from the deque of another thread.\n"
+		<< "# TYPE facescreen_compute_pool_steals_total counter\n"
+		<< "facescreen_compute_pool_steals_total " << tasksStolen.load(std::memory_order_relaxed) << "\n"
+		<< "# HELP facescreen_compute_pool_parallel_loops_total Parallel loops run on the compute pool.\n"
+		<< "# TYPE facescreen_compute_pool_parallel_loops_total counter\n"
+		<< "facescreen_compute_pool_parallel_loops_total " << parallelLoops.load(std::memory_order_relaxed) << "\n"
+		<< "# HELP facescreen_compute_pool_background_tasks_total Low-priority tasks (speculative precomputation) run by the compute pool.\n"
+		<< "# TYPE facescreen_compute_pool_background_tasks_total counter\n"
+		<< "facescreen_compute_pool_background_tasks_total " << backgroundTasksRun.load(std::memory_order_relaxed) << "\n"
+		<< "# HELP facescreen_compute_pool_background_queue_depth Low-priority tasks waiting for an idle compute pool thread.\n"
+		<< "# TYPE facescreen_compute_pool_background_queue_depth gauge\n"
+		<< "facescreen_compute_pool_background_queue_depth " << pendingBackgroundTasks.load(std::memory_order_relaxed) << "\n";
+}
+
+void parallelFor(const size_t begin, const size_t end, const size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+	if (sequentialLoops)
+	{
+		const size_t step = std::max<size_t>(grainSize, 1);
+		for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += std::min(step, end - chunkBegin))
+		{
+			body(chunkBegin, std::min(end, chunkBegin + step));
+		}
+		return;
+	}
+	if (ComputePool* pool = ComputePool::current())
+	{
+		pool->parallelFor(begin, end, grainSize, body);
+		return;
+	}
+	ComputePool::shared()->parallelFor(begin, end, grainSize, body);
+}
+
+SequentialParallelLoops::SequentialParallelLoops()
+	: previous(sequentialLoops)
+{
+	sequentialLoops = true;
+}
+
+SequentialParallelLoops::~SequentialParallelLoops()
+{
+	sequentialLoops = previous;
+}
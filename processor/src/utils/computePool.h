@@ -0,0 +1,154 @@
+#ifndef COMPUTEPOOL_H
+#define COMPUTEPOOL_H
+
+#include "instrumentedMutex.h"
+
+#include <pplx/pplxtasks.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of threads dedicated to CPU-heavy processing stages (mesh parsing, heatmap computation, classification, rendering, report generation).
+// On Linux, cpprestsdk's default pplx scheduler shares its threads with the network I/O of the http_listener. Running heavy stages there lets a few
+// slow requests delay all others, including trivial GETs. Stages are therefore scheduled on this pool, and request handlers only chain continuations.
+//
+// The pool is work-stealing: each worker keeps a deque of its own, to which tasks scheduled from the worker are pushed (and popped, newest first),
+// idle workers steal the oldest tasks of others, and tasks scheduled from other threads are queued for all workers. Parallel loops within stages
+// (parallelFor) run as nested tasks on the same threads, so the number of threads busy with computation never exceeds the size of the pool,
+// whatever the number of concurrent requests. Formerly, each stage running an OpenMP loop started a team of its own.
+class ComputePool : public pplx::scheduler_interface
+{
+public:
+	// numberOfThreads of 0 selects the number of hardware threads.
+	explicit ComputePool(unsigned int numberOfThreads = 0);
+	~ComputePool();
+
+	ComputePool(const ComputePool&) = delete;
+	ComputePool& operator=(const ComputePool&) = delete;
+
+	// Pool shared by the process, e.g., by all requests of the server and by parallelFor called outside any pool. Created on first call,
+	// with numberOfThreads (0: number of hardware threads); the argument of later calls is ignored.
+	static std::shared_ptr<ComputePool> shared(unsigned int numberOfThreads = 0);
+
+	// Pool the calling thread is a worker of, nullptr if none.
+	static ComputePool* current();
+
+	// Runs function on the pool. Returns a task completing with the result of function.
+	// Continuations of this task also run on the pool, unless given a different scheduler.
+	template<typename Function>
+	auto run(Function&& function)
+	{
+		return pplx::create_task(std::forward<Function>(function), taskOptions());
+	}
+
+	// Runs function on the pool at low priority: only on threads without other tasks to run, and on at most half of the threads (at least one)
+	// at a time, so that requests arriving meanwhile find threads free. For speculative work, e.g., precomputing results a client is likely to
+	// request next. Continuations of the returned task run at low priority too. Parallel loops within function run at normal priority, and
+	// threads waiting for a parallel loop do not start low-priority tasks. Tasks run without request trace or allocation accounting of a request.
+	template<typename Function>
+	auto runInBackground(Function&& function)
+	{
+		return pplx::create_task(std::forward<Function>(function), pplx::task_options(pplx::scheduler_ptr(backgroundScheduler)));
+	}
+
+	// Options for scheduling a continuation on the pool, e.g., message.extract_vector().then(stage, computePool->taskOptions())
+	// If a request trace (see requestTrace.h) or allocation accounting of a request (see allocationAccounting.h) is active on the calling thread,
+	// tasks scheduled with these options, and their continuations, run with it active, and their time spent in the queue is traced.
+	pplx::task_options taskOptions();
+
+	// pplx::scheduler_interface
+	void schedule(pplx::TaskProc_t procedure, void* parameter) override;
+
+	// Runs body(chunkBegin, chunkEnd) for consecutive chunks of grainSize indexes (the last one possibly shorter) covering [begin, end),
+	// concurrently on the pool, and returns once all chunks have run. The calling thread runs chunks itself and, if it is a worker, chunks of
+	// loops nested in this one while waiting, so parallel loops may be nested and called from tasks. It does not start other tasks meanwhile,
+	// which would delay the loop by work of other requests. Chunks run with the request trace, allocation accounting and stage of the calling
+	// thread active. If body throws, remaining chunks are skipped and the first exception is rethrown.
+	// Usage: pool.parallelFor(0, n, 1024, [&](size_t chunkBegin, size_t chunkEnd) { for (size_t i = chunkBegin; i < chunkEnd; ++i) ... });
+	void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+
+	size_t numberOfThreads() const { return workers.size(); }
+
+	// Number of scheduled tasks waiting for a free thread, not counting low-priority tasks (runInBackground).
+	size_t queueLength() const { return pendingTasks.load(std::memory_order_relaxed); }
+
+	// Renders utilisation of the pool (threads, busy time, tasks run and stolen, parallel loops) in Prometheus text format.
+	void appendMetrics(std::ostringstream& text) const;
+
+private:
+	using task = std::pair<pplx::TaskProc_t, void*>;
+
+	struct worker
+	{
+		std::mutex mutex;
+		std::deque<task> tasks; // own tasks are taken from the back, stolen ones from the front
+		std::atomic<std::uint64_t> busyNanoseconds{ 0 };
+		std::thread thread;
+	};
+
+	struct parallelLoop;
+	struct lowPriorityScheduler;
+	static parallelLoop*& runningLoop();
+	static void runChunks(parallelLoop& loop);
+	static void _pplx_cdecl runHelper(void* parameter);
+
+	void workerLoop(size_t index);
+	void push(task next);
+	void pushBackground(task next);
+	bool tryTake(size_t index, task& next);
+	bool tryRunOne(size_t index);
+	bool tryRunNested(size_t index, const parallelLoop& loop);
+	bool tryRunBackground(size_t index);
+	void run(size_t index, task next);
+
+	// Tasks scheduled from threads other than workers, and low-priority tasks.
+	mutable InstrumentedMutex queueMutex{ "computePoolQueue" };
+	std::deque<task> queue;
+	std::deque<task> backgroundQueue;
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<size_t> pendingTasks{ 0 };
+	std::atomic<size_t> pendingBackgroundTasks{ 0 };
+	std::atomic<size_t> runningBackgroundTasks{ 0 };
+	size_t maxRunningBackgroundTasks = 1;
+	std::shared_ptr<pplx::scheduler_interface> backgroundScheduler; // schedules onto backgroundQueue
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	bool stopping = false; // guarded by sleepMutex
+
+	std::atomic<std::uint64_t> tasksRun{ 0 };
+	std::atomic<std::uint64_t> tasksStolen{ 0 };
+	std::atomic<std::uint64_t> parallelLoops{ 0 };
+	std::atomic<std::uint64_t> backgroundTasksRun{ 0 };
+};
+
+// Runs a parallel loop (see ComputePool::parallelFor) on the pool of the calling thread, or on the shared pool if it is not a worker of any.
+// For processing stages, which run on the compute pool of the server as well as in command line tools.
+void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+
+// Makes parallelFor (above) run loops called on the calling thread sequentially on it until destruction. For command line tools that
+// distribute independent work (e.g., subjects) over threads of their own, where parallel loops within each piece of work only add overhead.
+class SequentialParallelLoops
+{
+public:
+	SequentialParallelLoops();
+	~SequentialParallelLoops();
+
+	SequentialParallelLoops(const SequentialParallelLoops&) = delete;
+	SequentialParallelLoops& operator=(const SequentialParallelLoops&) = delete;
+
+private:
+	const bool previous;
+};
+
+#endif // COMPUTEPOOL_H
@@ -0,0 +1,44 @@
+#include "instrumentedMutex.h"
+
+#include <deque>
+
+namespace
+{
+	// Plain std::mutex: registration is rare, and must not record itself.
+	std::mutex sitesMutex;
+
+	std::deque<LockSite>& sites() // deque: references stay valid as sites are added
+	{
+		static std::deque<LockSite> registeredSites;
+		return registeredSites;
+	}
+
+	LockSite& registerSite(const std::string& name)
+	{
+		std::lock_guard<std::mutex> guard(sitesMutex);
+		for (auto& site : sites())
+		{
+			if (site.name == name)
+			{
+				return site;
+			}
+		}
+		return sites().emplace_back(name);
+	}
+}
+
+std::vector<const LockSite*> lockSites()
+{
+	std::lock_guard<std::mutex> guard(sitesMutex);
+	std::vector<const LockSite*> registeredSites;
+	for (const auto& site : sites())
+	{
+		registeredSites.push_back(&site);
+	}
+	return registeredSites;
+}
+
+InstrumentedMutex::InstrumentedMutex(const std::string& name)
+	: site(registerSite(name))
+{
+}
@@ -0,0 +1,89 @@
+#ifndef INSTRUMENTEDMUTEX_H
+#define INSTRUMENTEDMUTEX_H
+
+#include "requestTrace.h"
+#include "stageTimer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Histogram of lock wait and hold times: 1 us doubling up to about 33 s.
+using LockHistogram = BasicLatencyHistogram<1000, 26>;
+
+// Statistics of all mutexes sharing a name, e.g., the mutexes of all processing sessions.
+struct LockSite
+{
+	explicit LockSite(std::string name) : name(std::move(name)) {}
+
+	const std::string name;
+	std::atomic<std::uint64_t> acquisitions{ 0 };
+	std::atomic<std::uint64_t> contendedAcquisitions{ 0 }; // had to wait
+	LockHistogram waitTimes;
+	LockHistogram holdTimes;
+};
+
+// Lock sites of the process in order of registration. Sites are never removed.
+std::vector<const LockSite*> lockSites();
+
+// Drop-in replacement of std::mutex for server locks (usable with std::lock_guard, std::unique_lock, std::condition_variable_any),
+// recording time spent waiting for and holding the lock in the histograms of its site (reported by /metrics and /debug/locks).
+// Waits are recorded as spans of the active request trace, if any. An uncontended lock costs an additional try_lock and clock read.
+class InstrumentedMutex
+{
+public:
+	// Mutexes of the same name share their lock site.
+	explicit InstrumentedMutex(const std::string& name);
+
+	InstrumentedMutex(const InstrumentedMutex&) = delete;
+	InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+	void lock()
+	{
+		++site.acquisitions;
+		if (mutex.try_lock())
+		{
+			acquired = std::chrono::steady_clock::now();
+			site.waitTimes.record(std::chrono::nanoseconds(0));
+			return;
+		}
+		++site.contendedAcquisitions;
+		const auto waiting = std::chrono::steady_clock::now();
+		mutex.lock();
+		acquired = std::chrono::steady_clock::now();
+		site.waitTimes.record(acquired - waiting);
+		if (auto* trace = RequestTrace::currentIfAny())
+		{
+			trace->addSpan(site.name, "lock", waiting, acquired);
+		}
+	}
+
+	bool try_lock()
+	{
+		if (!mutex.try_lock())
+		{
+			return false;
+		}
+		++site.acquisitions;
+		acquired = std::chrono::steady_clock::now();
+		site.waitTimes.record(std::chrono::nanoseconds(0));
+		return true;
+	}
+
+	void unlock()
+	{
+		site.holdTimes.record(std::chrono::steady_clock::now() - acquired);
+		mutex.unlock();
+	}
+
+private:
+	std::mutex mutex;
+	LockSite& site;
+	std::chrono::steady_clock::time_point acquired; // only accessed by the holder of mutex
+};
+
+#endif // INSTRUMENTEDMUTEX_H
@@ -0,0 +1,65 @@
+#ifndef KERNELSELECTION_H
+#define KERNELSELECTION_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+// Numerical kernels with an optimised implementation next to the legacy one.
+// The legacy implementations are kept as reference: faceScreenEquivalence runs both side by side and checks that clinical outputs
+// (heatmap, shape parameters, classification) agree within tolerances before an optimisation ships.
+enum class Kernel
+{
+	ShapeProjection, // vtkSurfacePCA: alignment and projection of resampled surface onto the modes
+	Resample, // vtkSurfacePCA: warp and closest-point resampling of the subject mesh
+	Signature, // msNormalisationTools: matched mean and signature (heatmap) computation
+	Classification, // ClassificationTools: projection onto the split models and closest-mean classification
+	NumberOfKernels // not a kernel
+};
+
+// Process-wide selection of implementations. Optimised implementations are used unless the legacy one is selected.
+// Selection is expected to change only while no computation runs (harness, server start-up).
+namespace kernelSelection
+{
+	inline const char* kernelName(const Kernel kernel)
+	{
+		static const char* names[] = { "shapeProjection", "resample", "signature", "classification" };
+		static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Kernel::NumberOfKernels), "Each kernel requires a name.");
+		return names[static_cast<size_t>(kernel)];
+	}
+
+	inline std::array<std::atomic<bool>, static_cast<size_t>(Kernel::NumberOfKernels)>& legacySelected()
+	{
+		static std::array<std::atomic<bool>, static_cast<size_t>(Kernel::NumberOfKernels)> selected{};
+		return selected;
+	}
+
+	inline bool useLegacy(const Kernel kernel) { return legacySelected()[static_cast<size_t>(kernel)].load(std::memory_order_relaxed); }
+
+	inline void selectLegacy(const Kernel kernel, const bool legacy) { legacySelected()[static_cast<size_t>(kernel)].store(legacy, std::memory_order_relaxed); }
+
+	inline void selectLegacyForAll(const bool legacy)
+	{
+		for (size_t k = 0; k < static_cast<size_t>(Kernel::NumberOfKernels); ++k)
+		{
+			selectLegacy(static_cast<Kernel>(k), legacy);
+		}
+	}
+
+	// Selects legacy implementation of kernel by name (see kernelName). Returns false if name is unknown.
+	inline bool selectLegacy(const std::string& name)
+	{
+		for (size_t k = 0; k < static_cast<size_t>(Kernel::NumberOfKernels); ++k)
+		{
+			if (name == kernelName(static_cast<Kernel>(k)))
+			{
+				selectLegacy(static_cast<Kernel>(k), true);
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+#endif // KERNELSELECTION_H
@@ -0,0 +1,316 @@
+#include "logger.h"
+
+#include <cpprest/asyncrt_utils.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	struct record
+	{
+		std::chrono::system_clock::time_point time;
+		LogLevel level = LogLevel::Info;
+		std::string processingTokenSuffix;
+		std::string text;
+	};
+
+	const char* levelName(const LogLevel level)
+	{
+		static const char* names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+		return names[static_cast<size_t>(level)];
+	}
+
+	// Bounded multi-producer queue with a single consumer (the writer), after D. Vyukov's bounded MPMC queue.
+	// Each slot carries a sequence number telling producers and the consumer whose turn it is, so neither takes a lock.
+	class recordRing
+	{
+	public:
+		static constexpr size_t capacity = 8192; // power of 2
+
+		recordRing()
+		{
+			for (size_t i = 0; i < capacity; ++i)
+			{
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		// Returns false if full.
+		bool push(record&& value)
+		{
+			size_t position = enqueuePosition.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				auto& slot = slots[position & (capacity - 1)];
+				const auto sequence = slot.sequence.load(std::memory_order_acquire);
+				const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+				if (difference == 0)
+				{
+					if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						slot.value = std::move(value);
+						slot.sequence.store(position + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (difference < 0)
+				{
+					return false;
+				}
+				else
+				{
+					position = enqueuePosition.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Single consumer only. Returns false if empty.
+		bool pop(record& value)
+		{
+			auto& slot = slots[dequeuePosition & (capacity - 1)];
+			if (slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+			{
+				return false;
+			}
+			value = std::move(slot.value);
+			slot.sequence.store(dequeuePosition + capacity, std::memory_order_release);
+			++dequeuePosition;
+			return true;
+		}
+
+	private:
+		struct slot
+		{
+			std::atomic<size_t> sequence{ 0 };
+			record value;
+		};
+
+		std::vector<slot> slots = std::vector<slot>(capacity);
+		std::atomic<size_t> enqueuePosition{ 0 };
+		size_t dequeuePosition = 0;
+	};
+
+	class asyncLogger
+	{
+	public:
+		asyncLogger()
+			: writer([this]() { run(); })
+		{}
+
+		~asyncLogger()
+		{
+			stopping.store(true, std::memory_order_release);
+			writer.join();
+		}
+
+		bool configure(const LogLevel level, const std::filesystem::path& logFile)
+		{
+			minimumLevel.store(level, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> guard(sinkMutex);
+			if (logFile.empty())
+			{
+				file.reset();
+				return true;
+			}
+			auto newFile = std::make_unique<std::ofstream>(logFile, std::ios::app);
+			if (!*newFile)
+			{
+				return false;
+			}
+			file = std::move(newFile);
+			return true;
+		}
+
+		bool enabled(const LogLevel level) const { return level >= minimumLevel.load(std::memory_order_relaxed); }
+
+		// Debug and info records are dropped if the ring is full. Warnings and errors are rare and wait for the writer instead.
+		void submit(record&& value)
+		{
+			while (!ring.push(std::move(value)))
+			{
+				if (value.level < LogLevel::Warning)
+				{
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					break;
+				}
+				std::this_thread::yield();
+			}
+			submitted.fetch_add(1, std::memory_order_release);
+		}
+
+		void flush()
+		{
+			const auto target = submitted.load(std::memory_order_acquire);
+			while (handled.load(std::memory_order_acquire) + dropped.load(std::memory_order_relaxed) < target)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		uint64_t droppedRecords() const { return dropped.load(std::memory_order_relaxed); }
+
+	private:
+		void run()
+		{
+			record value;
+			for (;;)
+			{
+				const bool stop = stopping.load(std::memory_order_acquire);
+				size_t written = 0;
+				{
+					std::lock_guard<std::mutex> guard(sinkMutex); // only contended by configure()
+					while (ring.pop(value))
+					{
+						write(value);
+						++written;
+					}
+					if (written > 0 && file)
+					{
+						file->flush();
+					}
+					else if (written > 0)
+					{
+						std::fflush(stdout);
+					}
+				}
+				handled.fetch_add(written, std::memory_order_release);
+				if (stop)
+				{
+					return;
+				}
+				if (written == 0)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				}
+			}
+		}
+
+		void write(const record& value)
+		{
+			const auto sinceEpoch = value.time.time_since_epoch();
+			const std::time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch).count();
+			const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000;
+			std::tm utc{};
+#ifdef _WIN32
+			gmtime_s(&utc, &seconds);
+#else
+			gmtime_r(&seconds, &utc);
+#endif
+			line.str(std::string());
+			line << std::put_time(&utc, "%Y-%m-%dT%H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << milliseconds << "Z " << levelName(value.level);
+			if (!value.processingTokenSuffix.empty())
+			{
+				line << " [" << value.processingTokenSuffix << ']';
+			}
+			line << ' ' << value.text << '\n';
+			const auto text = line.str();
+			if (file)
+			{
+				file->write(text.data(), text.size());
+			}
+			else
+			{
+				std::fwrite(text.data(), 1, text.size(), stdout);
+			}
+		}
+
+		recordRing ring;
+		std::atomic<LogLevel> minimumLevel{ LogLevel::Info };
+		std::atomic<uint64_t> submitted{ 0 };
+		std::atomic<uint64_t> handled{ 0 };
+		std::atomic<uint64_t> dropped{ 0 };
+		std::atomic<bool> stopping{ false };
+		std::mutex sinkMutex;
+		std::unique_ptr<std::ofstream> file; // nullptr: stdout
+		std::ostringstream line; // writer thread only
+		std::thread writer; // last member: started once all others are constructed
+	};
+
+	asyncLogger& instance()
+	{
+		static asyncLogger logger;
+		return logger;
+	}
+}
+
+bool logger::configure(const LogLevel minimumLevel, const std::filesystem::path& logFile)
+{
+	return instance().configure(minimumLevel, logFile);
+}
+
+bool logger::enabled(const LogLevel level)
+{
+	return instance().enabled(level);
+}
+
+std::optional<LogLevel> logger::levelFromName(const std::string& name)
+{
+	static const std::array<std::pair<const char*, LogLevel>, 4> levels = { { { "debug", LogLevel::Debug }, { "info", LogLevel::Info },
+		{ "warning", LogLevel::Warning }, { "error", LogLevel::Error } } };
+	for (const auto& level : levels)
+	{
+		if (name == level.first)
+		{
+			return level.second;
+		}
+	}
+	return {};
+}
+
+void logger::submit(const LogLevel level, const std::string& processingTokenSuffix, std::string text)
+{
+	instance().submit({ std::chrono::system_clock::now(), level, processingTokenSuffix, std::move(text) });
+}
+
+void logger::flush()
+{
+	instance().flush();
+}
+
+uint64_t logger::droppedRecords()
+{
+	return instance().droppedRecords();
+}
+
+LogRecord::LogRecord(const LogLevel level, const std::string& processingToken)
+	: level(level)
+{
+	if (!logger::enabled(level))
+	{
+		return;
+	}
+	processingTokenSuffix = processingToken.substr(processingToken.size() > 4 ? processingToken.size() - 4 : 0);
+	stream = std::make_unique<std::ostringstream>();
+}
+
+LogRecord::LogRecord(const LogLevel level, const std::wstring& processingToken)
+	: LogRecord(level, utility::conversions::to_utf8string(processingToken))
+{
+}
+
+LogRecord::~LogRecord()
+{
+	if (stream)
+	{
+		logger::submit(level, processingTokenSuffix, stream->str());
+	}
+}
+
+LogRecord& LogRecord::operator<<(const std::wstring& text)
+{
+	if (stream)
+	{
+		*stream << utility::conversions::to_utf8string(text);
+	}
+	return *this;
+}
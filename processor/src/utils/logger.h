@@ -0,0 +1,90 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+
+enum class LogLevel
+{
+	Debug,
+	Info,
+	Warning,
+	Error
+};
+
+// Asynchronous logging. Records are formatted on the calling thread and handed to a background writer through a lock-free ring buffer,
+// so that request threads never wait for the console or a log file. Each record carries a timestamp (UTC, milliseconds), its level and,
+// if given, the last four characters of the processing token it belongs to:
+//		2021-03-01T12:00:00.123Z INFO  [1a2b] Computing heatmap
+// If the ring buffer is full, debug and info records are dropped (and counted) rather than blocking the caller.
+// Records below the minimum level are not formatted at all. Request bodies must never be logged, only their size.
+namespace logger
+{
+	// Minimum level and destination of records, e.g., from the server config. Empty logFile writes to stdout. Defaults: Info, stdout.
+	// Returns false (keeping stdout) if logFile cannot be opened for appending.
+	bool configure(LogLevel minimumLevel, const std::filesystem::path& logFile);
+
+	bool enabled(LogLevel level);
+
+	// Parses debug, info, warning or error. Returns empty optional otherwise.
+	std::optional<LogLevel> levelFromName(const std::string& name);
+
+	// Queues a record for the writer.
+	void submit(LogLevel level, const std::string& processingTokenSuffix, std::string text);
+
+	// Blocks until all records queued so far are written.
+	void flush();
+
+	// Number of records dropped because the ring buffer was full.
+	uint64_t droppedRecords();
+}
+
+// Builds one record with stream syntax and submits it on destruction, e.g.:
+//		logInfo(processingToken) << "Computing heatmap for age " << subjectAge;
+// Do not stream std::endl; each record is one line.
+class LogRecord
+{
+public:
+	LogRecord(LogLevel level, const std::string& processingToken);
+	LogRecord(LogLevel level, const std::wstring& processingToken);
+	~LogRecord();
+
+	LogRecord(const LogRecord&) = delete;
+	LogRecord& operator=(const LogRecord&) = delete;
+
+	template<typename T>
+	LogRecord& operator<<(const T& value)
+	{
+		if (stream)
+		{
+			*stream << value;
+		}
+		return *this;
+	}
+
+	// Wide strings (utility::string_t on Windows) are written as UTF-8.
+	LogRecord& operator<<(const std::wstring& text);
+	LogRecord& operator<<(const wchar_t* text) { return *this << std::wstring(text); }
+	template<size_t N>
+	LogRecord& operator<<(const wchar_t (&text)[N]) { return *this << std::wstring(text); }
+
+private:
+	const LogLevel level;
+	std::string processingTokenSuffix;
+	std::unique_ptr<std::ostringstream> stream; // nullptr if level is disabled
+};
+
+inline LogRecord logDebug(const std::string& processingToken = std::string()) { return LogRecord(LogLevel::Debug, processingToken); }
+inline LogRecord logDebug(const std::wstring& processingToken) { return LogRecord(LogLevel::Debug, processingToken); }
+inline LogRecord logInfo(const std::string& processingToken = std::string()) { return LogRecord(LogLevel::Info, processingToken); }
+inline LogRecord logInfo(const std::wstring& processingToken) { return LogRecord(LogLevel::Info, processingToken); }
+inline LogRecord logWarning(const std::string& processingToken = std::string()) { return LogRecord(LogLevel::Warning, processingToken); }
+inline LogRecord logWarning(const std::wstring& processingToken) { return LogRecord(LogLevel::Warning, processingToken); }
+inline LogRecord logError(const std::string& processingToken = std::string()) { return LogRecord(LogLevel::Error, processingToken); }
+inline LogRecord logError(const std::wstring& processingToken) { return LogRecord(LogLevel::Error, processingToken); }
+
+#endif // LOGGER_H
@@ -0,0 +1,168 @@
+#include "multipartFormData.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace
+{
+
+std::string toLower(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return str;
+}
+
+std::string trim(const std::string& str)
+{
+	const auto first = str.find_first_not_of(" \t");
+	if (first == std::string::npos)
+	{
+		return std::string();
+	}
+	const auto last = str.find_last_not_of(" \t");
+	return str.substr(first, last - first + 1);
+}
+
+std::string unquote(const std::string& str)
+{
+	if (str.size() >= 2 && str.front() == '"' && str.back() == '"')
+	{
+		return str.substr(1, str.size() - 2);
+	}
+	return str;
+}
+
+// Returns value of parameter key (e.g., 'name') of a header value such as 'form-data; name="mesh"; filename="face.obj"'.
+std::string headerParameter(const std::string& headerValue, const std::string& key)
+{
+	size_t start = 0;
+	while (start <= headerValue.size())
+	{
+		auto end = headerValue.find(';', start);
+		if (end == std::string::npos)
+		{
+			end = headerValue.size();
+		}
+		const auto token = trim(headerValue.substr(start, end - start));
+		const auto separator = token.find('=');
+		if (separator != std::string::npos && toLower(trim(token.substr(0, separator))) == key)
+		{
+			return unquote(trim(token.substr(separator + 1)));
+		}
+		start = end + 1;
+	}
+	return std::string();
+}
+
+} // unnamed namespace
+
+std::optional<std::string> multipartFormData::boundaryFromContentType(const std::string& contentType)
+{
+	const auto contentTypeLower = toLower(contentType);
+	if (contentTypeLower.find("multipart/form-data") == std::string::npos)
+	{
+		return {};
+	}
+	const auto boundary = headerParameter(contentType, "boundary");
+	if (boundary.empty())
+	{
+		return {};
+	}
+	return boundary;
+}
+
+std::optional<std::map<std::string, multipartFormData::part>> multipartFormData::parse(const std::vector<unsigned char>& body, const std::string& boundary)
+{
+	using byteIterator = std::vector<unsigned char>::const_iterator;
+
+	const std::string delimiter("--" + boundary);
+	const std::string lineBreak("\r\n");
+	const std::string headerEnd("\r\n\r\n");
+	// Delimiters after the first one are preceded by the line break terminating the previous part's content.
+	const std::string partDelimiter(lineBreak + delimiter);
+
+	const auto find = [&body](byteIterator from, const std::string& pattern)
+	{
+		return std::search(from, body.cend(), pattern.cbegin(), pattern.cend());
+	};
+
+	std::map<std::string, part> parts;
+
+	auto it = find(body.cbegin(), delimiter); // Anything before the first delimiter is preamble and ignored.
+	if (it == body.cend())
+	{
+		return {};
+	}
+
+	while (true)
+	{
+		it += delimiter.size();
+		if (std::distance(it, body.cend()) >= 2 && *it == '-' && *(it + 1) == '-')
+		{
+			return parts; // Closing delimiter reached.
+		}
+
+		// Skip (optional) transport padding and line break after delimiter.
+		it = find(it, lineBreak);
+		if (it == body.cend())
+		{
+			return {};
+		}
+		it += lineBreak.size();
+
+		// Part headers, terminated by empty line. A part may have no headers at all.
+		part nextPart;
+		if (!(std::distance(it, body.cend()) >= 2 && *it == '\r' && *(it + 1) == '\n'))
+		{
+			const auto headersEnd = find(it, headerEnd);
+			if (headersEnd == body.cend())
+			{
+				return {};
+			}
+			const std::string headers(it, headersEnd);
+			size_t lineStart = 0;
+			while (lineStart < headers.size())
+			{
+				auto lineEnd = headers.find(lineBreak, lineStart);
+				if (lineEnd == std::string::npos)
+				{
+					lineEnd = headers.size();
+				}
+				const auto line = headers.substr(lineStart, lineEnd - lineStart);
+				const auto colon = line.find(':');
+				if (colon != std::string::npos)
+				{
+					const auto headerName = toLower(trim(line.substr(0, colon)));
+					const auto headerValue = trim(line.substr(colon + 1));
+					if (headerName == "content-disposition")
+					{
+						nextPart.name = headerParameter(headerValue, "name");
+						nextPart.filename = headerParameter(headerValue, "filename");
+					}
+					else if (headerName == "content-type")
+					{
+						nextPart.contentType = headerValue;
+					}
+				}
+				lineStart = lineEnd + lineBreak.size();
+			}
+			it = headersEnd + headerEnd.size();
+		}
+		else
+		{
+			it += lineBreak.size();
+		}
+
+		const auto contentEnd = find(it, partDelimiter);
+		if (contentEnd == body.cend())
+		{
+			return {};
+		}
+		nextPart.data.assign(it, contentEnd);
+		if (!nextPart.name.empty())
+		{
+			parts[nextPart.name] = std::move(nextPart);
+		}
+		it = contentEnd + lineBreak.size();
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef MULTIPARTFORMDATA_H
+#define MULTIPARTFORMDATA_H
+
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Minimal decoder for multipart/form-data request bodies (RFC 7578), as sent by, e.g., curl -F or python httpx (files=...).
+// cpprestsdk has no support for multipart bodies, hence this small helper.
+namespace multipartFormData
+{
+	struct part
+	{
+		std::string name;			// Value of 'name' in the Content-Disposition header of the part.
+		std::string filename;		// Value of 'filename' in the Content-Disposition header, empty if not provided.
+		std::string contentType;	// Content-Type header of the part, empty if not provided.
+		std::vector<unsigned char> data;
+
+		std::string asString() const { return std::string(data.cbegin(), data.cend()); }
+	};
+
+	// Extracts the boundary parameter from a Content-Type header value such as 'multipart/form-data; boundary=----abc'.
+	// Returns empty optional if the header does not describe a multipart body.
+	std::optional<std::string> boundaryFromContentType(const std::string& contentType);
+
+	// Splits body into its parts, keyed by part name. If a name occurs more than once, the last part wins.
+	// Returns empty optional if body is malformed (e.g., boundary not found or closing delimiter missing).
+	std::optional<std::map<std::string, part>> parse(const std::vector<unsigned char>& body, const std::string& boundary);
+}
+
+#endif // MULTIPARTFORMDATA_H
@@ -0,0 +1,49 @@
+#include "precomputation.h"
+#include "logger.h"
+
+#include <exception>
+
+Precomputation::Precomputation(std::shared_ptr<const CancellationToken> parent)
+	: cancellation(std::make_shared<CancellationToken>(std::move(parent)))
+{}
+
+void Precomputation::run(const std::string& key, const std::function<void(const CancellationToken*)>& computation)
+{
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		auto& state = computations[key];
+		if (state.claimed || state.started || cancellation->isCancelled())
+		{
+			return;
+		}
+		state.started = true;
+	}
+	try
+	{
+		computation(cancellation.get());
+	}
+	catch (const std::exception& e)
+	{
+		logWarning() << "Precomputation for " << key << " failed: " << e.what();
+	}
+	pplx::task_completion_event<void> done;
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		auto& state = computations[key];
+		state.finished = true;
+		done = state.done;
+	}
+	done.set(); // continuations of waiting requests may run on this thread, hence outside the lock
+}
+
+pplx::task<void> Precomputation::claim(const std::string& key)
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	auto& state = computations[key];
+	state.claimed = true;
+	if (state.started && !state.finished)
+	{
+		return pplx::create_task(state.done);
+	}
+	return pplx::task_from_result();
+}
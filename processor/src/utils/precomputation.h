@@ -0,0 +1,53 @@
+#ifndef PRECOMPUTATION_H
+#define PRECOMPUTATION_H
+
+#include "cancellationToken.h"
+#include "instrumentedMutex.h"
+
+#include <pplx/pplxtasks.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+// Speculative computations of a processing session, started at low priority (ComputePool::runInBackground) once the subject data they depend
+// on is complete, before the client requests a result needing them, e.g., the projection of the uploaded mesh onto the face model. Results go
+// to the result cache, where the requests find them. Each computation is identified by a key, e.g., its model directory:
+// - A request needing the result of a computation that is running waits for it (claim), instead of computing the same concurrently.
+// - A computation that has not started by the time a request needs its result is skipped, the request computes the result itself.
+// Sessions replace their precomputation when their subject data changes, cancelling the computations for the previous data. Thread-safe.
+class Precomputation
+{
+public:
+	// Computations are cancelled together with parent (the session), or by cancel().
+	explicit Precomputation(std::shared_ptr<const CancellationToken> parent);
+
+	Precomputation(const Precomputation&) = delete;
+	Precomputation& operator=(const Precomputation&) = delete;
+
+	void cancel() { cancellation->cancel(); }
+
+	// Runs computation for key, passing it the cancellation token of the precomputation, unless key has been claimed or the precomputation
+	// cancelled. Exceptions thrown by computation are logged, not rethrown. For the low-priority tasks of the computations.
+	void run(const std::string& key, const std::function<void(const CancellationToken*)>& computation);
+
+	// For a request needing the result of the computation for key: Returns a task completing once the computation has finished if it is
+	// running, or a completed task otherwise, in which case the computation is skipped should its task start later.
+	pplx::task<void> claim(const std::string& key);
+
+private:
+	struct computation
+	{
+		bool started = false;
+		bool claimed = false;
+		bool finished = false;
+		pplx::task_completion_event<void> done;
+	};
+
+	const std::shared_ptr<CancellationToken> cancellation;
+	InstrumentedMutex mutex{ "precomputation" };
+	std::map<std::string, computation> computations;
+};
+
+#endif // PRECOMPUTATION_H
@@ -0,0 +1,114 @@
+#include "requestTrace.h"
+#include "logger.h"
+
+#include <cpprest/json.h>
+
+#include <atomic>
+#include <fstream>
+
+namespace
+{
+	thread_local RequestTrace* activeTrace = nullptr;
+
+	std::atomic<int> nextThreadId{ 1 };
+}
+
+RequestTrace::RequestTrace(std::filesystem::path traceFile, std::string requestName)
+	: traceFile(std::move(traceFile))
+	, requestName(std::move(requestName))
+{
+}
+
+RequestTrace::~RequestTrace()
+{
+	try
+	{
+		write();
+	}
+	catch (const std::exception& ex) // Must not leave destructor, which may run on any thread.
+	{
+		logError() << "RequestTrace: Trace of " << requestName << " could not be written to " << traceFile << ": " << ex.what();
+	}
+}
+
+std::shared_ptr<RequestTrace> RequestTrace::current()
+{
+	return activeTrace ? activeTrace->shared_from_this() : nullptr;
+}
+
+RequestTrace* RequestTrace::currentIfAny()
+{
+	return activeTrace;
+}
+
+int RequestTrace::threadId()
+{
+	thread_local const int id = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+	return id;
+}
+
+void RequestTrace::addSpan(std::string name, const char* category, const clock::time_point start, const clock::time_point end,
+	std::vector<std::pair<std::string, std::string>> arguments, const int threadId)
+{
+	span newSpan{ std::move(name), category,
+		std::chrono::duration_cast<std::chrono::microseconds>(start - started).count(),
+		std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+		threadId, std::move(arguments) };
+	std::lock_guard<std::mutex> guard(spansMutex);
+	spans.push_back(std::move(newSpan));
+}
+
+void RequestTrace::write() const
+{
+	using utility::conversions::to_string_t;
+
+	std::vector<web::json::value> events;
+	events.reserve(spans.size());
+	for (const auto& span : spans) // No lock: no references (hence no spans) left.
+	{
+		web::json::value event = web::json::value::object();
+		event[U("name")] = web::json::value::string(to_string_t(span.name));
+		event[U("cat")] = web::json::value::string(to_string_t(std::string(span.category)));
+		event[U("ph")] = web::json::value::string(U("X")); // complete event
+		event[U("ts")] = web::json::value::number(span.startInMicroseconds);
+		event[U("dur")] = web::json::value::number(span.durationInMicroseconds);
+		event[U("pid")] = web::json::value::number(1);
+		event[U("tid")] = web::json::value::number(span.threadId);
+		if (!span.arguments.empty())
+		{
+			web::json::value arguments = web::json::value::object();
+			for (const auto& argument : span.arguments)
+			{
+				arguments[to_string_t(argument.first)] = web::json::value::string(to_string_t(argument.second));
+			}
+			event[U("args")] = arguments;
+		}
+		events.push_back(event);
+	}
+
+	web::json::value trace = web::json::value::object();
+	trace[U("traceEvents")] = web::json::value::array(events);
+	trace[U("displayTimeUnit")] = web::json::value::string(U("ms"));
+	trace[U("otherData")][U("request")] = web::json::value::string(to_string_t(requestName));
+
+	std::ofstream out(traceFile, std::ios::binary);
+	out << utility::conversions::to_utf8string(trace.serialize());
+	if (!out)
+	{
+		logError() << "RequestTrace: Cannot write trace file " << traceFile;
+		return;
+	}
+	logInfo() << "Trace of " << requestName << " written to " << traceFile;
+}
+
+RequestTrace::Activation::Activation(std::shared_ptr<RequestTrace> trace)
+	: trace(std::move(trace))
+	, previous(activeTrace)
+{
+	activeTrace = this->trace.get();
+}
+
+RequestTrace::Activation::~Activation()
+{
+	activeTrace = previous;
+}
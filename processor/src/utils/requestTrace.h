@@ -0,0 +1,118 @@
+#ifndef REQUESTTRACE_H
+#define REQUESTTRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Timeline of a single request, written as Chrome trace event json (open in chrome://tracing or https://ui.perfetto.dev) for
+// finding the critical path of slow requests: waits for locks and compute threads, processing stages, parallel loops, rendering.
+//
+// A trace is active on a thread while an Activation of it exists there. Spans (TraceSpan, ScopedStageTimer, waits for an
+// InstrumentedMutex) record into the trace active on their thread and cost a thread-local lookup only if there is none. Tasks
+// scheduled on the ComputePool inherit the trace active when they were scheduled, and so do the chunks of parallel loops (parallelFor).
+// Threads started otherwise have to activate it explicitly:
+//		std::thread worker([trace = RequestTrace::current()]() { RequestTrace::Activation activation(trace); TraceSpan span("work"); ... });
+//
+// The trace file is written when the last reference to the trace is released, i.e., after all work started by the request has
+// finished, even if this was after the response had been sent. Thread-safe.
+class RequestTrace : public std::enable_shared_from_this<RequestTrace>
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	RequestTrace(std::filesystem::path traceFile, std::string requestName);
+	~RequestTrace();
+
+	RequestTrace(const RequestTrace&) = delete;
+	RequestTrace& operator=(const RequestTrace&) = delete;
+
+	// Trace active on the calling thread, nullptr if none.
+	static std::shared_ptr<RequestTrace> current();
+
+	// Same as above, but without taking a reference. For checks on hot paths.
+	static RequestTrace* currentIfAny();
+
+	// Small sequential number of the calling thread (tid of its events).
+	static int threadId();
+
+	// Records a complete event. Arguments (name, value) are shown with the event.
+	void addSpan(std::string name, const char* category, clock::time_point start, clock::time_point end,
+		std::vector<std::pair<std::string, std::string>> arguments = {}, int threadId = RequestTrace::threadId());
+
+	// Makes trace the active trace of the calling thread until destruction (restoring the previously active trace).
+	// A nullptr trace leaves the thread untraced until then, so activations need not be guarded and do not leak a trace into unrelated work.
+	class Activation
+	{
+	public:
+		explicit Activation(std::shared_ptr<RequestTrace> trace);
+		~Activation();
+
+		Activation(const Activation&) = delete;
+		Activation& operator=(const Activation&) = delete;
+
+	private:
+		std::shared_ptr<RequestTrace> trace;
+		RequestTrace* previous;
+	};
+
+private:
+	struct span
+	{
+		std::string name;
+		const char* category;
+		std::int64_t startInMicroseconds;
+		std::int64_t durationInMicroseconds;
+		int threadId;
+		std::vector<std::pair<std::string, std::string>> arguments;
+	};
+
+	void write() const;
+
+	const std::filesystem::path traceFile;
+	const std::string requestName;
+	const clock::time_point started = clock::now();
+	std::mutex spansMutex;
+	std::vector<span> spans;
+};
+
+// Records the time from construction to destruction as span of the trace active on the calling thread, if any.
+// Usage: { TraceSpan span("render"); renderWindow->Render(); }
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* name, const char* category = "span")
+		: trace(RequestTrace::currentIfAny())
+		, name(name)
+		, category(category)
+	{
+		if (trace)
+		{
+			start = RequestTrace::clock::now();
+		}
+	}
+
+	~TraceSpan()
+	{
+		if (trace)
+		{
+			trace->addSpan(name, category, start, RequestTrace::clock::now());
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	RequestTrace* const trace;
+	const char* const name;
+	const char* const category;
+	RequestTrace::clock::time_point start;
+};
+
+#endif // REQUESTTRACE_H
@@ -0,0 +1,222 @@
+#include "resultCache.h"
+#include "logger.h"
+#include "serverMetrics.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	std::optional<std::string> readFile(const std::filesystem::path& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+		{
+			return {};
+		}
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	// Writes to a temporary file first and renames it, so that concurrent readers (and later runs) never see partially written files.
+	void writeFile(const std::filesystem::path& path, const std::string& content)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(path.parent_path(), error);
+		std::ostringstream tempName;
+		tempName << path.filename().string() << ".tmp" << std::this_thread::get_id();
+		const auto tempPath = path.parent_path() / tempName.str();
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			if (!file.write(content.data(), content.size()))
+			{
+				logError() << "ResultCache: Cannot write " << tempPath;
+				return;
+			}
+		}
+		std::filesystem::rename(tempPath, path, error);
+		if (error)
+		{
+			std::filesystem::remove(tempPath, error);
+		}
+	}
+}
+
+ResultCache::ResultCache(const size_t maxMemoryBytes, std::filesystem::path diskDirectory)
+	: maxMemoryBytes(maxMemoryBytes)
+	, diskDirectory(std::move(diskDirectory))
+{
+}
+
+std::filesystem::path ResultCache::modelDiskDirectory(const std::string& modelDirectory) const
+{
+	return diskDirectory / Sha256().update(modelDirectory).hexDigest().substr(0, 16);
+}
+
+std::string ResultCache::modelFingerprint(const std::filesystem::path& modelDirectory)
+{
+	std::vector<std::filesystem::path> files;
+	std::error_code error;
+	for (auto it = std::filesystem::recursive_directory_iterator(modelDirectory, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+	{
+		if (it->is_regular_file(error))
+		{
+			files.push_back(it->path());
+		}
+	}
+	std::sort(files.begin(), files.end()); // Directory iteration order is unspecified.
+
+	Sha256 fingerprintHash;
+	for (const auto& file : files)
+	{
+		const auto size = static_cast<unsigned long long>(std::filesystem::file_size(file, error));
+		const auto modified = static_cast<long long>(std::filesystem::last_write_time(file, error).time_since_epoch().count());
+		fingerprintHash.update(std::filesystem::relative(file, modelDirectory, error).generic_string()).update("\n", 1).updateValue(size).updateValue(modified);
+	}
+	const auto fingerprint = fingerprintHash.hexDigest();
+
+	const auto directory = modelDirectory.generic_string();
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	auto known = fingerprintByModelDirectory.find(directory);
+	std::optional<std::string> previousFingerprint;
+	if (known != fingerprintByModelDirectory.end())
+	{
+		previousFingerprint = known->second;
+	}
+	else if (!diskDirectory.empty())
+	{
+		previousFingerprint = readFile(modelDiskDirectory(directory) / "fingerprint");
+	}
+
+	if (previousFingerprint && *previousFingerprint != fingerprint)
+	{
+		logInfo() << "ResultCache: Model files in " << modelDirectory << " have changed. Invalidating cached results.";
+		eraseInMemory(directory);
+		if (!diskDirectory.empty())
+		{
+			std::filesystem::remove_all(modelDiskDirectory(directory), error);
+		}
+	}
+	if (!previousFingerprint || *previousFingerprint != fingerprint)
+	{
+		fingerprintByModelDirectory[directory] = fingerprint;
+		if (!diskDirectory.empty())
+		{
+			writeFile(modelDiskDirectory(directory) / "fingerprint", fingerprint);
+		}
+	}
+	return fingerprint;
+}
+
+void ResultCache::invalidateModel(const std::filesystem::path& modelDirectory)
+{
+	const auto directory = modelDirectory.generic_string();
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	eraseInMemory(directory);
+	fingerprintByModelDirectory.erase(directory);
+	if (!diskDirectory.empty())
+	{
+		std::error_code error;
+		std::filesystem::remove_all(modelDiskDirectory(directory), error);
+	}
+}
+
+std::optional<std::string> ResultCache::get(const std::filesystem::path& modelDirectory, const std::string& key)
+{
+	const auto directory = modelDirectory.generic_string();
+	{
+		std::lock_guard<InstrumentedMutex> guard(mutex);
+		auto found = entryByKey.find(key);
+		if (found != entryByKey.end())
+		{
+			entries.splice(entries.begin(), entries, found->second);
+			++serverMetrics::resultCacheHits;
+			return found->second->value;
+		}
+	}
+
+	if (!diskDirectory.empty())
+	{
+		auto value = readFile(modelDiskDirectory(directory) / key);
+		if (value)
+		{
+			std::lock_guard<InstrumentedMutex> guard(mutex);
+			insertInMemory(directory, key, *value);
+			++serverMetrics::resultCacheHits;
+			return value;
+		}
+	}
+	++serverMetrics::resultCacheMisses;
+	return {};
+}
+
+void ResultCache::put(const std::filesystem::path& modelDirectory, const std::string& key, std::string value)
+{
+	const auto directory = modelDirectory.generic_string();
+	if (!diskDirectory.empty())
+	{
+		writeFile(modelDiskDirectory(directory) / key, value);
+	}
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	insertInMemory(directory, key, std::move(value));
+}
+
+size_t ResultCache::memoryBytes() const
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	return usedMemoryBytes;
+}
+
+size_t ResultCache::numberOfEntries() const
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	return entries.size();
+}
+
+void ResultCache::insertInMemory(const std::string& modelDirectory, const std::string& key, std::string value)
+{
+	if (value.size() > maxMemoryBytes)
+	{
+		return;
+	}
+	auto existing = entryByKey.find(key);
+	if (existing != entryByKey.end())
+	{
+		usedMemoryBytes -= existing->second->value.size();
+		entries.erase(existing->second);
+		entryByKey.erase(existing);
+	}
+	while (!entries.empty() && usedMemoryBytes + value.size() > maxMemoryBytes)
+	{
+		usedMemoryBytes -= entries.back().value.size();
+		entryByKey.erase(entries.back().key);
+		entries.pop_back();
+	}
+	usedMemoryBytes += value.size();
+	entries.push_front({ key, modelDirectory, std::move(value) });
+	entryByKey[key] = entries.begin();
+}
+
+void ResultCache::eraseInMemory(const std::string& modelDirectory)
+{
+	for (auto it = entries.begin(); it != entries.end();)
+	{
+		if (it->modelDirectory == modelDirectory)
+		{
+			usedMemoryBytes -= it->value.size();
+			entryByKey.erase(it->key);
+			it = entries.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
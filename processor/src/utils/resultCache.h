@@ -0,0 +1,74 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include "instrumentedMutex.h"
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Content-addressed cache of computation results (projections, heatmaps, classifications), shared by all processing sessions.
+// Keys are digests of everything a result depends on (subject data, model fingerprint, parameters), so that a repeated request for the same scan
+// is served without recomputation, regardless of session or upload route. Values are opaque byte strings, serialised by the caller.
+// Entries are kept in an in-memory LRU tier bounded in size and, optionally, in an on-disk tier that persists across server restarts.
+// Each entry is tagged with the model directory it was computed with. Entries of a model directory are dropped once its files change.
+// Thread-safe.
+class ResultCache
+{
+public:
+	// maxMemoryBytes - Capacity of the in-memory tier (sum of value sizes).
+	// diskDirectory - Root directory of the on-disk tier. Empty disables the on-disk tier.
+	ResultCache(size_t maxMemoryBytes, std::filesystem::path diskDirectory);
+
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	// Returns fingerprint (digest of relative path, size and modification time of all files) of modelDirectory, to be included in keys.
+	// If the fingerprint differs from the one seen previously for modelDirectory (in this run or, with on-disk tier, an earlier one),
+	// all entries of modelDirectory are invalidated first.
+	std::string modelFingerprint(const std::filesystem::path& modelDirectory);
+
+	// Drops all entries computed with models in modelDirectory from both tiers.
+	void invalidateModel(const std::filesystem::path& modelDirectory);
+
+	// Returns cached value for key, or empty optional on cache miss. A hit on the on-disk tier is promoted to the in-memory tier.
+	std::optional<std::string> get(const std::filesystem::path& modelDirectory, const std::string& key);
+
+	// Stores value for key in both tiers. Values larger than the in-memory capacity are stored on disk only.
+	void put(const std::filesystem::path& modelDirectory, const std::string& key, std::string value);
+
+	size_t memoryBytes() const;
+	size_t numberOfEntries() const;
+
+private:
+	struct Entry
+	{
+		std::string key;
+		std::string modelDirectory;
+		std::string value;
+	};
+
+	// Directory of the on-disk tier holding entries (and the fingerprint) of modelDirectory.
+	std::filesystem::path modelDiskDirectory(const std::string& modelDirectory) const;
+
+	// Inserts into in-memory tier, evicting least recently used entries as needed. Requires lock on mutex.
+	void insertInMemory(const std::string& modelDirectory, const std::string& key, std::string value);
+
+	// Drops in-memory entries of modelDirectory. Requires lock on mutex.
+	void eraseInMemory(const std::string& modelDirectory);
+
+	mutable InstrumentedMutex mutex{ "resultCache" };
+	std::list<Entry> entries; // most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> entryByKey;
+	std::map<std::string, std::string> fingerprintByModelDirectory;
+	size_t usedMemoryBytes = 0;
+
+	const size_t maxMemoryBytes;
+	const std::filesystem::path diskDirectory;
+};
+
+#endif // RESULTCACHE_H
@@ -0,0 +1,115 @@
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <vtkDataObject.h>
+#include <vtkSmartPointer.h>
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Per-thread pools of temporaries used on the hot paths of heatmap computation and classification (shape vectors, mode weights,
+// VTK helper objects). Each thread (e.g., of the compute pool) keeps the buffers and objects it borrowed once, so repeated calls reuse
+// them instead of allocating afresh: in steady state, borrowing allocates nothing. Buffers keep the largest capacity requested on
+// their thread, i.e., memory held is bounded by a few shape vectors (3 x number of model points) per thread.
+//
+// Borrowed temporaries must not outlive the scope that borrowed them, and are not shared with other threads.
+namespace scratch
+{
+	template<typename T>
+	std::vector<std::vector<T>>& vectorPool()
+	{
+		thread_local std::vector<std::vector<T>> pool;
+		return pool;
+	}
+
+	template<typename VtkClass>
+	std::vector<vtkSmartPointer<VtkClass>>& vtkObjectPool()
+	{
+		thread_local std::vector<vtkSmartPointer<VtkClass>> pool;
+		return pool;
+	}
+
+	// Releases what a returned object refers to, e.g., the arrays of a vtkPolyData, so that the pool does not keep meshes alive.
+	template<typename VtkClass>
+	void release(VtkClass* object)
+	{
+		if constexpr (std::is_base_of<vtkDataObject, VtkClass>::value)
+		{
+			object->Initialize();
+		}
+	}
+}
+
+// Vector of size elements borrowed from the pool of the calling thread until destruction. Contents are not initialised.
+// Usage: ScratchVector<double> shapeVector(3 * N); shapeVector[j] = ...;
+template<typename T>
+class ScratchVector
+{
+public:
+	explicit ScratchVector(size_t size)
+	{
+		auto& pool = scratch::vectorPool<T>();
+		if (!pool.empty())
+		{
+			buffer = std::move(pool.back());
+			pool.pop_back();
+		}
+		buffer.resize(size);
+	}
+
+	~ScratchVector()
+	{
+		scratch::vectorPool<T>().push_back(std::move(buffer));
+	}
+
+	ScratchVector(const ScratchVector&) = delete;
+	ScratchVector& operator=(const ScratchVector&) = delete;
+
+	T* data() { return buffer.data(); }
+	size_t size() const { return buffer.size(); }
+	T& operator[](size_t i) { return buffer[i]; }
+	const T& operator[](size_t i) const { return buffer[i]; }
+
+private:
+	std::vector<T> buffer;
+};
+
+// VTK object borrowed from the pool of the calling thread until destruction. The object keeps its state from earlier use
+// (e.g., the cell types instantiated by a vtkGenericCell), except that data objects are emptied when returned.
+// Usage: ScratchVtkObject<vtkGenericCell> cell; locator->FindClosestPoint(p, closestPoint, cell, id, subid, dist2);
+template<typename VtkClass>
+class ScratchVtkObject
+{
+public:
+	ScratchVtkObject()
+	{
+		auto& pool = scratch::vtkObjectPool<VtkClass>();
+		if (pool.empty())
+		{
+			object = vtkSmartPointer<VtkClass>::New();
+			return;
+		}
+		object = std::move(pool.back());
+		pool.pop_back();
+	}
+
+	~ScratchVtkObject()
+	{
+		scratch::release(object.GetPointer());
+		scratch::vtkObjectPool<VtkClass>().push_back(std::move(object));
+	}
+
+	ScratchVtkObject(const ScratchVtkObject&) = delete;
+	ScratchVtkObject& operator=(const ScratchVtkObject&) = delete;
+
+	VtkClass* operator->() const { return object.GetPointer(); }
+	operator VtkClass*() const { return object.GetPointer(); }
+	VtkClass* get() const { return object.GetPointer(); }
+
+private:
+	vtkSmartPointer<VtkClass> object;
+};
+
+#endif // SCRATCHARENA_H
@@ -0,0 +1,116 @@
+#ifndef SERVERMETRICS_H
+#define SERVERMETRICS_H
+
+#include "instrumentedMutex.h"
+#include "stageTimer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+// Process-wide counters exposed by endpoint /metrics in Prometheus text format.
+namespace serverMetrics
+{
+	// Computations stopped early because the request was cancelled, e.g., its processing token deleted while computing.
+	inline std::atomic<std::uint64_t> computationsCancelled{ 0 };
+
+	// Computations stopped early because the deadline of the request (X-Deadline-Ms / deadlineMs) passed.
+	inline std::atomic<std::uint64_t> computationsDeadlineExceeded{ 0 };
+
+	// Lookups in the result cache (in-memory or on-disk tier) that returned a cached result, and those that did not.
+	inline std::atomic<std::uint64_t> resultCacheHits{ 0 };
+	inline std::atomic<std::uint64_t> resultCacheMisses{ 0 };
+
+	// Requests received, by HTTP method.
+	inline std::atomic<std::uint64_t> requestsGet{ 0 };
+	inline std::atomic<std::uint64_t> requestsPost{ 0 };
+	inline std::atomic<std::uint64_t> requestsPut{ 0 };
+	inline std::atomic<std::uint64_t> requestsDelete{ 0 };
+
+	// Renders one series of a Prometheus histogram (buckets, sum and count), labelled e.g. stage="signature".
+	template<typename Histogram>
+	void appendHistogramSeries(std::ostringstream& text, const char* metric, const std::string& label, const Histogram& histogram)
+	{
+		std::uint64_t cumulativeCount = 0;
+		for (size_t bucket = 0; bucket < Histogram::numberOfBuckets; ++bucket)
+		{
+			cumulativeCount += histogram.count(bucket);
+			text << metric << "_bucket{" << label << ",le=\"" << Histogram::upperBoundInSeconds(bucket) << "\"} " << cumulativeCount << "\n";
+		}
+		cumulativeCount += histogram.count(Histogram::numberOfBuckets);
+		text << metric << "_bucket{" << label << ",le=\"+Inf\"} " << cumulativeCount << "\n"
+			<< metric << "_sum{" << label << "} " << histogram.sumInSeconds() << "\n"
+			<< metric << "_count{" << label << "} " << cumulativeCount << "\n";
+	}
+
+	// Renders the latency histograms of all stages (see stageTimer.h) as one Prometheus histogram with label stage.
+	inline void appendStageHistograms(std::ostringstream& text)
+	{
+		text << "# HELP facescreen_stage_duration_seconds Duration of processing stages.\n"
+			<< "# TYPE facescreen_stage_duration_seconds histogram\n";
+		for (size_t s = 0; s < static_cast<size_t>(Stage::NumberOfStages); ++s)
+		{
+			appendHistogramSeries(text, "facescreen_stage_duration_seconds", std::string("stage=\"") + stageName(static_cast<Stage>(s)) + "\"", stageHistograms()[s]);
+		}
+	}
+
+	// Renders acquisitions and wait and hold time histograms of all lock sites (see instrumentedMutex.h), with label lock.
+	inline void appendLockMetrics(std::ostringstream& text)
+	{
+		const auto sites = lockSites();
+		text << "# HELP facescreen_lock_acquisitions_total Acquisitions of server locks.\n"
+			<< "# TYPE facescreen_lock_acquisitions_total counter\n";
+		for (const auto* site : sites)
+		{
+			text << "facescreen_lock_acquisitions_total{lock=\"" << site->name << "\"} " << site->acquisitions.load() << "\n";
+		}
+		text << "# HELP facescreen_lock_contended_acquisitions_total Acquisitions of server locks that had to wait for another holder.\n"
+			<< "# TYPE facescreen_lock_contended_acquisitions_total counter\n";
+		for (const auto* site : sites)
+		{
+			text << "facescreen_lock_contended_acquisitions_total{lock=\"" << site->name << "\"} " << site->contendedAcquisitions.load() << "\n";
+		}
+		text << "# HELP facescreen_lock_wait_seconds Time spent waiting to acquire server locks.\n"
+			<< "# TYPE facescreen_lock_wait_seconds histogram\n";
+		for (const auto* site : sites)
+		{
+			appendHistogramSeries(text, "facescreen_lock_wait_seconds", "lock=\"" + site->name + "\"", site->waitTimes);
+		}
+		text << "# HELP facescreen_lock_hold_seconds Time server locks were held.\n"
+			<< "# TYPE facescreen_lock_hold_seconds histogram\n";
+		for (const auto* site : sites)
+		{
+			appendHistogramSeries(text, "facescreen_lock_hold_seconds", "lock=\"" + site->name + "\"", site->holdTimes);
+		}
+	}
+
+	// Renders all process-wide metrics. Gauges owned by the server (queue depth, sessions, ...) are appended by the caller.
+	inline std::string prometheusText()
+	{
+		std::ostringstream text;
+		text << "# HELP facescreen_requests_total Requests received, by HTTP method.\n"
+			<< "# TYPE facescreen_requests_total counter\n"
+			<< "facescreen_requests_total{method=\"GET\"} " << requestsGet.load() << "\n"
+			<< "facescreen_requests_total{method=\"POST\"} " << requestsPost.load() << "\n"
+			<< "facescreen_requests_total{method=\"PUT\"} " << requestsPut.load() << "\n"
+			<< "facescreen_requests_total{method=\"DELETE\"} " << requestsDelete.load() << "\n";
+		text << "# HELP facescreen_computations_cancelled_total Computations stopped early after their request was cancelled.\n"
+			<< "# TYPE facescreen_computations_cancelled_total counter\n"
+			<< "facescreen_computations_cancelled_total " << computationsCancelled.load() << "\n"
+			<< "# HELP facescreen_computations_deadline_exceeded_total Computations stopped early after the deadline of their request passed.\n"
+			<< "# TYPE facescreen_computations_deadline_exceeded_total counter\n"
+			<< "facescreen_computations_deadline_exceeded_total " << computationsDeadlineExceeded.load() << "\n"
+			<< "# HELP facescreen_result_cache_hits_total Result cache lookups served from cache.\n"
+			<< "# TYPE facescreen_result_cache_hits_total counter\n"
+			<< "facescreen_result_cache_hits_total " << resultCacheHits.load() << "\n"
+			<< "# HELP facescreen_result_cache_misses_total Result cache lookups requiring computation.\n"
+			<< "# TYPE facescreen_result_cache_misses_total counter\n"
+			<< "facescreen_result_cache_misses_total " << resultCacheMisses.load() << "\n";
+		appendStageHistograms(text);
+		appendLockMetrics(text);
+		return text.str();
+	}
+}
+
+#endif // SERVERMETRICS_H
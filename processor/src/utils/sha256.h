@@ -0,0 +1,35 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental SHA-256 (FIPS 180-4), used for content-addressing cached results.
+// Self-contained, as cpprestsdk does not expose a hash function on all platforms.
+class Sha256
+{
+public:
+	Sha256();
+
+	Sha256& update(const void* data, size_t length);
+	Sha256& update(const std::string& data) { return update(data.data(), data.size()); }
+
+	// Hashes the bytes of a trivially copyable value, e.g., a float. Not portable across architectures of different endianness.
+	template<typename T>
+	Sha256& updateValue(const T& value) { return update(&value, sizeof(T)); }
+
+	// Finishes hashing. Returns digest as 64 lower case hex digits. The object must not be updated afterwards.
+	std::string hexDigest();
+
+private:
+	void processBlock(const uint8_t* block);
+
+	std::array<uint32_t, 8> state;
+	std::array<uint8_t, 64> buffer;
+	size_t bufferLength = 0;
+	uint64_t totalLength = 0;
+};
+
+#endif // SHA256_H
@@ -0,0 +1,159 @@
+#ifndef STAGETIMER_H
+#define STAGETIMER_H
+
+#include "requestTrace.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Processing stages timed on the hot paths of heatmap computation, classification, rendering and report generation.
+enum class Stage
+{
+	ModelLoad,
+	TriangleFilter,
+	TpsWarp,
+	LocatorBuild,
+	ClosestPointResample,
+	Projection,
+	MatchedMeanSelection,
+	Signature,
+	LandmarkTransform,
+	Rendering,
+	JpegEncode,
+	ReportBuild,
+	NumberOfStages // not a stage
+};
+
+// Name of stage as used for the stage label of metrics.
+inline const char* stageName(Stage stage)
+{
+	static const char* names[] = { "model_load", "triangle_filter", "tps_warp", "locator_build", "closest_point_resample", "projection",
+		"matched_mean_selection", "signature", "landmark_transform", "rendering", "jpeg_encode", "report_build" };
+	static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Stage::NumberOfStages), "Each stage requires a name.");
+	return names[static_cast<size_t>(stage)];
+}
+
+// Stage running on the calling thread (innermost ScopedStageTimer), Stage::NumberOfStages if none. Used to attribute allocations to stages.
+inline Stage& activeStage()
+{
+	thread_local Stage stage = Stage::NumberOfStages;
+	return stage;
+}
+
+// Histogram of durations with logarithmically spaced buckets, from firstUpperBoundInNanoseconds doubling with each bucket, plus an overflow bucket.
+// Recording is lock-free (relaxed atomic increments), so that concurrent stages on the compute pool never wait for each other.
+template<std::uint64_t firstUpperBoundInNanoseconds, size_t numberOfBoundedBuckets>
+class BasicLatencyHistogram
+{
+public:
+	static constexpr size_t numberOfBuckets = numberOfBoundedBuckets;
+
+	// Upper bound of bucket in seconds (inclusive). The overflow bucket has no upper bound.
+	static constexpr double upperBoundInSeconds(size_t bucket) { return 1e-9 * static_cast<double>(firstUpperBoundInNanoseconds << bucket); }
+
+	void record(std::chrono::nanoseconds duration)
+	{
+		const double seconds = std::chrono::duration<double>(duration).count();
+		size_t bucket = 0;
+		while (bucket < numberOfBuckets && seconds > upperBoundInSeconds(bucket))
+		{
+			++bucket;
+		}
+		counts[bucket].fetch_add(1, std::memory_order_relaxed);
+		sumInNanoseconds.fetch_add(static_cast<std::uint64_t>(duration.count()), std::memory_order_relaxed);
+	}
+
+	// Number of durations recorded in bucket (non-cumulative). Bucket numberOfBuckets is the overflow bucket.
+	std::uint64_t count(size_t bucket) const { return counts[bucket].load(std::memory_order_relaxed); }
+
+	double sumInSeconds() const { return static_cast<double>(sumInNanoseconds.load(std::memory_order_relaxed)) * 1e-9; }
+
+	// Upper bound in seconds of the bucket containing quantile (between 0 and 1) of the recorded durations. 0 if none were recorded,
+	// infinity if the quantile is in the overflow bucket.
+	double quantileUpperBoundInSeconds(double quantile) const
+	{
+		std::uint64_t total = 0;
+		for (size_t bucket = 0; bucket <= numberOfBuckets; ++bucket)
+		{
+			total += count(bucket);
+		}
+		if (total == 0)
+		{
+			return 0.0;
+		}
+		const auto rank = static_cast<std::uint64_t>(std::ceil(quantile * static_cast<double>(total)));
+		std::uint64_t cumulativeCount = 0;
+		for (size_t bucket = 0; bucket < numberOfBuckets; ++bucket)
+		{
+			cumulativeCount += count(bucket);
+			if (cumulativeCount >= rank)
+			{
+				return upperBoundInSeconds(bucket);
+			}
+		}
+		return std::numeric_limits<double>::infinity();
+	}
+
+private:
+	std::array<std::atomic<std::uint64_t>, numberOfBuckets + 1> counts{};
+	std::atomic<std::uint64_t> sumInNanoseconds{ 0 };
+};
+
+// Histogram of stage durations: 0.5 ms doubling up to about 33 s.
+using LatencyHistogram = BasicLatencyHistogram<500000, 17>;
+
+// Histograms of all stages of the process, indexed by Stage.
+inline std::array<LatencyHistogram, static_cast<size_t>(Stage::NumberOfStages)>& stageHistograms()
+{
+	static std::array<LatencyHistogram, static_cast<size_t>(Stage::NumberOfStages)> histograms;
+	return histograms;
+}
+
+// Records the time from construction to destruction (or to stop()) in the histogram of stage, and as span of the active request trace, if any.
+// Usage: { ScopedStageTimer timer(Stage::LocatorBuild); locator->Update(); }
+class ScopedStageTimer
+{
+public:
+	explicit ScopedStageTimer(Stage stage)
+		: stage(stage)
+		, previousStage(activeStage())
+		, start(std::chrono::steady_clock::now())
+	{
+		activeStage() = stage;
+	}
+
+	~ScopedStageTimer() { stop(); }
+
+	ScopedStageTimer(const ScopedStageTimer&) = delete;
+	ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+	// Records the duration now, e.g., if the stage ends before the enclosing scope. Subsequent calls have no effect.
+	void stop()
+	{
+		if (stopped)
+		{
+			return;
+		}
+		stopped = true;
+		activeStage() = previousStage;
+		const auto end = std::chrono::steady_clock::now();
+		stageHistograms()[static_cast<size_t>(stage)].record(end - start);
+		if (auto* trace = RequestTrace::currentIfAny())
+		{
+			trace->addSpan(stageName(stage), "stage", start, end);
+		}
+	}
+
+private:
+	const Stage stage;
+	const Stage previousStage;
+	const std::chrono::steady_clock::time_point start;
+	bool stopped = false;
+};
+
+#endif // STAGETIMER_H
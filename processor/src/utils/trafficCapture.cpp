@@ -0,0 +1,110 @@
+#include "trafficCapture.h"
+#include "logger.h"
+#include "sha256.h"
+#include "zstr/zstr.hpp"
+
+#include <cpprest/asyncrt_utils.h>
+
+#include <utility>
+#include <vector>
+
+TrafficCapture::TrafficCapture(const std::filesystem::path& captureFile, const bool storeBodies)
+	: storeBodies(storeBodies)
+{
+	try
+	{
+		out = std::make_unique<zstr::ofstream>(captureFile.string(), std::ios_base::out | std::ios_base::binary);
+	}
+	catch (const std::exception& ex) // strict_fstream::Exception if file cannot be opened
+	{
+		logError() << "TrafficCapture: Cannot open capture file " << captureFile << ": " << ex.what();
+		return;
+	}
+
+	web::json::value header = web::json::value::object();
+	header[U("faceScreenCapture")] = web::json::value::number(1);
+	header[U("started")] = web::json::value::string(utility::datetime::utc_now().to_string(utility::datetime::ISO_8601));
+	header[U("bodiesStored")] = web::json::value::boolean(storeBodies);
+	write(header);
+}
+
+TrafficCapture::~TrafficCapture()
+{
+	close();
+}
+
+void TrafficCapture::close()
+{
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	out.reset(); // zstr::ofstream finishes the gzip stream, then closes the file
+}
+
+pplx::task<void> TrafficCapture::capture(web::http::http_request message)
+{
+	const auto received = clock::now();
+	auto self = shared_from_this();
+	return message.extract_vector().then([self, message, received](pplx::task<std::vector<unsigned char>> bodyTask) mutable
+	{
+		std::vector<unsigned char> body;
+		try
+		{
+			body = bodyTask.get();
+		}
+		catch (const std::exception& ex)
+		{
+			logError() << "TrafficCapture: Request body could not be received: " << ex.what();
+		}
+
+		web::json::value entry = web::json::value::object();
+		entry[U("t")] = web::json::value::number(std::chrono::duration<double, std::milli>(received - self->started).count());
+		entry[U("method")] = web::json::value::string(message.method());
+		entry[U("path")] = web::json::value::string(message.relative_uri().path());
+		entry[U("query")] = web::json::value::string(message.relative_uri().query());
+		utility::string_t header;
+		if (message.headers().match(web::http::header_names::content_type, header))
+		{
+			entry[U("contentType")] = web::json::value::string(header);
+		}
+		if (message.headers().match(U("X-Deadline-Ms"), header))
+		{
+			entry[U("deadline")] = web::json::value::string(header);
+		}
+		entry[U("bodyBytes")] = web::json::value::number(static_cast<uint64_t>(body.size()));
+		if (!body.empty())
+		{
+			entry[U("bodySha256")] = web::json::value::string(utility::conversions::to_string_t(Sha256().update(body.data(), body.size()).hexDigest()));
+			if (self->storeBodies)
+			{
+				entry[U("body")] = web::json::value::string(utility::conversions::to_base64(body));
+			}
+			message.set_body(std::move(body)); // Keeps Content-Type as received.
+		}
+
+		message.get_response().then([self, entry, received](pplx::task<web::http::http_response> responseTask) mutable
+		{
+			web::http::status_code status = 0;
+			try
+			{
+				status = responseTask.get().status_code();
+			}
+			catch (const std::exception&) // request dropped without response
+			{
+			}
+			entry[U("status")] = web::json::value::number(status);
+			entry[U("latencyMs")] = web::json::value::number(std::chrono::duration<double, std::milli>(clock::now() - received).count());
+			self->write(entry);
+		});
+	});
+}
+
+void TrafficCapture::write(const web::json::value& entry)
+{
+	const auto line = utility::conversions::to_utf8string(entry.serialize());
+	std::lock_guard<InstrumentedMutex> guard(mutex);
+	if (!out)
+	{
+		return;
+	}
+	// Not flushed per record: flushing a zstr stream finishes a gzip member, i.e., would compress each record on its own.
+	*out << line << '\n';
+}
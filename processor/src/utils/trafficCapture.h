@@ -0,0 +1,58 @@
+#ifndef TRAFFICCAPTURE_H
+#define TRAFFICCAPTURE_H
+
+#include "instrumentedMutex.h"
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+
+// Opt-in recording of requests to the REST endpoints, for reproducing performance problems seen in production (see faceScreenReplay).
+// The capture file is gzip-compressed, one json object per line. The first line is a header ({"faceScreenCapture": 1, "started": ...}),
+// each further line a request, written once its response has been sent (i.e., in order of completion):
+//		t			- milliseconds from start of capture to receipt of request
+//		method, path, query	- as received (path relative to the listener, query not decoded)
+//		contentType, deadline	- headers Content-Type and X-Deadline-Ms, if present
+//		bodyBytes, bodySha256	- size and digest of request body
+//		body			- request body, base64 encoded, if bodies are stored
+//		status, latencyMs	- status code of response (0 if none was sent) and milliseconds from receipt of request to response
+// Bodies contain patient data (meshes, landmarks). Store them only where this is permitted; otherwise, only their digests are recorded.
+// Records are compressed together, as one gzip stream finished by close() (on server shutdown). The capture of a server killed meanwhile is
+// truncated: faceScreenReplay reads its records up to the last block written, later ones are lost.
+// Thread-safe.
+class TrafficCapture : public std::enable_shared_from_this<TrafficCapture>
+{
+public:
+	// Starts a new capture file (an existing file is overwritten). Check isOpen() before use.
+	TrafficCapture(const std::filesystem::path& captureFile, bool storeBodies);
+	~TrafficCapture();
+
+	TrafficCapture(const TrafficCapture&) = delete;
+	TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+	bool isOpen() const { return out != nullptr; }
+
+	// Finishes the gzip stream and closes the capture file. Requests completing afterwards are not recorded. Called by the destructor.
+	void close();
+
+	// Receives the body of message and records the request once the response has been sent. The body is put back into message,
+	// so the handler reads it as usual. Handle message on completion of the returned task, which never completes with an exception.
+	pplx::task<void> capture(web::http::http_request message);
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	// Appends one line to the capture file.
+	void write(const web::json::value& entry);
+
+	InstrumentedMutex mutex{ "trafficCapture" };
+	std::unique_ptr<std::ostream> out;
+	const bool storeBodies;
+	const clock::time_point started = clock::now();
+};
+
+#endif // TRAFFICCAPTURE_H